@@ -15,4 +15,13 @@ struct backend {
     void (*refresh)(const struct bar *bar);
     void (*set_cursor)(struct bar *bar, const char *cursor);
     const char *(*output_name)(const struct bar *bar);
+
+    /*
+     * Optional. Called before painting a frame that only re-paints
+     * parts of the bar; brings 'pix' up to date with the previous
+     * frame. Returns false if that isn't possible (e.g. the bar has
+     * been resized), in which case the entire bar is re-painted.
+     * Without it, all frames are re-painted in full.
+     */
+    bool (*reuse_frame)(const struct bar *bar);
 };
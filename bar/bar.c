@@ -10,12 +10,14 @@
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include <sys/eventfd.h>
 
 #define LOG_MODULE "bar"
 #define LOG_ENABLE_DBG 0
 #include "../log.h"
+#include "../trace.h"
 
 #if defined(ENABLE_X11)
  #include "xcb.h"
@@ -25,33 +27,52 @@
  #include "wayland.h"
 #endif
 
+#include "headless.h"
+#include "workers.h"
+
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
+/* The module running on the calling thread, if any */
+static thread_local struct module *current_module = NULL;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
 /*
- * Calculate total width of left/center/rigth groups.
+ * Calculate total width of left/center/rigth groups, from the
+ * exposables of all modules, in bar order.
  * Note: begin_expose() must have been called
  */
 static void
-calculate_widths(const struct private *b, int *left, int *center, int *right)
+calculate_widths(const struct private *b, struct exposable *const *exps,
+                 int *left, int *center, int *right)
 {
+    const size_t center_idx = b->left.count;
+    const size_t right_idx = center_idx + b->center.count;
+
     *left = 0;
     *center = 0;
     *right = 0;
 
     for (size_t i = 0; i < b->left.count; i++) {
-        struct exposable *e = b->left.exps[i];
+        struct exposable *e = exps[i];
         if (e->width > 0)
             *left += b->left_spacing + e->width + b->right_spacing;
     }
 
     for (size_t i = 0; i < b->center.count; i++) {
-        struct exposable *e = b->center.exps[i];
+        struct exposable *e = exps[center_idx + i];
         if (e->width > 0)
             *center += b->left_spacing + e->width + b->right_spacing;
     }
 
     for (size_t i = 0; i < b->right.count; i++) {
-        struct exposable *e = b->right.exps[i];
+        struct exposable *e = exps[right_idx + i];
         if (e->width > 0)
             *right += b->left_spacing + e->width + b->right_spacing;
     }
@@ -69,11 +90,418 @@ calculate_widths(const struct private *b, int *left, int *center, int *right)
     assert(*right >= 0);
 }
 
+static const char *
+module_trace_name(const struct private *bar, size_t idx)
+{
+    return bar->trace_names != NULL ? bar->trace_names[idx] : NULL;
+}
+
+/*
+ * Like module_begin_expose(), but records timing statistics and trace
+ * events. The time it takes to acquire the module lock is sampled
+ * before calling content() (which takes the lock itself).
+ */
+static struct exposable *
+module_begin_expose_instrumented(const struct private *bar, size_t idx,
+                                 struct module *mod)
+{
+    struct stats *stats = bar->stats;
+    const char *name = module_trace_name(bar, idx);
+
+    uint64_t start = stats_clock(stats);
+    trace_begin("lock", name);
+    mtx_lock(&mod->lock);
+    mtx_unlock(&mod->lock);
+    trace_end("lock", name);
+    stats_module(stats, idx, STATS_MODULE_LOCK_WAIT, start);
+
+    start = stats_clock(stats);
+    trace_begin("content", name);
+    struct exposable *e = mod->content(mod);
+    trace_end("content", name);
+    stats_module(stats, idx, STATS_MODULE_CONTENT, start);
+
+    start = stats_clock(stats);
+    trace_begin("begin-expose", name);
+    e->begin_expose(e);
+    trace_end("begin-expose", name);
+    stats_module(stats, idx, STATS_MODULE_BEGIN_EXPOSE, start);
+    return e;
+}
+
+static struct exposable *
+begin_expose(const struct private *bar, size_t idx, struct module *mod)
+{
+    return bar->stats != NULL || trace_enabled()
+        ? module_begin_expose_instrumented(bar, idx, mod)
+        : module_begin_expose(mod);
+}
+
+/*
+ * Instantiates module 'idx' (left, center and right modules numbered
+ * consecutively) into the frame's exposables. Called in parallel,
+ * from the worker threads, when 'layout-threads' is enabled; each
+ * call only touches its own slot.
+ */
 static void
-expose(const struct bar *_bar)
+layout_module(void *ctx, size_t idx)
 {
-    const struct private *bar = _bar->private;
-    pixman_image_t *pix = bar->pix;
+    struct private *bar = ctx;
+    struct module_group *group = &bar->left;
+    size_t i = idx;
+
+    if (i >= group->count) {
+        i -= group->count;
+        group = &bar->center;
+    }
+    if (i >= group->count) {
+        i -= group->count;
+        group = &bar->right;
+    }
+
+    bar->frame_exps[idx] = begin_expose(bar, idx, group->mods[i]);
+    assert(bar->frame_exps[idx]->width >= 0);
+}
+
+/* Flattens the module groups' exposables into 'exps', in bar order */
+static void
+all_exposables(const struct private *bar, struct exposable **exps)
+{
+    size_t idx = 0;
+    for (size_t i = 0; i < bar->left.count; i++)
+        exps[idx++] = bar->left.exps[i];
+    for (size_t i = 0; i < bar->center.count; i++)
+        exps[idx++] = bar->center.exps[i];
+    for (size_t i = 0; i < bar->right.count; i++)
+        exps[idx++] = bar->right.exps[i];
+}
+
+/*
+ * Swaps the frame's exposables, in bar order, with the module groups'
+ * ones. Must be called with the lock held.
+ */
+static void
+swap_exposables(struct private *bar, struct exposable **exps)
+{
+    struct module_group *groups[] = {&bar->left, &bar->center, &bar->right};
+    size_t idx = 0;
+
+    for (size_t g = 0; g < 3; g++) {
+        for (size_t i = 0; i < groups[g]->count; i++, idx++) {
+            struct exposable *e = groups[g]->exps[i];
+            groups[g]->exps[i] = exps[idx];
+            exps[idx] = e;
+        }
+    }
+}
+
+/* Waits for the frame in progress, if any. Must be called with the lock held */
+static void
+wait_for_render(struct private *bar)
+{
+    while (bar->rendering)
+        cnd_wait(&bar->render_done, &bar->lock);
+}
+
+/*
+ * Appends a module's x-range to a hit-test table. Must be called in
+ * painting order. Where groups overlap (i.e. the bar overflows), the
+ * earlier group wins.
+ */
+static void
+hit_add(struct hit_table *table, struct exposable *e, int x)
+{
+    if (e->width == 0)
+        return;
+
+    int start = x;
+    const int end = x + e->width;
+
+    if (table->count > 0) {
+        const struct hit_region *prev = &table->regions[table->count - 1];
+        start = max(start, prev->x + prev->width);
+    }
+
+    if (start >= end)
+        return;
+
+    assert(table->count < table->size);
+    table->regions[table->count++] = (struct hit_region){
+        .x = start, .width = end - start, .origin = x, .exp = e};
+}
+
+/* Binary searches a hit-test table */
+static const struct hit_region *
+hit_test(const struct hit_table *table, int x)
+{
+    size_t lo = 0;
+    size_t hi = table->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->regions[mid].x <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    const struct hit_region *hit = &table->regions[lo - 1];
+    return x < hit->x + hit->width ? hit : NULL;
+}
+
+static void
+expose_module(const struct private *bar, size_t idx,
+              const struct exposable *e, pixman_image_t *pix, int x, int y)
+{
+    const char *name = module_trace_name(bar, idx);
+    uint64_t start = stats_clock(bar->stats);
+
+    trace_begin("expose", name);
+    e->expose(e, pix, x, y, bar->height);
+    trace_end("expose", name);
+
+    stats_module(bar->stats, idx, STATS_MODULE_EXPOSE, start);
+}
+
+/*
+ * Paints module 'idx', and, if its exposable requested a new frame,
+ * records it as animated (and the earliest requested frame in
+ * 'frame_delay')
+ */
+static void
+paint_module(struct private *bar, size_t idx, struct exposable *e,
+             pixman_image_t *pix, int x, int y, uint64_t *frame_delay)
+{
+    expose_module(bar, idx, e, pix, x, y);
+
+    const uint64_t delay = exposable_take_frame_request();
+    if (delay == 0)
+        return;
+
+    if (*frame_delay == 0 || delay < *frame_delay)
+        *frame_delay = delay;
+
+    assert(bar->animated_count < bar->animated_size);
+    bar->animated[bar->animated_count++] = (struct animated_region){
+        .idx = idx, .exp = e, .x = x, .width = e->width};
+}
+
+static bool run_deferred_refreshes(const struct bar *_bar);
+
+static int
+ticker_thread(void *arg)
+{
+    const struct bar *_bar = arg;
+    struct private *bar = _bar->private;
+
+    pthread_setname_np(pthread_self(), "bar(ticker)");
+    trace_thread_name("bar(ticker)");
+
+    mtx_lock(&bar->ticker.lock);
+
+    while (!bar->ticker.quit) {
+        if (!bar->ticker.armed) {
+            cnd_wait(&bar->ticker.cond, &bar->ticker.lock);
+            continue;
+        }
+
+        /* Re-evaluate if woken up early; we may have been re-armed */
+        if (cnd_timedwait(&bar->ticker.cond, &bar->ticker.lock,
+                          &bar->ticker.deadline) != thrd_timedout)
+            continue;
+
+        bar->ticker.armed = false;
+        const bool deferred = run_deferred_refreshes(_bar);
+        mtx_unlock(&bar->ticker.lock);
+
+        if (deferred) {
+            trace_instant("refresh(deferred)", NULL);
+            atomic_store(&bar->layout_dirty, true);
+        } else {
+            /* Re-paint only; doesn't mark the layout as dirty */
+            trace_instant("animation-frame", NULL);
+        }
+
+        bar->backend.iface->refresh(_bar);
+
+        mtx_lock(&bar->ticker.lock);
+    }
+
+    mtx_unlock(&bar->ticker.lock);
+    return 0;
+}
+
+/*
+ * Schedules a re-paint in 'delay_ns' nanoseconds, unless one is due
+ * earlier. Must be called with the ticker lock held.
+ */
+static void
+ticker_arm_locked(const struct bar *_bar, uint64_t delay_ns)
+{
+    struct private *bar = _bar->private;
+
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_sec += delay_ns / 1000000000;
+    deadline.tv_nsec += delay_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    if (bar->ticker.quit)
+        return;
+
+    if (!bar->ticker.started) {
+        if (thrd_create(&bar->ticker.thrd, &ticker_thread, (void *)_bar) != thrd_success) {
+            LOG_ERR("failed to create animation ticker thread");
+            return;
+        }
+        bar->ticker.started = true;
+    }
+
+    if (!bar->ticker.armed ||
+        deadline.tv_sec < bar->ticker.deadline.tv_sec ||
+        (deadline.tv_sec == bar->ticker.deadline.tv_sec &&
+         deadline.tv_nsec < bar->ticker.deadline.tv_nsec))
+    {
+        bar->ticker.deadline = deadline;
+        bar->ticker.armed = true;
+        cnd_signal(&bar->ticker.cond);
+    }
+}
+
+static void
+ticker_arm(const struct bar *_bar, uint64_t delay_ns)
+{
+    struct private *bar = _bar->private;
+
+    mtx_lock(&bar->ticker.lock);
+    ticker_arm_locked(_bar, delay_ns);
+    mtx_unlock(&bar->ticker.lock);
+}
+
+/*
+ * Fires the deferred module refreshes that are due, and re-arms the
+ * ticker for the remaining ones. Returns true if any fired. Must be
+ * called with the ticker lock held.
+ */
+static bool
+run_deferred_refreshes(const struct bar *_bar)
+{
+    struct private *bar = _bar->private;
+    const uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+    bool fired = false;
+
+    tll_foreach(bar->ticker.deferred, it) {
+        struct module_refresh_limit *limit = &it->item->refresh_limit;
+
+        if (limit->deadline <= now) {
+            limit->pending = false;
+            limit->last_refresh = now;
+            tll_remove(bar->ticker.deferred, it);
+            fired = true;
+        } else if (limit->deadline < next)
+            next = limit->deadline;
+    }
+
+    if (next != UINT64_MAX)
+        ticker_arm_locked(_bar, next - now);
+
+    return fired;
+}
+
+/* Must be called with the ticker lock held */
+static void
+cancel_deferred_refresh(struct private *bar, struct module *mod)
+{
+    if (!mod->refresh_limit.pending)
+        return;
+
+    mod->refresh_limit.pending = false;
+
+    tll_foreach(bar->ticker.deferred, it) {
+        if (it->item == mod) {
+            tll_remove(bar->ticker.deferred, it);
+            break;
+        }
+    }
+}
+
+/*
+ * Applies the module's refresh limits to a refresh request. Returns
+ * true if the refresh should be done now. Else, it is deferred to
+ * when the limits allow it; the last request of a burst is always
+ * followed by a refresh.
+ */
+static bool
+refresh_limit(const struct bar *_bar, struct module *mod)
+{
+    struct private *bar = _bar->private;
+    struct module_refresh_limit *limit = &mod->refresh_limit;
+    const uint64_t now = now_ns();
+
+    mtx_lock(&bar->ticker.lock);
+
+    /* Leading edge: the first request after a quiet period */
+    const bool quiet = now - limit->last_request >= limit->debounce_ns;
+    limit->last_request = now;
+
+    uint64_t due = limit->last_refresh + limit->interval_ns;
+
+    /* Trailing edge: when the burst has been quiet for 'debounce' */
+    if (!quiet && now + limit->debounce_ns > due)
+        due = now + limit->debounce_ns;
+
+    const bool refresh_now = due <= now;
+
+    if (refresh_now) {
+        limit->last_refresh = now;
+        cancel_deferred_refresh(bar, mod);
+    } else {
+        limit->deadline = due;
+        if (!limit->pending) {
+            limit->pending = true;
+            tll_push_back(bar->ticker.deferred, mod);
+        }
+        ticker_arm_locked(_bar, due - now);
+    }
+
+    mtx_unlock(&bar->ticker.lock);
+    return refresh_now;
+}
+
+static void
+ticker_stop(struct private *bar)
+{
+    mtx_lock(&bar->ticker.lock);
+    bar->ticker.quit = true;
+    cnd_signal(&bar->ticker.cond);
+    mtx_unlock(&bar->ticker.lock);
+
+    if (bar->ticker.started)
+        thrd_join(bar->ticker.thrd, NULL);
+}
+
+/* Paints the entire bar */
+static void
+paint_all(struct private *bar, struct exposable *const *exps,
+          pixman_image_t *pix, uint64_t *frame_delay)
+{
+    const size_t center_idx = bar->left.count;
+    const size_t right_idx = center_idx + bar->center.count;
+
+    int left_width, center_width, right_width;
+    calculate_widths(bar, exps, &left_width, &center_width, &right_width);
+
+    struct hit_table *hits = &bar->next_hits;
+    hits->count = 0;
+
+    pixman_image_set_clip_region32(pix, NULL);
 
     pixman_image_fill_rectangles(
         PIXMAN_OP_SRC, pix, &bar->background, 1,
@@ -102,36 +530,6 @@ expose(const struct bar *_bar)
              bar->border.bottom_width},
         });
 
-    for (size_t i = 0; i < bar->left.count; i++) {
-        struct module *m = bar->left.mods[i];
-        struct exposable *e = bar->left.exps[i];
-        if (e != NULL)
-            e->destroy(e);
-        bar->left.exps[i] = module_begin_expose(m);
-        assert(bar->left.exps[i]->width >= 0);
-    }
-
-    for (size_t i = 0; i < bar->center.count; i++) {
-        struct module *m = bar->center.mods[i];
-        struct exposable *e = bar->center.exps[i];
-        if (e != NULL)
-            e->destroy(e);
-        bar->center.exps[i] = module_begin_expose(m);
-        assert(bar->center.exps[i]->width >= 0);
-    }
-
-    for (size_t i = 0; i < bar->right.count; i++) {
-        struct module *m = bar->right.mods[i];
-        struct exposable *e = bar->right.exps[i];
-        if (e != NULL)
-            e->destroy(e);
-        bar->right.exps[i] = module_begin_expose(m);
-        assert(bar->right.exps[i]->width >= 0);
-    }
-
-    int left_width, center_width, right_width;
-    calculate_widths(bar, &left_width, &center_width, &right_width);
-
     int y = bar->border.top_width;
     int x = bar->border.left_width + bar->left_margin - bar->left_spacing;
     pixman_region32_t clip;
@@ -147,16 +545,19 @@ expose(const struct bar *_bar)
     pixman_region32_fini(&clip);
 
     for (size_t i = 0; i < bar->left.count; i++) {
-        const struct exposable *e = bar->left.exps[i];
-        e->expose(e, pix, x + bar->left_spacing, y, bar->height);
+        struct exposable *e = exps[i];
+        paint_module(bar, i, e, pix, x + bar->left_spacing, y, frame_delay);
+        hit_add(hits, e, x + bar->left_spacing);
         if (e->width > 0)
             x += bar->left_spacing + e->width + bar->right_spacing;
     }
 
     x = bar->width / 2 - center_width / 2 - bar->left_spacing;
     for (size_t i = 0; i < bar->center.count; i++) {
-        const struct exposable *e = bar->center.exps[i];
-        e->expose(e, pix, x + bar->left_spacing, y, bar->height);
+        struct exposable *e = exps[center_idx + i];
+        paint_module(
+            bar, center_idx + i, e, pix, x + bar->left_spacing, y, frame_delay);
+        hit_add(hits, e, x + bar->left_spacing);
         if (e->width > 0)
             x += bar->left_spacing + e->width + bar->right_spacing;
     }
@@ -168,20 +569,211 @@ expose(const struct bar *_bar)
         bar->border.right_width);
 
     for (size_t i = 0; i < bar->right.count; i++) {
-        const struct exposable *e = bar->right.exps[i];
-        e->expose(e, pix, x + bar->left_spacing, y, bar->height);
+        struct exposable *e = exps[right_idx + i];
+        paint_module(
+            bar, right_idx + i, e, pix, x + bar->left_spacing, y, frame_delay);
+        hit_add(hits, e, x + bar->left_spacing);
         if (e->width > 0)
             x += bar->left_spacing + e->width + bar->right_spacing;
     }
 
+    pixman_region32_fini(&bar->damage);
+    pixman_region32_init_rect(
+        &bar->damage, 0, 0, bar->width, bar->height_with_border);
+}
+
+/*
+ * Re-paints the animated exposables only, in the same place as in the
+ * previous frame; the layout hasn't changed, and the rest of the bar
+ * is kept from the previous frame
+ */
+static void
+paint_animated(struct private *bar, pixman_image_t *pix, uint64_t *frame_delay)
+{
+    const int y = bar->border.top_width;
+    const size_t count = bar->animated_count;
+
+    pixman_region32_fini(&bar->damage);
+    pixman_region32_init(&bar->damage);
+
+    /* Re-built by paint_module(), in place */
+    bar->animated_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct animated_region r = bar->animated[i];
+
+        /* Same clipping as when painting the entire bar */
+        pixman_region32_t clip;
+        pixman_region32_init_rect(
+            &clip,
+            bar->border.left_width + bar->left_margin,
+            bar->border.top_width,
+            (bar->width -
+             bar->left_margin - bar->right_margin -
+             bar->border.left_width - bar->border.right_width),
+            bar->height);
+        pixman_region32_intersect_rect(&clip, &clip, r.x, y, r.width, bar->height);
+
+        /*
+         * A module entirely outside the clip isn't visible, and must
+         * not be painted with whatever clip is currently set. It
+         * stops animating until the next full frame.
+         */
+        if (pixman_region32_not_empty(&clip)) {
+            pixman_image_set_clip_region32(pix, &clip);
+            pixman_image_fill_rectangles(
+                PIXMAN_OP_SRC, pix, &bar->background, 1,
+                &(pixman_rectangle16_t){r.x, y, r.width, bar->height});
+            pixman_region32_union(&bar->damage, &bar->damage, &clip);
+
+            paint_module(bar, r.idx, r.exp, pix, r.x, y, frame_delay);
+        }
+
+        pixman_region32_fini(&clip);
+    }
+}
+
+static void
+expose(const struct bar *_bar)
+{
+    struct private *bar = _bar->private;
+
+    /*
+     * Only the frame's state is snapshotted with the lock held. It is
+     * laid out, painted and committed without it, such that e.g.
+     * pointer events aren't stalled by a slow frame. Meanwhile,
+     * pointer events are hit-tested against the frame on screen.
+     */
+    mtx_lock(&bar->lock);
+    wait_for_render(bar);
+    bar->rendering = true;
+
+    pixman_image_t *pix = bar->pix;
+    const size_t count = bar->left.count + bar->center.count + bar->right.count;
+
+    if (bar->frame_exps_size < count) {
+        bar->frame_exps = realloc(bar->frame_exps, count * sizeof(bar->frame_exps[0]));
+        bar->frame_exps_size = count;
+    }
+
+    const bool relayout = atomic_exchange(&bar->layout_dirty, false);
+    if (!relayout) {
+        /* Re-use the current exposables */
+        all_exposables(bar, bar->frame_exps);
+    }
+
+    mtx_unlock(&bar->lock);
+
+    struct exposable **exps = bar->frame_exps;
+
+    uint64_t frame_start = stats_clock(bar->stats);
+    trace_begin("frame", NULL);
+    trace_begin("layout", NULL);
+
+    if (!relayout)
+        ;
+    else if (bar->workers != NULL)
+        workers_run(bar->workers, count, &layout_module, bar);
+    else {
+        for (size_t i = 0; i < count; i++)
+            layout_module(bar, i);
+    }
+
+    if (bar->next_hits.size < count) {
+        bar->next_hits.regions = realloc(
+            bar->next_hits.regions, count * sizeof(bar->next_hits.regions[0]));
+        bar->next_hits.size = count;
+    }
+
+    if (bar->animated_size < count) {
+        bar->animated = realloc(bar->animated, count * sizeof(bar->animated[0]));
+        bar->animated_size = count;
+    }
+
+    trace_end("layout", NULL);
+    stats_frame(bar->stats, STATS_FRAME_LAYOUT, frame_start);
+
+    /*
+     * Unless the layout has changed, only the animated exposables
+     * need to be re-painted (e.g. a marquee ticking)
+     */
+    const bool partial =
+        !relayout &&
+        bar->animated_count > 0 &&
+        bar->backend.iface->reuse_frame != NULL &&
+        bar->backend.iface->reuse_frame(_bar);
+
+    uint64_t paint_start = stats_clock(bar->stats);
+    trace_begin(partial ? "paint(animated)" : "paint", NULL);
+
+    uint64_t frame_delay = 0;
+    if (partial)
+        paint_animated(bar, pix, &frame_delay);
+    else {
+        bar->animated_count = 0;
+        paint_all(bar, exps, pix, &frame_delay);
+    }
+
+    trace_end(partial ? "paint(animated)" : "paint", NULL);
+    stats_frame(bar->stats, STATS_FRAME_PAINT, paint_start);
+
+    if (frame_delay > 0)
+        ticker_arm(_bar, frame_delay);
+
+    uint64_t commit_start = stats_clock(bar->stats);
+    trace_begin("commit", NULL);
     bar->backend.iface->commit(_bar);
+    trace_end("commit", NULL);
+    stats_frame(bar->stats, STATS_FRAME_COMMIT, commit_start);
+
+    /* Publish the frame; pointer events now hit-test against it */
+    mtx_lock(&bar->lock);
+
+    if (relayout)
+        swap_exposables(bar, exps);
+
+    if (!partial) {
+        struct hit_table on_screen = bar->hits;
+        bar->hits = bar->next_hits;
+        bar->next_hits = on_screen;
+    }
+
+    bar->rendering = false;
+    cnd_broadcast(&bar->render_done);
+    mtx_unlock(&bar->lock);
+
+    /* The previous frame's exposables are no longer reachable */
+    if (relayout) {
+        for (size_t i = 0; i < count; i++) {
+            if (exps[i] != NULL)
+                exps[i]->destroy(exps[i]);
+            exps[i] = NULL;
+        }
+    }
+
+    trace_end("frame", NULL);
+    stats_frame(bar->stats, STATS_FRAME_TOTAL, frame_start);
 }
 
 
 static void
 refresh(const struct bar *bar)
 {
-    const struct private *b = bar->private;
+    struct private *b = bar->private;
+    stats_refresh(b->stats);
+
+    struct module *mod = current_module;
+    if (mod != NULL && mod->bar == bar &&
+        (mod->refresh_limit.interval_ns > 0 ||
+         mod->refresh_limit.debounce_ns > 0) &&
+        !refresh_limit(bar, mod))
+    {
+        trace_instant("refresh-deferred", NULL);
+        return;
+    }
+
+    trace_instant("refresh", NULL);
+    atomic_store(&b->layout_dirty, true);
     b->backend.iface->refresh(bar);
 }
 
@@ -199,9 +791,46 @@ output_name(const struct bar *bar)
     return b->backend.iface->output_name(bar);
 }
 
+/* Flattens the module groups into 'mods', in bar order */
 static void
-on_mouse(struct bar *_bar, enum mouse_event event, enum mouse_button btn,
-         int x, int y)
+all_modules(const struct private *bar, struct module **mods)
+{
+    size_t idx = 0;
+    for (size_t i = 0; i < bar->left.count; i++)
+        mods[idx++] = bar->left.mods[i];
+    for (size_t i = 0; i < bar->center.count; i++)
+        mods[idx++] = bar->center.mods[i];
+    for (size_t i = 0; i < bar->right.count; i++)
+        mods[idx++] = bar->right.mods[i];
+}
+
+static void
+enable_stats(struct bar *_bar, const char *path)
+{
+    struct private *bar = _bar->private;
+    assert(bar->stats == NULL);
+
+    mtx_lock(&bar->lock);
+    wait_for_render(bar);
+
+    size_t count = bar->left.count + bar->center.count + bar->right.count;
+    struct module *mods[count > 0 ? count : 1];
+    all_modules(bar, mods);
+
+    bar->stats = stats_new(path, count, mods);
+    mtx_unlock(&bar->lock);
+}
+
+static void
+dump_stats(const struct bar *_bar)
+{
+    const struct private *bar = _bar->private;
+    stats_dump(bar->stats);
+}
+
+static void
+on_mouse_locked(struct bar *_bar, enum mouse_event event,
+                enum mouse_button btn, int x, int y)
 {
     struct private *bar = _bar->private;
 
@@ -213,80 +842,185 @@ on_mouse(struct bar *_bar, enum mouse_event event, enum mouse_button btn,
         return;
     }
 
-    int left_width, center_width, right_width;
-    calculate_widths(bar, &left_width, &center_width, &right_width);
+    const struct hit_region *hit = hit_test(&bar->hits, x);
+    if (hit != NULL) {
+        struct exposable *e = hit->exp;
+        if (e->on_mouse != NULL)
+            e->on_mouse(e, _bar, event, btn, x - hit->origin, y);
+        return;
+    }
 
-    int mx = bar->border.left_width + bar->left_margin - bar->left_spacing;
-    for (size_t i = 0; i < bar->left.count; i++) {
-        struct exposable *e = bar->left.exps[i];
+    set_cursor(_bar, "left_ptr");
+}
 
-        if (e->width == 0)
-            continue;
+static void
+on_mouse(struct bar *_bar, enum mouse_event event, enum mouse_button btn,
+         int x, int y)
+{
+    struct private *bar = _bar->private;
 
-        mx += bar->left_spacing;
-        if (x >= mx && x < mx + e->width) {
-            if (e->on_mouse != NULL)
-                e->on_mouse(e, _bar, event, btn, x - mx, y);
-            return;
-        }
+    mtx_lock(&bar->lock);
+    on_mouse_locked(_bar, event, btn, x, y);
+    mtx_unlock(&bar->lock);
+}
 
-        mx += e->width + bar->right_spacing;
-    }
+static void
+set_module_thread_name(thrd_t id, struct module *mod)
+{
+    char title[16];
+    if (mod->description != NULL)
+        strncpy(title, mod->description(mod), sizeof(title));
+    else
+        strncpy(title, "mod:<unknown>", sizeof(title));
 
-    mx = bar->width / 2 - center_width / 2 - bar->left_spacing;
-    for (size_t i = 0; i < bar->center.count; i++) {
-        struct exposable *e = bar->center.exps[i];
+    title[15] = '\0';
 
-        if (e->width == 0)
-            continue;
+    if (pthread_setname_np(id, title) < 0)
+        LOG_ERRNO("failed to set thread title");
+}
 
-        mx += bar->left_spacing;
-        if (x >= mx && x < mx + e->width) {
-            if (e->on_mouse != NULL)
-                e->on_mouse(e, _bar, event, btn, x - mx, y);
-            return;
-        }
+struct module_thread_context {
+    struct module *mod;
+    struct module_stats *stats;
+    const char *trace_name;
+};
+
+/*
+ * Module thread entry point, used when stats or tracing is enabled,
+ * or when the module's refreshes are limited
+ */
+static int
+module_thread(void *_ctx)
+{
+    struct module_thread_context ctx = *(struct module_thread_context *)_ctx;
+    free(_ctx);
+
+    current_module = ctx.mod;
+    stats_module_thread_init(ctx.stats);
+    trace_thread_name(ctx.trace_name);
+
+    trace_begin("run", NULL);
+    int ret = ctx.mod->run(ctx.mod);
+    trace_end("run", NULL);
+    return ret;
+}
 
-        mx += e->width + bar->right_spacing;
+/*
+ * Each module gets its own abort FD, allowing modules to be stopped
+ * individually. A module whose abort FD is -1 is not running.
+ *
+ * Must be called with the lock held.
+ */
+static bool
+start_module(struct private *bar, thrd_t *thrd, size_t idx, struct module *mod)
+{
+    mod->abort_fd = eventfd(0, EFD_CLOEXEC);
+    if (mod->abort_fd == -1) {
+        LOG_ERRNO("%s: failed to create abort FD",
+                  mod->description != NULL ? mod->description(mod) : "<unknown>");
+        return false;
     }
 
-    mx = bar->width - (right_width +
-                       bar->left_spacing +
-                       bar->right_margin +
-                       bar->border.right_width);
+    /*
+     * Signals are handled by the main thread. Module threads (and any
+     * threads they start) inherit our signal mask, so block everything
+     * while creating them, regardless of which thread we are called
+     * from.
+     */
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    int r;
+    const bool limited = mod->refresh_limit.interval_ns > 0 ||
+                         mod->refresh_limit.debounce_ns > 0;
+
+    if (bar->stats != NULL || trace_enabled() || limited) {
+        struct module_thread_context *ctx = malloc(sizeof(*ctx));
+        *ctx = (struct module_thread_context){
+            .mod = mod,
+            .stats = stats_module_stats(bar->stats, idx),
+            .trace_name = module_trace_name(bar, idx),
+        };
+        r = thrd_create(thrd, &module_thread, ctx);
+        if (r != thrd_success)
+            free(ctx);
+    } else
+        r = thrd_create(thrd, (int (*)(void *))mod->run, mod);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (r != thrd_success) {
+        LOG_ERR("%s: failed to start module thread",
+                mod->description != NULL ? mod->description(mod) : "<unknown>");
+        close(mod->abort_fd);
+        mod->abort_fd = -1;
+        return false;
+    }
 
-    for (size_t i = 0; i < bar->right.count; i++) {
-        struct exposable *e = bar->right.exps[i];
+    set_module_thread_name(*thrd, mod);
+    return true;
+}
 
-        if (e->width == 0)
-            continue;
+static void
+stop_module(struct module *mod)
+{
+    if (mod->abort_fd == -1)
+        return;
 
-        mx += bar->left_spacing;
-        if (x >= mx && x < mx + e->width) {
-            if (e->on_mouse != NULL)
-                e->on_mouse(e, _bar, event, btn, x - mx, y);
-            return;
-        }
+    if (write(mod->abort_fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+        LOG_ERRNO("failed to signal abort to module");
+}
 
-        mx += e->width + bar->right_spacing;
-    }
+/* Waits for a stopped module to terminate, and returns its exit value */
+static int
+join_module(struct module *mod, thrd_t thrd)
+{
+    if (mod->abort_fd == -1)
+        return 0;
 
-    set_cursor(_bar, "left_ptr");
+    int ret;
+    thrd_join(thrd, &ret);
+
+    close(mod->abort_fd);
+    mod->abort_fd = -1;
+    return ret;
 }
 
+/* Interns all module names, for use in trace events */
 static void
-set_module_thread_name(thrd_t id, struct module *mod)
+init_trace_names(struct private *bar)
 {
-    char title[16];
-    if (mod->description != NULL)
-        strncpy(title, mod->description(mod), sizeof(title));
-    else
-        strncpy(title, "mod:<unknown>", sizeof(title));
+    size_t count = bar->left.count + bar->center.count + bar->right.count;
+    struct module *mods[count > 0 ? count : 1];
+    all_modules(bar, mods);
 
-    title[15] = '\0';
+    free(bar->trace_names);
+    bar->trace_names = calloc(count > 0 ? count : 1, sizeof(bar->trace_names[0]));
 
-    if (pthread_setname_np(id, title) < 0)
-        LOG_ERRNO("failed to set thread title");
+    for (size_t i = 0; i < count; i++) {
+        const struct module *m = mods[i];
+        bar->trace_names[i] = trace_intern(
+            m->description != NULL ? m->description(m) : "<unknown>");
+    }
+}
+
+static int
+join_group(const struct module_group *group, const char *name)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < group->count; i++) {
+        struct module *m = group->mods[i];
+        int mod_ret = join_module(m, group->thrds[i]);
+        if (mod_ret != 0) {
+            LOG_ERR("module: %s #%zu (%s): non-zero exit value: %d",
+                    name, i, m->description(m), mod_ret);
+        }
+        ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
+    }
+
+    return ret;
 }
 
 static int
@@ -297,6 +1031,13 @@ run(struct bar *_bar)
     bar->height_with_border =
         bar->height + bar->border.top_width + bar->border.bottom_width;
 
+    if (trace_enabled()) {
+        trace_thread_name("bar");
+        mtx_lock(&bar->lock);
+        init_trace_names(bar);
+        mtx_unlock(&bar->lock);
+    }
+
     if (!bar->backend.iface->setup(_bar)) {
         bar->backend.iface->cleanup(_bar);
         if (write(_bar->abort_fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
@@ -304,75 +1045,66 @@ run(struct bar *_bar)
         return 1;
     }
 
+    if (bar->layout_threads > 0)
+        bar->workers = workers_new(bar->layout_threads);
+
     set_cursor(_bar, "left_ptr");
     expose(_bar);
 
     /* Start modules */
-    thrd_t thrd_left[max(bar->left.count, 1)];
-    thrd_t thrd_center[max(bar->center.count, 1)];
-    thrd_t thrd_right[max(bar->right.count, 1)];
+    mtx_lock(&bar->lock);
+    bar->modules_state = MODULES_RUNNING;
 
-    for (size_t i = 0; i < bar->left.count; i++) {
-        struct module *mod = bar->left.mods[i];
-
-        mod->abort_fd = _bar->abort_fd;
-        thrd_create(&thrd_left[i], (int (*)(void *))bar->left.mods[i]->run, mod);
-        set_module_thread_name(thrd_left[i], mod);
-    }
+    for (size_t i = 0; i < bar->left.count; i++)
+        start_module(bar, &bar->left.thrds[i], i, bar->left.mods[i]);
     for (size_t i = 0; i < bar->center.count; i++) {
-        struct module *mod = bar->center.mods[i];
-
-        mod->abort_fd = _bar->abort_fd;
-        thrd_create(&thrd_center[i], (int (*)(void *))bar->center.mods[i]->run, mod);
-        set_module_thread_name(thrd_center[i], mod);
+        start_module(bar, &bar->center.thrds[i], bar->left.count + i,
+                     bar->center.mods[i]);
     }
     for (size_t i = 0; i < bar->right.count; i++) {
-        struct module *mod = bar->right.mods[i];
-
-        mod->abort_fd = _bar->abort_fd;
-        thrd_create(&thrd_right[i], (int (*)(void *))bar->right.mods[i]->run, mod);
-        set_module_thread_name(thrd_right[i], mod);
+        start_module(bar, &bar->right.thrds[i],
+                     bar->left.count + bar->center.count + i,
+                     bar->right.mods[i]);
     }
 
+    mtx_unlock(&bar->lock);
     LOG_DBG("all modules started");
 
     bar->backend.iface->loop(_bar, &expose, &on_mouse);
 
     LOG_DBG("shutting down");
+    ticker_stop(bar);
+
+    /*
+     * Stop modules. Once stopped, the module groups are no longer
+     * modified, and can be accessed without holding the lock.
+     */
+    mtx_lock(&bar->lock);
+    bar->modules_state = MODULES_STOPPED;
+    for (size_t i = 0; i < bar->left.count; i++)
+        stop_module(bar->left.mods[i]);
+    for (size_t i = 0; i < bar->center.count; i++)
+        stop_module(bar->center.mods[i]);
+    for (size_t i = 0; i < bar->right.count; i++)
+        stop_module(bar->right.mods[i]);
+    mtx_unlock(&bar->lock);
 
     /* Wait for modules to terminate */
     int ret = 0;
     int mod_ret;
-    for (size_t i = 0; i < bar->left.count; i++) {
-        thrd_join(thrd_left[i], &mod_ret);
-        if (mod_ret != 0) {
-            const struct module *m = bar->left.mods[i];
-            LOG_ERR("module: LEFT #%zu (%s): non-zero exit value: %d",
-                    i, m->description(m), mod_ret);
-        }
-        ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
-    }
-    for (size_t i = 0; i < bar->center.count; i++) {
-        thrd_join(thrd_center[i], &mod_ret);
-        if (mod_ret != 0) {
-            const struct module *m = bar->center.mods[i];
-            LOG_ERR("module: CENTER #%zu (%s): non-zero exit value: %d",
-                    i, m->description(m), mod_ret);
-        }
-        ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
-    }
-    for (size_t i = 0; i < bar->right.count; i++) {
-        thrd_join(thrd_right[i], &mod_ret);
-        if (mod_ret != 0) {
-            const struct module *m = bar->right.mods[i];
-            LOG_ERR("module: RIGHT #%zu (%s): non-zero exit value: %d",
-                    i, m->description(m), mod_ret);
-        }
-        ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
-    }
+
+    mod_ret = join_group(&bar->left, "LEFT");
+    ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
+    mod_ret = join_group(&bar->center, "CENTER");
+    ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
+    mod_ret = join_group(&bar->right, "RIGHT");
+    ret = ret == 0 && mod_ret != 0 ? mod_ret : ret;
 
     LOG_DBG("modules joined");
 
+    workers_destroy(bar->workers);
+    bar->workers = NULL;
+
     bar->backend.iface->cleanup(_bar);
 
     LOG_DBG("bar exiting");
@@ -380,45 +1112,243 @@ run(struct bar *_bar)
 }
 
 static void
-destroy(struct bar *bar)
+group_init(struct module_group *group, struct bar_modules mods)
 {
-    struct private *b = bar->private;
-
-    for (size_t i = 0; i < b->left.count; i++) {
-        struct module *m = b->left.mods[i];
-        struct exposable *e = b->left.exps[i];
-        if (e != NULL)
-            e->destroy(e);
-        m->destroy(m);
-    }
-    for (size_t i = 0; i < b->center.count; i++) {
-        struct module *m = b->center.mods[i];
-        struct exposable *e = b->center.exps[i];
-        if (e != NULL)
-            e->destroy(e);
-        m->destroy(m);
+    group->mods = malloc(max(mods.count, 1) * sizeof(group->mods[0]));
+    group->exps = calloc(max(mods.count, 1), sizeof(group->exps[0]));
+    group->thrds = calloc(max(mods.count, 1), sizeof(group->thrds[0]));
+    group->count = mods.count;
+
+    for (size_t i = 0; i < mods.count; i++) {
+        group->mods[i] = mods.mods[i];
+        group->mods[i]->abort_fd = -1;
     }
-    for (size_t i = 0; i < b->right.count; i++) {
-        struct module *m = b->right.mods[i];
-        struct exposable *e = b->right.exps[i];
+}
+
+static void
+group_destroy(struct module_group *group)
+{
+    for (size_t i = 0; i < group->count; i++) {
+        struct module *m = group->mods[i];
+        struct exposable *e = group->exps[i];
         if (e != NULL)
             e->destroy(e);
         m->destroy(m);
     }
 
-    free(b->left.mods);
-    free(b->left.exps);
-    free(b->center.mods);
-    free(b->center.exps);
-    free(b->right.mods);
-    free(b->right.exps);
+    free(group->mods);
+    free(group->exps);
+    free(group->thrds);
+}
+
+static void
+destroy(struct bar *bar)
+{
+    struct private *b = bar->private;
+
+    stats_dump(b->stats);
+    stats_destroy(b->stats);
+
+    group_destroy(&b->left);
+    group_destroy(&b->center);
+    group_destroy(&b->right);
+
+    tll_free(b->ticker.deferred);
+    cnd_destroy(&b->ticker.cond);
+    mtx_destroy(&b->ticker.lock);
+    cnd_destroy(&b->render_done);
+    mtx_destroy(&b->lock);
     free(b->monitor);
+    free(b->trace_names);
+    free(b->frame_exps);
+    free(b->animated);
+    pixman_region32_fini(&b->damage);
+    free(b->hits.regions);
+    free(b->next_hits.regions);
     free(b->backend.data);
 
     free(bar->private);
     free(bar);
 }
 
+static void
+get_modules(const struct bar *_bar, struct bar_modules *left,
+            struct bar_modules *center, struct bar_modules *right)
+{
+    struct private *bar = _bar->private;
+
+    mtx_lock(&bar->lock);
+    *left = (struct bar_modules){bar->left.mods, bar->left.count};
+    *center = (struct bar_modules){bar->center.mods, bar->center.count};
+    *right = (struct bar_modules){bar->right.mods, bar->right.count};
+    mtx_unlock(&bar->lock);
+}
+
+struct removed_module {
+    struct module *mod;
+    thrd_t thrd;
+};
+
+static void
+update_modules(struct bar *_bar, struct bar_modules left,
+               struct bar_modules center, struct bar_modules right)
+{
+    struct private *bar = _bar->private;
+
+    struct module_group *old_groups[] = {&bar->left, &bar->center, &bar->right};
+    const struct bar_modules new_mods[] = {left, center, right};
+    struct module_group new_groups[3];
+
+    mtx_lock(&bar->lock);
+    wait_for_render(bar);
+
+    if (bar->modules_state == MODULES_STOPPED) {
+        mtx_unlock(&bar->lock);
+        LOG_WARN("bar is shutting down, ignoring module update");
+
+        /* We own the new modules; destroy those not already in the bar */
+        for (size_t g = 0; g < 3; g++) {
+            for (size_t i = 0; i < new_mods[g].count; i++) {
+                struct module *m = new_mods[g].mods[i];
+                bool in_bar = false;
+
+                for (size_t og = 0; og < 3 && !in_bar; og++) {
+                    for (size_t j = 0; j < old_groups[og]->count; j++) {
+                        if (old_groups[og]->mods[j] == m) {
+                            in_bar = true;
+                            break;
+                        }
+                    }
+                }
+
+                if (!in_bar)
+                    m->destroy(m);
+            }
+        }
+        return;
+    }
+
+    size_t total = left.count + center.count + right.count;
+    bool is_new[max(total, 1)];
+
+    /* Move modules that are in both the current and the new set */
+    size_t idx = 0;
+    size_t added = 0;
+    for (size_t g = 0; g < 3; g++) {
+        struct module_group *group = &new_groups[g];
+
+        group->mods = malloc(max(new_mods[g].count, 1) * sizeof(group->mods[0]));
+        group->exps = calloc(max(new_mods[g].count, 1), sizeof(group->exps[0]));
+        group->thrds = calloc(max(new_mods[g].count, 1), sizeof(group->thrds[0]));
+        group->count = new_mods[g].count;
+
+        for (size_t i = 0; i < group->count; i++, idx++) {
+            struct module *m = new_mods[g].mods[i];
+            group->mods[i] = m;
+            is_new[idx] = true;
+
+            for (size_t og = 0; og < 3 && is_new[idx]; og++) {
+                struct module_group *old = old_groups[og];
+
+                for (size_t j = 0; j < old->count; j++) {
+                    if (old->mods[j] != m)
+                        continue;
+
+                    group->exps[i] = old->exps[j];
+                    group->thrds[i] = old->thrds[j];
+                    old->mods[j] = NULL;
+                    old->exps[j] = NULL;
+                    is_new[idx] = false;
+                    break;
+                }
+            }
+
+            if (is_new[idx]) {
+                added++;
+                m->bar = _bar;
+                m->abort_fd = -1;
+            }
+        }
+    }
+
+    /* Whatever remains in the current set is to be removed */
+    size_t removed_count = 0;
+    for (size_t g = 0; g < 3; g++) {
+        for (size_t i = 0; i < old_groups[g]->count; i++)
+            removed_count += old_groups[g]->mods[i] != NULL;
+    }
+
+    struct removed_module removed[max(removed_count, 1)];
+    idx = 0;
+
+    for (size_t g = 0; g < 3; g++) {
+        struct module_group *old = old_groups[g];
+
+        for (size_t i = 0; i < old->count; i++) {
+            struct module *m = old->mods[i];
+            if (m == NULL)
+                continue;
+
+            struct exposable *e = old->exps[i];
+            if (e != NULL)
+                e->destroy(e);
+
+            stop_module(m);
+            removed[idx++] = (struct removed_module){m, old->thrds[i]};
+        }
+
+        free(old->mods);
+        free(old->exps);
+        free(old->thrds);
+        *old = new_groups[g];
+    }
+
+    /* Until the next frame, there's nothing to hit */
+    bar->hits.count = 0;
+    atomic_store(&bar->layout_dirty, true);
+
+    struct module *mods[max(total, 1)];
+    all_modules(bar, mods);
+    stats_update_modules(bar->stats, total, mods);
+
+    if (trace_enabled())
+        init_trace_names(bar);
+
+    if (bar->modules_state == MODULES_RUNNING) {
+        idx = 0;
+        for (size_t g = 0; g < 3; g++) {
+            struct module_group *group = old_groups[g];
+
+            for (size_t i = 0; i < group->count; i++, idx++) {
+                if (is_new[idx])
+                    start_module(bar, &group->thrds[i], idx, group->mods[i]);
+            }
+        }
+    }
+
+    mtx_unlock(&bar->lock);
+
+    LOG_DBG("modules updated: %zu added, %zu removed", added, removed_count);
+
+    /* Removed modules' threads no longer reference the bar state */
+    for (size_t i = 0; i < removed_count; i++) {
+        struct module *m = removed[i].mod;
+        int mod_ret = join_module(m, removed[i].thrd);
+        if (mod_ret != 0) {
+            LOG_WARN("module: %s: non-zero exit value: %d",
+                     m->description(m), mod_ret);
+        }
+
+        mtx_lock(&bar->ticker.lock);
+        cancel_deferred_refresh(bar, m);
+        mtx_unlock(&bar->ticker.lock);
+
+        m->destroy(m);
+    }
+
+    refresh(_bar);
+}
+
 struct bar *
 bar_new(const struct bar_config *config)
 {
@@ -463,6 +1393,11 @@ bar_new(const struct bar_config *config)
         return NULL;
 #endif
         break;
+
+    case BAR_BACKEND_HEADLESS:
+        backend_data = bar_backend_headless_new(config->backend_options);
+        backend_iface = &headless_backend_iface;
+        break;
     }
 
     if (backend_data == NULL)
@@ -479,6 +1414,7 @@ bar_new(const struct bar_config *config)
     priv->left_margin = config->left_margin;
     priv->right_margin = config->right_margin;
     priv->trackpad_sensitivity = config->trackpad_sensitivity;
+    priv->layout_threads = config->layout_threads;
     priv->border.left_width = config->border.left_width;
     priv->border.right_width = config->border.right_width;
     priv->border.top_width = config->border.top_width;
@@ -488,24 +1424,19 @@ bar_new(const struct bar_config *config)
     priv->border.right_margin = config->border.right_margin;
     priv->border.top_margin = config->border.top_margin;
     priv->border.bottom_margin = config->border.bottom_margin;
-    priv->left.mods = malloc(config->left.count * sizeof(priv->left.mods[0]));
-    priv->left.exps = calloc(config->left.count, sizeof(priv->left.exps[0]));
-    priv->center.mods = malloc(config->center.count * sizeof(priv->center.mods[0]));
-    priv->center.exps = calloc(config->center.count, sizeof(priv->center.exps[0]));
-    priv->right.mods = malloc(config->right.count * sizeof(priv->right.mods[0]));
-    priv->right.exps = calloc(config->right.count, sizeof(priv->right.exps[0]));
-    priv->left.count = config->left.count;
-    priv->center.count = config->center.count;
-    priv->right.count = config->right.count;
     priv->backend.data = backend_data;
     priv->backend.iface = backend_iface;
-
-    for (size_t i = 0; i < priv->left.count; i++)
-        priv->left.mods[i] = config->left.mods[i];
-    for (size_t i = 0; i < priv->center.count; i++)
-        priv->center.mods[i] = config->center.mods[i];
-    for (size_t i = 0; i < priv->right.count; i++)
-        priv->right.mods[i] = config->right.mods[i];
+    priv->modules_state = MODULES_NOT_STARTED;
+    mtx_init(&priv->lock, mtx_plain);
+    cnd_init(&priv->render_done);
+    pixman_region32_init(&priv->damage);
+    mtx_init(&priv->ticker.lock, mtx_plain);
+    cnd_init(&priv->ticker.cond);
+    atomic_init(&priv->layout_dirty, true);
+
+    group_init(&priv->left, config->left);
+    group_init(&priv->center, config->center);
+    group_init(&priv->right, config->right);
 
     struct bar *bar = calloc(1, sizeof(*bar));
     bar->private = priv;
@@ -514,6 +1445,10 @@ bar_new(const struct bar_config *config)
     bar->refresh = &refresh;
     bar->set_cursor = &set_cursor;
     bar->output_name = &output_name;
+    bar->enable_stats = &enable_stats;
+    bar->dump_stats = &dump_stats;
+    bar->get_modules = &get_modules;
+    bar->update_modules = &update_modules;
 
     for (size_t i = 0; i < priv->left.count; i++)
         priv->left.mods[i]->bar = bar;
@@ -4,6 +4,11 @@
 #include "../font-shaping.h"
 #include "../module.h"
 
+struct bar_modules {
+    struct module **mods;
+    size_t count;
+};
+
 struct bar {
     int abort_fd;
 
@@ -15,14 +20,40 @@ struct bar {
     void (*set_cursor)(struct bar *bar, const char *cursor);
 
     const char *(*output_name)(const struct bar *bar);
+
+    /*
+     * Enables per-frame and per-module timing statistics. Must be
+     * called before run(). 'path' is where dump_stats() writes the
+     * statistics; if NULL, they are logged.
+     */
+    void (*enable_stats)(struct bar *bar, const char *path);
+    void (*dump_stats)(const struct bar *bar);
+
+    /*
+     * Returns the bar's current modules. The arrays are owned by the
+     * bar, and valid until the next call to update_modules().
+     */
+    void (*get_modules)(const struct bar *bar, struct bar_modules *left,
+                        struct bar_modules *center, struct bar_modules *right);
+
+    /*
+     * Replaces the bar's modules; may be called while the bar is
+     * running. Modules that are part of both the current and the new
+     * set keep running. New modules are started, and modules no longer
+     * used are stopped and destroyed. The bar takes ownership of the
+     * new modules, but not of the arrays.
+     */
+    void (*update_modules)(struct bar *bar, struct bar_modules left,
+                           struct bar_modules center, struct bar_modules right);
 };
 
 enum bar_location { BAR_TOP, BAR_BOTTOM };
 enum bar_layer { BAR_LAYER_TOP, BAR_LAYER_BOTTOM };
-enum bar_backend { BAR_BACKEND_AUTO, BAR_BACKEND_XCB, BAR_BACKEND_WAYLAND };
+enum bar_backend { BAR_BACKEND_AUTO, BAR_BACKEND_XCB, BAR_BACKEND_WAYLAND, BAR_BACKEND_HEADLESS };
 
 struct bar_config {
     enum bar_backend backend;
+    const char *backend_options;
 
     const char *monitor;
     enum bar_layer layer;
@@ -32,6 +63,7 @@ struct bar_config {
     int left_spacing, right_spacing;
     int left_margin, right_margin;
     int trackpad_sensitivity;
+    int layout_threads;
 
     pixman_color_t background;
 
@@ -43,18 +75,9 @@ struct bar_config {
         int top_margin, bottom_margin;
     } border;
 
-    struct {
-        struct module **mods;
-        size_t count;
-    } left;
-    struct {
-        struct module **mods;
-        size_t count;
-    } center;
-    struct {
-        struct module **mods;
-        size_t count;
-    } right;
+    struct bar_modules left;
+    struct bar_modules center;
+    struct bar_modules right;
 };
 
 struct bar *bar_new(const struct bar_config *config);
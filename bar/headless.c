@@ -0,0 +1,567 @@
+#include "headless.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <pixman.h>
+#include <tllist.h>
+
+#include "private.h"
+
+#define LOG_MODULE "bar:headless"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../trace.h"
+#include "../png-yambar.h"
+#include "../stride.h"
+
+/*
+ * Renders into an in-memory buffer, without any display server.
+ *
+ * Intended for testing, and for benchmarking the render path. Frames
+ * can be dumped to disk, and mouse events can be replayed from a
+ * script.
+ */
+
+enum script_event_type {
+    SCRIPT_MOTION,
+    SCRIPT_CLICK,
+    SCRIPT_WAIT,
+};
+
+struct script_event {
+    enum script_event_type type;
+    enum mouse_button btn;
+    int x, y;
+    int wait_ms;
+};
+
+struct headless_backend {
+    /* Options */
+    int width;              /* Logical width */
+    int scale;
+    unsigned max_frames;    /* Exit after this many frames, 0 == never */
+    char *dump_path;        /* Frame dump file name template */
+    bool dump_png;          /* Dump PNGs, or raw pixels */
+
+    tll(struct script_event) script;
+    struct timespec script_deadline;
+
+    int refresh_fd;
+    void *data;
+    pixman_image_t *pix;
+    char *cursor;
+
+    /* Statistics */
+    unsigned frame_count;
+    unsigned timed_frame_count;
+    struct timespec expose_time;
+};
+
+static bool
+parse_int(const char *value, int min, int *out)
+{
+    errno = 0;
+    char *end;
+    long v = strtol(value, &end, 10);
+    if (errno != 0 || *end != '\0' || v < min || v > 1 << 20)
+        return false;
+    *out = v;
+    return true;
+}
+
+static bool
+parse_button(const char *name, enum mouse_button *btn)
+{
+    static const char *const names[] = {
+        [MOUSE_BTN_LEFT] = "left",
+        [MOUSE_BTN_MIDDLE] = "middle",
+        [MOUSE_BTN_RIGHT] = "right",
+        [MOUSE_BTN_WHEEL_UP] = "wheel-up",
+        [MOUSE_BTN_WHEEL_DOWN] = "wheel-down",
+        [MOUSE_BTN_PREVIOUS] = "previous",
+        [MOUSE_BTN_NEXT] = "next",
+    };
+
+    for (size_t i = MOUSE_BTN_LEFT; i < MOUSE_BTN_COUNT; i++) {
+        if (strcmp(names[i], name) == 0) {
+            *btn = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Mouse script; one event per line:
+ *
+ *   motion X Y
+ *   click BUTTON X Y
+ *   wait MILLISECONDS
+ *
+ * Coordinates are logical (i.e. they are multiplied with the
+ * scale). Empty lines, and lines starting with '#', are ignored.
+ */
+static bool
+load_script(struct headless_backend *backend, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open mouse script", path);
+        return false;
+    }
+
+    bool ret = false;
+    char *line = NULL;
+    size_t size = 0;
+    int line_no = 0;
+
+    while (getline(&line, &size, f) >= 0) {
+        line_no++;
+
+        char *saveptr = NULL;
+        const char *cmd = strtok_r(line, " \t\n", &saveptr);
+        if (cmd == NULL || cmd[0] == '#')
+            continue;
+
+        const char *args[3] = {NULL};
+        size_t arg_count = 0;
+        for (const char *arg = strtok_r(NULL, " \t\n", &saveptr);
+             arg != NULL;
+             arg = strtok_r(NULL, " \t\n", &saveptr))
+        {
+            if (arg_count >= 3) {
+                arg_count++;
+                break;
+            }
+            args[arg_count++] = arg;
+        }
+
+        struct script_event evt = {0};
+        bool valid = false;
+
+        if (strcmp(cmd, "motion") == 0) {
+            evt.type = SCRIPT_MOTION;
+            evt.btn = MOUSE_BTN_NONE;
+            valid = arg_count == 2 &&
+                parse_int(args[0], 0, &evt.x) &&
+                parse_int(args[1], 0, &evt.y);
+        } else if (strcmp(cmd, "click") == 0) {
+            evt.type = SCRIPT_CLICK;
+            valid = arg_count == 3 &&
+                parse_button(args[0], &evt.btn) &&
+                parse_int(args[1], 0, &evt.x) &&
+                parse_int(args[2], 0, &evt.y);
+        } else if (strcmp(cmd, "wait") == 0) {
+            evt.type = SCRIPT_WAIT;
+            valid = arg_count == 1 && parse_int(args[0], 0, &evt.wait_ms);
+        }
+
+        if (!valid) {
+            LOG_ERR("%s:%d: invalid mouse script event", path, line_no);
+            goto out;
+        }
+
+        tll_push_back(backend->script, evt);
+    }
+
+    LOG_INFO("%s: %zu mouse script events", path, tll_length(backend->script));
+    ret = true;
+
+out:
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+static void
+free_options(struct headless_backend *backend)
+{
+    free(backend->dump_path);
+    backend->dump_path = NULL;
+    tll_free(backend->script);
+}
+
+/*
+ * Options are a comma separated list of KEY=VALUE pairs:
+ *
+ *   width=N       logical width of the bar (default: 1920)
+ *   scale=N       integer scale factor (default: 1)
+ *   frames=N      exit after N frames (default: 0, run until aborted)
+ *   dump=PATH     dump each frame; PNG if PATH ends in '.png',
+ *                 otherwise raw, premultiplied, ARGB32 (host order)
+ *   script=PATH   mouse script
+ */
+void *
+bar_backend_headless_new(const char *options)
+{
+    struct headless_backend *backend = calloc(1, sizeof(*backend));
+    backend->width = 1920;
+    backend->scale = 1;
+    backend->refresh_fd = -1;
+
+    if (options == NULL)
+        return backend;
+
+    char *copy = strdup(options);
+    char *saveptr = NULL;
+
+    for (char *opt = strtok_r(copy, ",", &saveptr);
+         opt != NULL;
+         opt = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(opt, '=');
+        if (value == NULL) {
+            LOG_ERR("%s: invalid headless option: expected KEY=VALUE", opt);
+            goto err;
+        }
+
+        *value++ = '\0';
+
+        bool valid = true;
+        if (strcmp(opt, "width") == 0)
+            valid = parse_int(value, 1, &backend->width);
+        else if (strcmp(opt, "scale") == 0)
+            valid = parse_int(value, 1, &backend->scale);
+        else if (strcmp(opt, "frames") == 0) {
+            int frames;
+            valid = parse_int(value, 0, &frames);
+            backend->max_frames = frames;
+        } else if (strcmp(opt, "dump") == 0) {
+            const char *ext = strrchr(value, '.');
+            free(backend->dump_path);
+            backend->dump_path = strdup(value);
+            backend->dump_png = ext != NULL && strcmp(ext, ".png") == 0;
+        } else if (strcmp(opt, "script") == 0)
+            valid = load_script(backend, value);
+        else {
+            LOG_ERR("%s: invalid headless option", opt);
+            goto err;
+        }
+
+        if (!valid) {
+            LOG_ERR("%s: invalid value for headless option '%s'", value, opt);
+            goto err;
+        }
+    }
+
+    free(copy);
+    return backend;
+
+err:
+    free(copy);
+    free_options(backend);
+    free(backend);
+    return NULL;
+}
+
+static bool
+setup(struct bar *_bar)
+{
+    struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    backend->refresh_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (backend->refresh_fd < 0) {
+        LOG_ERRNO("failed to create refresh eventfd");
+        return false;
+    }
+
+    bar->width = backend->width * backend->scale;
+
+    const int stride = stride_for_format_and_width(PIXMAN_a8r8g8b8, bar->width);
+    backend->data = calloc(bar->height_with_border, stride);
+    backend->pix = pixman_image_create_bits_no_clear(
+        PIXMAN_a8r8g8b8, bar->width, bar->height_with_border,
+        backend->data, stride);
+
+    if (backend->pix == NULL) {
+        LOG_ERR("failed to create %dx%d image", bar->width, bar->height_with_border);
+        return false;
+    }
+
+    bar->pix = backend->pix;
+
+    LOG_INFO("headless: %dx%d (scale %d)",
+             bar->width, bar->height_with_border, backend->scale);
+
+    clock_gettime(CLOCK_MONOTONIC, &backend->script_deadline);
+    return true;
+}
+
+static void
+cleanup(struct bar *_bar)
+{
+    struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    if (backend->timed_frame_count > 0) {
+        const double total_us =
+            backend->expose_time.tv_sec * 1000000. +
+            backend->expose_time.tv_nsec / 1000.;
+
+        LOG_INFO("%u frames, %u timed: %.1f µs/frame (average)",
+                 backend->frame_count, backend->timed_frame_count,
+                 total_us / backend->timed_frame_count);
+    }
+
+    if (backend->pix != NULL)
+        pixman_image_unref(backend->pix);
+    backend->pix = NULL;
+    bar->pix = NULL;
+
+    free(backend->data);
+    backend->data = NULL;
+
+    if (backend->refresh_fd >= 0)
+        close(backend->refresh_fd);
+    backend->refresh_fd = -1;
+
+    free(backend->cursor);
+    backend->cursor = NULL;
+
+    free_options(backend);
+}
+
+static void
+timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void
+timespec_sub(const struct timespec *a, const struct timespec *b,
+             struct timespec *res)
+{
+    res->tv_sec = a->tv_sec - b->tv_sec;
+    res->tv_nsec = a->tv_nsec - b->tv_nsec;
+    if (res->tv_nsec < 0) {
+        res->tv_sec--;
+        res->tv_nsec += 1000000000;
+    }
+}
+
+/* Milliseconds until the next script event is due; -1 if no events */
+static int
+script_timeout(const struct headless_backend *backend)
+{
+    if (tll_length(backend->script) == 0)
+        return -1;
+
+    struct timespec now, diff;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_sub(&backend->script_deadline, &now, &diff);
+
+    if (diff.tv_sec < 0)
+        return 0;
+    return diff.tv_sec * 1000 + (diff.tv_nsec + 999999) / 1000000;
+}
+
+static void
+run_script(struct bar *_bar,
+           void (*on_mouse)(struct bar *bar, enum mouse_event event,
+                            enum mouse_button btn, int x, int y))
+{
+    struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    while (tll_length(backend->script) > 0 && script_timeout(backend) == 0) {
+        struct script_event evt = tll_pop_front(backend->script);
+        const int x = evt.x * backend->scale;
+        const int y = evt.y * backend->scale;
+
+        switch (evt.type) {
+        case SCRIPT_MOTION:
+            LOG_DBG("script: motion: %dx%d", x, y);
+            on_mouse(_bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE, x, y);
+            break;
+
+        case SCRIPT_CLICK:
+            LOG_DBG("script: click: button=%d, %dx%d", evt.btn, x, y);
+            on_mouse(_bar, ON_MOUSE_CLICK, evt.btn, x, y);
+            break;
+
+        case SCRIPT_WAIT:
+            clock_gettime(CLOCK_MONOTONIC, &backend->script_deadline);
+            timespec_add_ms(&backend->script_deadline, evt.wait_ms);
+            break;
+        }
+    }
+}
+
+static void
+loop(struct bar *_bar,
+     void (*expose)(const struct bar *bar),
+     void (*on_mouse)(struct bar *bar, enum mouse_event event,
+                      enum mouse_button btn, int x, int y))
+{
+    struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    pthread_setname_np(pthread_self(), "bar(headless)");
+
+    while (backend->max_frames == 0 ||
+           backend->frame_count < backend->max_frames)
+    {
+        struct pollfd fds[] = {
+            {.fd = _bar->abort_fd, .events = POLLIN},
+            {.fd = backend->refresh_fd, .events = POLLIN},
+        };
+
+        int r = poll(fds, sizeof(fds) / sizeof(fds[0]), script_timeout(backend));
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERRNO("failed to poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            return;
+
+        if (fds[1].revents & POLLIN) {
+            /* Coalesce all pending refresh requests into a single frame */
+            uint64_t count;
+            if (read(backend->refresh_fd, &count, sizeof(count)) != sizeof(count))
+                LOG_ERRNO("failed to read from refresh eventfd");
+            else {
+                stats_refresh_coalesced(bar->stats, count);
+                trace_instant_value("coalesced", count);
+            }
+
+            struct timespec start, end, diff;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            expose(_bar);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            timespec_sub(&end, &start, &diff);
+            backend->expose_time.tv_sec += diff.tv_sec;
+            backend->expose_time.tv_nsec += diff.tv_nsec;
+            if (backend->expose_time.tv_nsec >= 1000000000) {
+                backend->expose_time.tv_sec++;
+                backend->expose_time.tv_nsec -= 1000000000;
+            }
+            backend->timed_frame_count++;
+        }
+
+        run_script(_bar, on_mouse);
+    }
+
+    LOG_INFO("rendered %u frames, exiting", backend->frame_count);
+    if (write(_bar->abort_fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+        LOG_ERRNO("failed to signal abort to modules");
+}
+
+static void
+dump_frame(const struct private *bar, const struct headless_backend *backend)
+{
+    /* foo.png -> foo-000001.png */
+    const char *path = backend->dump_path;
+    const char *slash = strrchr(path, '/');
+    const char *ext = strrchr(path, '.');
+    if (ext == NULL || (slash != NULL && ext < slash))
+        ext = path + strlen(path);
+
+    char *frame_path = NULL;
+    if (asprintf(&frame_path, "%.*s-%06u%s",
+                 (int)(ext - path), path, backend->frame_count, ext) < 0)
+    {
+        LOG_ERRNO("failed to format frame dump path");
+        return;
+    }
+
+    if (backend->dump_png)
+        png_save(frame_path, backend->pix);
+    else {
+        FILE *f = fopen(frame_path, "wb");
+        if (f == NULL)
+            LOG_ERRNO("%s: failed to open", frame_path);
+        else {
+            const size_t size =
+                pixman_image_get_stride(backend->pix) * bar->height_with_border;
+            if (fwrite(backend->data, 1, size, f) != size)
+                LOG_ERRNO("%s: failed to write frame", frame_path);
+            fclose(f);
+        }
+    }
+
+    free(frame_path);
+}
+
+static void
+commit(const struct bar *_bar)
+{
+    const struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    backend->frame_count++;
+    LOG_DBG("frame #%u", backend->frame_count);
+
+    if (backend->dump_path != NULL)
+        dump_frame(bar, backend);
+}
+
+static void
+refresh(const struct bar *_bar)
+{
+    const struct private *bar = _bar->private;
+    const struct headless_backend *backend = bar->backend.data;
+
+    if (write(backend->refresh_fd, &(uint64_t){1}, sizeof(uint64_t))
+        != sizeof(uint64_t))
+    {
+        LOG_ERRNO("failed to signal 'refresh' to main thread");
+    }
+}
+
+static void
+set_cursor(struct bar *_bar, const char *cursor)
+{
+    struct private *bar = _bar->private;
+    struct headless_backend *backend = bar->backend.data;
+
+    if (backend->cursor != NULL && strcmp(backend->cursor, cursor) == 0)
+        return;
+
+    LOG_DBG("cursor: %s", cursor);
+    free(backend->cursor);
+    backend->cursor = strdup(cursor);
+}
+
+static const char *
+output_name(const struct bar *_bar)
+{
+    return "HEADLESS-1";
+}
+
+static bool
+reuse_frame(const struct bar *_bar)
+{
+    /* We only have a single image, always holding the last frame */
+    return true;
+}
+
+const struct backend headless_backend_iface = {
+    .setup = &setup,
+    .cleanup = &cleanup,
+    .loop = &loop,
+    .commit = &commit,
+    .refresh = &refresh,
+    .set_cursor = &set_cursor,
+    .output_name = &output_name,
+    .reuse_frame = &reuse_frame,
+};
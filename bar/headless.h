@@ -0,0 +1,7 @@
+#pragma once
+
+#include "backend.h"
+
+extern const struct backend headless_backend_iface;
+
+void *bar_backend_headless_new(const char *options);
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <time.h>
+
+#include <tllist.h>
+
 #include "../bar/bar.h"
 #include "backend.h"
+#include "stats.h"
 
 struct private {
     /* From bar_config */
@@ -14,6 +20,7 @@ struct private {
     int left_spacing, right_spacing;
     int left_margin, right_margin;
     int trackpad_sensitivity;
+    int layout_threads;
 
     pixman_color_t background;
 
@@ -25,21 +32,98 @@ struct private {
         int top_margin, bottom_margin;
     } border;
 
-    struct {
-        struct module **mods;
-        struct exposable **exps;
-        size_t count;
-    } left;
-    struct {
+    /* Protects the module groups, 'modules_state' and the frame state below */
+    mtx_t lock;
+
+    enum {
+        MODULES_NOT_STARTED,
+        MODULES_RUNNING,
+        MODULES_STOPPED,
+    } modules_state;
+
+    struct module_group {
         struct module **mods;
         struct exposable **exps;
+        thrd_t *thrds;
         size_t count;
-    } center;
+    } left, center, right;
+
+    /*
+     * Set when the modules' content must be re-instantiated. Frames
+     * rendered without it (e.g. animation frames, or frames requested
+     * by the backend) re-paint the previous frame's exposables.
+     */
+    atomic_bool layout_dirty;
+
+    /*
+     * Frames are laid out, painted and committed without holding the
+     * lock (which would stall e.g. pointer events). 'rendering' is
+     * set while a frame is in progress; until it is cleared (and
+     * 'render_done' signalled), the module groups, their exposables,
+     * the hit-test table, 'pix' and the bar's size must not be
+     * modified, or destroyed.
+     */
+    bool rendering;
+    cnd_t render_done;
+
+    /* The frame's exposables, in bar order. Owned by the render thread */
+    struct exposable **frame_exps;
+    size_t frame_exps_size;
+
+    /*
+     * Exposables that requested a new frame (i.e. are animated) when
+     * last painted, and where. When nothing else has changed, only
+     * these are re-painted. Owned by the render thread.
+     */
+    struct animated_region {
+        size_t idx;  /* Module index, in bar order */
+        struct exposable *exp;
+        int x, width;
+    } *animated;
+    size_t animated_count;
+    size_t animated_size;
+
+    /*
+     * Region (in buffer pixels) re-painted by the frame being
+     * committed; the entire bar, or the animated regions only. Read
+     * by the backend's commit().
+     */
+    pixman_region32_t damage;
+
+    /*
+     * Schedules the re-paints requested by animated exposables, and
+     * the refreshes deferred by modules' refresh limits. The lock
+     * also protects the modules' refresh limit state.
+     */
     struct {
-        struct module **mods;
-        struct exposable **exps;
+        mtx_t lock;
+        cnd_t cond;
+        thrd_t thrd;
+        bool started;
+        bool quit;
+        bool armed;
+        struct timespec deadline;  /* TIME_UTC */
+
+        /* Modules with a pending, deferred, refresh */
+        tll(struct module *) deferred;
+    } ticker;
+
+    /*
+     * Hit-test tables: the x-range of each visible module, in
+     * ascending order. 'hits' describes the frame on screen, and is
+     * what pointer events are tested against. 'next_hits' is built,
+     * by the render thread, for the frame in progress, and swapped
+     * in when that frame is done. Emptied when the modules change.
+     */
+    struct hit_table {
+        struct hit_region {
+            int x, width;
+            int origin;  /* Module's x; less than 'x' if partially covered */
+            struct exposable *exp;
+        } *regions;
         size_t count;
-    } right;
+        size_t size;
+    } hits, next_hits;
 
     /* Calculated run-time */
     int width;
@@ -47,6 +131,10 @@ struct private {
 
     pixman_image_t *pix;
 
+    struct workers *workers;  /* NULL unless 'layout_threads' > 0 */
+    struct stats *stats;  /* NULL unless enabled */
+    const char **trace_names;  /* Interned module names, when tracing */
+
     struct {
         void *data;
         const struct backend *iface;
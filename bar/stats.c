@@ -0,0 +1,317 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#define LOG_MODULE "stats"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../module.h"
+
+#include <tllist.h>
+
+/* Number of samples the percentiles are calculated from */
+#define WINDOW_SIZE 256
+
+struct metric {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t window[WINDOW_SIZE];  /* Ring buffer, indexed by 'count' */
+};
+
+struct module_stats {
+    struct stats *stats;
+    struct module *mod;
+    struct metric metrics[STATS_MODULE_COUNT];
+    atomic_uint_least64_t refreshes;
+};
+
+struct stats {
+    char *path;
+
+    /* Protects the metrics; counters are atomic */
+    mtx_t lock;
+
+    struct metric frame[STATS_FRAME_COUNT];
+    atomic_uint_least64_t refreshes;  /* Not from a module thread */
+    atomic_uint_least64_t coalesced;
+    atomic_uint_least64_t dropped;
+
+    /* Current modules, in bar order */
+    size_t count;
+    struct module_stats **mods;
+
+    /* All modules' statistics, including those of removed modules
+     * (their threads may still reference them) */
+    tll(struct module_stats *) all;
+};
+
+static thread_local struct module_stats *current_module = NULL;
+
+static const char *const frame_metric_names[STATS_FRAME_COUNT] = {
+    [STATS_FRAME_LAYOUT] = "layout",
+    [STATS_FRAME_PAINT] = "paint",
+    [STATS_FRAME_COMMIT] = "commit",
+    [STATS_FRAME_TOTAL] = "total",
+};
+
+static const char *const module_metric_names[STATS_MODULE_COUNT] = {
+    [STATS_MODULE_CONTENT] = "content",
+    [STATS_MODULE_BEGIN_EXPOSE] = "begin-expose",
+    [STATS_MODULE_EXPOSE] = "expose",
+    [STATS_MODULE_LOCK_WAIT] = "lock-wait",
+};
+
+/* Must be called with the lock held */
+static void
+set_modules(struct stats *stats, size_t count, struct module *mods[static count])
+{
+    struct module_stats **new_mods = calloc(
+        count > 0 ? count : 1, sizeof(new_mods[0]));
+
+    for (size_t i = 0; i < count; i++) {
+        tll_foreach(stats->all, it) {
+            if (it->item->mod == mods[i]) {
+                new_mods[i] = it->item;
+                break;
+            }
+        }
+
+        if (new_mods[i] == NULL) {
+            struct module_stats *ms = calloc(1, sizeof(*ms));
+            ms->stats = stats;
+            ms->mod = mods[i];
+            tll_push_back(stats->all, ms);
+            new_mods[i] = ms;
+        }
+    }
+
+    free(stats->mods);
+    stats->mods = new_mods;
+    stats->count = count;
+}
+
+struct stats *
+stats_new(const char *path, size_t count, struct module *mods[static count])
+{
+    struct stats *stats = calloc(1, sizeof(*stats));
+    if (stats == NULL)
+        return NULL;
+
+    stats->path = path != NULL ? strdup(path) : NULL;
+    mtx_init(&stats->lock, mtx_plain);
+    set_modules(stats, count, mods);
+    return stats;
+}
+
+void
+stats_destroy(struct stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    tll_free_and_free(stats->all, free);
+    mtx_destroy(&stats->lock);
+    free(stats->mods);
+    free(stats->path);
+    free(stats);
+}
+
+void
+stats_update_modules(
+    struct stats *stats, size_t count, struct module *mods[static count])
+{
+    if (stats == NULL)
+        return;
+
+    mtx_lock(&stats->lock);
+    set_modules(stats, count, mods);
+    mtx_unlock(&stats->lock);
+}
+
+static void
+metric_add(struct metric *m, uint64_t ns)
+{
+    m->window[m->count % WINDOW_SIZE] = ns;
+    m->count++;
+    m->total += ns;
+    if (ns > m->max)
+        m->max = ns;
+}
+
+void
+stats_frame(struct stats *stats, enum stats_frame_metric metric,
+            uint64_t start)
+{
+    if (stats == NULL)
+        return;
+
+    uint64_t ns = stats_clock(stats) - start;
+
+    mtx_lock(&stats->lock);
+    metric_add(&stats->frame[metric], ns);
+    mtx_unlock(&stats->lock);
+}
+
+void
+stats_module(struct stats *stats, size_t idx,
+             enum stats_module_metric metric, uint64_t start)
+{
+    if (stats == NULL)
+        return;
+
+    uint64_t ns = stats_clock(stats) - start;
+
+    mtx_lock(&stats->lock);
+    metric_add(&stats->mods[idx]->metrics[metric], ns);
+    mtx_unlock(&stats->lock);
+}
+
+void
+stats_refresh(struct stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    struct module_stats *ms = current_module;
+    if (ms != NULL && ms->stats == stats)
+        atomic_fetch_add_explicit(&ms->refreshes, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&stats->refreshes, 1, memory_order_relaxed);
+}
+
+void
+stats_refresh_coalesced(struct stats *stats, size_t count)
+{
+    if (stats == NULL || count <= 1)
+        return;
+
+    atomic_fetch_add_explicit(
+        &stats->coalesced, count - 1, memory_order_relaxed);
+}
+
+void
+stats_frame_dropped(struct stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    atomic_fetch_add_explicit(&stats->dropped, 1, memory_order_relaxed);
+}
+
+struct module_stats *
+stats_module_stats(struct stats *stats, size_t idx)
+{
+    if (stats == NULL)
+        return NULL;
+
+    mtx_lock(&stats->lock);
+    struct module_stats *ms = stats->mods[idx];
+    mtx_unlock(&stats->lock);
+    return ms;
+}
+
+void
+stats_module_thread_init(struct module_stats *ms)
+{
+    current_module = ms;
+}
+
+static int
+u64_cmp(const void *_a, const void *_b)
+{
+    const uint64_t *a = _a;
+    const uint64_t *b = _b;
+    return *a < *b ? -1 : *a > *b ? 1 : 0;
+}
+
+static void
+metric_print(FILE *f, const char *name, const struct metric *m)
+{
+    if (m->count == 0) {
+        fprintf(f, "  %-14s %10d\n", name, 0);
+        return;
+    }
+
+    size_t n = m->count < WINDOW_SIZE ? m->count : WINDOW_SIZE;
+    uint64_t sorted[WINDOW_SIZE];
+    memcpy(sorted, m->window, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), &u64_cmp);
+
+    fprintf(f, "  %-14s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            name, (unsigned long long)m->count,
+            m->total / (double)m->count / 1000.,
+            sorted[(n - 1) * 50 / 100] / 1000.,
+            sorted[(n - 1) * 90 / 100] / 1000.,
+            sorted[(n - 1) * 99 / 100] / 1000.,
+            m->max / 1000.);
+}
+
+void
+stats_dump(struct stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&buf, &size);
+    if (f == NULL) {
+        LOG_ERRNO("failed to create memory stream");
+        return;
+    }
+
+    mtx_lock(&stats->lock);
+
+    fprintf(f, "frames: %llu, dropped: %llu, coalesced refreshes: %llu\n",
+            (unsigned long long)stats->frame[STATS_FRAME_TOTAL].count,
+            (unsigned long long)atomic_load(&stats->dropped),
+            (unsigned long long)atomic_load(&stats->coalesced));
+    fprintf(f, "  %-14s %10s %9s %9s %9s %9s %9s\n",
+            "(us)", "count", "avg", "p50", "p90", "p99", "max");
+
+    for (size_t i = 0; i < STATS_FRAME_COUNT; i++)
+        metric_print(f, frame_metric_names[i], &stats->frame[i]);
+
+    for (size_t i = 0; i < stats->count; i++) {
+        const struct module_stats *ms = stats->mods[i];
+        const struct module *mod = ms->mod;
+
+        fprintf(f, "module #%zu (%s): refreshes: %llu\n",
+                i, mod->description != NULL ? mod->description(mod) : "<unknown>",
+                (unsigned long long)atomic_load(&ms->refreshes));
+
+        for (size_t j = 0; j < STATS_MODULE_COUNT; j++)
+            metric_print(f, module_metric_names[j], &ms->metrics[j]);
+    }
+
+    fprintf(f, "other refreshes: %llu\n",
+            (unsigned long long)atomic_load(&stats->refreshes));
+
+    mtx_unlock(&stats->lock);
+    fclose(f);
+
+    if (stats->path != NULL) {
+        FILE *out = fopen(stats->path, "w");
+        if (out == NULL)
+            LOG_ERRNO("%s: failed to open", stats->path);
+        else {
+            fwrite(buf, 1, size, out);
+            fclose(out);
+        }
+    } else {
+        for (char *saveptr = NULL, *line = strtok_r(buf, "\n", &saveptr);
+             line != NULL;
+             line = strtok_r(NULL, "\n", &saveptr))
+        {
+            LOG_INFO("%s", line);
+        }
+    }
+
+    free(buf);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct module;
+
+/*
+ * Timing statistics, per frame and per module.
+ *
+ * Everything is disabled (and no clocks are read) unless stats have
+ * been enabled; all functions accept a NULL 'stats'.
+ *
+ * Each metric keeps lifetime totals, and a rolling window of the most
+ * recent samples, from which the percentiles in the dump are
+ * calculated.
+ */
+struct stats;
+struct module_stats;
+
+enum stats_frame_metric {
+    STATS_FRAME_LAYOUT,  /* content() + begin_expose() of all modules */
+    STATS_FRAME_PAINT,   /* background + expose() of all modules */
+    STATS_FRAME_COMMIT,  /* Backend commit */
+    STATS_FRAME_TOTAL,
+    STATS_FRAME_COUNT,
+};
+
+enum stats_module_metric {
+    STATS_MODULE_CONTENT,
+    STATS_MODULE_BEGIN_EXPOSE,
+    STATS_MODULE_EXPOSE,
+    STATS_MODULE_LOCK_WAIT,
+    STATS_MODULE_COUNT,
+};
+
+/*
+ * 'path' is where dumps are written. If NULL, dumps are logged
+ * instead.
+ */
+struct stats *stats_new(const char *path, size_t count, struct module *mods[static count]);
+void stats_destroy(struct stats *stats);
+
+/*
+ * Replaces the set of modules (e.g. after a configuration
+ * reload). Modules part of both the old and new set keep their
+ * statistics.
+ */
+void stats_update_modules(
+    struct stats *stats, size_t count, struct module *mods[static count]);
+
+void stats_dump(struct stats *stats);
+
+/* Returns the current time, in nanoseconds, or 0 if stats are disabled */
+static inline uint64_t
+stats_clock(const struct stats *stats)
+{
+    if (stats == NULL)
+        return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Records the time elapsed since 'start' (as returned by stats_clock()) */
+void stats_frame(struct stats *stats, enum stats_frame_metric metric,
+                 uint64_t start);
+void stats_module(struct stats *stats, size_t idx,
+                  enum stats_module_metric metric, uint64_t start);
+
+/* Refresh requests are attributed to the calling module thread */
+void stats_refresh(struct stats *stats);
+
+/* 'count' refresh requests were merged into a single frame */
+void stats_refresh_coalesced(struct stats *stats, size_t count);
+
+/* A rendered frame was replaced by a newer one, before being shown */
+void stats_frame_dropped(struct stats *stats);
+
+/* Returns the statistics of module 'idx' (NULL if stats are disabled) */
+struct module_stats *stats_module_stats(struct stats *stats, size_t idx);
+
+/*
+ * Called by module threads, before running the module; subsequent
+ * refresh requests from the calling thread are attributed to 'ms'.
+ */
+void stats_module_thread_init(struct module_stats *ms);
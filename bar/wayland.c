@@ -4,9 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include <unistd.h>
 #include <poll.h>
 #include <pthread.h>
+#include <threads.h>
 #include <errno.h>
 
 #include <sys/mman.h>
@@ -21,23 +23,51 @@
 #include <xdg-output-unstable-v1.h>
 #include <wlr-layer-shell-unstable-v1.h>
 
+#if defined(HAVE_FRACTIONAL_SCALE)
+ #include <fractional-scale-v1.h>
+ #include <viewporter.h>
+#endif
+
 #define LOG_MODULE "bar:wayland"
 #define LOG_ENABLE_DBG 0
 #include "../log.h"
+#include "../trace.h"
 #include "../stride.h"
 
 #include "private.h"
 
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+/* Number of SHM buffers kept around; see get_buffer() */
+#define MAX_BUFFERS 3
+
+/* Pools at least this large are backed by huge pages, if possible */
+#define HUGE_PAGE_THRESHOLD (2 * 1024 * 1024)
+
 struct buffer {
+    struct wayland_backend *backend;
+
     bool busy;
+    bool stale;  /* Destroy when no longer busy */
     size_t width;
     size_t height;
+    size_t offset;  /* Within the SHM pool */
     size_t size;
-    void *mmapped;
+    int stride;
 
     struct wl_buffer *wl_buf;
 
     pixman_image_t *pix;
+
+    /* Where the buffer's contents are older than the last frame's */
+    pixman_region32_t outdated;
+};
+
+struct shm_pool {
+    int fd;
+    void *mmapped;
+    size_t size;
+    struct wl_shm_pool *wl_pool;
 };
 
 struct monitor {
@@ -99,27 +129,95 @@ struct wayland_backend {
     const struct monitor *monitor;
     char *last_mapped_monitor;
 
-    int scale;
+    /*
+     * Buffer pixels per logical (surface) pixel. Integral, unless the
+     * compositor supports fractional scaling, in which case the
+     * buffer is mapped to the surface's logical size with a viewport
+     */
+    float scale;
 
     struct zxdg_output_manager_v1 *xdg_output_manager;
 
+#if defined(HAVE_FRACTIONAL_SCALE)
+    struct wp_viewporter *viewporter;
+    struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+    struct wp_viewport *viewport;
+    struct wp_fractional_scale_v1 *fractional_scale;
+
+    /* Compositor's preferred scale for our surface (0 if not yet known) */
+    float preferred_fractional_scale;
+#endif
+
+    /* update_size() is waiting for the surface to be configured */
+    bool configuring;
+
     /* TODO: set directly in bar instead */
     int width, height;
+    int logical_width, logical_height;
+
+    /*
+     * The bar's height, including borders, as configured. The actual
+     * height is re-derived from this on each scale change, since
+     * rounding it to a whole number of logical pixels is lossy
+     */
+    int configured_height_with_border;
 
-    /* Used to signal e.g. refresh */
+    /* Used by the render thread, to signal a finished frame */
     int pipe_fds[2];
 
     /* We're already waiting for a frame done callback */
     bool render_scheduled;
 
+    /*
+     * Frames are rendered in a separate thread, leaving this thread
+     * to deal with Wayland events only. Finished frames are handed
+     * back through 'pending_buffer', and committed by this thread.
+     *
+     * 'lock' protects the buffers (including the pool), 'next_buffer',
+     * 'pending_buffer', and the render thread state.
+     *
+     * Buffers are only allocated when no frame is being painted (by
+     * the render thread, when committing, or with the bar's lock held
+     * and no frame in progress), since growing the pool re-creates all
+     * buffers' pixman images.
+     */
+    mtx_t lock;
+    cnd_t cond;
+    thrd_t render_thread;
+    bool render_requested;
+    bool render_quit;
+    size_t refresh_count;   /* Since the last rendered frame */
+    void (*bar_expose)(const struct bar *bar);
+
+    /*
+     * With an opaque background, buffers have no alpha channel, and
+     * the surface has an opaque region, allowing the compositor to
+     * skip blending the bar
+     */
+    bool opaque;
+    pixman_format_code_t pix_format;
+    uint32_t shm_format;
+
+    struct shm_pool pool;           /* All buffers are allocated from here */
     tll(struct buffer) buffers;     /* List of SHM buffers */
     struct buffer *next_buffer;     /* Bar is rendering to this one */
-    struct buffer *pending_buffer;  /* Finished, but not yet rendered */
+    struct buffer *pending_buffer;  /* Finished, but not yet committed */
+    struct buffer *last_frame;      /* The most recently finished frame */
+
+    /* Damaged by the frames finished since the last surface commit */
+    pixman_region32_t damage;
     struct wl_callback *frame_callback;
 
     double aggregated_scroll;
     bool have_discrete;
 
+    /*
+     * Pointer motion is coalesced, and delivered at most once per
+     * frame callback (or, when idle, once per batch of events)
+     */
+    bool motion_pending;
+    int motion_x, motion_y;
+
     void (*bar_on_mouse)(struct bar *bar, enum mouse_event event,
                          enum mouse_button btn, int x, int y);
 };
@@ -147,6 +245,7 @@ bar_backend_wayland_new(void)
 {
     struct wayland_backend *backend = calloc(1, sizeof(struct wayland_backend));
     backend->pipe_fds[0] = backend->pipe_fds[1] = -1;
+    backend->pool.fd = -1;
     return backend;
 }
 
@@ -230,6 +329,24 @@ reload_cursor_theme(struct seat *seat, int new_scale)
     seat->pointer.theme = theme;
 }
 
+static int
+surface_to_buffer(const struct wayland_backend *backend, wl_fixed_t v)
+{
+    return (int)(wl_fixed_to_double(v) * backend->scale);
+}
+
+static void
+flush_motion(struct wayland_backend *backend)
+{
+    if (!backend->motion_pending)
+        return;
+
+    backend->motion_pending = false;
+    backend->bar_on_mouse(
+        backend->bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE,
+        backend->motion_x, backend->motion_y);
+}
+
 static void
 wl_pointer_enter(void *data, struct wl_pointer *wl_pointer,
                  uint32_t serial, struct wl_surface *surface,
@@ -239,8 +356,8 @@ wl_pointer_enter(void *data, struct wl_pointer *wl_pointer,
     struct wayland_backend *backend = seat->backend;
 
     seat->pointer.serial = serial;
-    seat->pointer.x = wl_fixed_to_int(surface_x) * backend->scale;
-    seat->pointer.y = wl_fixed_to_int(surface_y) * backend->scale;
+    seat->pointer.x = surface_to_buffer(backend, surface_x);
+    seat->pointer.y = surface_to_buffer(backend, surface_y);
 
     backend->active_seat = seat;
     reload_cursor_theme(seat, backend->monitor->scale);
@@ -256,8 +373,10 @@ wl_pointer_leave(void *data, struct wl_pointer *wl_pointer,
 
     backend->have_discrete = false;
 
-    if (backend->active_seat == seat)
+    if (backend->active_seat == seat) {
         backend->active_seat = NULL;
+        backend->motion_pending = false;
+    }
 }
 
 static void
@@ -267,13 +386,13 @@ wl_pointer_motion(void *data, struct wl_pointer *wl_pointer,
     struct seat *seat = data;
     struct wayland_backend *backend = seat->backend;
 
-    seat->pointer.x = wl_fixed_to_int(surface_x) * backend->scale;
-    seat->pointer.y = wl_fixed_to_int(surface_y) * backend->scale;
+    seat->pointer.x = surface_to_buffer(backend, surface_x);
+    seat->pointer.y = surface_to_buffer(backend, surface_y);
 
     backend->active_seat = seat;
-    backend->bar_on_mouse(
-        backend->bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE,
-        seat->pointer.x, seat->pointer.y);
+    backend->motion_pending = true;
+    backend->motion_x = seat->pointer.x;
+    backend->motion_y = seat->pointer.y;
 }
 
 static void
@@ -298,6 +417,7 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer,
             return;
         }
 
+        flush_motion(backend);
         backend->bar_on_mouse(
             backend->bar, ON_MOUSE_CLICK, btn, seat->pointer.x, seat->pointer.y);
     }
@@ -335,6 +455,7 @@ wl_pointer_axis(void *data, struct wl_pointer *wl_pointer,
     const double step = bar->trackpad_sensitivity;
     const double adjust = backend->aggregated_scroll > 0 ? -step : step;
 
+    flush_motion(backend);
     while (fabs(backend->aggregated_scroll) >= step) {
         backend->bar_on_mouse(
             backend->bar, ON_MOUSE_CLICK, btn,
@@ -386,6 +507,7 @@ wl_pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer,
 
     int count = abs(discrete);
 
+    flush_motion(backend);
     for (int32_t i = 0; i < count; i++) {
         backend->bar_on_mouse(
             backend->bar, ON_MOUSE_CLICK, btn,
@@ -478,6 +600,7 @@ output_done(void *data, struct wl_output *wl_output)
 
 static bool update_size(struct wayland_backend *backend);
 static void refresh(const struct bar *_bar);
+static void submit_pending(struct wayland_backend *backend);
 
 static void
 output_scale(void *data, struct wl_output *wl_output, int32_t factor)
@@ -489,7 +612,7 @@ output_scale(void *data, struct wl_output *wl_output, int32_t factor)
     mon->scale = factor;
 
     if (mon->backend->monitor == mon) {
-        int old_scale = mon->backend->scale;
+        float old_scale = mon->backend->scale;
         update_size(mon->backend);
 
         if (mon->backend->scale != old_scale)
@@ -721,6 +844,26 @@ handle_global(void *data, struct wl_registry *registry,
         backend->xdg_output_manager = wl_registry_bind(
             registry, name, &zxdg_output_manager_v1_interface, required);
     }
+
+#if defined(HAVE_FRACTIONAL_SCALE)
+    else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required))
+            return;
+
+        backend->viewporter = wl_registry_bind(
+            registry, name, &wp_viewporter_interface, required);
+    }
+
+    else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+        const uint32_t required = 1;
+        if (!verify_iface_version(interface, version, required))
+            return;
+
+        backend->fractional_scale_manager = wl_registry_bind(
+            registry, name, &wp_fractional_scale_manager_v1_interface, required);
+    }
+#endif
 }
 
 static void
@@ -767,8 +910,24 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
                         uint32_t serial, uint32_t w, uint32_t h)
 {
     struct wayland_backend *backend = data;
-    backend->width = w * backend->scale;
-    backend->height = h * backend->scale;
+    backend->logical_width = w;
+    backend->logical_height = h;
+    backend->width = roundf(w * backend->scale);
+    backend->height = roundf(h * backend->scale);
+
+#if defined(HAVE_FRACTIONAL_SCALE)
+    if (backend->viewport != NULL)
+        wp_viewport_set_destination(backend->viewport, w, h);
+#endif
+
+    if (backend->opaque) {
+        struct wl_region *region = wl_compositor_create_region(backend->compositor);
+        if (region != NULL) {
+            wl_region_add(region, 0, 0, w, h);
+            wl_surface_set_opaque_region(backend->surface, region);
+            wl_region_destroy(region);
+        }
+    }
 
     zwlr_layer_surface_v1_ack_configure(surface, serial);
 }
@@ -788,6 +947,40 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 };
 
 static const struct wl_surface_listener surface_listener;
+static void put_buffer(struct wayland_backend *backend, struct buffer *buffer);
+
+#if defined(HAVE_FRACTIONAL_SCALE)
+static void
+fractional_scale_preferred_scale(
+    void *data, struct wp_fractional_scale_v1 *wp_fractional_scale_v1,
+    uint32_t scale)
+{
+    struct wayland_backend *backend = data;
+    const float new_scale = (float)scale / 120.;
+
+    if (backend->preferred_fractional_scale == new_scale)
+        return;
+
+    LOG_DBG("preferred fractional scale: %.3f", new_scale);
+    backend->preferred_fractional_scale = new_scale;
+
+    /* update_size() picks up the new scale by itself */
+    if (backend->configuring)
+        return;
+
+    if (backend->layer_surface != NULL) {
+        float old_scale = backend->scale;
+        update_size(backend);
+
+        if (backend->scale != old_scale)
+            refresh(backend->bar);
+    }
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+    .preferred_scale = &fractional_scale_preferred_scale,
+};
+#endif
 
 static bool
 create_surface(struct wayland_backend *backend)
@@ -807,6 +1000,20 @@ create_surface(struct wayland_backend *backend)
 
     wl_surface_add_listener(backend->surface, &surface_listener, backend);
 
+#if defined(HAVE_FRACTIONAL_SCALE)
+    if (backend->viewporter != NULL && backend->fractional_scale_manager != NULL) {
+        backend->viewport = wp_viewporter_get_viewport(
+            backend->viewporter, backend->surface);
+
+        backend->fractional_scale =
+            wp_fractional_scale_manager_v1_get_fractional_scale(
+                backend->fractional_scale_manager, backend->surface);
+
+        wp_fractional_scale_v1_add_listener(
+            backend->fractional_scale, &fractional_scale_listener, backend);
+    }
+#endif
+
     enum zwlr_layer_shell_v1_layer layer = bar->layer == BAR_LAYER_BOTTOM
         ? ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM
         : ZWLR_LAYER_SHELL_V1_LAYER_TOP;
@@ -841,6 +1048,17 @@ create_surface(struct wayland_backend *backend)
 static void
 destroy_surface(struct wayland_backend *backend)
 {
+#if defined(HAVE_FRACTIONAL_SCALE)
+    if (backend->fractional_scale != NULL)
+        wp_fractional_scale_v1_destroy(backend->fractional_scale);
+    if (backend->viewport != NULL)
+        wp_viewport_destroy(backend->viewport);
+
+    backend->fractional_scale = NULL;
+    backend->viewport = NULL;
+    backend->preferred_fractional_scale = 0;
+#endif
+
     if (backend->layer_surface != NULL)
         zwlr_layer_surface_v1_destroy(backend->layer_surface);
     if (backend->surface != NULL)
@@ -848,128 +1066,363 @@ destroy_surface(struct wayland_backend *backend)
     if (backend->frame_callback != NULL)
         wl_callback_destroy(backend->frame_callback);
 
+    /*
+     * The render thread may still be rendering to 'next_buffer'. That
+     * is harmless, as the buffer isn't destroyed, only made available
+     * for re-use. But don't take it away while it's being committed
+     */
+    mtx_lock(&backend->lock);
     if (backend->pending_buffer != NULL)
-        backend->pending_buffer->busy = false;
+        put_buffer(backend, backend->pending_buffer);
     if (backend->next_buffer != NULL)
-        backend->next_buffer->busy = false;
+        put_buffer(backend, backend->next_buffer);
+
+    backend->pending_buffer = NULL;
+    backend->next_buffer = NULL;
+    mtx_unlock(&backend->lock);
 
     backend->layer_surface = NULL;
     backend->surface = NULL;
     backend->frame_callback = NULL;
-    backend->pending_buffer = NULL;
-    backend->next_buffer = NULL;
 
     backend->scale = 0;
     backend->render_scheduled = false;
 }
 
+/*
+ * SHM buffer management
+ *
+ * All buffers are sub-allocated from a single memfd backed pool,
+ * which grows as needed. At most MAX_BUFFERS buffers are kept around;
+ * buffers allocated beyond that (e.g. when the compositor holds on to
+ * buffers for longer than usual), and buffers whose size no longer
+ * matches the bar's, are destroyed as soon as they are no longer busy.
+ */
+
+static void
+buffer_destroy(struct wayland_backend *backend, struct buffer *buffer)
+{
+    if (buffer->wl_buf != NULL)
+        wl_buffer_destroy(buffer->wl_buf);
+    if (buffer->pix != NULL)
+        pixman_image_unref(buffer->pix);
+    pixman_region32_fini(&buffer->outdated);
+
+    if (backend->last_frame == buffer)
+        backend->last_frame = NULL;
+
+    tll_foreach(backend->buffers, it) {
+        if (&it->item == buffer) {
+            tll_remove(backend->buffers, it);
+            break;
+        }
+    }
+}
+
+/*
+ * Called when neither we, nor the compositor, are using the
+ * buffer. Must be called with the lock held.
+ */
+static void
+put_buffer(struct wayland_backend *backend, struct buffer *buffer)
+{
+    assert(buffer->busy);
+    buffer->busy = false;
+
+    if (buffer->stale)
+        buffer_destroy(backend, buffer);
+}
+
 static void
 buffer_release(void *data, struct wl_buffer *wl_buffer)
 {
     //printf("buffer release\n");
     struct buffer *buffer = data;
-    assert(buffer->busy);
-    buffer->busy = false;
+    struct wayland_backend *backend = buffer->backend;
+    trace_instant("buffer-release", NULL);
+
+    mtx_lock(&backend->lock);
+    put_buffer(backend, buffer);
+    mtx_unlock(&backend->lock);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
     .release = &buffer_release,
 };
 
-static struct buffer *
-get_buffer(struct wayland_backend *backend)
+static void
+pool_destroy(struct wayland_backend *backend)
+{
+    struct shm_pool *pool = &backend->pool;
+
+    if (pool->wl_pool != NULL)
+        wl_shm_pool_destroy(pool->wl_pool);
+    if (pool->mmapped != NULL)
+        munmap(pool->mmapped, pool->size);
+    if (pool->fd >= 0)
+        close(pool->fd);
+
+    pool->wl_pool = NULL;
+    pool->mmapped = NULL;
+    pool->size = 0;
+    pool->fd = -1;
+}
+
+/* (Re-)creates all buffers' pixman images, after the pool has been re-mapped */
+static bool
+pool_update_images(struct wayland_backend *backend)
 {
     tll_foreach(backend->buffers, it) {
-        if (!it->item.busy && it->item.width == backend->width && it->item.height == backend->height) {
-            it->item.busy = true;
-            return &it->item;
+        struct buffer *buf = &it->item;
+
+        if (buf->pix != NULL)
+            pixman_image_unref(buf->pix);
+
+        buf->pix = pixman_image_create_bits_no_clear(
+            backend->pix_format, buf->width, buf->height,
+            (uint32_t *)((uint8_t *)backend->pool.mmapped + buf->offset),
+            buf->stride);
+
+        if (buf->pix == NULL) {
+            LOG_ERR("failed to create pixman image");
+            return false;
         }
     }
 
-    /*
-     * No existing buffer available. Create a new one by:
-     *
-     * 1. open a memory backed "file" with memfd_create()
-     * 2. mmap() the memory file, to be used by the pixman image
-     * 3. create a wayland shm buffer for the same memory file
-     *
-     * The pixman image and the wayland buffer are now sharing memory.
-     */
+    return true;
+}
 
-    int pool_fd = -1;
-    void *mmapped = NULL;
-    size_t size = 0;
+static bool
+pool_map(struct wayland_backend *backend, size_t size)
+{
+    struct shm_pool *pool = &backend->pool;
 
-    struct wl_shm_pool *pool = NULL;
-    struct wl_buffer *buf = NULL;
+    void *mmapped = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
 
-    pixman_image_t *pix = NULL;
+    if (mmapped == MAP_FAILED) {
+        LOG_ERRNO("failed to mmap SHM backing memory file");
+        return false;
+    }
+
+#if defined(MADV_HUGEPAGE)
+    /* Very wide (or tall) bars; not an error if unsupported */
+    if (size >= HUGE_PAGE_THRESHOLD)
+        madvise(mmapped, size, MADV_HUGEPAGE);
+#endif
+
+    if (pool->mmapped != NULL)
+        munmap(pool->mmapped, pool->size);
+
+    pool->mmapped = mmapped;
+    pool->size = size;
+    return true;
+}
+
+static bool
+pool_create(struct wayland_backend *backend, size_t size)
+{
+    struct shm_pool *pool = &backend->pool;
+    assert(pool->fd < 0);
 
     /* Backing memory for SHM */
 #if defined(MEMFD_CREATE)
-    pool_fd = memfd_create("yambar-wayland-shm-buffer-pool", MFD_CLOEXEC);
+    pool->fd = memfd_create(
+        "yambar-wayland-shm-buffer-pool", MFD_CLOEXEC | MFD_ALLOW_SEALING);
 #elif defined(__FreeBSD__)
     // memfd_create on FreeBSD 13 is SHM_ANON without sealing support
-    pool_fd = shm_open(SHM_ANON, O_RDWR | O_CLOEXEC, 0600);
+    pool->fd = shm_open(SHM_ANON, O_RDWR | O_CLOEXEC, 0600);
 #else
     char name[] = "/tmp/yambar-wayland-shm-buffer-pool-XXXXXX";
-    pool_fd = mkostemp(name, O_CLOEXEC);
+    pool->fd = mkostemp(name, O_CLOEXEC);
     unlink(name);
 #endif
-    if (pool_fd == -1) {
+    if (pool->fd == -1) {
         LOG_ERRNO("failed to create SHM backing memory file");
         goto err;
     }
 
-    /* Total size */
-    const uint32_t stride = stride_for_format_and_width(
-        PIXMAN_a8r8g8b8, backend->width);
-
-    size = stride * backend->height;
-    if (ftruncate(pool_fd, size) == -1) {
-        LOG_ERR("failed to truncate SHM pool");
+    if (ftruncate(pool->fd, size) == -1) {
+        LOG_ERRNO("failed to truncate SHM pool");
         goto err;
     }
 
-    mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
-    if (mmapped == MAP_FAILED) {
-        LOG_ERR("failed to mmap SHM backing memory file");
+#if defined(MEMFD_CREATE) && defined(F_ADD_SEALS)
+    /*
+     * The pool only ever grows. Sealing it against shrinking
+     * guarantees the compositor it won't SIGBUS when accessing it
+     */
+    if (fcntl(pool->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+        LOG_ERRNO("failed to seal SHM pool (ignored)");
+#endif
+
+    if (!pool_map(backend, size))
         goto err;
-    }
 
-    pool = wl_shm_create_pool(backend->shm, pool_fd, size);
-    if (pool == NULL) {
+    pool->wl_pool = wl_shm_create_pool(backend->shm, pool->fd, size);
+    if (pool->wl_pool == NULL) {
         LOG_ERR("failed to create SHM pool");
         goto err;
     }
 
-    buf = wl_shm_pool_create_buffer(
-        pool, 0, backend->width, backend->height, stride, WL_SHM_FORMAT_ARGB8888);
+    LOG_DBG("SHM pool created: %zu bytes", size);
+    return true;
+
+err:
+    pool_destroy(backend);
+    return false;
+}
+
+static bool
+pool_grow(struct wayland_backend *backend, size_t size)
+{
+    struct shm_pool *pool = &backend->pool;
+    assert(size > pool->size);
+
+    if (ftruncate(pool->fd, size) == -1) {
+        LOG_ERRNO("failed to grow SHM pool");
+        return false;
+    }
+
+    if (!pool_map(backend, size))
+        return false;
+
+    wl_shm_pool_resize(pool->wl_pool, size);
+
+    LOG_DBG("SHM pool resized: %zu bytes", size);
+    return pool_update_images(backend);
+}
+
+/*
+ * Finds room for a 'size' bytes large buffer in the pool (first fit),
+ * growing the pool if necessary
+ */
+static bool
+pool_alloc(struct wayland_backend *backend, size_t size, size_t *offset)
+{
+    size_t candidate = 0;
+
+    /* Try offset 0, and the end of each existing buffer */
+    while (true) {
+        bool overlaps = false;
+        size_t next = SIZE_MAX;
+
+        tll_foreach(backend->buffers, it) {
+            const struct buffer *buf = &it->item;
+            const size_t buf_end = buf->offset + buf->size;
+
+            if (candidate < buf_end && buf->offset < candidate + size) {
+                overlaps = true;
+                if (buf_end < next)
+                    next = buf_end;
+            }
+        }
+
+        if (!overlaps)
+            break;
+
+        candidate = next;
+    }
+
+    const size_t end = candidate + size;
+
+    if (backend->pool.fd < 0) {
+        /* Room for the entire ring, up front */
+        if (!pool_create(backend, max(end, size * MAX_BUFFERS)))
+            return false;
+    } else if (end > backend->pool.size) {
+        if (!pool_grow(backend, max(end, backend->pool.size * 3 / 2)))
+            return false;
+    }
+
+    *offset = candidate;
+    return true;
+}
+
+/* Must be called with both the bar's lock, and the backend lock, held */
+static struct buffer *
+get_buffer(struct wayland_backend *backend, int width, int height)
+{
+    size_t count = 0;
+
+    tll_foreach(backend->buffers, it) {
+        struct buffer *buf = &it->item;
+
+        if (buf->width != width || buf->height != height) {
+            /* Reclaim buffers with stale dimensions */
+            if (!buf->busy)
+                buffer_destroy(backend, buf);
+            else
+                buf->stale = true;
+            continue;
+        }
+
+        if (buf->stale)
+            continue;
+
+        if (!buf->busy) {
+            buf->busy = true;
+            return buf;
+        }
+
+        count++;
+    }
+
+    const uint32_t stride = stride_for_format_and_width(backend->pix_format, width);
+
+    /* Page aligned, to keep buffers from sharing pages */
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t size =
+        ((size_t)stride * height + page_size - 1) / page_size * page_size;
+
+    /*
+     * If the pool is much larger than what we need (e.g. after the
+     * bar has shrunk), and no buffers are in use, re-create it
+     */
+    if (tll_length(backend->buffers) == 0 &&
+        backend->pool.size > 2 * size * MAX_BUFFERS)
+    {
+        pool_destroy(backend);
+    }
+
+    size_t offset;
+    if (!pool_alloc(backend, size, &offset))
+        return NULL;
+
+    struct wl_buffer *buf = wl_shm_pool_create_buffer(
+        backend->pool.wl_pool, offset, width, height,
+        stride, backend->shm_format);
+
     if (buf == NULL) {
         LOG_ERR("failed to create SHM buffer");
-        goto err;
+        return NULL;
     }
 
-    /* We use the entire pool for our single buffer */
-    wl_shm_pool_destroy(pool); pool = NULL;
-    close(pool_fd); pool_fd = -1;
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        backend->pix_format, width, height,
+        (uint32_t *)((uint8_t *)backend->pool.mmapped + offset), stride);
 
-    pix = pixman_image_create_bits_no_clear(
-        PIXMAN_a8r8g8b8, backend->width, backend->height, (uint32_t *)mmapped, stride);
     if (pix == NULL) {
         LOG_ERR("failed to create pixman image");
-        goto err;
+        wl_buffer_destroy(buf);
+        return NULL;
     }
 
+    if (count >= MAX_BUFFERS)
+        LOG_DBG("all %d buffers busy; allocating a temporary buffer", MAX_BUFFERS);
+
     /* Push to list of available buffers, but marked as 'busy' */
     tll_push_back(
         backend->buffers,
         ((struct buffer){
+            .backend = backend,
             .busy = true,
-            .width = backend->width,
-            .height = backend->height,
+            .stale = count >= MAX_BUFFERS,
+            .width = width,
+            .height = height,
+            .offset = offset,
             .size = size,
-            .mmapped = mmapped,
+            .stride = stride,
             .wl_buf = buf,
             .pix = pix,
             })
@@ -977,21 +1430,10 @@ get_buffer(struct wayland_backend *backend)
 
     struct buffer *ret = &tll_back(backend->buffers);
     wl_buffer_add_listener(ret->wl_buf, &buffer_listener, ret);
-    return ret;
 
-err:
-    if (pix != NULL)
-        pixman_image_unref(pix);
-    if (buf != NULL)
-        wl_buffer_destroy(buf);
-    if (pool != NULL)
-        wl_shm_pool_destroy(pool);
-    if (pool_fd != -1)
-        close(pool_fd);
-    if (mmapped != NULL)
-        munmap(mmapped, size);
-
-    return NULL;
+    /* Nothing has been rendered to it yet */
+    pixman_region32_init_rect(&ret->outdated, 0, 0, ret->width, ret->height);
+    return ret;
 }
 
 static int
@@ -1020,14 +1462,30 @@ guess_scale(const struct wayland_backend *backend)
     return 1;
 }
 
+/*
+ * Returns the scale to render with. With fractional scaling, this is
+ * the compositor's preferred scale; otherwise, the (integral) scale
+ * of the output we're on.
+ */
+static float
+current_scale(const struct wayland_backend *backend)
+{
+#if defined(HAVE_FRACTIONAL_SCALE)
+    if (backend->viewport != NULL && backend->preferred_fractional_scale > 0)
+        return backend->preferred_fractional_scale;
+#endif
+
+    const struct monitor *mon = backend->monitor;
+    return mon != NULL ? mon->scale : guess_scale(backend);
+}
+
 static bool
 update_size(struct wayland_backend *backend)
 {
     struct bar *_bar = backend->bar;
     struct private *bar = _bar->private;
 
-    const struct monitor *mon = backend->monitor;
-    const int scale = mon != NULL ? mon->scale : guess_scale(backend);
+    const float scale = current_scale(backend);
 
     assert(backend->surface != NULL);
 
@@ -1036,19 +1494,20 @@ update_size(struct wayland_backend *backend)
 
     backend->scale = scale;
 
-    int height = bar->height_with_border;
-    height /= scale;
-    height *= scale;
-    bar->height = height - bar->border.top_width - bar->border.bottom_width;
-    bar->height_with_border = height;
+    /*
+     * The surface's size is in logical pixels. Adjust the bar's
+     * height such that it maps to a whole number of those
+     */
+    const int logical_height = backend->configured_height_with_border / scale;
+    const int height = roundf(logical_height * scale);
 
     zwlr_layer_surface_v1_set_size(
-        backend->layer_surface, 0, bar->height_with_border / scale);
+        backend->layer_surface, 0, logical_height);
     zwlr_layer_surface_v1_set_exclusive_zone(
         backend->layer_surface,
-        (bar->height_with_border + (bar->location == BAR_TOP
-                                    ? bar->border.bottom_margin
-                                    : bar->border.top_margin))
+        (height + (bar->location == BAR_TOP
+                   ? bar->border.bottom_margin
+                   : bar->border.top_margin))
         / scale);
 
     zwlr_layer_surface_v1_set_margin(
@@ -1060,24 +1519,39 @@ update_size(struct wayland_backend *backend)
         );
 
     /* Trigger a 'configure' event, after which we'll have the width */
+    backend->configuring = true;
     wl_surface_commit(backend->surface);
     wl_display_roundtrip(backend->display);
+    backend->configuring = false;
+
+    /* The preferred scale may have been announced while configuring */
+    if (current_scale(backend) != scale)
+        return update_size(backend);
 
-    if (backend->width == -1 ||
-        backend->height != bar->height_with_border) {
+    if (backend->width == -1 || backend->height != height) {
         LOG_ERR("failed to get panel width");
         return false;
     }
 
+    /* Wait for the render thread to finish the current frame */
+    mtx_lock(&bar->lock);
+    while (bar->rendering)
+        cnd_wait(&bar->render_done, &bar->lock);
+    mtx_lock(&backend->lock);
+
+    bar->height = height - bar->border.top_width - bar->border.bottom_width;
+    bar->height_with_border = height;
     bar->width = backend->width;
 
     /* Reload buffers */
     if (backend->next_buffer != NULL)
-        backend->next_buffer->busy = false;
-    backend->next_buffer = get_buffer(backend);
+        put_buffer(backend, backend->next_buffer);
+    backend->next_buffer = get_buffer(backend, bar->width, bar->height_with_border);
     assert(backend->next_buffer != NULL && backend->next_buffer->busy);
     bar->pix = backend->next_buffer->pix;
 
+    mtx_unlock(&backend->lock);
+    mtx_unlock(&bar->lock);
     return true;
 }
 
@@ -1088,6 +1562,17 @@ setup(struct bar *_bar)
     struct wayland_backend *backend = bar->backend.data;
 
     backend->bar = _bar;
+    backend->configured_height_with_border = bar->height_with_border;
+
+    /* XRGB8888 is, like ARGB8888, always supported */
+    backend->opaque = bar->background.alpha == 0xffff;
+    backend->pix_format = backend->opaque ? PIXMAN_x8r8g8b8 : PIXMAN_a8r8g8b8;
+    backend->shm_format = backend->opaque
+        ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+
+    mtx_init(&backend->lock, mtx_plain);
+    cnd_init(&backend->cond);
+    pixman_region32_init(&backend->damage);
 
     backend->display = wl_display_connect(NULL);
     if (backend->display == NULL) {
@@ -1135,7 +1620,7 @@ setup(struct bar *_bar)
     }
 
     assert(backend->monitor == NULL ||
-           backend->width / backend->monitor->scale <= backend->monitor->width_px);
+           backend->logical_width <= backend->monitor->width_px);
 
     if (pipe2(backend->pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
         LOG_ERRNO("failed to create pipe");
@@ -1178,15 +1663,16 @@ cleanup(struct bar *_bar)
 
     destroy_surface(backend);
 
-    tll_foreach(backend->buffers, it) {
-        if (it->item.wl_buf != NULL)
-            wl_buffer_destroy(it->item.wl_buf);
-        if (it->item.pix != NULL)
-            pixman_image_unref(it->item.pix);
+    tll_foreach(backend->buffers, it)
+        buffer_destroy(backend, &it->item);
+    pool_destroy(backend);
 
-        munmap(it->item.mmapped, it->item.size);
-        tll_remove(backend->buffers, it);
-    }
+#if defined(HAVE_FRACTIONAL_SCALE)
+    if (backend->fractional_scale_manager != NULL)
+        wp_fractional_scale_manager_v1_destroy(backend->fractional_scale_manager);
+    if (backend->viewporter != NULL)
+        wp_viewporter_destroy(backend->viewporter);
+#endif
 
     if (backend->layer_shell != NULL)
         zwlr_layer_shell_v1_destroy(backend->layer_shell);
@@ -1204,6 +1690,47 @@ cleanup(struct bar *_bar)
     /* Destroyed when freeing buffer list */
     bar->pix = NULL;
 
+    pixman_region32_fini(&backend->damage);
+    cnd_destroy(&backend->cond);
+    mtx_destroy(&backend->lock);
+}
+
+static int
+render_thread(void *arg)
+{
+    struct bar *_bar = arg;
+    struct private *bar = _bar->private;
+    struct wayland_backend *backend = bar->backend.data;
+
+    pthread_setname_np(pthread_self(), "bar(wl-render)");
+    trace_thread_name("bar(wl-render)");
+
+    mtx_lock(&backend->lock);
+
+    while (true) {
+        while (!backend->render_requested && !backend->render_quit)
+            cnd_wait(&backend->cond, &backend->lock);
+
+        if (backend->render_quit)
+            break;
+
+        /* Coalesce “refresh” requests made since the last frame */
+        size_t count = backend->refresh_count;
+        backend->render_requested = false;
+        backend->refresh_count = 0;
+
+        mtx_unlock(&backend->lock);
+
+        LOG_DBG("coalesced %zu refresh requests", count);
+        stats_refresh_coalesced(bar->stats, count);
+        trace_instant_value("coalesced", count);
+        backend->bar_expose(_bar);
+
+        mtx_lock(&backend->lock);
+    }
+
+    mtx_unlock(&backend->lock);
+    return 0;
 }
 
 static void
@@ -1219,11 +1746,17 @@ loop(struct bar *_bar,
     pthread_setname_np(pthread_self(), "bar(wayland)");
 
     backend->bar_on_mouse = on_mouse;
+    backend->bar_expose = expose;
+
+    if (thrd_create(&backend->render_thread, &render_thread, _bar) != thrd_success) {
+        LOG_ERR("failed to create render thread");
+        goto out;
+    }
 
     while (wl_display_prepare_read(backend->display) != 0) {
         if (wl_display_dispatch_pending(backend->display) < 0) {
             LOG_ERRNO("failed to dispatch pending Wayland events");
-            goto out;
+            goto out_join;
         }
     }
 
@@ -1249,10 +1782,7 @@ loop(struct bar *_bar,
         }
 
         if (fds[2].revents & POLLIN) {
-            bool do_expose = false;
-
-            /* Coalesce “refresh” commands */
-            size_t count = 0;
+            /* The render thread has finished one, or more, frames */
             while (true) {
                 uint8_t command;
                 ssize_t r = read(backend->pipe_fds[0], &command, sizeof(command));
@@ -1261,38 +1791,45 @@ loop(struct bar *_bar,
 
                 if (r != sizeof(command)) {
                     LOG_ERRNO("failed to read from command pipe");
-                    goto out;
+                    goto out_join;
                 }
 
                 assert(command == 1);
-                if (command == 1) {
-                    count++;
-                    do_expose = true;
-                }
             }
 
-            LOG_DBG("coalesced %zu expose commands", count);
-            if (do_expose)
-                expose(_bar);
+            mtx_lock(&backend->lock);
+            submit_pending(backend);
+            mtx_unlock(&backend->lock);
         }
 
         if (fds[1].revents & POLLIN) {
             if (wl_display_read_events(backend->display) < 0) {
                 LOG_ERRNO("failed to read events from the Wayland socket");
-                goto out;
+                goto out_join;
             }
 
             while (wl_display_prepare_read(backend->display) != 0) {
                 if (wl_display_dispatch_pending(backend->display) < 0) {
                     LOG_ERRNO("failed to dispatch pending Wayland events");
-                    goto out;
+                    goto out_join;
                 }
             }
 
+            /* Otherwise, delivered by the next frame callback */
+            if (!backend->render_scheduled)
+                flush_motion(backend);
+
             wl_display_flush(backend->display);
         }
     }
 
+out_join:
+    mtx_lock(&backend->lock);
+    backend->render_quit = true;
+    cnd_signal(&backend->cond);
+    mtx_unlock(&backend->lock);
+    thrd_join(backend->render_thread, NULL);
+
 out:
     if (!send_abort_to_modules)
         return;
@@ -1321,7 +1858,7 @@ surface_enter(void *data, struct wl_surface *wl_surface,
         if (backend->monitor != mon) {
             backend->monitor = mon;
 
-            int old_scale = backend->scale;
+            float old_scale = backend->scale;
             update_size(backend);
 
             if (backend->scale != old_scale)
@@ -1355,10 +1892,60 @@ static const struct wl_surface_listener surface_listener = {
 static void frame_callback(
     void *data, struct wl_callback *wl_callback, uint32_t callback_data);
 
+static void
+attach_buffer(struct wayland_backend *backend, struct buffer *buffer)
+{
+#if defined(HAVE_FRACTIONAL_SCALE)
+    /* The viewport (see layer_surface_configure()) does the scaling */
+    wl_surface_set_buffer_scale(
+        backend->surface, backend->viewport != NULL ? 1 : (int)backend->scale);
+#else
+    wl_surface_set_buffer_scale(backend->surface, (int)backend->scale);
+#endif
+
+    wl_surface_attach(backend->surface, buffer->wl_buf, 0, 0);
+
+    /* Only what the frames since the last commit actually re-painted */
+    int count;
+    const pixman_box32_t *boxes = pixman_region32_rectangles(&backend->damage, &count);
+
+    for (int i = 0; i < count; i++) {
+        wl_surface_damage_buffer(
+            backend->surface, boxes[i].x1, boxes[i].y1,
+            boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+    }
+
+    pixman_region32_fini(&backend->damage);
+    pixman_region32_init(&backend->damage);
+}
+
 static const struct wl_callback_listener frame_listener = {
     .done = &frame_callback,
 };
 
+/* Must be called with the lock held */
+static void
+submit_pending(struct wayland_backend *backend)
+{
+    if (backend->render_scheduled || backend->pending_buffer == NULL)
+        return;
+
+    struct buffer *buffer = backend->pending_buffer;
+    assert(buffer->busy);
+
+    trace_instant("surface-commit", NULL);
+    attach_buffer(backend, buffer);
+
+    struct wl_callback *cb = wl_surface_frame(backend->surface);
+    wl_callback_add_listener(cb, &frame_listener, backend->bar->private);
+    wl_surface_commit(backend->surface);
+    wl_display_flush(backend->display);
+
+    backend->frame_callback = cb;
+    backend->pending_buffer = NULL;
+    backend->render_scheduled = true;
+}
+
 static void
 frame_callback(void *data, struct wl_callback *wl_callback, uint32_t callback_data)
 {
@@ -1366,89 +1953,126 @@ frame_callback(void *data, struct wl_callback *wl_callback, uint32_t callback_da
     struct private *bar = data;
     struct wayland_backend *backend = bar->backend.data;
 
-    backend->render_scheduled = false;
+    trace_instant("frame-callback", NULL);
 
     assert(wl_callback == backend->frame_callback);
     wl_callback_destroy(wl_callback);
     backend->frame_callback = NULL;
 
-    if (backend->pending_buffer != NULL) {
-        struct buffer *buffer = backend->pending_buffer;
-        assert(buffer->busy);
-
-        wl_surface_set_buffer_scale(backend->surface, backend->scale);
-        wl_surface_attach(backend->surface, buffer->wl_buf, 0, 0);
-        wl_surface_damage(backend->surface, 0, 0, backend->width, backend->height);
-
-        struct wl_callback *cb = wl_surface_frame(backend->surface);
-        wl_callback_add_listener(cb, &frame_listener, bar);
-        wl_surface_commit(backend->surface);
-        wl_display_flush(backend->display);
+    mtx_lock(&backend->lock);
+    backend->render_scheduled = false;
+    submit_pending(backend);
+    mtx_unlock(&backend->lock);
 
-        backend->frame_callback = cb;
-        backend->pending_buffer = NULL;
-        backend->render_scheduled = true;
-    } else
-        ;//printf("nothing more to do\n");
+    flush_motion(backend);
 }
 
+/*
+ * Called by the render thread, at the end of each frame (without the
+ * bar's lock, but with the frame still in progress). The finished
+ * frame is handed over to the Wayland thread, which commits it to
+ * the surface as soon as the compositor is ready for it.
+ */
 static void
 commit(const struct bar *_bar)
 {
     struct private *bar = _bar->private;
     struct wayland_backend *backend = bar->backend.data;
 
-    //printf("commit: %dxl%d\n", backend->width, backend->height);
+    mtx_lock(&backend->lock);
 
-    if (backend->next_buffer == NULL)
+    if (backend->next_buffer == NULL) {
+        mtx_unlock(&backend->lock);
         return;
+    }
 
-    assert(backend->next_buffer != NULL);
     assert(backend->next_buffer->busy);
 
-    if (backend->render_scheduled) {
-        //printf("already scheduled\n");
+    /* All other buffers are now outdated where this frame painted */
+    struct buffer *finished = backend->next_buffer;
+    tll_foreach(backend->buffers, it) {
+        if (&it->item != finished)
+            pixman_region32_union(&it->item.outdated, &it->item.outdated, &bar->damage);
+    }
 
-        if (backend->pending_buffer != NULL)
-            backend->pending_buffer->busy = false;
+    pixman_region32_fini(&finished->outdated);
+    pixman_region32_init(&finished->outdated);
+    backend->last_frame = finished;
 
-        backend->pending_buffer = backend->next_buffer;
-        backend->next_buffer = NULL;
-    } else {
+    /* Committed along with the next surface commit (even if this frame is dropped) */
+    pixman_region32_union(&backend->damage, &backend->damage, &bar->damage);
 
-        //printf("scheduling new frame callback\n");
-        struct buffer *buffer = backend->next_buffer;
-        assert(buffer->busy);
+    if (backend->pending_buffer != NULL) {
+        /* Never committed; the compositor hasn't caught up */
+        put_buffer(backend, backend->pending_buffer);
+        stats_frame_dropped(bar->stats);
+        trace_instant("frame-dropped", NULL);
+    }
 
-        wl_surface_set_buffer_scale(backend->surface, backend->scale);
-        wl_surface_attach(backend->surface, buffer->wl_buf, 0, 0);
-        wl_surface_damage(backend->surface, 0, 0, backend->width, backend->height);
+    trace_instant("frame-queued", NULL);
+    backend->pending_buffer = backend->next_buffer;
 
-        struct wl_callback *cb = wl_surface_frame(backend->surface);
-        wl_callback_add_listener(cb, &frame_listener, bar);
-        wl_surface_commit(backend->surface);
-        wl_display_flush(backend->display);
+    backend->next_buffer = get_buffer(
+        backend, bar->width, bar->height_with_border);
+    assert(backend->next_buffer != NULL && backend->next_buffer->busy);
+    bar->pix = backend->next_buffer->pix;
+
+    mtx_unlock(&backend->lock);
 
-        backend->render_scheduled = true;
-        backend->frame_callback = cb;
+    /* Wake up the Wayland thread */
+    if (write(backend->pipe_fds[1], &(uint8_t){1}, sizeof(uint8_t))
+        != sizeof(uint8_t))
+    {
+        LOG_ERRNO("failed to signal 'frame ready' to the Wayland thread");
     }
+}
 
-    backend->next_buffer = get_buffer(backend);
-    assert(backend->next_buffer != NULL && backend->next_buffer->busy);
-    bar->pix = backend->next_buffer->pix;
+/*
+ * Called by the render thread, before painting a frame that only
+ * re-paints parts of the bar. Copies the regions where the buffer
+ * we're about to render to is outdated, from the last frame's buffer.
+ */
+static bool
+reuse_frame(const struct bar *_bar)
+{
+    const struct private *bar = _bar->private;
+    struct wayland_backend *backend = bar->backend.data;
+
+    mtx_lock(&backend->lock);
+
+    struct buffer *buf = backend->next_buffer;
+    struct buffer *prev = backend->last_frame;
+
+    const bool reusable =
+        buf != NULL && prev != NULL &&
+        buf->width == prev->width && buf->height == prev->height;
+
+    if (reusable && buf != prev && pixman_region32_not_empty(&buf->outdated)) {
+        pixman_image_set_clip_region32(buf->pix, &buf->outdated);
+        pixman_image_composite32(
+            PIXMAN_OP_SRC, prev->pix, NULL, buf->pix, 0, 0, 0, 0, 0, 0,
+            buf->width, buf->height);
+        pixman_image_set_clip_region32(buf->pix, NULL);
+
+        pixman_region32_fini(&buf->outdated);
+        pixman_region32_init(&buf->outdated);
+    }
+
+    mtx_unlock(&backend->lock);
+    return reusable;
 }
 
 static void
 refresh(const struct bar *_bar)
 {
     const struct private *bar = _bar->private;
-    const struct wayland_backend *backend = bar->backend.data;
+    struct wayland_backend *backend = bar->backend.data;
 
-    if (write(backend->pipe_fds[1], &(uint8_t){1}, sizeof(uint8_t))
-        != sizeof(uint8_t))
-    {
-        LOG_ERRNO("failed to signal 'refresh' to main thread");
-    }
+    mtx_lock(&backend->lock);
+    backend->render_requested = true;
+    backend->refresh_count++;
+    cnd_signal(&backend->cond);
+    mtx_unlock(&backend->lock);
 }
 
 static void
@@ -1494,4 +2118,5 @@ const struct backend wayland_backend_iface = {
     .refresh = &refresh,
     .set_cursor = &set_cursor,
     .output_name = &bar_output_name,
+    .reuse_frame = &reuse_frame,
 };
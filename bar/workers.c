@@ -0,0 +1,155 @@
+#include "workers.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <pthread.h>
+
+#define LOG_MODULE "workers"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../trace.h"
+
+struct workers {
+    mtx_t lock;
+    cnd_t cond;       /* Signalled when a new batch is available */
+    cnd_t done_cond;  /* Signalled when the last worker leaves a batch */
+
+    size_t thread_count;
+    thrd_t *threads;
+
+    /* Current batch; protected by the lock */
+    size_t generation;
+    bool quit;
+    void (*job)(void *ctx, size_t idx);
+    void *ctx;
+    size_t count;
+    size_t active;  /* Workers still working on the current batch */
+
+    atomic_size_t next;  /* Next job to hand out */
+};
+
+static void
+run_jobs(struct workers *workers, void (*job)(void *ctx, size_t idx),
+         void *ctx, size_t count)
+{
+    while (true) {
+        size_t idx = atomic_fetch_add_explicit(
+            &workers->next, 1, memory_order_relaxed);
+
+        if (idx >= count)
+            break;
+
+        job(ctx, idx);
+    }
+}
+
+static int
+worker_thread(void *arg)
+{
+    struct workers *workers = arg;
+
+    pthread_setname_np(pthread_self(), "bar(worker)");
+    trace_thread_name("bar(worker)");
+
+    size_t generation = 0;
+
+    mtx_lock(&workers->lock);
+
+    while (true) {
+        while (workers->generation == generation && !workers->quit)
+            cnd_wait(&workers->cond, &workers->lock);
+
+        if (workers->quit)
+            break;
+
+        generation = workers->generation;
+
+        void (*job)(void *ctx, size_t idx) = workers->job;
+        void *ctx = workers->ctx;
+        size_t count = workers->count;
+
+        mtx_unlock(&workers->lock);
+        run_jobs(workers, job, ctx, count);
+        mtx_lock(&workers->lock);
+
+        if (--workers->active == 0)
+            cnd_signal(&workers->done_cond);
+    }
+
+    mtx_unlock(&workers->lock);
+    return 0;
+}
+
+struct workers *
+workers_new(size_t count)
+{
+    struct workers *workers = calloc(1, sizeof(*workers));
+    workers->threads = calloc(count > 0 ? count : 1, sizeof(workers->threads[0]));
+
+    mtx_init(&workers->lock, mtx_plain);
+    cnd_init(&workers->cond);
+    cnd_init(&workers->done_cond);
+
+    for (size_t i = 0; i < count; i++) {
+        if (thrd_create(&workers->threads[i], &worker_thread, workers) != thrd_success) {
+            LOG_ERR("failed to create worker thread");
+            break;
+        }
+        workers->thread_count++;
+    }
+
+    LOG_DBG("%zu worker threads", workers->thread_count);
+    return workers;
+}
+
+void
+workers_destroy(struct workers *workers)
+{
+    if (workers == NULL)
+        return;
+
+    mtx_lock(&workers->lock);
+    workers->quit = true;
+    cnd_broadcast(&workers->cond);
+    mtx_unlock(&workers->lock);
+
+    for (size_t i = 0; i < workers->thread_count; i++)
+        thrd_join(workers->threads[i], NULL);
+
+    cnd_destroy(&workers->done_cond);
+    cnd_destroy(&workers->cond);
+    mtx_destroy(&workers->lock);
+    free(workers->threads);
+    free(workers);
+}
+
+void
+workers_run(struct workers *workers, size_t count,
+            void (*job)(void *ctx, size_t idx), void *ctx)
+{
+    if (workers->thread_count == 0 || count <= 1) {
+        for (size_t i = 0; i < count; i++)
+            job(ctx, i);
+        return;
+    }
+
+    mtx_lock(&workers->lock);
+    workers->job = job;
+    workers->ctx = ctx;
+    workers->count = count;
+    workers->active = workers->thread_count;
+    atomic_store_explicit(&workers->next, 0, memory_order_relaxed);
+    workers->generation++;
+    cnd_broadcast(&workers->cond);
+    mtx_unlock(&workers->lock);
+
+    run_jobs(workers, job, ctx, count);
+
+    /* Wait for the workers to finish the jobs they've picked up */
+    mtx_lock(&workers->lock);
+    while (workers->active > 0)
+        cnd_wait(&workers->done_cond, &workers->lock);
+    mtx_unlock(&workers->lock);
+}
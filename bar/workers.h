@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * A small pool of worker threads, used to run a batch of independent
+ * jobs in parallel.
+ *
+ * The calling thread participates in the batch. Jobs are handed out
+ * one at a time, to whichever thread is idle, so that a slow job
+ * doesn't hold up the remaining ones.
+ */
+struct workers;
+
+/* 'count' is the number of threads, in addition to the calling thread */
+struct workers *workers_new(size_t count);
+void workers_destroy(struct workers *workers);
+
+/*
+ * Calls 'job(ctx, idx)' for all 'idx' in [0, count), and returns when
+ * all jobs have finished. Not re-entrant.
+ */
+void workers_run(struct workers *workers, size_t count,
+                 void (*job)(void *ctx, size_t idx), void *ctx);
@@ -322,6 +322,10 @@ loop(struct bar *_bar,
 
     const int fd = xcb_get_file_descriptor(backend->conn);
 
+    /* Motion events are coalesced; only the last one of each batch is delivered */
+    bool have_motion = false;
+    int motion_x = 0, motion_y = 0;
+
     while (true) {
         struct pollfd fds[] = {
             {.fd = _bar->abort_fd, .events = POLLIN},
@@ -347,6 +351,12 @@ loop(struct bar *_bar,
              e != NULL;
              e = xcb_poll_for_event(backend->conn))
         {
+            if (have_motion && XCB_EVENT_RESPONSE_TYPE(e) != XCB_MOTION_NOTIFY) {
+                /* Deliver it before anything that depends on it (e.g. clicks) */
+                on_mouse(_bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE, motion_x, motion_y);
+                have_motion = false;
+            }
+
             switch (XCB_EVENT_RESPONSE_TYPE(e)) {
             case 0:
                 LOG_ERR("XCB: %s", xcb_error((const xcb_generic_error_t *)e));
@@ -358,7 +368,9 @@ loop(struct bar *_bar,
 
             case XCB_MOTION_NOTIFY: {
                 const xcb_motion_notify_event_t *evt = (void *)e;
-                on_mouse(_bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE, evt->event_x, evt->event_y);
+                motion_x = evt->event_x;
+                motion_y = evt->event_y;
+                have_motion = true;
                 break;
             }
 
@@ -396,6 +408,12 @@ loop(struct bar *_bar,
             free(e);
             xcb_flush(backend->conn);
         }
+
+        if (have_motion) {
+            on_mouse(_bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE, motion_x, motion_y);
+            have_motion = false;
+            xcb_flush(backend->conn);
+        }
     }
 }
 
@@ -457,6 +475,7 @@ set_cursor(struct bar *_bar, const char *cursor)
     if (backend->cursor != 0)
         xcb_free_cursor(backend->conn, backend->cursor);
 
+    backend->xcursor = cursor;
     backend->cursor = xcb_cursor_load_cursor(backend->cursor_ctx, cursor);
     xcb_change_window_attributes(
         backend->conn, backend->win, XCB_CW_CURSOR, &backend->cursor);
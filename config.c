@@ -12,6 +12,7 @@
 #include "bar/bar.h"
 #include "color.h"
 #include "config-verify.h"
+#include "fonts.h"
 #include "icon.h"
 #include "module.h"
 #include "plugin.h"
@@ -96,7 +97,7 @@ conf_to_font(const struct yml_node *node)
         fonts[count++] = font;
     }
 
-    struct fcft_font *ret = fcft_from_name(count, fonts, NULL);
+    struct fcft_font *ret = fonts_from_name(count, fonts, NULL);
 
     free(fonts);
     free(copy);
@@ -357,14 +358,151 @@ conf_to_particle(const struct yml_node *node, struct conf_inherit inherited)
     return iface->from_conf(pair.value, common);
 }
 
+/*
+ * Create a default font and foreground
+ *
+ * These aren't used by the bar itself, but passed down to modules
+ * and particles. This allows us to specify a default font and
+ * foreground color at top-level.
+ */
+static struct conf_inherit
+conf_to_bar_inherit(const struct yml_node *bar, int height)
+{
+    enum font_shaping font_shaping = FONT_SHAPE_FULL;
+    pixman_color_t foreground = {0xffff, 0xffff, 0xffff, 0xffff}; /* White */
+
+    const struct yml_node *font_node = yml_get_value(bar, "font");
+    struct fcft_font *font = font_node != NULL
+        ? conf_to_font(font_node)
+        : fonts_from_name(1, &(const char *){"sans"}, NULL);
+
+    const struct yml_node *font_shaping_node = yml_get_value(bar, "font-shaping");
+    if (font_shaping_node != NULL)
+        font_shaping = conf_to_font_shaping(font_shaping_node);
+
+    // Get a default icon basedirs
+    struct basedirs *basedirs = NULL;
+    struct themes *themes = NULL;
+    const struct yml_node *basedirs_node = yml_get_value(bar, "icon-basedirs");
+    if (basedirs_node != NULL) {
+        conf_to_themes(basedirs_node, &basedirs, &themes);
+    } else {
+        basedirs = get_basedirs();
+        themes = init_themes(basedirs);
+    }
+
+    const struct yml_node *icon_theme_node = yml_get_value(bar, "icon-theme");
+    char *icon_theme;
+    if (icon_theme_node != NULL) {
+        icon_theme = strdup(yml_value_as_string(icon_theme_node));
+    } else {
+        icon_theme = NULL;
+    }
+
+    const struct yml_node *icon_size_node = yml_get_value(bar, "icon-size");
+    int icon_size = icon_size_node ? yml_value_as_int(icon_size_node) : height;
+
+    const struct yml_node *foreground_node = yml_get_value(bar, "foreground");
+    if (foreground_node != NULL)
+        foreground = conf_to_color(foreground_node);
+
+    return (struct conf_inherit){
+        .font = font,
+        .font_shaping = font_shaping,
+        .basedirs = basedirs,
+        .themes = themes,
+        .icon_theme = icon_theme,
+        .icon_size = icon_size,
+        .foreground = foreground
+    };
+}
+
+static void
+conf_inherit_release(struct conf_inherit *inherited)
+{
+    fcft_destroy((struct fcft_font *)inherited->font);
+    themes_dec(inherited->themes);
+    basedirs_dec(inherited->basedirs);
+    free(inherited->icon_theme);
+}
+
+/* 'node' is a module list entry, i.e. a {<name>: {...}} dictionary */
+static struct module *
+module_from_conf(const struct yml_node *node, struct conf_inherit inherited)
+{
+    struct yml_dict_iter m = yml_dict_iter(node);
+    const char *mod_name = yml_value_as_string(m.key);
+
+    /*
+     * These aren't used by the modules, but passed down
+     * to particles. This allows us to specify a default
+     * font and foreground for each module, and having it
+     * applied to all its particles.
+     */
+    const struct yml_node *mod_font = yml_get_value(m.value, "font");
+    const struct yml_node *mod_font_shaping = yml_get_value(m.value, "font-shaping");
+    const struct yml_node *mod_foreground = yml_get_value(m.value, "foreground");
+    const struct yml_node *mod_basedirs = yml_get_value(m.value, "icon-basedirs");
+    const struct yml_node *mod_icon_theme = yml_get_value(m.value, "icon-theme");
+    const struct yml_node *mod_icon_size = yml_get_value(m.value, "icon-size");
+
+    struct basedirs *basedirs = NULL;
+    struct themes *themes = NULL;
+    if (mod_basedirs) {
+        conf_to_themes(mod_basedirs, &basedirs, &themes);
+    } else {
+        themes = themes_inc(inherited.themes);
+        basedirs = basedirs_inc(inherited.basedirs);
+    }
+
+    char *icon_theme = NULL;
+    if (mod_icon_theme) {
+        icon_theme = strdup(yml_value_as_string(mod_icon_theme));
+    } else if (inherited.icon_theme) {
+        icon_theme = strdup(inherited.icon_theme);
+    }
+
+    struct conf_inherit mod_inherit
+        = {.font = mod_font != NULL ? conf_to_font(mod_font) : inherited.font,
+           .font_shaping
+           = mod_font_shaping != NULL ? conf_to_font_shaping(mod_font_shaping) : inherited.font_shaping,
+           .basedirs = basedirs,
+           .themes = themes,
+           .icon_theme = icon_theme,
+           .icon_size = mod_icon_size != NULL ? yml_value_as_int(mod_icon_size) : inherited.icon_size,
+           .foreground = mod_foreground != NULL ? conf_to_color(mod_foreground) : inherited.foreground
+        };
+
+    const struct module_iface *iface = plugin_load_module(mod_name);
+    struct module *mod = iface->from_conf(m.value, mod_inherit);
+
+    if (mod != NULL) {
+        const struct yml_node *max_rate = yml_get_value(m.value, "max-refresh-rate");
+        const struct yml_node *debounce = yml_get_value(m.value, "debounce");
+
+        if (max_rate != NULL && yml_value_as_int(max_rate) > 0) {
+            mod->refresh_limit.interval_ns =
+                1000000000ull / yml_value_as_int(max_rate);
+        }
+        if (debounce != NULL) {
+            mod->refresh_limit.debounce_ns =
+                (uint64_t)yml_value_as_int(debounce) * 1000000ull;
+        }
+    }
+
+    return mod;
+}
+
 struct bar *
-conf_to_bar(const struct yml_node *bar, enum bar_backend backend)
+conf_to_bar(const struct yml_node *bar, enum bar_backend backend,
+            const char *backend_options)
 {
     if (!conf_verify_bar(bar))
         return NULL;
 
     struct bar_config conf = {
         .backend = backend,
+        .backend_options = backend_options,
         .layer = BAR_LAYER_BOTTOM,
         .font_shaping = FONT_SHAPE_FULL,
     };
@@ -433,6 +571,11 @@ conf_to_bar(const struct yml_node *bar, enum bar_backend backend)
         ? yml_value_as_int(trackpad_sensitivity)
         : 30;
 
+    const struct yml_node *layout_threads =
+        yml_get_value(bar, "layout-threads");
+    if (layout_threads != NULL)
+        conf.layout_threads = yml_value_as_int(layout_threads);
+
     const struct yml_node *border = yml_get_value(bar, "border");
     if (border != NULL) {
         const struct yml_node *width = yml_get_value(border, "width");
@@ -481,62 +624,7 @@ conf_to_bar(const struct yml_node *bar, enum bar_backend backend)
             conf.border.bottom_margin = yml_value_as_int(bottom_margin);
     }
 
-    /*
-     * Create a default font and foreground
-     *
-     * These aren't used by the bar itself, but passed down to modules
-     * and particles. This allows us to specify a default font and
-     * foreground color at top-level.
-     */
-    struct fcft_font *font = fcft_from_name(1, &(const char *){"sans"}, NULL);
-    enum font_shaping font_shaping = FONT_SHAPE_FULL;
-    pixman_color_t foreground = {0xffff, 0xffff, 0xffff, 0xffff}; /* White */
-
-    const struct yml_node *font_node = yml_get_value(bar, "font");
-    if (font_node != NULL) {
-        fcft_destroy(font);
-        font = conf_to_font(font_node);
-    }
-
-    const struct yml_node *font_shaping_node = yml_get_value(bar, "font-shaping");
-    if (font_shaping_node != NULL)
-        font_shaping = conf_to_font_shaping(font_shaping_node);
-
-    // Get a default icon basedirs
-    struct basedirs *basedirs = NULL;
-    struct themes *themes = NULL;
-    const struct yml_node *basedirs_node = yml_get_value(bar, "icon-basedirs");
-    if (basedirs_node != NULL) {
-        conf_to_themes(basedirs_node, &basedirs, &themes);
-    } else {
-        basedirs = get_basedirs();
-        themes = init_themes(basedirs);
-    }
-
-    const struct yml_node *icon_theme_node = yml_get_value(bar, "icon-theme");
-    char *icon_theme;
-    if (icon_theme_node != NULL) {
-        icon_theme = strdup(yml_value_as_string(icon_theme_node));
-    } else {
-        icon_theme = NULL;
-    }
-
-    const struct yml_node *icon_size_node = yml_get_value(bar, "icon-size");
-    int icon_size = icon_size_node ? yml_value_as_int(icon_size_node) : conf.height;
-
-    const struct yml_node *foreground_node = yml_get_value(bar, "foreground");
-    if (foreground_node != NULL)
-        foreground = conf_to_color(foreground_node);
-
-    struct conf_inherit inherited = {
-        .font = font,
-        .font_shaping = font_shaping,
-        .basedirs = basedirs,
-        .themes = themes,
-        .icon_theme = icon_theme,
-        .icon_size = icon_size,
-        .foreground = foreground
-    };
+    struct conf_inherit inherited = conf_to_bar_inherit(bar, conf.height);
 
     const struct yml_node *left = yml_get_value(bar, "left");
     const struct yml_node *center = yml_get_value(bar, "center");
@@ -554,51 +642,7 @@ conf_to_bar(const struct yml_node *bar, enum bar_backend backend)
                  it.node != NULL;
                  yml_list_next(&it), idx++)
             {
-                struct yml_dict_iter m = yml_dict_iter(it.node);
-                const char *mod_name = yml_value_as_string(m.key);
-
-                /*
-                 * These aren't used by the modules, but passed down
-                 * to particles. This allows us to specify a default
-                 * font and foreground for each module, and having it
-                 * applied to all its particles.
-                 */
-                const struct yml_node *mod_font = yml_get_value(m.value, "font");
-                const struct yml_node *mod_font_shaping = yml_get_value(m.value, "font-shaping");
-                const struct yml_node *mod_foreground = yml_get_value(m.value, "foreground");
-                const struct yml_node *mod_basedirs = yml_get_value(m.value, "icon-basedirs");
-                const struct yml_node *mod_icon_theme = yml_get_value(m.value, "icon-theme");
-                const struct yml_node *mod_icon_size = yml_get_value(m.value, "icon-size");
-
-                struct basedirs *basedirs = NULL;
-                struct themes *themes = NULL;
-                if (mod_basedirs) {
-                    conf_to_themes(mod_basedirs, &basedirs, &themes);
-                } else {
-                    themes = themes_inc(inherited.themes);
-                    basedirs = basedirs_inc(inherited.basedirs);
-                }
-
-                char *icon_theme = NULL;
-                if (mod_icon_theme) {
-                    icon_theme = strdup(yml_value_as_string(mod_icon_theme));
-                } else if (inherited.icon_theme) {
-                    icon_theme = strdup(inherited.icon_theme);
-                }
-
-                struct conf_inherit mod_inherit
-                    = {.font = mod_font != NULL ? conf_to_font(mod_font) : inherited.font,
-                       .font_shaping
-                       = mod_font_shaping != NULL ? conf_to_font_shaping(mod_font_shaping) : inherited.font_shaping,
-                       .basedirs = basedirs,
-                       .themes = themes,
-                       .icon_theme = icon_theme,
-                       .icon_size = mod_icon_size != NULL ? yml_value_as_int(mod_icon_size) : inherited.icon_size,
-                       .foreground = mod_foreground != NULL ? conf_to_color(mod_foreground) : inherited.foreground
-                    };
-
-                const struct module_iface *iface = plugin_load_module(mod_name);
-                mods[idx] = iface->from_conf(m.value, mod_inherit);
+                mods[idx] = module_from_conf(it.node, inherited);
             }
 
             if (i == 0) {
@@ -619,9 +663,131 @@ conf_to_bar(const struct yml_node *bar, enum bar_backend backend)
     free(conf.left.mods);
     free(conf.center.mods);
     free(conf.right.mods);
-    fcft_destroy(font);
-    themes_dec(themes);
-    basedirs_dec(basedirs);
+    conf_inherit_release(&inherited);
 
     return ret;
 }
+
+bool
+conf_bar_needs_restart(const struct yml_node *old_bar,
+                       const struct yml_node *new_bar)
+{
+    /* Everything but the module lists is a bar-level setting */
+    for (struct yml_dict_iter it = yml_dict_iter(new_bar);
+         it.key != NULL;
+         yml_dict_next(&it))
+    {
+        const char *key = yml_value_as_string(it.key);
+        if (strcmp(key, "left") == 0 ||
+            strcmp(key, "center") == 0 ||
+            strcmp(key, "right") == 0)
+        {
+            continue;
+        }
+
+        if (!yml_equal(it.value, yml_get_value(old_bar, key)))
+            return true;
+    }
+
+    for (struct yml_dict_iter it = yml_dict_iter(old_bar);
+         it.key != NULL;
+         yml_dict_next(&it))
+    {
+        const char *key = yml_value_as_string(it.key);
+        if (yml_get_value(new_bar, key) == NULL)
+            return true;
+    }
+
+    return false;
+}
+
+bool
+conf_update_modules(struct bar *bar, const struct yml_node *old_bar,
+                    const struct yml_node *new_bar)
+{
+    if (!conf_verify_bar(new_bar))
+        return false;
+
+    struct bar_modules current[3];
+    bar->get_modules(bar, &current[0], &current[1], &current[2]);
+
+    /* Flatten the current modules, and the config they were created from */
+    size_t old_count = current[0].count + current[1].count + current[2].count;
+    struct module *old_mods[old_count > 0 ? old_count : 1];
+    const struct yml_node *old_nodes[old_count > 0 ? old_count : 1];
+    bool reused[old_count > 0 ? old_count : 1];
+
+    static const char *const groups[] = {"left", "center", "right"};
+
+    size_t idx = 0;
+    for (size_t g = 0; g < 3; g++) {
+        const struct yml_node *node = yml_get_value(old_bar, groups[g]);
+        size_t i = 0;
+
+        for (struct yml_list_iter it = yml_list_iter(node);
+             node != NULL && it.node != NULL;
+             yml_list_next(&it), i++)
+        {
+            assert(i < current[g].count);
+            old_mods[idx] = current[g].mods[i];
+            old_nodes[idx] = it.node;
+            reused[idx] = false;
+            idx++;
+        }
+
+        assert(i == current[g].count);
+    }
+
+    assert(idx == old_count);
+
+    const struct yml_node *height = yml_get_value(new_bar, "height");
+    struct conf_inherit inherited = conf_to_bar_inherit(
+        new_bar, yml_value_as_int(height));
+
+    struct bar_modules new_mods[3] = {{0}};
+    size_t kept = 0, created = 0;
+
+    for (size_t g = 0; g < 3; g++) {
+        const struct yml_node *node = yml_get_value(new_bar, groups[g]);
+        if (node == NULL)
+            continue;
+
+        new_mods[g].count = yml_list_length(node);
+        new_mods[g].mods = calloc(
+            new_mods[g].count > 0 ? new_mods[g].count : 1,
+            sizeof(new_mods[g].mods[0]));
+
+        size_t i = 0;
+        for (struct yml_list_iter it = yml_list_iter(node);
+             it.node != NULL;
+             yml_list_next(&it), i++)
+        {
+            /* Re-use an identically configured module, if possible */
+            for (size_t j = 0; j < old_count; j++) {
+                if (!reused[j] && yml_equal(it.node, old_nodes[j])) {
+                    new_mods[g].mods[i] = old_mods[j];
+                    reused[j] = true;
+                    kept++;
+                    break;
+                }
+            }
+
+            if (new_mods[g].mods[i] == NULL) {
+                new_mods[g].mods[i] = module_from_conf(it.node, inherited);
+                created++;
+            }
+        }
+    }
+
+    conf_inherit_release(&inherited);
+
+    LOG_INFO("modules: %zu unchanged, %zu created, %zu removed",
+             kept, created, old_count - kept);
+
+    bar->update_modules(bar, new_mods[0], new_mods[1], new_mods[2]);
+
+    for (size_t g = 0; g < 3; g++)
+        free(new_mods[g].mods);
+
+    return true;
+}
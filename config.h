@@ -10,7 +10,25 @@ struct bar;
 struct particle;
 
 bool conf_verify_bar(const struct yml_node *bar);
-struct bar *conf_to_bar(const struct yml_node *bar, enum bar_backend backend);
+struct bar *conf_to_bar(const struct yml_node *bar, enum bar_backend backend,
+                        const char *backend_options);
+
+/*
+ * Configuration reload. Returns true if 'new_bar' differs from
+ * 'old_bar' in anything but the module lists, i.e. if the bar itself
+ * must be re-created.
+ */
+bool conf_bar_needs_restart(const struct yml_node *old_bar,
+                            const struct yml_node *new_bar);
+
+/*
+ * Updates a running bar's modules, from 'new_bar'. 'old_bar' must be
+ * the configuration the bar's current modules were created from, and
+ * must not need a restart (see above). Modules whose configuration is
+ * unchanged are kept running.
+ */
+bool conf_update_modules(struct bar *bar, const struct yml_node *old_bar,
+                         const struct yml_node *new_bar);
 
 /*
  * Utility functions, for e.g. modules
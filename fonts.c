@@ -0,0 +1,192 @@
+#include "fonts.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include <tllist.h>
+
+#define LOG_MODULE "fonts"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+struct font_entry {
+    char *key;
+    struct fcft_font *font;
+};
+
+static once_flag init_once = ONCE_FLAG_INIT;
+static mtx_t lock;
+static tll(struct font_entry) fonts = tll_init();
+
+static thrd_t prewarm_thread;
+static bool prewarm_thread_running = false;
+static atomic_bool prewarm_abort = false;
+
+static void
+init(void)
+{
+    mtx_init(&lock, mtx_plain);
+}
+
+/* Names and attributes, separated by ASCII unit separators */
+static char *
+font_key(size_t count, const char *names[static count], const char *attributes)
+{
+    size_t len = 2;
+    for (size_t i = 0; i < count; i++)
+        len += strlen(names[i]) + 1;
+    if (attributes != NULL)
+        len += strlen(attributes);
+
+    char *key = malloc(len);
+    char *p = key;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t name_len = strlen(names[i]);
+        memcpy(p, names[i], name_len);
+        p += name_len;
+        *p++ = '\x1f';
+    }
+
+    *p++ = '\x1f';
+
+    if (attributes != NULL) {
+        size_t attrs_len = strlen(attributes);
+        memcpy(p, attributes, attrs_len);
+        p += attrs_len;
+    }
+
+    *p = '\0';
+    return key;
+}
+
+struct fcft_font *
+fonts_from_name(size_t count, const char *names[static count],
+                const char *attributes)
+{
+    call_once(&init_once, &init);
+
+    char *key = font_key(count, names, attributes);
+    struct fcft_font *font = NULL;
+
+    mtx_lock(&lock);
+
+    tll_foreach(fonts, it) {
+        if (strcmp(it->item.key, key) == 0) {
+            LOG_DBG("%s: re-using font", key);
+            font = fcft_clone(it->item.font);
+            free(key);
+            goto out;
+        }
+    }
+
+    font = fcft_from_name(count, names, attributes);
+    if (font == NULL) {
+        free(key);
+        goto out;
+    }
+
+    tll_push_back(fonts, ((struct font_entry){.key = key, .font = font}));
+    font = fcft_clone(font);
+
+out:
+    mtx_unlock(&lock);
+    return font;
+}
+
+static int
+prewarm(void *_fonts)
+{
+    struct fcft_font **fonts_to_warm = _fonts;
+
+    for (size_t i = 0; fonts_to_warm[i] != NULL; i++) {
+        struct fcft_font *font = fonts_to_warm[i];
+
+        /*
+         * Particles with 'font-shaping: full' (the default) rasterize
+         * text runs, whose glyphs are cached by glyph index, separately
+         * from the per-codepoint glyphs rasterized below (used with
+         * 'font-shaping: none'). Warm both.
+         *
+         * Subpixel mode must match the one used by the particles.
+         */
+        if (!atomic_load(&prewarm_abort) &&
+            fcft_capabilities() & FCFT_CAPABILITY_TEXT_RUN_SHAPING)
+        {
+            char32_t ascii[0x7f - 0x20];
+            for (char32_t cp = 0x20; cp < 0x7f; cp++)
+                ascii[cp - 0x20] = cp;
+
+            fcft_text_run_destroy(fcft_rasterize_text_run_utf32(
+                font, sizeof(ascii) / sizeof(ascii[0]), ascii,
+                FCFT_SUBPIXEL_NONE));
+        }
+
+        for (char32_t cp = 0x20; cp < 0x7f; cp++) {
+            if (atomic_load(&prewarm_abort))
+                break;
+
+            fcft_rasterize_char_utf32(font, cp, FCFT_SUBPIXEL_NONE);
+        }
+
+        fcft_destroy(font);
+    }
+
+    free(fonts_to_warm);
+    return 0;
+}
+
+void
+fonts_prewarm(void)
+{
+    call_once(&init_once, &init);
+
+    if (prewarm_thread_running)
+        return;
+
+    mtx_lock(&lock);
+
+    struct fcft_font **fonts_to_warm = calloc(
+        tll_length(fonts) + 1, sizeof(fonts_to_warm[0]));
+
+    size_t idx = 0;
+    tll_foreach(fonts, it)
+        fonts_to_warm[idx++] = fcft_clone(it->item.font);
+
+    mtx_unlock(&lock);
+
+    LOG_DBG("pre-warming glyph caches of %zu font(s)", idx);
+
+    if (thrd_create(&prewarm_thread, &prewarm, fonts_to_warm) != thrd_success) {
+        LOG_ERR("failed to create font pre-warm thread");
+        for (size_t i = 0; i < idx; i++)
+            fcft_destroy(fonts_to_warm[i]);
+        free(fonts_to_warm);
+        return;
+    }
+
+    prewarm_thread_running = true;
+}
+
+void
+fonts_fini(void)
+{
+    if (prewarm_thread_running) {
+        atomic_store(&prewarm_abort, true);
+        thrd_join(prewarm_thread, NULL);
+        prewarm_thread_running = false;
+    }
+
+    call_once(&init_once, &init);
+
+    mtx_lock(&lock);
+    tll_foreach(fonts, it) {
+        fcft_destroy(it->item.font);
+        free(it->item.key);
+        tll_remove(fonts, it);
+    }
+    mtx_unlock(&lock);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <fcft/fcft.h>
+
+/*
+ * Font registry. Fonts are keyed on their (trimmed) names and
+ * attributes; requesting the same font more than once returns the
+ * same, shared, instance, instead of resolving the font (with
+ * fontconfig) again.
+ *
+ * The returned font is a new reference; free it with fcft_destroy().
+ */
+struct fcft_font *fonts_from_name(
+    size_t count, const char *names[static count], const char *attributes);
+
+/*
+ * Rasterizes the printable ASCII glyphs of all registered fonts, in a
+ * background thread, to avoid stalling the first frame(s) on glyph
+ * rasterization. Glyphs are rasterized both individually, and as a
+ * shaped text run (if fcft supports text shaping), matching what the
+ * particles do with and without 'font-shaping: full'.
+ */
+void fonts_prewarm(void);
+
+/* Stops the pre-warm thread, and releases the registry's references */
+void fonts_fini(void);
@@ -13,7 +13,9 @@
 #include "icon.h"
 #include "log.h"
 #include "particle.h"
+#include "pixels.h"
 #include "plugin.h"
+#include "stride.h"
 #include "stringop.h"
 
 void
@@ -21,6 +23,12 @@ icon_pixmaps_free(const struct ref *ref)
 {
     struct icon_pixmaps *p = (struct icon_pixmaps *)ref;
     tll_free_and_free(p->list, free);
+
+    tll_foreach(p->images, it)
+        pixels_shared_unref(it->item.pixels);
+    tll_free(p->images);
+
+    mtx_destroy(&p->lock);
     free(p);
 }
 
@@ -43,10 +51,82 @@ new_icon_pixmaps()
     struct icon_pixmaps *p = malloc(sizeof(*p));
     p->refcount = (struct ref){icon_pixmaps_free, 1};
     icon_pixmaps_t tmp = tll_init();
+    icon_pixmap_images_t tmp_images = tll_init();
     p->list = tmp;
+    p->images = tmp_images;
+    mtx_init(&p->lock, mtx_plain);
     return p;
 }
 
+static const struct icon_pixmap *
+best_pixmap_for_size(const struct icon_pixmaps *p, int size)
+{
+    /*
+     * Prefer the smallest pixmap that is at least as large as the
+     * target size (i.e. downscale), and fall back to the largest
+     * one (i.e. upscale).
+     */
+    const struct icon_pixmap *best = NULL;
+    tll_foreach(p->list, it) {
+        const struct icon_pixmap *pm = it->item;
+
+        if (best == NULL)
+            best = pm;
+        else if (best->size < size) {
+            if (pm->size > best->size)
+                best = pm;
+        } else if (pm->size >= size && pm->size < best->size)
+            best = pm;
+    }
+
+    return best;
+}
+
+pixman_image_t *
+icon_pixmaps_get_image(struct icon_pixmaps *p, int size)
+{
+    pixman_image_t *ret = NULL;
+
+    mtx_lock(&p->lock);
+
+    tll_foreach(p->images, it) {
+        if (it->item.size == size) {
+            ret = pixels_shared_image(it->item.pixels);
+            goto out;
+        }
+    }
+
+    const struct icon_pixmap *pm = best_pixmap_for_size(p, size);
+    if (pm == NULL)
+        goto out;
+
+    pixman_image_t *src = pixman_image_create_bits_no_clear(
+        PIXMAN_a8r8g8b8, pm->size, pm->size, (uint32_t *)pm->pixels,
+        stride_for_format_and_width(PIXMAN_a8r8g8b8, pm->size));
+    if (src == NULL)
+        goto out;
+
+    pixman_image_t *scaled = pixels_scale_image(src, size, size);
+    pixman_image_unref(src);
+
+    if (scaled == NULL)
+        goto out;
+
+    struct pixels_shared *pixels = pixels_shared_new(scaled);
+    if (pixels == NULL) {
+        pixman_image_unref(scaled);
+        goto out;
+    }
+
+    LOG_DBG("scaled %dx%d pixmap to %dx%d", pm->size, pm->size, size, size);
+    tll_push_back(p->images, ((struct icon_pixmap_image){size, pixels}));
+    ret = pixels_shared_image(pixels);
+
+out:
+    mtx_unlock(&p->lock);
+    return ret;
+}
+
 bool
 dir_exists(char *path)
 {
@@ -445,74 +525,178 @@ read_theme_file(char *basedir, char *theme_name)
     return theme;
 }
 
-themes_t
-load_themes_in_dir(char *basedir)
+/*
+ * Parsed index.theme files, keyed on their path. Shared by all theme
+ * registries (i.e. all bars and particles, regardless of their base
+ * directories), and kept for the lifetime of the process; they are
+ * never modified after being parsed, and can thus be used without
+ * holding any locks.
+ */
+struct theme_file {
+    char *path;
+    struct icon_theme *theme; /* NULL if missing, or invalid */
+};
+
+static once_flag theme_files_init_once = ONCE_FLAG_INIT;
+static mtx_t theme_files_lock;
+static tll(struct theme_file) theme_files = tll_init();
+
+static void
+theme_files_init(void)
+{
+    mtx_init(&theme_files_lock, mtx_plain);
+}
+
+static struct icon_theme *
+load_theme(char *basedir, char *theme_name)
 {
-    themes_t themes = tll_init();
+    call_once(&theme_files_init_once, &theme_files_init);
+
+    char *path = format_str("%s/%s/index.theme", basedir, theme_name);
+    struct icon_theme *theme = NULL;
+
+    mtx_lock(&theme_files_lock);
 
-    DIR *dir;
-    if (!(dir = opendir(basedir))) {
-        return themes;
+    tll_foreach(theme_files, it) {
+        if (strcmp(it->item.path, path) == 0) {
+            theme = it->item.theme;
+            free(path);
+            goto out;
+        }
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-        if (entry->d_name[0] == '.')
+    theme = read_theme_file(basedir, theme_name);
+    if (theme != NULL)
+        LOG_INFO("loaded icon theme: %s (%s)", theme->name, path);
+
+    tll_push_back(theme_files, ((struct theme_file){.path = path, .theme = theme}));
+
+out:
+    mtx_unlock(&theme_files_lock);
+    return theme;
+}
+
+static bool
+theme_matches(const struct icon_theme *theme, const char *name)
+{
+    return strcmp(theme->name, name) == 0 || strcmp(theme->dir, name) == 0;
+}
+
+static struct icon_theme *
+loaded_theme(const struct themes *t, const char *name)
+{
+    tll_foreach(t->themes, it) {
+        if (theme_matches(it->item, name))
+            return it->item;
+    }
+    return NULL;
+}
+
+static void
+add_theme(struct themes *t, struct icon_theme *theme)
+{
+    tll_foreach(t->themes, it) {
+        if (it->item == theme || strcmp(it->item->name, theme->name) == 0)
+            return;
+    }
+    tll_push_back(t->themes, theme);
+}
+
+/*
+ * Loads all themes in all base directories. Only needed when a
+ * theme is referred to by a name that does not match its directory.
+ */
+static void
+scan_themes(struct themes *t)
+{
+    LOG_DBG("scanning all icon themes");
+
+    tll_foreach(t->basedirs->basedirs, bd_it) {
+        DIR *dir = opendir(bd_it->item);
+        if (dir == NULL)
             continue;
 
-        struct icon_theme *theme = read_theme_file(basedir, entry->d_name);
-        if (theme) {
-            tll_push_back(themes, theme);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.')
+                continue;
+
+            struct icon_theme *theme = load_theme(bd_it->item, entry->d_name);
+            if (theme != NULL)
+                add_theme(t, theme);
         }
+        closedir(dir);
     }
-    closedir(dir);
-    return themes;
+
+    t->scanned = true;
 }
 
-void
-log_loaded_themes(themes_t themes)
+/*
+ * Returns the theme with the specified name (either its directory
+ * name, or the name in its index.theme), loading it if necessary.
+ */
+static struct icon_theme *
+lookup_theme(struct themes *t, const char *name)
 {
-    if (tll_length(themes) == 0) {
-        LOG_INFO("Warning: no icon themes loaded");
-        return;
-    }
-    const char sep[] = ", ";
-    size_t sep_len = strlen(sep);
+    struct icon_theme *theme = NULL;
 
-    size_t len = 0;
-    tll_foreach(themes, it) { len += strlen(it->item->name) + sep_len; }
+    mtx_lock(&t->lock);
 
-    char *str = malloc(len + 1);
-    if (!str) {
-        return;
+    if ((theme = loaded_theme(t, name)) != NULL)
+        goto out;
+
+    tll_foreach(t->missing, it) {
+        if (strcmp(it->item, name) == 0)
+            goto out;
     }
-    char *p = str;
-    bool start = true;
-    tll_foreach(themes, it)
-    {
-        if (!start) {
-            memcpy(p, sep, sep_len);
-            p += sep_len;
+
+    /* Most themes' names match their directory names, possibly in lower case */
+    char *lower = strdup(name);
+    for (char *c = lower; *c != '\0'; c++)
+        *c = tolower((unsigned char)*c);
+
+    const char *candidates[] = {name, lower};
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && theme == NULL; i++) {
+        if (i > 0 && strcmp(candidates[i], name) == 0)
+            break;
+
+        tll_foreach(t->basedirs->basedirs, it) {
+            struct icon_theme *candidate = load_theme(it->item, (char *)candidates[i]);
+            if (candidate != NULL && theme_matches(candidate, name)) {
+                theme = candidate;
+                break;
+            }
         }
-        start = false;
+    }
+    free(lower);
+
+    if (theme == NULL && !t->scanned) {
+        scan_themes(t);
+        theme = loaded_theme(t, name);
+    }
 
-        struct icon_theme *theme = it->item;
-        size_t name_len = strlen(theme->name);
-        memcpy(p, theme->name, name_len);
-        p += name_len;
+    if (theme != NULL)
+        add_theme(t, theme);
+    else {
+        LOG_DBG("icon theme not found: %s", name);
+        tll_push_back(t->missing, strdup(name));
     }
-    *p = '\0';
 
-    LOG_INFO("Loaded icon themes: %s", str);
-    free(str);
+out:
+    mtx_unlock(&t->lock);
+    return theme;
 }
 
 void
 themes_free(const struct ref *ref)
 {
-    LOG_INFO("themes free");
     struct themes *p = (struct themes *)ref;
-    tll_free_and_free(p->themes, destroy_theme);
+
+    /* The themes themselves are owned by the process wide cache */
+    tll_free(p->themes);
+    tll_free_and_free(p->missing, free);
+    basedirs_dec(p->basedirs);
+    mtx_destroy(&p->lock);
     free(p);
 }
 
@@ -532,23 +716,10 @@ themes_inc(struct themes *t)
 struct themes *
 init_themes(struct basedirs *basedirs)
 {
-
-    themes_t themes = tll_init();
-    tll_foreach(basedirs->basedirs, it)
-    {
-        themes_t dir_themes = load_themes_in_dir(it->item);
-        tll_foreach(dir_themes, it)
-        {
-            struct icon_theme *theme = it->item;
-            tll_remove(dir_themes, it);
-            tll_push_back(themes, theme);
-        }
-    }
-
-    log_loaded_themes(themes);
-    struct themes *out = malloc(sizeof(*out));
-    out->themes = themes;
+    struct themes *out = calloc(1, sizeof(*out));
     out->refcount = (struct ref){themes_free, 1};
+    out->basedirs = basedirs_inc(basedirs);
+    mtx_init(&out->lock, mtx_plain);
     return out;
 }
 
@@ -581,18 +752,10 @@ theme_exists_in_basedir(char *theme, char *basedir)
 }
 
 static char *
-find_icon_with_theme(string_list_t basedirs, themes_t themes, char *name, int size, char *theme_name, int *min_size,
+find_icon_with_theme(string_list_t basedirs, struct themes *themes, char *name, int size, char *theme_name, int *min_size,
                      int *max_size)
 {
-    struct icon_theme *theme = NULL;
-    tll_foreach(themes, it)
-    {
-        theme = it->item;
-        if (strcmp(theme->name, theme_name) == 0) {
-            break;
-        }
-        theme = NULL;
-    }
+    struct icon_theme *theme = lookup_theme(themes, theme_name);
     if (!theme)
         return NULL;
 
@@ -671,7 +834,7 @@ find_fallback_icon(string_list_t basedirs, char *name, int *min_size, int *max_s
 }
 
 char *
-find_icon(themes_t themes, string_list_t basedirs, char *name, int size, char *theme, int *min_size, int *max_size)
+find_icon(struct themes *themes, string_list_t basedirs, char *name, int size, char *theme, int *min_size, int *max_size)
 {
     // TODO https://specifications.freedesktop.org/icon-theme-spec/icon-theme-spec-latest.html#implementation_notes
     //
@@ -2,6 +2,8 @@
 
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <threads.h>
+#include <pixman.h>
 #include <tllist.h>
 
 struct ref {
@@ -34,11 +36,31 @@ void icon_pixmaps_dec(struct icon_pixmaps *p);
 
 struct icon_pixmaps *icon_pixmaps_inc(struct icon_pixmaps *ip);
 
+/*
+ * Returns an image, scaled to 'size' x 'size' pixels, from the best
+ * matching pixmap. The scaled image is cached for as long as the
+ * pixmaps themselves are alive. The caller must unref the returned
+ * image.
+ */
+pixman_image_t *icon_pixmaps_get_image(struct icon_pixmaps *p, int size);
+
 typedef tll(struct icon_pixmap *) icon_pixmaps_t;
 
+struct pixels_shared;
+
+struct icon_pixmap_image {
+    int size;
+    struct pixels_shared *pixels;
+};
+
+typedef tll(struct icon_pixmap_image) icon_pixmap_images_t;
+
 struct icon_pixmaps {
     struct ref refcount;
     icon_pixmaps_t list;
+
+    mtx_t lock;
+    icon_pixmap_images_t images; /* Scaled, cached, images */
 };
 
 enum icon_dir_type { ICON_DIR_FIXED, ICON_DIR_SCALABLE, ICON_DIR_THRESHOLD };
@@ -59,9 +81,19 @@ typedef tll(struct icon_theme *) themes_t;
 typedef tll(char *) string_list_t;
 typedef tll(struct icon_theme_subdir *) subdirs_t;
 
+/*
+ * Icon theme registry. Themes are loaded lazily, on first lookup;
+ * only the requested themes (and the themes they inherit) are
+ * loaded. The parsed themes themselves are shared process wide.
+ */
 struct themes {
     struct ref refcount;
-    themes_t themes;
+    struct basedirs *basedirs;
+
+    mtx_t lock;
+    themes_t themes;       /* Loaded themes, not owned */
+    string_list_t missing; /* Theme names known not to exist */
+    bool scanned;          /* All themes in all base directories loaded */
 };
 
 struct basedirs {
@@ -95,7 +127,6 @@ void themes_dec(struct themes *p);
 
 struct themes *themes_inc(struct themes *p);
 
-char *find_icon(themes_t themes, string_list_t basedirs, char *name, int size, char *theme, int *min_size,
+char *find_icon(struct themes *themes, string_list_t basedirs, char *name, int size, char *theme, int *min_size,
                 int *max_size);
 
-void log_loaded_themes(themes_t themes);
@@ -1,18 +1,32 @@
 #include "log.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <threads.h>
+#include <time.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
 
 #define ALEN(v) (sizeof(v) / sizeof((v)[0]))
-#define UNUSED __attribute__((unused))
+
+/* Max number of queued messages */
+#define QUEUE_SIZE 1024
+
+/* At most RATE_LIMIT_BURST repetitions of a message, per RATE_LIMIT_INTERVAL */
+#define RATE_LIMIT_BURST 5
+#define RATE_LIMIT_INTERVAL 5  /* Seconds */
+#define RATE_LIMIT_SITES 512   /* Hash buckets; colliding sites share limits */
 
 static bool colorize = false;
 static bool do_syslog = true;
@@ -31,6 +45,237 @@ static const struct {
     [LOG_CLASS_DEBUG] = {"debug", " dbg", 36, LOG_DEBUG},
 };
 
+/* A formatted message. 'module' and 'file' are string literals */
+struct entry {
+    enum log_class log_class;
+    const char *module;
+    const char *file;
+    int lineno;
+    int sys_errno;
+    unsigned suppressed;  /* Preceding repetitions dropped by the rate limit */
+    char *msg;
+};
+
+/*
+ * Messages are formatted by the logging thread, and pushed to a
+ * bounded, lock-free, multi-producer queue. A single writer thread
+ * writes them to stderr and syslog, and thus logging threads never
+ * block on either. When the queue is full, messages are dropped (and
+ * counted).
+ *
+ * A slot's sequence number tells whether it is free to produce to
+ * (seq == pos), or holds a message to consume (seq == pos + 1).
+ */
+static struct {
+    atomic_size_t seq;
+    struct entry entry;
+} queue[QUEUE_SIZE];
+
+static atomic_size_t queue_head;  /* Next position to produce to */
+static size_t queue_tail;         /* Next position to consume; writer only */
+static atomic_uint dropped;
+
+static struct {
+    int fd;  /* eventfd, signalled when messages have been queued */
+    thrd_t thread;
+    atomic_bool quit;
+} writer = {.fd = -1};
+
+/* False before log_init(), after log_deinit(), and in forked children */
+static atomic_bool writer_running;
+
+/* Last message's hash, interval and repetition count, per call site */
+static atomic_uint_least64_t rate_limits[RATE_LIMIT_SITES];
+
+static void
+write_entry(const struct entry *e)
+{
+    const char *prefix = log_level_map[e->log_class].log_prefix;
+    unsigned int class_clr = log_level_map[e->log_class].color;
+
+    char clr[16];
+    snprintf(clr, sizeof(clr), "\033[%um", class_clr);
+
+    char errno_str[128] = "";
+    if (e->sys_errno != 0) {
+        snprintf(errno_str, sizeof(errno_str), ": %s (%d)",
+                 strerror(e->sys_errno), e->sys_errno);
+    }
+
+    char suppressed_str[64] = "";
+    if (e->suppressed > 0) {
+        snprintf(suppressed_str, sizeof(suppressed_str),
+                 " (%u repeated messages suppressed)", e->suppressed);
+    }
+
+    fprintf(stderr, "%s%s%s: %s%s:%d: %s%s%s%s\n",
+            colorize ? clr : "", prefix, colorize ? "\033[0m" : "",
+            colorize ? "\033[2m" : "", e->file, e->lineno,
+            colorize ? "\033[0m" : "",
+            e->msg, errno_str, suppressed_str);
+
+    if (!do_syslog)
+        return;
+
+    /* Map our log level to syslog's level */
+    int level = log_level_map[e->log_class].syslog_equivalent;
+
+    syslog(level, "%s: %s%s%s%s", e->module, e->msg,
+           e->sys_errno != 0 ? ": " : "",
+           e->sys_errno != 0 ? strerror(e->sys_errno) : "",
+           suppressed_str);
+}
+
+static bool
+queue_push(const struct entry *e)
+{
+    size_t pos = atomic_load_explicit(&queue_head, memory_order_relaxed);
+
+    while (true) {
+        const size_t seq = atomic_load_explicit(
+            &queue[pos % QUEUE_SIZE].seq, memory_order_acquire);
+        const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue_head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        } else if (diff < 0) {
+            /* Full; the writer hasn't consumed the slot yet */
+            return false;
+        } else
+            pos = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    }
+
+    queue[pos % QUEUE_SIZE].entry = *e;
+    atomic_store_explicit(
+        &queue[pos % QUEUE_SIZE].seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool
+queue_pop(struct entry *e)
+{
+    const size_t pos = queue_tail;
+    atomic_size_t *seq = &queue[pos % QUEUE_SIZE].seq;
+
+    if (atomic_load_explicit(seq, memory_order_acquire) != pos + 1)
+        return false;
+
+    *e = queue[pos % QUEUE_SIZE].entry;
+    atomic_store_explicit(seq, pos + QUEUE_SIZE, memory_order_release);
+    queue_tail++;
+    return true;
+}
+
+static void
+drain(void)
+{
+    struct entry e;
+    while (queue_pop(&e)) {
+        write_entry(&e);
+        free(e.msg);
+    }
+
+    unsigned count = atomic_exchange(&dropped, 0);
+    if (count > 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "log queue full: %u messages dropped", count);
+        write_entry(&(struct entry){
+            .log_class = LOG_CLASS_WARNING,
+            .module = "log",
+            .file = __FILE__,
+            .lineno = __LINE__,
+            .msg = msg,
+        });
+    }
+}
+
+static int
+writer_thread(void *arg)
+{
+    /* Leave signals to the threads expecting them */
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_setname_np(pthread_self(), "log");
+
+    while (!atomic_load(&writer.quit)) {
+        uint64_t count;
+        if (read(writer.fd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+
+        drain();
+    }
+
+    drain();
+    return 0;
+}
+
+static void
+atfork_child(void)
+{
+    /* The writer thread wasn't forked; log synchronously */
+    atomic_store(&writer_running, false);
+}
+
+static void
+atfork_register(void)
+{
+    pthread_atfork(NULL, NULL, &atfork_child);
+}
+
+static void
+writer_start(void)
+{
+    static once_flag atfork_once = ONCE_FLAG_INIT;
+    call_once(&atfork_once, &atfork_register);
+
+    for (size_t i = 0; i < QUEUE_SIZE; i++)
+        atomic_init(&queue[i].seq, i);
+    atomic_init(&queue_head, 0);
+    queue_tail = 0;
+
+    writer.fd = eventfd(0, EFD_CLOEXEC);
+    if (writer.fd < 0)
+        return;
+
+    atomic_store(&writer.quit, false);
+
+    if (thrd_create(&writer.thread, &writer_thread, NULL) != thrd_success) {
+        close(writer.fd);
+        writer.fd = -1;
+        return;
+    }
+
+    atomic_store(&writer_running, true);
+}
+
+static void
+writer_stop(void)
+{
+    if (!atomic_exchange(&writer_running, false))
+        return;
+
+    atomic_store(&writer.quit, true);
+
+    /*
+     * A blocking eventfd write only fails if interrupted. The thread
+     * must be joined regardless, since it uses the FD until it exits.
+     */
+    while (write(writer.fd, &(uint64_t){1}, sizeof(uint64_t)) < 0 &&
+           errno == EINTR)
+        ;
+
+    thrd_join(writer.thread, NULL);
+    close(writer.fd);
+    writer.fd = -1;
+}
+
 void
 log_init(enum log_colorize _colorize, bool _do_syslog,
          enum log_facility syslog_facility, enum log_class _log_level)
@@ -51,15 +296,76 @@ log_init(enum log_colorize _colorize, bool _do_syslog,
         openlog(NULL, /*LOG_PID*/0, facility_map[syslog_facility]);
         setlogmask(LOG_UPTO(slvl));
     }
+
+    if (log_level > LOG_CLASS_NONE)
+        writer_start();
 }
 
 void
 log_deinit(void)
 {
+    /* Flushes all queued messages */
+    writer_stop();
+
     if (do_syslog)
         closelog();
 }
 
+static uint32_t
+hash_str(const char *s)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (; *s != '\0'; s++)
+        hash = (hash ^ (uint8_t)*s) * 16777619u;
+    return hash;
+}
+
+/*
+ * Returns false if 'msg' repeats the call site's previous message
+ * more than RATE_LIMIT_BURST times within the current interval. Else,
+ * 'suppressed' is the number of repetitions dropped before it.
+ */
+static bool
+rate_limit(const char *file, int lineno, const char *msg, unsigned *suppressed)
+{
+    const size_t idx =
+        ((uintptr_t)file * 31 + (unsigned)lineno) % RATE_LIMIT_SITES;
+    atomic_uint_least64_t *site = &rate_limits[idx];
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* (hash << 32 | window << 16 | count) */
+    const uint64_t key =
+        (uint64_t)hash_str(msg) << 32 |
+        (uint64_t)(uint16_t)(now.tv_sec / RATE_LIMIT_INTERVAL) << 16;
+
+    uint64_t old = atomic_load_explicit(site, memory_order_relaxed);
+    uint64_t new;
+
+    do {
+        if ((old & ~0xffffull) != key)
+            new = key | 1;
+        else if ((old & 0xffff) < 0xffff)
+            new = old + 1;
+        else
+            new = old;
+    } while (!atomic_compare_exchange_weak_explicit(
+                 site, &old, new, memory_order_relaxed, memory_order_relaxed));
+
+    const unsigned count = old & 0xffff;
+
+    if ((old & ~0xffffull) != key) {
+        /* New message, or interval */
+        *suppressed = count > RATE_LIMIT_BURST ? count - RATE_LIMIT_BURST : 0;
+        return true;
+    }
+
+    *suppressed = 0;
+    return count < RATE_LIMIT_BURST;
+}
+
 static void
 _log(enum log_class log_class, const char *module, const char *file, int lineno,
      const char *fmt, int sys_errno, va_list va)
@@ -67,63 +373,56 @@ _log(enum log_class log_class, const char *module, const char *file, int lineno,
     assert(log_class > LOG_CLASS_NONE);
     assert(log_class < ALEN(log_level_map));
 
+    /* Before formatting anything */
     if (log_class > log_level)
         return;
 
-    const char *prefix = log_level_map[log_class].log_prefix;
-    unsigned int class_clr = log_level_map[log_class].color;
-
-    char clr[16];
-    snprintf(clr, sizeof(clr), "\033[%um", class_clr);
-    fprintf(stderr, "%s%s%s: ", colorize ? clr : "", prefix, colorize ? "\033[0m" : "");
-
-    if (colorize)
-        fputs("\033[2m", stderr);
-    fprintf(stderr, "%s:%d: ", file, lineno);
-    if (colorize)
-        fputs("\033[0m", stderr);
-
-    vfprintf(stderr, fmt, va);
-
-    if (sys_errno != 0)
-        fprintf(stderr, ": %s (%d)", strerror(sys_errno), sys_errno);
+    /* Don't clobber the caller's errno */
+    const int errno_copy = errno;
 
-    fputc('\n', stderr);
-}
+    struct entry e = {
+        .log_class = log_class,
+        .module = module,
+        .file = file,
+        .lineno = lineno,
+        .sys_errno = sys_errno,
+    };
 
-static void
-_sys_log(enum log_class log_class, const char *module,
-         const char UNUSED *file, int UNUSED lineno,
-         const char *fmt, int sys_errno, va_list va)
-{
-    assert(log_class > LOG_CLASS_NONE);
-    assert(log_class < ALEN(log_level_map));
+    if (vasprintf(&e.msg, fmt, va) < 0)
+        goto out;
 
-    if (!do_syslog)
-        return;
+    if (log_class < LOG_CLASS_DEBUG &&
+        !rate_limit(file, lineno, e.msg, &e.suppressed))
+    {
+        free(e.msg);
+        goto out;
+    }
 
-    /* Map our log level to syslog's level */
-    int level = log_level_map[log_class].syslog_equivalent;
+    if (!atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        write_entry(&e);
+        free(e.msg);
+        goto out;
+    }
 
-    char msg[4096];
-    int n = vsnprintf(msg, sizeof(msg), fmt, va);
-    assert(n >= 0);
+    if (!queue_push(&e)) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        free(e.msg);
+        goto out;
+    }
 
-    if (sys_errno != 0 && (size_t)n < sizeof(msg))
-        snprintf(msg + n, sizeof(msg) - n, ": %s", strerror(sys_errno));
+    if (write(writer.fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        /* Nothing we can do; the message is written with the next one */
+    }
 
-    syslog(level, "%s: %s", module, msg);
+out:
+    errno = errno_copy;
 }
 
 void
 log_msg_va(enum log_class log_class, const char *module,
            const char *file, int lineno, const char *fmt, va_list va)
 {
-    va_list va2;
-    va_copy(va2, va);
     _log(log_class, module, file, lineno, fmt, 0, va);
-    _sys_log(log_class, module, file, lineno, fmt, 0, va2);
-    va_end(va2);
 }
 
 void
@@ -160,11 +459,7 @@ log_errno_provided_va(enum log_class log_class, const char *module,
                       const char *file, int lineno, int errno_copy,
                       const char *fmt, va_list va)
 {
-    va_list va2;
-    va_copy(va2, va);
     _log(log_class, module, file, lineno, fmt, errno_copy, va);
-    _sys_log(log_class, module, file, lineno, fmt, errno_copy, va2);
-    va_end(va2);
 }
 
 void
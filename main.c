@@ -20,6 +20,8 @@
 
 #include "bar/bar.h"
 #include "config.h"
+#include "fonts.h"
+#include "trace.h"
 #include "yml.h"
 
 #define LOG_MODULE "main"
@@ -27,6 +29,9 @@
 #include "version.h"
 
 static volatile sig_atomic_t aborted = 0;
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t write_trace = 0;
+static volatile sig_atomic_t reload = 0;
 
 static void
 signal_handler(int signo)
@@ -34,6 +39,24 @@ signal_handler(int signo)
     aborted = signo;
 }
 
+static void
+dump_stats_handler(int signo)
+{
+    dump_stats = 1;
+}
+
+static void
+write_trace_handler(int signo)
+{
+    write_trace = 1;
+}
+
+static void
+reload_handler(int signo)
+{
+    reload = 1;
+}
+
 static char *
 get_config_path_user_config(void)
 {
@@ -84,8 +107,8 @@ get_config_path(void)
     return NULL;
 }
 
-static struct bar *
-load_bar(const char *config_path, enum bar_backend backend)
+static struct yml_node *
+load_config(const char *config_path)
 {
     FILE *conf_file = fopen(config_path, "r");
     if (conf_file == NULL) {
@@ -93,7 +116,6 @@ load_bar(const char *config_path, enum bar_backend backend)
         return NULL;
     }
 
-    struct bar *bar = NULL;
     char *yml_error = NULL;
 
     struct yml_node *conf = yml_load(conf_file, &yml_error);
@@ -102,38 +124,126 @@ load_bar(const char *config_path, enum bar_backend backend)
         goto out;
     }
 
-    const struct yml_node *bar_conf = yml_get_value(conf, "bar");
-    if (bar_conf == NULL) {
+    if (yml_get_value(conf, "bar") == NULL) {
         LOG_ERR("%s: missing required top level key 'bar'", config_path);
-        goto out;
-    }
-
-    bar = conf_to_bar(bar_conf, backend);
-    if (bar == NULL) {
-        LOG_ERR("%s: failed to load configuration", config_path);
+        yml_destroy(conf);
+        conf = NULL;
         goto out;
     }
 
 out:
     free(yml_error);
-    yml_destroy(conf);
     fclose(conf_file);
+    return conf;
+}
+
+static struct bar *
+load_bar(const struct yml_node *conf, const char *config_path,
+         enum bar_backend backend, const char *backend_options)
+{
+    struct bar *bar = conf_to_bar(
+        yml_get_value(conf, "bar"), backend, backend_options);
+
+    if (bar == NULL)
+        LOG_ERR("%s: failed to load configuration", config_path);
     return bar;
 }
 
+/*
+ * Re-loads the configuration. Modules whose configuration is
+ * unchanged keep running. Only if the bar's own settings have
+ * changed, is the bar re-created.
+ *
+ * On failure, the current configuration is kept.
+ */
+static void
+reload_config(const char *config_path, enum bar_backend backend,
+              const char *backend_options, struct yml_node **conf,
+              struct bar **bar, thrd_t *bar_thread, int abort_fd,
+              bool stats, const char *stats_path, const sigset_t *signal_mask)
+{
+    LOG_INFO("%s: reloading configuration", config_path);
+
+    struct yml_node *new_conf = load_config(config_path);
+    if (new_conf == NULL)
+        return;
+
+    const struct yml_node *old_bar_conf = yml_get_value(*conf, "bar");
+    const struct yml_node *new_bar_conf = yml_get_value(new_conf, "bar");
+
+    if (!conf_bar_needs_restart(old_bar_conf, new_bar_conf)) {
+        /* New module threads must not receive signals either */
+        pthread_sigmask(SIG_BLOCK, signal_mask, NULL);
+        bool updated = conf_update_modules(*bar, old_bar_conf, new_bar_conf);
+        pthread_sigmask(SIG_UNBLOCK, signal_mask, NULL);
+
+        if (!updated) {
+            LOG_ERR("%s: failed to load configuration", config_path);
+            yml_destroy(new_conf);
+            return;
+        }
+
+        yml_destroy(*conf);
+        *conf = new_conf;
+        return;
+    }
+
+    LOG_INFO("bar configuration changed, re-creating the bar");
+
+    /* Instantiate the new bar before tearing down the current one */
+    struct bar *new_bar = load_bar(
+        new_conf, config_path, backend, backend_options);
+
+    if (new_bar == NULL) {
+        yml_destroy(new_conf);
+        return;
+    }
+
+    if (write(abort_fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+        LOG_ERRNO("failed to signal abort to threads");
+
+    int res;
+    int r = thrd_join(*bar_thread, &res);
+    if (r != 0)
+        LOG_ERRNO_P(r, "failed to join bar thread");
+
+    (*bar)->destroy(*bar);
+    yml_destroy(*conf);
+
+    /* Reset the abort signal */
+    uint64_t value;
+    if (read(abort_fd, &value, sizeof(value)) != sizeof(value))
+        LOG_ERRNO("failed to reset abort FD");
+
+    *bar = new_bar;
+    *conf = new_conf;
+
+    new_bar->abort_fd = abort_fd;
+    if (stats)
+        new_bar->enable_stats(new_bar, stats_path);
+
+    /* The bar thread, and thus the module threads, must not receive signals */
+    pthread_sigmask(SIG_BLOCK, signal_mask, NULL);
+    thrd_create(bar_thread, (int (*)(void *))new_bar->run, new_bar);
+    pthread_sigmask(SIG_UNBLOCK, signal_mask, NULL);
+}
+
 static void
 print_usage(const char *prog_name)
 {
     printf("Usage: %s [OPTION]...\n", prog_name);
     printf("\n");
     printf("Options:\n");
-    printf("  -b,--backend={xcb,wayland,auto}          backend to use (default: auto)\n"
+    printf("  -b,--backend={xcb,wayland,headless,auto} backend to use (default: auto)\n"
            "  -c,--config=FILE                         alternative configuration file\n"
            "  -C,--validate                            verify configuration then quit\n"
            "  -p,--print-pid=FILE|FD                   print PID to file or FD\n"
            "  -d,--log-level={info|warning|error|none} log level (info)\n"
            "  -l,--log-colorize=[never|always|auto]    enable/disable colorization of log output on stderr\n"
            "  -s,--log-no-syslog                       disable syslog logging\n"
+           "  -S,--stats[=FILE]                        collect timing statistics; dump on SIGUSR1 and exit,\n"
+           "                                           to FILE or the log\n"
+           "  -T,--trace=FILE                          record trace events, written to FILE on SIGUSR2 and exit\n"
            "  -v,--version                             show the version number and quit\n");
 }
 
@@ -185,6 +295,8 @@ main(int argc, char *const *argv)
         {"log-level",        required_argument, 0, 'd'},
         {"log-colorize",     optional_argument, 0, 'l'},
         {"log-no-syslog",    no_argument,       0, 's'},
+        {"stats",            optional_argument, 0, 'S'},
+        {"trace",            required_argument, 0, 'T'},
         {"version",          no_argument,       0, 'v'},
         {"help",             no_argument,       0, 'h'},
         {NULL,               no_argument,       0, 0},
@@ -196,13 +308,18 @@ main(int argc, char *const *argv)
     bool verify_config = false;
     char *config_path = NULL;
     enum bar_backend backend = BAR_BACKEND_AUTO;
+    const char *backend_options = NULL;
 
     enum log_class log_level = LOG_CLASS_INFO;
     enum log_colorize log_colorize = LOG_COLORIZE_AUTO;
     bool log_syslog = true;
 
+    bool stats = false;
+    const char *stats_path = NULL;
+    const char *trace_path = NULL;
+
     while (true) {
-        int c = getopt_long(argc, argv, ":b:c:Cp:d:l::svh", longopts, NULL);
+        int c = getopt_long(argc, argv, ":b:c:Cp:d:l::sS::T:vh", longopts, NULL);
         if (c == -1)
             break;
 
@@ -212,6 +329,12 @@ main(int argc, char *const *argv)
                 backend = BAR_BACKEND_XCB;
             else if (strcmp(optarg, "wayland") == 0)
                 backend = BAR_BACKEND_WAYLAND;
+            else if (strcmp(optarg, "headless") == 0)
+                backend = BAR_BACKEND_HEADLESS;
+            else if (strncmp(optarg, "headless:", 9) == 0) {
+                backend = BAR_BACKEND_HEADLESS;
+                backend_options = &optarg[9];
+            }
             else {
                 fprintf(stderr, "%s: invalid backend\n", optarg);
                 return EXIT_FAILURE;
@@ -272,6 +395,15 @@ main(int argc, char *const *argv)
             log_syslog = false;
             break;
 
+        case 'S':
+            stats = true;
+            stats_path = optarg;
+            break;
+
+        case 'T':
+            trace_path = optarg;
+            break;
+
         case 'v':
             printf("yambar version %s\n", YAMBAR_VERSION);
             return EXIT_SUCCESS;
@@ -299,17 +431,29 @@ main(int argc, char *const *argv)
     fcft_init((enum fcft_log_colorize)log_colorize, log_syslog,
               (enum fcft_log_class)log_level);
     atexit(&fcft_fini);
+    atexit(&fonts_fini);
+
+    /* Must be enabled before any threads are started */
+    if (trace_path != NULL && !trace_init(trace_path)) {
+        LOG_ERR("%s: failed to enable tracing", trace_path);
+        log_deinit();
+        return 1;
+    }
 
     const struct sigaction sa = {.sa_handler = &signal_handler};
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
+    const struct sigaction hup = {.sa_handler = &reload_handler};
+    sigaction(SIGHUP, &hup, NULL);
+
     /* Block SIGINT (this is under the assumption that threads inherit
      * the signal mask */
     sigset_t signal_mask;
     sigemptyset(&signal_mask);
     sigaddset(&signal_mask, SIGINT);
     sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGHUP);
     pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
 
     int abort_fd = eventfd(0, EFD_CLOEXEC);
@@ -328,10 +472,15 @@ main(int argc, char *const *argv)
         }
     }
 
-    struct bar *bar = load_bar(config_path, backend);
-    free(config_path);
+    /* Kept, to be able to tell what has changed when reloading */
+    struct yml_node *conf = load_config(config_path);
+    struct bar *bar = conf != NULL
+        ? load_bar(conf, config_path, backend, backend_options)
+        : NULL;
 
     if (bar == NULL) {
+        yml_destroy(conf);
+        free(config_path);
         close(abort_fd);
         log_deinit();
         return 1;
@@ -339,6 +488,8 @@ main(int argc, char *const *argv)
 
     if (verify_config) {
         bar->destroy(bar);
+        yml_destroy(conf);
+        free(config_path);
         close(abort_fd);
         log_deinit();
         return 0;
@@ -346,8 +497,27 @@ main(int argc, char *const *argv)
 
     setlocale(LC_ALL, "");
 
+    /* Rasterize common glyphs while the bar is starting up */
+    fonts_prewarm();
+
     bar->abort_fd = abort_fd;
 
+    if (stats) {
+        bar->enable_stats(bar, stats_path);
+
+        const struct sigaction usr1 = {.sa_handler = &dump_stats_handler};
+        sigaction(SIGUSR1, &usr1, NULL);
+        sigaddset(&signal_mask, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+    }
+
+    if (trace_enabled()) {
+        const struct sigaction usr2 = {.sa_handler = &write_trace_handler};
+        sigaction(SIGUSR2, &usr2, NULL);
+        sigaddset(&signal_mask, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+    }
+
     thrd_t bar_thread;
     thrd_create(&bar_thread, (int (*)(void *))bar->run, bar);
 
@@ -363,6 +533,24 @@ main(int argc, char *const *argv)
         struct pollfd fds[] = {{.fd = abort_fd, .events = POLLIN}};
         int r __attribute__((unused)) = poll(fds, sizeof(fds) / sizeof(fds[0]), -1);
 
+        if (dump_stats) {
+            dump_stats = 0;
+            bar->dump_stats(bar);
+        }
+
+        if (write_trace) {
+            write_trace = 0;
+            trace_write();
+        }
+
+        if (reload) {
+            reload = 0;
+            reload_config(config_path, backend, backend_options, &conf,
+                          &bar, &bar_thread, abort_fd, stats, stats_path,
+                          &signal_mask);
+            continue;
+        }
+
         if (fds[0].revents & (POLLIN | POLLHUP)) {
             /*
              * Either the bar aborted (triggering the abort_fd), or user
@@ -388,7 +576,10 @@ done:
         LOG_ERRNO_P(r, "failed to join bar thread");
 
     bar->destroy(bar);
+    yml_destroy(conf);
+    free(config_path);
     close(abort_fd);
+    trace_fini();
 
     if (unlink_pid_file)
         unlink(pid_file);
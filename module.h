@@ -1,11 +1,30 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <threads.h>
 
 #include "particle.h"
 
 struct bar;
 
+/*
+ * Limits on how often a module's refresh requests are honored, from
+ * its 'max-refresh-rate' and 'debounce' attributes. Enforced by the
+ * bar, for refreshes requested by the module's own thread. A request
+ * that isn't honored immediately is deferred, never dropped.
+ */
+struct module_refresh_limit {
+    uint64_t interval_ns;   /* Min time between refreshes; 0 = no limit */
+    uint64_t debounce_ns;   /* Quiet time ending a burst; 0 = no debounce */
+
+    /* State, owned by the bar (CLOCK_MONOTONIC, in ns) */
+    uint64_t last_request;
+    uint64_t last_refresh;
+    uint64_t deadline;      /* Of the deferred refresh, if 'pending' */
+    bool pending;
+};
+
 struct module {
     const struct bar *bar;
 
@@ -14,6 +33,8 @@ struct module {
 
     void *private;
 
+    struct module_refresh_limit refresh_limit;
+
     int (*run)(struct module *mod);
     void (*destroy)(struct module *module);
 
@@ -40,4 +61,6 @@ struct exposable *module_begin_expose(struct module *mod);
     {"anchors", false, NULL},                      \
     {"font", false, &conf_verify_font},            \
     {"foreground", false, &conf_verify_color},     \
+    {"max-refresh-rate", false, &conf_verify_unsigned}, \
+    {"debounce", false, &conf_verify_unsigned},    \
     {NULL, false, NULL}
@@ -7,17 +7,14 @@
 #include <errno.h>
 #include <poll.h>
 
-#include <sys/stat.h>
-#include <fcntl.h>
-
-#include <libudev.h>
-
 #define LOG_MODULE "backlight"
 #include "../log.h"
 #include "../bar/bar.h"
 #include "../config.h"
 #include "../config-verify.h"
 #include "../plugin.h"
+#include "sysfs.h"
+#include "udev-hub.h"
 
 struct private {
     struct particle *label;
@@ -25,6 +22,8 @@ struct private {
     char *device;
     long max_brightness;
     long current_brightness;
+
+    struct sysfs_attrs attrs;
 };
 
 static void
@@ -71,84 +70,64 @@ content(struct module *mod)
     return exposable;
 }
 
-static const char *
-readline_from_fd(int fd)
-{
-    static char buf[4096];
-
-    ssize_t sz = read(fd, buf, sizeof(buf) - 1);
-    lseek(fd, 0, SEEK_SET);
+enum {
+    ATTR_BRIGHTNESS,
+    ATTR_MAX_BRIGHTNESS,
+    ATTR_COUNT,
+};
 
-    if (sz < 0) {
-        LOG_WARN("failed to read from FD=%d", fd);
-        return NULL;
-    }
+static const char *const attr_names[ATTR_COUNT] = {
+    [ATTR_BRIGHTNESS] = "brightness",
+    [ATTR_MAX_BRIGHTNESS] = "max_brightness",
+};
 
-    buf[sz] = '\0';
-    for (ssize_t i = sz - 1; i >= 0 && buf[i] == '\n'; sz--)
-        buf[i] = '\0';
+static bool
+update_brightness(struct module *mod, bool update_max)
+{
+    struct private *m = mod->private;
+    struct sysfs_attrs *attrs = &m->attrs;
 
-    return buf;
-}
+    long current, max = m->max_brightness;
 
-static long
-readint_from_fd(int fd)
-{
-    const char *s = readline_from_fd(fd);
-    if (s == NULL)
-        return 0;
-
-    long ret;
-    int r = sscanf(s, "%ld", &ret);
-    if (r != 1) {
-        LOG_WARN("failed to convert \"%s\" to an integer", s);
-        return 0;
+    if (!sysfs_attr_read_int(attrs, ATTR_BRIGHTNESS, &current) ||
+        (update_max && !sysfs_attr_read_int(attrs, ATTR_MAX_BRIGHTNESS, &max)))
+    {
+        return false;
     }
 
-    return ret;
+    mtx_lock(&mod->lock);
+    m->current_brightness = current;
+    m->max_brightness = max;
+    mtx_unlock(&mod->lock);
+    return true;
 }
 
-static int
-initialize(struct private *m)
+static bool
+initialize(struct module *mod)
 {
-    int backlight_fd = open("/sys/class/backlight", O_RDONLY);
-    if (backlight_fd == -1) {
-        LOG_ERRNO("/sys/class/backlight");
-        return -1;
-    }
-
-    int base_dir_fd = openat(backlight_fd, m->device, O_RDONLY);
-    close(backlight_fd);
-
-    if (base_dir_fd == -1) {
-        LOG_ERRNO("/sys/class/backlight/%s", m->device);
-        return -1;
-    }
+    struct private *m = mod->private;
+    struct sysfs_attrs *attrs = &m->attrs;
 
-    int max_fd = openat(base_dir_fd, "max_brightness", O_RDONLY);
-    if (max_fd == -1) {
-        LOG_ERRNO("/sys/class/backlight/%s/max_brightness", m->device);
-        close(base_dir_fd);
-        return -1;
+    if (!sysfs_attrs_init(attrs, "/sys/class/backlight", m->device,
+                          ATTR_COUNT, attr_names))
+    {
+        return false;
     }
 
-    m->max_brightness = readint_from_fd(max_fd);
-    close(max_fd);
-
-    int current_fd = openat(base_dir_fd, "brightness", O_RDONLY);
-    close(base_dir_fd);
-
-    if (current_fd == -1) {
-        LOG_ERRNO("/sys/class/backlight/%s/brightness", m->device);
-        return -1;
+    for (size_t i = 0; i < ATTR_COUNT; i++) {
+        if (!sysfs_attr_present(attrs, i)) {
+            LOG_ERR("%s/%s: not available", attrs->path, attrs->names[i]);
+            return false;
+        }
     }
 
-    m->current_brightness = readint_from_fd(current_fd);
+    if (!update_brightness(mod, true))
+        return false;
 
     LOG_INFO("%s: brightness: %ld (max: %ld)", m->device, m->current_brightness,
              m->max_brightness);
 
-    return current_fd;
+    return true;
 }
 
 static int
@@ -157,33 +136,26 @@ run(struct module *mod)
     const struct bar *bar = mod->bar;
     struct private *m = mod->private;
 
-    int current_fd = initialize(m);
-    if (current_fd == -1)
+    if (!initialize(mod)) {
+        sysfs_attrs_destroy(&m->attrs);
         return 1;
+    }
 
-    struct udev *udev = udev_new();
-    struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
-
-    if (udev == NULL || mon == NULL) {
-        LOG_ERR("failed to initialize udev monitor");
-
-        if (udev == NULL)
-            udev_unref(udev);
+    struct udev_hub_subscription *sub =
+        udev_hub_subscribe("backlight", m->device);
 
-        close(current_fd);
+    if (sub == NULL) {
+        sysfs_attrs_destroy(&m->attrs);
         return 1;
     }
 
-    udev_monitor_filter_add_match_subsystem_devtype(mon, "backlight", NULL);
-    udev_monitor_enable_receiving(mon);
-
     bar->refresh(bar);
 
     int ret = 1;
     while (true) {
         struct pollfd fds[] = {
             {.fd = mod->abort_fd, .events = POLLIN},
-            {.fd = udev_monitor_get_fd(mon), .events = POLLIN},
+            {.fd = udev_hub_fd(sub), .events = POLLIN},
         };
         if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
             if (errno == EINTR)
@@ -198,27 +170,31 @@ run(struct module *mod)
             break;
         }
 
-        struct udev_device *dev = udev_monitor_receive_device(mon);
-        if (dev == NULL)
-            continue;
+        /* Only events for our device are dispatched to us */
+        bool changed = false;
+        bool added = false;
 
-        const char *sysname = udev_device_get_sysname(dev);
-        bool is_us = sysname != NULL && strcmp(sysname, m->device) == 0;
-        udev_device_unref(dev);
+        struct udev_hub_event *event;
+        while ((event = udev_hub_next_event(sub)) != NULL) {
+            changed = true;
+            added = added ||
+                (event->action != NULL && strcmp(event->action, "add") == 0);
+            udev_hub_event_destroy(event);
+        }
 
-        if (!is_us)
+        if (!changed)
             continue;
 
-        mtx_lock(&mod->lock);
-        m->current_brightness = readint_from_fd(current_fd);
-        mtx_unlock(&mod->lock);
-        bar->refresh(bar);
-    }
+        /* Device (re-)added; the old attributes are stale */
+        if (added)
+            sysfs_attrs_reopen(&m->attrs);
 
-    udev_monitor_unref(mon);
-    udev_unref(udev);
+        if (update_brightness(mod, added))
+            bar->refresh(bar);
+    }
 
-    close(current_fd);
+    udev_hub_unsubscribe(sub);
+    sysfs_attrs_destroy(&m->attrs);
     return ret;
 }
 
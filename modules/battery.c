@@ -8,11 +8,6 @@
 
 #include <poll.h>
 
-#include <sys/stat.h>
-#include <fcntl.h>
-
-#include <libudev.h>
-
 #define LOG_MODULE "battery"
 #define LOG_ENABLE_DBG 1
 #include "../log.h"
@@ -20,6 +15,8 @@
 #include "../config.h"
 #include "../config-verify.h"
 #include "../plugin.h"
+#include "sysfs.h"
+#include "udev-hub.h"
 
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
@@ -40,6 +37,8 @@ struct private {
     long charge_full_design;
     long charge_full;
 
+    struct sysfs_attrs attrs;
+
     enum state state;
     long capacity;
     long energy;
@@ -174,219 +173,142 @@ content(struct module *mod)
     return exposable;
 }
 
-static const char *
-readline_from_fd(int fd, size_t sz, char buf[static sz])
-{
-    ssize_t bytes = read(fd, buf, sz - 1);
-    lseek(fd, 0, SEEK_SET);
+/* Read once, at startup */
+enum {
+    INFO_MANUFACTURER,
+    INFO_MODEL_NAME,
+    INFO_ENERGY_FULL_DESIGN,
+    INFO_ENERGY_FULL,
+    INFO_CHARGE_FULL_DESIGN,
+    INFO_CHARGE_FULL,
+    INFO_COUNT,
+};
 
-    if (bytes < 0) {
-        LOG_WARN("failed to read from FD=%d", fd);
-        return NULL;
-    }
+static const char *const info_names[INFO_COUNT] = {
+    [INFO_MANUFACTURER] = "manufacturer",
+    [INFO_MODEL_NAME] = "model_name",
+    [INFO_ENERGY_FULL_DESIGN] = "energy_full_design",
+    [INFO_ENERGY_FULL] = "energy_full",
+    [INFO_CHARGE_FULL_DESIGN] = "charge_full_design",
+    [INFO_CHARGE_FULL] = "charge_full",
+};
 
-    buf[bytes] = '\0';
-    for (ssize_t i = bytes - 1; i >= 0 && buf[i] == '\n'; bytes--)
-        buf[i] = '\0';
+/* Kept open, and re-read on each update */
+enum {
+    ATTR_STATUS,
+    ATTR_CAPACITY,
+    ATTR_ENERGY_NOW,
+    ATTR_POWER_NOW,
+    ATTR_CHARGE_NOW,
+    ATTR_CURRENT_NOW,
+    ATTR_TIME_TO_EMPTY_NOW,
+    ATTR_TIME_TO_FULL_NOW,
+    ATTR_COUNT,
+};
 
-    return buf;
-}
+static const char *const attr_names[ATTR_COUNT] = {
+    [ATTR_STATUS] = "status",
+    [ATTR_CAPACITY] = "capacity",
+    [ATTR_ENERGY_NOW] = "energy_now",
+    [ATTR_POWER_NOW] = "power_now",
+    [ATTR_CHARGE_NOW] = "charge_now",
+    [ATTR_CURRENT_NOW] = "current_now",
+    [ATTR_TIME_TO_EMPTY_NOW] = "time_to_empty_now",
+    [ATTR_TIME_TO_FULL_NOW] = "time_to_full_now",
+};
+
+static const char *power_supply_path = "/sys/class/power_supply";
 
 static long
-readint_from_fd(int fd)
+read_optional_int(struct sysfs_attrs *attrs, size_t idx)
 {
-    char buf[512];
-    const char *s = readline_from_fd(fd, sizeof(buf), buf);
-    if (s == NULL)
-        return 0;
-
-    long ret;
-    int r = sscanf(s, "%ld", &ret);
-    if (r != 1) {
-        LOG_WARN("failed to convert \"%s\" to an integer", s);
-        return 0;
+    long value;
+    return sysfs_attr_read_int(attrs, idx, &value) ? value : -1;
+}
+
+static char *
+read_optional_string(struct sysfs_attrs *attrs, size_t idx)
+{
+    if (!sysfs_attr_present(attrs, idx)) {
+        LOG_WARN("%s/%s: not available", attrs->path, attrs->names[idx]);
+        return NULL;
     }
 
-    return ret;
+    char buf[512];
+    const char *s = sysfs_attr_read(attrs, idx, sizeof(buf), buf);
+    return s != NULL ? strdup(s) : NULL;
 }
 
 static bool
 initialize(struct private *m)
 {
-    char line_buf[512];
-
-    int pw_fd = open("/sys/class/power_supply", O_RDONLY);
-    if (pw_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply");
-        return false;
-    }
-
-    int base_dir_fd = openat(pw_fd, m->battery, O_RDONLY);
-    close(pw_fd);
-
-    if (base_dir_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply/%s", m->battery);
-        return false;
-    }
-
+    struct sysfs_attrs info;
+    if (!sysfs_attrs_init(&info, power_supply_path, m->battery,
+                          INFO_COUNT, info_names))
     {
-        int fd = openat(base_dir_fd, "manufacturer", O_RDONLY);
-        if (fd == -1) {
-            LOG_WARN("/sys/class/power_supply/%s/manufacturer: %s",
-                     m->battery, strerror(errno));
-            m->manufacturer = NULL;
-        } else {
-            m->manufacturer = strdup(readline_from_fd(fd, sizeof(line_buf), line_buf));
-            close(fd);
-        }
+        sysfs_attrs_destroy(&info);
+        return false;
     }
 
-    {
-        int fd = openat(base_dir_fd, "model_name", O_RDONLY);
-        if (fd == -1) {
-            LOG_WARN("/sys/class/power_supply/%s/model_name: %s",
-                     m->battery, strerror(errno));
-            m->model = NULL;
-        } else {
-            m->model = strdup(readline_from_fd(fd, sizeof(line_buf), line_buf));
-            close(fd);
-        }
-    }
+    m->manufacturer = read_optional_string(&info, INFO_MANUFACTURER);
+    m->model = read_optional_string(&info, INFO_MODEL_NAME);
 
-    if (faccessat(base_dir_fd, "energy_full_design", O_RDONLY, 0) == 0 &&
-        faccessat(base_dir_fd, "energy_full", O_RDONLY, 0) == 0)
+    if (sysfs_attr_present(&info, INFO_ENERGY_FULL_DESIGN) &&
+        sysfs_attr_present(&info, INFO_ENERGY_FULL))
     {
-        {
-            int fd = openat(base_dir_fd, "energy_full_design", O_RDONLY);
-            if (fd == -1) {
-                LOG_ERRNO("/sys/class/power_supply/%s/energy_full_design", m->battery);
-                goto err;
-            }
-
-            m->energy_full_design = readint_from_fd(fd);
-            close(fd);
-        }
-
-        {
-            int fd = openat(base_dir_fd, "energy_full", O_RDONLY);
-            if (fd == -1) {
-                LOG_ERRNO("/sys/class/power_supply/%s/energy_full", m->battery);
-                goto err;
-            }
-
-            m->energy_full = readint_from_fd(fd);
-            close(fd);
-        }
-    } else {
+        m->energy_full_design = read_optional_int(&info, INFO_ENERGY_FULL_DESIGN);
+        m->energy_full = read_optional_int(&info, INFO_ENERGY_FULL);
+    } else
         m->energy_full = m->energy_full_design = -1;
-    }
 
-    if (faccessat(base_dir_fd, "charge_full_design", O_RDONLY, 0) == 0 &&
-        faccessat(base_dir_fd, "charge_full", O_RDONLY, 0) == 0)
+    if (sysfs_attr_present(&info, INFO_CHARGE_FULL_DESIGN) &&
+        sysfs_attr_present(&info, INFO_CHARGE_FULL))
     {
-        {
-            int fd = openat(base_dir_fd, "charge_full_design", O_RDONLY);
-            if (fd == -1) {
-                LOG_ERRNO("/sys/class/power_supply/%s/charge_full_design", m->battery);
-                goto err;
-            }
-
-            m->charge_full_design = readint_from_fd(fd);
-            close(fd);
-        }
-
-        {
-            int fd = openat(base_dir_fd, "charge_full", O_RDONLY);
-            if (fd == -1) {
-                LOG_ERRNO("/sys/class/power_supply/%s/charge_full", m->battery);
-                goto err;
-            }
-
-            m->charge_full = readint_from_fd(fd);
-            close(fd);
-        }
-    } else {
+        m->charge_full_design = read_optional_int(&info, INFO_CHARGE_FULL_DESIGN);
+        m->charge_full = read_optional_int(&info, INFO_CHARGE_FULL);
+    } else
         m->charge_full = m->charge_full_design = -1;
-    }
 
-    close(base_dir_fd);
-    return true;
+    sysfs_attrs_destroy(&info);
 
-err:
-    close(base_dir_fd);
-    return false;
+    return sysfs_attrs_init(
+        &m->attrs, power_supply_path, m->battery, ATTR_COUNT, attr_names);
 }
 
 static bool
 update_status(struct module *mod)
 {
     struct private *m = mod->private;
+    struct sysfs_attrs *attrs = &m->attrs;
 
-    int pw_fd = open("/sys/class/power_supply", O_RDONLY);
-    if (pw_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply");
-        return false;
-    }
-
-    int base_dir_fd = openat(pw_fd, m->battery, O_RDONLY);
-    close(pw_fd);
-
-    if (base_dir_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply/%s", m->battery);
-        return false;
-    }
+    if (!sysfs_attr_present(attrs, ATTR_STATUS) ||
+        !sysfs_attr_present(attrs, ATTR_CAPACITY))
+    {
+        /* E.g. the battery wasn't present when the attributes were opened */
+        if (!sysfs_attrs_reopen(attrs))
+            return false;
 
-    int status_fd = openat(base_dir_fd, "status", O_RDONLY);
-    if (status_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply/%s/status", m->battery);
-        close(base_dir_fd);
-        return false;
+        if (!sysfs_attr_present(attrs, ATTR_STATUS) ||
+            !sysfs_attr_present(attrs, ATTR_CAPACITY))
+        {
+            LOG_ERR("%s: status and/or capacity not available", attrs->path);
+            return false;
+        }
     }
 
-    int capacity_fd = openat(base_dir_fd, "capacity", O_RDONLY);
-    if (capacity_fd < 0) {
-        LOG_ERRNO("/sys/class/power_supply/%s/capacity", m->battery);
-        close(status_fd);
-        close(base_dir_fd);
-        return false;
-    }
+    long capacity;
+    if (!sysfs_attr_read_int(attrs, ATTR_CAPACITY, &capacity))
+        capacity = 0;
 
-    int energy_fd = openat(base_dir_fd, "energy_now", O_RDONLY);
-    int power_fd = openat(base_dir_fd, "power_now", O_RDONLY);
-    int charge_fd = openat(base_dir_fd, "charge_now", O_RDONLY);
-    int current_fd = openat(base_dir_fd, "current_now", O_RDONLY);
-    int time_to_empty_fd = openat(base_dir_fd, "time_to_empty_now", O_RDONLY);
-    int time_to_full_fd = openat(base_dir_fd, "time_to_full_now", O_RDONLY);
-
-    long capacity = readint_from_fd(capacity_fd);
-    long energy = energy_fd >= 0 ? readint_from_fd(energy_fd) : -1;
-    long power = power_fd >= 0 ? readint_from_fd(power_fd) : -1;
-    long charge = charge_fd >= 0 ? readint_from_fd(charge_fd) : -1;
-    long current = current_fd >= 0 ? readint_from_fd(current_fd) : -1;
-    long time_to_empty = time_to_empty_fd >= 0 ? readint_from_fd(time_to_empty_fd) : -1;
-    long time_to_full = time_to_full_fd >= 0 ? readint_from_fd(time_to_full_fd) : -1;
+    long energy = read_optional_int(attrs, ATTR_ENERGY_NOW);
+    long power = read_optional_int(attrs, ATTR_POWER_NOW);
+    long charge = read_optional_int(attrs, ATTR_CHARGE_NOW);
+    long current = read_optional_int(attrs, ATTR_CURRENT_NOW);
+    long time_to_empty = read_optional_int(attrs, ATTR_TIME_TO_EMPTY_NOW);
+    long time_to_full = read_optional_int(attrs, ATTR_TIME_TO_FULL_NOW);
 
     char buf[512];
-    const char *status = readline_from_fd(status_fd, sizeof(buf), buf);
-
-    if (status_fd >= 0)
-        close(status_fd);
-    if (capacity_fd >= 0)
-        close(capacity_fd);
-    if (energy_fd >= 0)
-        close(energy_fd);
-    if (power_fd >= 0)
-        close(power_fd);
-    if (charge_fd >= 0)
-        close(charge_fd);
-    if (current_fd >= 0)
-        close(current_fd);
-    if (time_to_empty_fd >= 0)
-        close(time_to_empty_fd);
-    if (time_to_full_fd >= 0)
-        close(time_to_full_fd);
-    if (base_dir_fd >= 0)
-        close(base_dir_fd);
+    const char *status = sysfs_attr_read(attrs, ATTR_STATUS, sizeof(buf), buf);
 
     enum state state;
 
@@ -431,8 +353,10 @@ run(struct module *mod)
     const struct bar *bar = mod->bar;
     struct private *m = mod->private;
 
-    if (!initialize(m))
+    if (!initialize(m)) {
+        sysfs_attrs_destroy(&m->attrs);
         return -1;
+    }
 
     LOG_INFO("%s: %s %s (at %.1f%% of original capacity)",
              m->battery, m->manufacturer, m->model,
@@ -444,15 +368,12 @@ run(struct module *mod)
 
     int ret = 1;
 
-    struct udev *udev = udev_new();
-    struct udev_monitor *mon = udev_monitor_new_from_netlink(udev, "udev");
+    struct udev_hub_subscription *sub =
+        udev_hub_subscribe("power_supply", m->battery);
 
-    if (udev == NULL || mon == NULL)
+    if (sub == NULL)
         goto out;
 
-    udev_monitor_filter_add_match_subsystem_devtype(mon, "power_supply", NULL);
-    udev_monitor_enable_receiving(mon);
-
     if (!update_status(mod))
         goto out;
 
@@ -463,7 +384,7 @@ run(struct module *mod)
     while (true) {
         struct pollfd fds[] = {
             {.fd = mod->abort_fd, .events = POLLIN},
-            {.fd = udev_monitor_get_fd(mon), .events = POLLIN},
+            {.fd = udev_hub_fd(sub), .events = POLLIN},
         };
 
         int timeout = m->poll_interval > 0 ? timeout_left_ms : -1;
@@ -492,20 +413,19 @@ run(struct module *mod)
         bool udev_for_us = false;
 
         if (fds[1].revents & POLLIN) {
-            struct udev_device *dev = udev_monitor_receive_device(mon);
-            if (dev != NULL) {
-                const char *sysname = udev_device_get_sysname(dev);
-                udev_for_us =
-                    sysname != NULL && strcmp(sysname, m->battery) == 0;
-
-                if (!udev_for_us) {
-                    LOG_DBG("udev notification not for us (%s != %s)",
-                            m->battery, sysname != sysname ? sysname : "NULL");
-                } else
-                    LOG_DBG("triggering update due to udev notification");
-
-                udev_device_unref(dev);
+            /* Only events for our battery are dispatched to us */
+            struct udev_hub_event *event;
+            while ((event = udev_hub_next_event(sub)) != NULL) {
+                /* Battery (re-)inserted; the old attributes are stale */
+                if (event->action != NULL && strcmp(event->action, "add") == 0)
+                    sysfs_attrs_reopen(&m->attrs);
+
+                udev_for_us = true;
+                udev_hub_event_destroy(event);
             }
+
+            if (udev_for_us)
+                LOG_DBG("triggering update due to udev notification");
         }
 
         if (udev_for_us || poll_ret == 0) {
@@ -540,10 +460,8 @@ run(struct module *mod)
     }
 
 out:
-    if (mon != NULL)
-        udev_monitor_unref(mon);
-    if (udev != NULL)
-        udev_unref(udev);
+    udev_hub_unsubscribe(sub);
+    sysfs_attrs_destroy(&m->attrs);
     return ret;
 }
 
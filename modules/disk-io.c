@@ -1,9 +1,11 @@
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <string.h>
 #include <dirent.h>
+#include <time.h>
 
 #include <tllist.h>
 
@@ -16,18 +18,23 @@
 #include "../config.h"
 #include "../particles/dynlist.h"
 #include "../plugin.h"
+#include "rate.h"
 
 static const long min_poll_interval = 250;
 
+/*
+ * /proc/diskstats counters are unsigned longs in the kernel, i.e. they
+ * wrap at 32 bits on 32-bit platforms
+ */
+static const int counter_bits = sizeof(unsigned long) * CHAR_BIT;
+
 struct device_stats {
     char *name;
     bool is_disk;
 
-    uint64_t prev_sectors_read;
-    uint64_t cur_sectors_read;
-
-    uint64_t prev_sectors_written;
-    uint64_t cur_sectors_written;
+    /* Read/write speed, in bytes/s */
+    struct rate read;
+    struct rate written;
 
     uint32_t ios_in_progress;
 
@@ -37,6 +44,8 @@ struct device_stats {
 struct private {
     struct particle *label;
     uint16_t interval;
+    enum rate_smoothing smoothing;
+    int smoothing_samples;
     tll(struct device_stats *) devices;
 };
 
@@ -64,11 +73,13 @@ is_disk(char const *name)
 }
 
 static struct device_stats*
-new_device_stats(char const *name)
+new_device_stats(const struct private *m, char const *name)
 {
     struct device_stats *dev = malloc(sizeof(*dev));
     dev->name = strdup(name);
     dev->is_disk = is_disk(name);
+    rate_init(&dev->read, m->smoothing, m->smoothing_samples);
+    rate_init(&dev->written, m->smoothing, m->smoothing_samples);
     return dev;
 }
 
@@ -112,6 +123,10 @@ refresh_device_stats(struct private *m)
         return;
     }
 
+    /* All devices are sampled at (roughly) the same time */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
     /*
      * Devices may be added or removed during the bar's lifetime, as external
      * block devices are connected or disconnected from the machine. /proc/diskstats
@@ -175,11 +190,9 @@ refresh_device_stats(struct private *m)
         tll_foreach(m->devices, it) {
             struct device_stats *dev = it->item;
             if (strcmp(dev->name, device_name) == 0){
-                dev->prev_sectors_read = dev->cur_sectors_read;
-                dev->prev_sectors_written = dev->cur_sectors_written;
                 dev->ios_in_progress = ios_in_progress;
-                dev->cur_sectors_read = sectors_read;
-                dev->cur_sectors_written = sectors_written;
+                rate_update(&dev->read, sectors_read, counter_bits, 512, &now);
+                rate_update(&dev->written, sectors_written, counter_bits, 512, &now);
                 dev->exists = true;
                 found = true;
                 break;
@@ -187,12 +200,10 @@ refresh_device_stats(struct private *m)
         }
 
         if (!found) {
-            struct device_stats *new_dev = new_device_stats(device_name);
+            struct device_stats *new_dev = new_device_stats(m, device_name);
             new_dev->ios_in_progress = ios_in_progress;
-            new_dev->prev_sectors_read = sectors_read;
-            new_dev->cur_sectors_read = sectors_read;
-            new_dev->prev_sectors_written = sectors_written;
-            new_dev->cur_sectors_written = sectors_written;
+            rate_update(&new_dev->read, sectors_read, counter_bits, 512, &now);
+            rate_update(&new_dev->written, sectors_written, counter_bits, 512, &now);
             new_dev->exists = true;
             tll_push_back(m->devices, new_dev);
         }
@@ -215,20 +226,22 @@ static struct exposable *
 content(struct module *mod)
 {
     const struct private *p = mod->private;
-    uint64_t total_bytes_read = 0;
-    uint64_t total_bytes_written = 0;
+    double total_read_speed = 0;
+    double total_write_speed = 0;
+    double total_read_speed_avg = 0;
+    double total_write_speed_avg = 0;
     uint32_t total_ios_in_progress = 0;
     mtx_lock(&mod->lock);
     struct exposable *tag_parts[p->devices.length + 1];
     int i = 0;
     tll_foreach(p->devices, it) {
         struct device_stats *dev = it->item;
-        uint64_t bytes_read = (dev->cur_sectors_read - dev->prev_sectors_read) * 512;
-        uint64_t bytes_written = (dev->cur_sectors_written - dev->prev_sectors_written) * 512;
 
         if (dev->is_disk){
-            total_bytes_read += bytes_read;
-            total_bytes_written += bytes_written;
+            total_read_speed += dev->read.rate;
+            total_write_speed += dev->written.rate;
+            total_read_speed_avg += dev->read.smoothed;
+            total_write_speed_avg += dev->written.smoothed;
             total_ios_in_progress += dev->ios_in_progress;
         }
 
@@ -236,11 +249,13 @@ content(struct module *mod)
             .tags = (struct tag *[]) {
                 tag_new_string(mod, "device", dev->name),
                 tag_new_bool(mod, "is_disk", dev->is_disk),
-                tag_new_int(mod, "read_speed", (bytes_read * 1000) / p->interval),
-                tag_new_int(mod, "write_speed", (bytes_written * 1000) / p->interval),
+                tag_new_int(mod, "read_speed", dev->read.rate),
+                tag_new_int(mod, "write_speed", dev->written.rate),
+                tag_new_int(mod, "read_speed_avg", dev->read.smoothed),
+                tag_new_int(mod, "write_speed_avg", dev->written.smoothed),
                 tag_new_int(mod, "ios_in_progress", dev->ios_in_progress),
             },
-            .count = 5,
+            .count = 7,
         };
         tag_parts[i++] = p->label->instantiate(p->label, &tags);
         tag_set_destroy(&tags);
@@ -249,11 +264,13 @@ content(struct module *mod)
         .tags = (struct tag *[]) {
             tag_new_string(mod, "device", "Total"),
             tag_new_bool(mod, "is_disk", true),
-            tag_new_int(mod, "read_speed", (total_bytes_read * 1000) / p->interval),
-            tag_new_int(mod, "write_speed", (total_bytes_written * 1000) / p->interval),
+            tag_new_int(mod, "read_speed", total_read_speed),
+            tag_new_int(mod, "write_speed", total_write_speed),
+            tag_new_int(mod, "read_speed_avg", total_read_speed_avg),
+            tag_new_int(mod, "write_speed_avg", total_write_speed_avg),
             tag_new_int(mod, "ios_in_progress", total_ios_in_progress),
         },
-        .count = 5,
+        .count = 7,
     };
     tag_parts[i] = p->label->instantiate(p->label, &tags);
     tag_set_destroy(&tags);
@@ -293,11 +310,14 @@ run(struct module *mod)
 }
 
 static struct module *
-disk_io_new(uint16_t interval, struct particle *label)
+disk_io_new(uint16_t interval, enum rate_smoothing smoothing,
+            int smoothing_samples, struct particle *label)
 {
     struct private *p = calloc(1, sizeof(*p));
     p->label = label;
     p->interval = interval;
+    p->smoothing = smoothing;
+    p->smoothing_samples = smoothing_samples;
 
     struct module *mod = module_common_new();
     mod->private = p;
@@ -312,10 +332,13 @@ static struct module *
 from_conf(const struct yml_node *node, struct conf_inherit inherited)
 {
     const struct yml_node *interval = yml_get_value(node, "poll-interval");
+    const struct yml_node *smoothing = yml_get_value(node, "smoothing");
+    const struct yml_node *samples = yml_get_value(node, "smoothing-samples");
     const struct yml_node *c = yml_get_value(node, "content");
 
     return disk_io_new(
             interval == NULL ? min_poll_interval : yml_value_as_int(interval),
+            rate_conf_to_smoothing(smoothing), rate_conf_to_samples(samples),
             conf_to_particle(c, inherited));
 }
 
@@ -340,6 +363,7 @@ verify_conf(keychain_t *chain, const struct yml_node *node)
 {
     static const struct attr_info attrs[] = {
         {"poll-interval", false, &conf_verify_poll_interval},
+        RATE_COMMON_ATTRS,
         MODULE_COMMON_ATTRS,
     };
 
@@ -9,7 +9,6 @@
 
 #if defined(ENABLE_X11)
  #include <xcb/xcb.h>
- #include <xcb/xcb_aux.h>
 #endif
 
 #include <json-c/json_tokener.h>
@@ -20,6 +19,7 @@
 
 #if defined(ENABLE_X11)
  #include "../xcb.h"
+ #include "x11-hub.h"
 #endif
 
 #include "i3-ipc.h"
@@ -28,18 +28,20 @@
 static bool
 get_socket_address_x11(struct sockaddr_un *addr)
 {
-    int default_screen;
-    xcb_connection_t *conn = xcb_connect(NULL, &default_screen);
-    if (xcb_connection_has_error(conn) > 0) {
-        LOG_ERR("failed to connect to X");
-        xcb_disconnect(conn);
+    struct x11_hub *hub = x11_hub_get();
+    if (hub == NULL)
         return false;
-    }
 
-    xcb_screen_t *screen = xcb_aux_get_screen(conn, default_screen);
+    xcb_connection_t *conn = x11_hub_connection(hub);
+    xcb_screen_t *screen = x11_hub_screen(hub);
 
-    xcb_atom_t atom = get_atom(conn, "I3_SOCKET_PATH");
-    assert(atom != XCB_ATOM_NONE);
+    xcb_atom_t atom;
+    if (!x11_hub_intern_atoms(
+            hub, 1, (const char *const []){"I3_SOCKET_PATH"}, &atom))
+    {
+        x11_hub_put(hub);
+        return false;
+    }
 
     xcb_get_property_cookie_t cookie
         = xcb_get_property_unchecked(
@@ -72,7 +74,7 @@ get_socket_address_x11(struct sockaddr_un *addr)
 err:
     free(err);
     free(reply);
-    xcb_disconnect(conn);
+    x11_hub_put(hub);
     return ret;
 }
 #endif
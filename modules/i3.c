@@ -1078,6 +1078,8 @@ verify_conf(keychain_t *chain, const struct yml_node *node)
         {"strip-workspace-numbers", false, &conf_verify_bool},
         {"content", true, &verify_content},
         {"anchors", false, NULL},
+        {"max-refresh-rate", false, &conf_verify_unsigned},
+        {"debounce", false, &conf_verify_unsigned},
         {NULL, false, NULL},
     };
 
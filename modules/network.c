@@ -26,11 +26,13 @@
 #define LOG_MODULE "network"
 #define LOG_ENABLE_DBG 0
 #include "../log.h"
+#include "../trace.h"
 #include "../bar/bar.h"
 #include "../config.h"
 #include "../config-verify.h"
 #include "../module.h"
 #include "../plugin.h"
+#include "rate.h"
 
 #define UNUSED __attribute__((unused))
 
@@ -81,11 +83,9 @@ struct private {
     uint32_t rx_bitrate;
     uint32_t tx_bitrate;
 
-    double ul_speed;
-    uint64_t ul_bits;
-
-    double dl_speed;
-    uint64_t dl_bits;
+    /* Upload/download speed, in bits/s */
+    struct rate ul;
+    struct rate dl;
 };
 
 static void
@@ -167,10 +167,12 @@ content(struct module *mod)
             tag_new_int(mod, "signal", m->signal_strength_dbm),
             tag_new_int(mod, "rx-bitrate", m->rx_bitrate),
             tag_new_int(mod, "tx-bitrate", m->tx_bitrate),
-            tag_new_float(mod, "dl-speed", m->dl_speed),
-            tag_new_float(mod, "ul-speed", m->ul_speed),
+            tag_new_float(mod, "dl-speed", m->dl.rate),
+            tag_new_float(mod, "ul-speed", m->ul.rate),
+            tag_new_float(mod, "dl-speed-avg", m->dl.smoothed),
+            tag_new_float(mod, "ul-speed-avg", m->ul.smoothed),
         },
-        .count = 13,
+        .count = 15,
     };
 
     mtx_unlock(&mod->lock);
@@ -1123,18 +1125,13 @@ static void
 handle_stats(struct module *mod, struct rt_stats_msg *msg)
 {
     struct private *m = mod->private;
-    uint64_t ul_bits = msg->stats.tx_bytes * 8;
-    uint64_t dl_bits = msg->stats.rx_bytes * 8;
-
-    const double poll_interval_secs = (double)m->poll_interval / 1000.;
 
-    if (m->ul_bits != 0)
-        m->ul_speed = (double)(ul_bits - m->ul_bits) / poll_interval_secs;
-    if (m->dl_bits != 0)
-        m->dl_speed = (double)(dl_bits - m->dl_bits) / poll_interval_secs;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    m->ul_bits = ul_bits;
-    m->dl_bits = dl_bits;
+    /* rtnl_link_stats64 counters are in bytes; rates are in bits/s */
+    rate_update(&m->ul, msg->stats.tx_bytes, 64, 8, &now);
+    rate_update(&m->dl, msg->stats.rx_bytes, 64, 8, &now);
 }
 
 static bool
@@ -1392,6 +1389,9 @@ run(struct module *mod)
             break;
         }
 
+        if ((fds[1].revents | fds[2].revents) & POLLIN)
+            trace_instant("wakeup", "netlink");
+
         if (fds[1].revents & POLLIN) {
             /* Read one (or more) messages */
             void *reply;
@@ -1450,7 +1450,8 @@ run(struct module *mod)
 }
 
 static struct module *
-network_new(const char *iface, struct particle *label, int poll_interval)
+network_new(const char *iface, struct particle *label, int poll_interval,
+            enum rate_smoothing smoothing, int smoothing_samples)
 {
     int urandom_fd = open("/dev/urandom", O_RDONLY);
     if (urandom_fd < 0) {
@@ -1462,6 +1463,8 @@ network_new(const char *iface, struct particle *label, int poll_interval)
     priv->iface = strdup(iface);
     priv->label = label;
     priv->poll_interval = poll_interval;
+    rate_init(&priv->ul, smoothing, smoothing_samples);
+    rate_init(&priv->dl, smoothing, smoothing_samples);
 
     priv->genl_sock = -1;
     priv->rt_sock = -1;
@@ -1486,10 +1489,13 @@ from_conf(const struct yml_node *node, struct conf_inherit inherited)
     const struct yml_node *name = yml_get_value(node, "name");
     const struct yml_node *content = yml_get_value(node, "content");
     const struct yml_node *poll = yml_get_value(node, "poll-interval");
+    const struct yml_node *smoothing = yml_get_value(node, "smoothing");
+    const struct yml_node *samples = yml_get_value(node, "smoothing-samples");
 
     return network_new(
         yml_value_as_string(name), conf_to_particle(content, inherited),
-        poll != NULL ? yml_value_as_int(poll) : 0);
+        poll != NULL ? yml_value_as_int(poll) : 0,
+        rate_conf_to_smoothing(smoothing), rate_conf_to_samples(samples));
 }
 
 static bool
@@ -1514,6 +1520,7 @@ verify_conf(keychain_t *chain, const struct yml_node *node)
     static const struct attr_info attrs[] = {
         {"name", true, &conf_verify_string},
         {"poll-interval", false, &conf_verify_poll_interval},
+        RATE_COMMON_ATTRS,
         MODULE_COMMON_ATTRS,
     };
 
@@ -0,0 +1,182 @@
+#include "rate.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#define LOG_MODULE "rate"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+
+/* Samples closer than this (in seconds) are ignored */
+static const double min_elapsed = 0.001;
+
+static const int default_samples = 5;
+
+static void
+reset(struct rate *rate)
+{
+    rate->have_sample = false;
+    rate->rate = 0.;
+    rate->smoothed = 0.;
+    rate->window.idx = 0;
+    rate->window.count = 0;
+}
+
+void
+rate_init(struct rate *rate, enum rate_smoothing smoothing, int samples)
+{
+    assert(samples >= 1 && samples <= RATE_WINDOW_MAX);
+
+    memset(rate, 0, sizeof(*rate));
+    rate->smoothing = smoothing;
+    rate->samples = samples;
+    reset(rate);
+}
+
+static double
+timespec_diff_secs(const struct timespec *a, const struct timespec *b)
+{
+    return (double)(a->tv_sec - b->tv_sec) +
+        (double)(a->tv_nsec - b->tv_nsec) / 1000000000.;
+}
+
+static void
+update_smoothed(struct rate *rate, uint64_t delta, double elapsed)
+{
+    switch (rate->smoothing) {
+    case RATE_SMOOTHING_NONE:
+        rate->smoothed = rate->rate;
+        break;
+
+    case RATE_SMOOTHING_EWMA: {
+        /* Same weighting as an N-period exponential moving average */
+        const double alpha = 2. / (rate->samples + 1);
+
+        if (rate->window.count == 0) {
+            rate->smoothed = rate->rate;
+            rate->window.count = 1;
+        } else
+            rate->smoothed += alpha * (rate->rate - rate->smoothed);
+        break;
+    }
+
+    case RATE_SMOOTHING_WINDOW: {
+        /*
+         * Time weighted average over the last N samples; i.e. total
+         * delta over total elapsed time. Unlike averaging the rates,
+         * this doesn't over-weigh short (or delayed) intervals.
+         */
+        rate->window.delta[rate->window.idx] = delta;
+        rate->window.elapsed[rate->window.idx] = elapsed;
+        rate->window.idx = (rate->window.idx + 1) % rate->samples;
+        if (rate->window.count < rate->samples)
+            rate->window.count++;
+
+        uint64_t total_delta = 0;
+        double total_elapsed = 0.;
+        for (int i = 0; i < rate->window.count; i++) {
+            total_delta += rate->window.delta[i];
+            total_elapsed += rate->window.elapsed[i];
+        }
+
+        rate->smoothed = (double)total_delta / total_elapsed;
+        break;
+    }
+    }
+}
+
+void
+rate_update(struct rate *rate, uint64_t value, int bits, uint64_t scale,
+            const struct timespec *now)
+{
+    assert(bits == 32 || bits == 64);
+    assert(bits == 64 || value <= UINT32_MAX);
+
+    if (!rate->have_sample) {
+        rate->have_sample = true;
+        rate->last_value = value;
+        rate->last_time = *now;
+        return;
+    }
+
+    const double elapsed = timespec_diff_secs(now, &rate->last_time);
+    if (elapsed < min_elapsed) {
+        /* Wait for the next sample, rather than dividing by ~zero */
+        return;
+    }
+
+    uint64_t delta;
+    if (value >= rate->last_value)
+        delta = value - rate->last_value;
+
+    else if (bits == 32 && rate->last_value > UINT32_MAX / 2) {
+        /* Most likely a 32-bit counter that wrapped around */
+        delta = (UINT32_MAX - rate->last_value) + value + 1;
+        LOG_DBG("32-bit counter wrap: %" PRIu64 " -> %" PRIu64,
+                rate->last_value, value);
+    }
+
+    else {
+        /* Counter was reset; start over */
+        LOG_DBG("counter reset: %" PRIu64 " -> %" PRIu64,
+                rate->last_value, value);
+        reset(rate);
+        rate->have_sample = true;
+        rate->last_value = value;
+        rate->last_time = *now;
+        return;
+    }
+
+    delta *= scale;
+
+    rate->rate = (double)delta / elapsed;
+    update_smoothed(rate, delta, elapsed);
+
+    rate->last_value = value;
+    rate->last_time = *now;
+}
+
+bool
+rate_conf_verify_smoothing(keychain_t *chain, const struct yml_node *node)
+{
+    return conf_verify_enum(
+        chain, node, (const char *[]){"none", "ewma", "window"}, 3);
+}
+
+bool
+rate_conf_verify_samples(keychain_t *chain, const struct yml_node *node)
+{
+    if (!conf_verify_unsigned(chain, node))
+        return false;
+
+    const int samples = yml_value_as_int(node);
+    if (samples < 1 || samples > RATE_WINDOW_MAX) {
+        LOG_ERR("%s: smoothing-samples must be in the range 1-%d",
+                conf_err_prefix(chain, node), RATE_WINDOW_MAX);
+        return false;
+    }
+
+    return true;
+}
+
+enum rate_smoothing
+rate_conf_to_smoothing(const struct yml_node *node)
+{
+    if (node == NULL)
+        return RATE_SMOOTHING_NONE;
+
+    const char *v = yml_value_as_string(node);
+    if (strcmp(v, "ewma") == 0)
+        return RATE_SMOOTHING_EWMA;
+    else if (strcmp(v, "window") == 0)
+        return RATE_SMOOTHING_WINDOW;
+    else
+        return RATE_SMOOTHING_NONE;
+}
+
+int
+rate_conf_to_samples(const struct yml_node *node)
+{
+    return node != NULL ? yml_value_as_int(node) : default_samples;
+}
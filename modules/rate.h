@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../config-verify.h"
+#include "../yml.h"
+
+/*
+ * Rate estimator for monotonically increasing counters (bytes
+ * transferred, sectors read etc).
+ *
+ * Each sample is timestamped (CLOCK_MONOTONIC), and the rate is
+ * calculated from the actual time elapsed since the previous sample,
+ * rather than from the configured poll interval. This keeps the rate
+ * accurate even when the module thread is delayed.
+ *
+ * Counters are passed raw, together with their width (32 or 64
+ * bits) and a scale factor (e.g. 512 for sector counts), which is
+ * applied to the delta. Wrap-arounds are only considered for 32-bit
+ * counters; any other decrease is taken as a counter reset
+ * (e.g. interface re-created), which re-baselines the estimator
+ * instead of producing a bogus rate.
+ *
+ * Optionally, a smoothed rate is maintained as well, either as an
+ * exponentially weighted moving average, or as a time-weighted
+ * average over the last N samples.
+ */
+
+#define RATE_WINDOW_MAX 16
+
+enum rate_smoothing {
+    RATE_SMOOTHING_NONE,
+    RATE_SMOOTHING_EWMA,
+    RATE_SMOOTHING_WINDOW,
+};
+
+struct rate {
+    enum rate_smoothing smoothing;
+    int samples;
+
+    bool have_sample;
+    uint64_t last_value;
+    struct timespec last_time;
+
+    double rate;        /* Instantaneous rate, in units/s */
+    double smoothed;    /* Smoothed rate, in units/s */
+
+    /* Ring buffer of (delta, elapsed) pairs, for windowed averages */
+    struct {
+        uint64_t delta[RATE_WINDOW_MAX];
+        double elapsed[RATE_WINDOW_MAX];
+        int idx;
+        int count;
+    } window;
+};
+
+void rate_init(struct rate *rate, enum rate_smoothing smoothing, int samples);
+void rate_update(struct rate *rate, uint64_t value, int bits, uint64_t scale,
+                 const struct timespec *now);
+
+/* Configuration helpers, for modules exposing the smoothing options */
+#define RATE_COMMON_ATTRS                                  \
+    {"smoothing", false, &rate_conf_verify_smoothing},     \
+    {"smoothing-samples", false, &rate_conf_verify_samples}
+
+bool rate_conf_verify_smoothing(keychain_t *chain, const struct yml_node *node);
+bool rate_conf_verify_samples(keychain_t *chain, const struct yml_node *node);
+
+enum rate_smoothing rate_conf_to_smoothing(const struct yml_node *node);
+int rate_conf_to_samples(const struct yml_node *node);
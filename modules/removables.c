@@ -23,11 +23,20 @@
 #include "../config-verify.h"
 #include "../particles/dynlist.h"
 #include "../plugin.h"
+#include "udev-hub.h"
 
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
 typedef tll(char *) mount_point_list_t;
 
+/* A /proc/self/mountinfo entry, for a block device */
+struct mount {
+    char *dev_path;
+    char *mount_point;
+};
+
+typedef tll(struct mount) mount_list_t;
+
 struct partition {
     const struct block_device *block;
 
@@ -61,6 +70,10 @@ struct private {
 
     tll(char *) ignore;
     tll(struct block_device) devices;
+
+    /* Block devices' mounts, as of the last parse of mountinfo */
+    int mount_info_fd;
+    mount_list_t mounts;
 };
 
 static void
@@ -72,6 +85,13 @@ free_partition(struct partition *p)
     tll_free_and_free(p->mount_points, free);
 }
 
+static void
+free_mount(struct mount *mount)
+{
+    free(mount->dev_path);
+    free(mount->mount_point);
+}
+
 static void
 free_device(struct block_device *b)
 {
@@ -96,6 +116,10 @@ destroy(struct module *mod)
     tll_free(m->devices);
     tll_free_and_free(m->ignore, free);
 
+    tll_foreach(m->mounts, it)
+        free_mount(&it->item);
+    tll_free(m->mounts);
+
     free(m);
     module_default_destroy(mod);
 }
@@ -161,47 +185,138 @@ content(struct module *mod)
         exposables, idx, m->left_spacing, m->right_spacing);
 }
 
-static void
-find_mount_points(const char *dev_path, mount_point_list_t *mount_points)
+/* Reads all of /proc/self/mountinfo; it must be read in one go */
+static char *
+read_mount_info(int fd)
 {
-    int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
-    FILE *f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        LOG_ERRNO("failed to rewind /proc/self/mountinfo");
+        return NULL;
+    }
 
-    if (fd < 0 || f == NULL) {
-        LOG_ERRNO("failed to open /proc/self/mountinfo");
-        if (fd >= 0)
-            close(fd);
-        return;
+    size_t size = 16384;
+    size_t len = 0;
+    char *buf = malloc(size);
+
+    while (true) {
+        ssize_t bytes = read(fd, &buf[len], size - len - 1);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERRNO("failed to read /proc/self/mountinfo");
+            free(buf);
+            return NULL;
+        }
+
+        if (bytes == 0)
+            break;
+
+        len += bytes;
+        if (len + 1 >= size) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
     }
 
-    char line[4096];
-    while (fgets(line, sizeof(line), f) != NULL) {
-        char *dev = NULL, *path = NULL;
+    buf[len] = '\0';
+    return buf;
+}
 
-        if (sscanf(line, "%*u %*u %*u:%*u %*s %ms %*[^-] - %*s %ms %*s",
-                   &path, &dev) != 2)
+/* Un-escapes octal escapes (e.g. '\040' for space), in place */
+static char *
+unescape_octal(char *s)
+{
+    char *out = s;
+    for (const char *in = s; *in != '\0'; ) {
+        if (in[0] == '\\' &&
+            in[1] >= '0' && in[1] <= '3' &&
+            in[2] >= '0' && in[2] <= '7' &&
+            in[3] >= '0' && in[3] <= '7')
         {
+            *out++ = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+            in += 4;
+        } else
+            *out++ = *in++;
+    }
+
+    *out = '\0';
+    return s;
+}
+
+/*
+ * Parses mountinfo into a list of block device mounts. Only mounts
+ * whose source is a device node are kept; pseudo filesystems are
+ * skipped without copying anything.
+ */
+static bool
+parse_mount_info(int fd, mount_list_t *mounts)
+{
+    char *buf = read_mount_info(fd);
+    if (buf == NULL)
+        return false;
+
+    char *saveptr = NULL;
+    for (char *line = strtok_r(buf, "\n", &saveptr);
+         line != NULL;
+         line = strtok_r(NULL, "\n", &saveptr))
+    {
+        /*
+         * ID PARENT-ID MAJOR:MINOR ROOT MOUNT-POINT OPTIONS [OPTIONAL...] - FSTYPE SOURCE SUPER-OPTIONS
+         */
+        char *sep = strstr(line, " - ");
+        if (sep == NULL) {
             LOG_ERR("failed to parse /proc/self/mountinfo: %s", line);
-            free(dev);
-            free(path);
-            break;
+            continue;
         }
 
-        if (strcmp(dev, dev_path) == 0)
-            tll_push_back(*mount_points, strdup(path));
+        /* SOURCE, after the filesystem type */
+        char *source = strchr(sep + 3, ' ');
+        if (source == NULL || strncmp(++source, "/dev/", 5) != 0)
+            continue;
+        source[strcspn(source, " ")] = '\0';
+
+        /* MOUNT-POINT, the fifth field */
+        char *mount_point = line;
+        for (int i = 0; i < 4 && mount_point != NULL; i++) {
+            mount_point = strchr(mount_point, ' ');
+            if (mount_point != NULL)
+                mount_point++;
+        }
+
+        if (mount_point == NULL || mount_point >= sep) {
+            LOG_ERR("failed to parse /proc/self/mountinfo: %s", line);
+            continue;
+        }
+        mount_point[strcspn(mount_point, " ")] = '\0';
 
-        free(dev);
-        free(path);
+        tll_push_back(
+            *mounts,
+            ((struct mount){
+                .dev_path = strdup(unescape_octal(source)),
+                .mount_point = strdup(unescape_octal(mount_point))}));
     }
 
-    fclose(f);
+    free(buf);
+    return true;
 }
 
+static void
+find_mount_points(const struct private *m, const char *dev_path,
+                  mount_point_list_t *mount_points)
+{
+    tll_foreach(m->mounts, it) {
+        if (strcmp(it->item.dev_path, dev_path) == 0)
+            tll_push_back(*mount_points, strdup(it->item.mount_point));
+    }
+}
+
+/* Must be called with the module lock held */
 static bool
-update_mount_points(struct partition *partition)
+update_mount_points(const struct private *m, struct partition *partition)
 {
     mount_point_list_t new_mounts = tll_init();
-    find_mount_points(partition->dev_path, &new_mounts);
+    find_mount_points(m, partition->dev_path, &new_mounts);
 
     bool updated = false;
 
@@ -241,6 +356,86 @@ update_mount_points(struct partition *partition)
     return updated;
 }
 
+static bool
+mount_list_contains(const mount_list_t *mounts, const struct mount *mount)
+{
+    tll_foreach(*mounts, it) {
+        if (strcmp(it->item.dev_path, mount->dev_path) == 0 &&
+            strcmp(it->item.mount_point, mount->mount_point) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+mount_list_has_dev(const mount_list_t *mounts, const char *dev_path)
+{
+    tll_foreach(*mounts, it) {
+        if (strcmp(it->item.dev_path, dev_path) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Re-parses mountinfo, and updates the mount points of the partitions
+ * whose mounts have changed. Returns true if any partition was updated.
+ */
+static bool
+update_mounts(struct module *mod)
+{
+    struct private *m = mod->private;
+
+    mount_list_t mounts = tll_init();
+    if (!parse_mount_info(m->mount_info_fd, &mounts))
+        return false;
+
+    /* Mounts added, or removed, since the last parse */
+    mount_list_t changed = tll_init();
+
+    tll_foreach(mounts, it) {
+        if (!mount_list_contains(&m->mounts, &it->item))
+            tll_push_back(changed, it->item);
+    }
+    tll_foreach(m->mounts, it) {
+        if (!mount_list_contains(&mounts, &it->item))
+            tll_push_back(changed, it->item);
+    }
+
+    bool updated = false;
+
+    if (tll_length(changed) > 0) {
+        mount_list_t old_mounts = m->mounts;
+        m->mounts = mounts;
+        mounts = old_mounts;
+
+        mtx_lock(&mod->lock);
+        tll_foreach(m->devices, dev) {
+            tll_foreach(dev->item.partitions, part) {
+                if (mount_list_has_dev(&changed, part->item.dev_path) &&
+                    update_mount_points(m, &part->item))
+                {
+                    updated = true;
+                }
+            }
+        }
+        mtx_unlock(&mod->lock);
+    }
+
+    /* 'changed' references (but doesn't own) entries in both lists */
+    tll_free(changed);
+
+    tll_foreach(mounts, it)
+        free_mount(&it->item);
+    tll_free(mounts);
+
+    return updated;
+}
+
 static struct partition *
 add_partition(struct module *mod, struct block_device *block,
               struct udev_device *dev)
@@ -289,7 +484,7 @@ add_partition(struct module *mod, struct block_device *block,
             .mount_points = tll_init()}));
 
     struct partition *p = &tll_back(block->partitions);
-    update_mount_points(p);
+    update_mount_points(m, p);
     mtx_unlock(&mod->lock);
 
     return p;
@@ -346,7 +541,7 @@ add_audio_cd(struct module *mod, struct block_device *block,
             .mount_points = tll_init()}));
 
     struct partition *p = &tll_back(block->partitions);
-    update_mount_points(p);
+    update_mount_points(m, p);
     mtx_unlock(&mod->lock);
 
     return p;
@@ -354,9 +549,8 @@ add_audio_cd(struct module *mod, struct block_device *block,
 
 static bool
 del_partition(struct module *mod, struct block_device *block,
-              struct udev_device *dev)
+              const char *sys_path)
 {
-    const char *sys_path = udev_device_get_devpath(dev);
     mtx_lock(&mod->lock);
 
     tll_foreach(block->partitions, it) {
@@ -460,10 +654,9 @@ add_device(struct module *mod, struct udev_device *dev)
 }
 
 static bool
-del_device(struct module *mod, struct udev_device *dev)
+del_device(struct module *mod, const char *sys_path)
 {
     struct private *m = mod->private;
-    const char *sys_path = udev_device_get_devpath(dev);
     mtx_lock(&mod->lock);
 
     tll_foreach(m->devices, it) {
@@ -531,7 +724,7 @@ change_device(struct module *mod, struct udev_device *dev)
             else if (audio_track_count > 0)
                 return add_audio_cd(mod, block, dev) != NULL;
         } else
-            return del_partition(mod, block, dev);
+            return del_partition(mod, block, udev_device_get_devpath(dev));
     }
 
 out:
@@ -540,53 +733,71 @@ out:
 }
 
 static bool
-handle_udev_event(struct module *mod, struct udev_device *dev)
+handle_udev_event(struct module *mod, struct udev *udev,
+                  const struct udev_hub_event *event)
 {
     struct private *m = mod->private;
 
-    const char *action = udev_device_get_action(dev);
+    const char *action = event->action != NULL ? event->action : "";
     bool add = strcmp(action, "add") == 0;
     bool del = strcmp(action, "remove") == 0;
     bool change = strcmp(action, "change") == 0;
 
     if (!add && !del && !change) {
-        LOG_WARN("%s: unhandled action: %s", udev_device_get_devpath(dev), action);
+        LOG_WARN("%s: unhandled action: %s", event->devpath, action);
         return false;
     }
 
-    const char *devtype = udev_device_get_property_value(dev, "DEVTYPE");
+    const char *devtype = event->devtype;
+    if (devtype == NULL)
+        return false;
+
+    /*
+     * Events are parsed, and shared, by the udev hub; added and
+     * changed devices are re-created from sysfs (and the udev
+     * database), to get all their properties and attributes.
+     */
+    struct udev_device *dev = NULL;
+    if (add || change) {
+        dev = udev_device_new_from_syspath(udev, event->syspath);
+        if (dev == NULL) {
+            LOG_WARN("%s: device gone before it could be %s",
+                     event->devpath, add ? "added" : "updated");
+            return false;
+        }
+    }
+
+    bool ret = false;
 
     if (strcmp(devtype, "disk") == 0) {
         if (add)
-            return add_device(mod, dev) != NULL;
+            ret = add_device(mod, dev) != NULL;
         else if (del)
-            return del_device(mod, dev);
+            ret = del_device(mod, event->devpath);
         else
-            return change_device(mod, dev);
+            ret = change_device(mod, dev);
     }
 
-    if (strcmp(devtype, "partition") == 0) {
-        struct udev_device *parent = udev_device_get_parent(dev);
-        const char *parent_sys_path = udev_device_get_devpath(parent);
-
+    else if (strcmp(devtype, "partition") == 0 && event->parent_devpath != NULL) {
         tll_foreach(m->devices, it) {
-            if (strcmp(it->item.sys_path, parent_sys_path) != 0)
+            if (strcmp(it->item.sys_path, event->parent_devpath) != 0)
                 continue;
 
             if (add)
-                return add_partition(mod, &it->item, dev) != NULL;
+                ret = add_partition(mod, &it->item, dev) != NULL;
             else if (del)
-                return del_partition(mod, &it->item, dev);
+                ret = del_partition(mod, &it->item, event->devpath);
             else {
                 LOG_ERR("unimplemented: 'change' event on partition: %s",
-                        udev_device_get_devpath(dev));
-                return false;
+                        event->devpath);
             }
             break;
         }
     }
 
-    return false;
+    if (dev != NULL)
+        udev_device_unref(dev);
+    return ret;
 }
 
 static int
@@ -594,11 +805,30 @@ run(struct module *mod)
 {
     struct private *m = mod->private;
 
+    /* Used to enumerate, and look up, devices; events come from the hub */
     struct udev *udev = udev_new();
-    struct udev_monitor *dev_mon = udev_monitor_new_from_netlink(udev, "udev");
+    if (udev == NULL) {
+        LOG_ERR("failed to create udev context");
+        return 1;
+    }
 
-    udev_monitor_filter_add_match_subsystem_devtype(dev_mon, "block", NULL);
-    udev_monitor_enable_receiving(dev_mon);
+    /* Subscribe before enumerating, to not miss any events in between */
+    struct udev_hub_subscription *sub = udev_hub_subscribe("block", NULL);
+    if (sub == NULL) {
+        udev_unref(udev);
+        return 1;
+    }
+
+    /*
+     * To be able to poll() mountinfo for changes, to detect
+     * mount/unmount operations. Parsed before adding any partitions,
+     * since they look up their mount points in the parsed mounts.
+     */
+    m->mount_info_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (m->mount_info_fd < 0)
+        LOG_ERRNO("failed to open /proc/self/mountinfo");
+    else
+        update_mounts(mod);
 
     struct udev_enumerate *dev_enum = udev_enumerate_new(udev);
     assert(dev_enum != NULL);
@@ -645,17 +875,13 @@ run(struct module *mod)
     udev_enumerate_unref(dev_enum);
     mod->bar->refresh(mod->bar);
 
-    /* To be able to poll() mountinfo for changes, to detect
-     * mount/unmount operations */
-    int mount_info_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
-
     int ret = 1;
 
     while (true) {
         struct pollfd fds[] = {
             {.fd = mod->abort_fd, .events = POLLIN},
-            {.fd = udev_monitor_get_fd(dev_mon), .events = POLLIN},
-            {.fd = mount_info_fd, .events = POLLPRI},
+            {.fd = udev_hub_fd(sub), .events = POLLIN},
+            {.fd = m->mount_info_fd, .events = POLLPRI},
         };
         if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
             if (errno == EINTR)
@@ -672,32 +898,26 @@ run(struct module *mod)
 
         bool update = false;
 
-        if (fds[2].revents & POLLPRI) {
-            tll_foreach(m->devices, dev) {
-                tll_foreach(dev->item.partitions, part) {
-                    if (update_mount_points(&part->item))
-                        update = true;
-                }
-            }
-        }
+        if ((fds[2].revents & POLLPRI) && update_mounts(mod))
+            update = true;
 
         if (fds[1].revents & POLLIN) {
-            struct udev_device *dev = udev_monitor_receive_device(dev_mon);
-            if (dev == NULL)
-                continue;
-
-            if (handle_udev_event(mod, dev))
-                update = true;
-            udev_device_unref(dev);
+            struct udev_hub_event *event;
+            while ((event = udev_hub_next_event(sub)) != NULL) {
+                if (handle_udev_event(mod, udev, event))
+                    update = true;
+                udev_hub_event_destroy(event);
+            }
         }
 
         if (update)
             mod->bar->refresh(mod->bar);
     }
 
-    close(mount_info_fd);
+    if (m->mount_info_fd >= 0)
+        close(m->mount_info_fd);
 
-    udev_monitor_unref(dev_mon);
+    udev_hub_unsubscribe(sub);
     udev_unref(udev);
     return ret;
 }
@@ -710,6 +930,7 @@ removables_new(struct particle *label, int left_spacing, int right_spacing,
     priv->label = label;
     priv->left_spacing = left_spacing;
     priv->right_spacing = right_spacing;
+    priv->mount_info_fd = -1;
 
     for (size_t i = 0; i < ignore_count; i++)
         tll_push_back(priv->ignore, strdup(ignore[i]));
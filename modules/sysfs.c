@@ -0,0 +1,155 @@
+#include "sysfs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <fcntl.h>
+
+#define LOG_MODULE "sysfs"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+
+static void
+close_all(struct sysfs_attrs *attrs)
+{
+    for (size_t i = 0; i < attrs->count; i++) {
+        if (attrs->fds[i] >= 0)
+            close(attrs->fds[i]);
+        attrs->fds[i] = -1;
+    }
+
+    if (attrs->dir_fd >= 0)
+        close(attrs->dir_fd);
+    attrs->dir_fd = -1;
+}
+
+bool
+sysfs_attrs_reopen(struct sysfs_attrs *attrs)
+{
+    close_all(attrs);
+
+    attrs->dir_fd = open(attrs->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (attrs->dir_fd < 0) {
+        LOG_ERRNO("%s", attrs->path);
+        return false;
+    }
+
+    for (size_t i = 0; i < attrs->count; i++) {
+        attrs->fds[i] = openat(
+            attrs->dir_fd, attrs->names[i], O_RDONLY | O_CLOEXEC);
+
+        if (attrs->fds[i] < 0)
+            LOG_DBG("%s/%s: %s", attrs->path, attrs->names[i], strerror(errno));
+    }
+
+    return true;
+}
+
+bool
+sysfs_attrs_init(struct sysfs_attrs *attrs, const char *class_path,
+                 const char *device, size_t count,
+                 const char *const names[static count])
+{
+    size_t len = strlen(class_path) + 1 + strlen(device) + 1;
+
+    attrs->path = malloc(len);
+    snprintf(attrs->path, len, "%s/%s", class_path, device);
+    attrs->dir_fd = -1;
+    attrs->count = count;
+    attrs->names = names;
+    attrs->fds = malloc(count * sizeof(attrs->fds[0]));
+
+    for (size_t i = 0; i < count; i++)
+        attrs->fds[i] = -1;
+
+    return sysfs_attrs_reopen(attrs);
+}
+
+void
+sysfs_attrs_destroy(struct sysfs_attrs *attrs)
+{
+    if (attrs->fds != NULL)
+        close_all(attrs);
+
+    free(attrs->fds);
+    free(attrs->path);
+    attrs->fds = NULL;
+    attrs->path = NULL;
+    attrs->count = 0;
+}
+
+bool
+sysfs_attr_present(const struct sysfs_attrs *attrs, size_t idx)
+{
+    return attrs->fds[idx] >= 0;
+}
+
+const char *
+sysfs_attr_read(struct sysfs_attrs *attrs, size_t idx,
+                size_t sz, char buf[static sz])
+{
+    if (attrs->fds[idx] < 0)
+        return NULL;
+
+    ssize_t bytes = pread(attrs->fds[idx], buf, sz - 1, 0);
+
+    if (bytes < 0 && errno == ENODEV) {
+        /* Device went away; it may have been re-added */
+        LOG_DBG("%s: device gone, re-opening", attrs->path);
+        if (!sysfs_attrs_reopen(attrs) || attrs->fds[idx] < 0)
+            return NULL;
+
+        bytes = pread(attrs->fds[idx], buf, sz - 1, 0);
+    }
+
+    if (bytes < 0) {
+        LOG_WARN("%s/%s: failed to read: %s",
+                 attrs->path, attrs->names[idx], strerror(errno));
+        return NULL;
+    }
+
+    while (bytes > 0 && buf[bytes - 1] == '\n')
+        bytes--;
+
+    buf[bytes] = '\0';
+    return buf;
+}
+
+bool
+sysfs_attr_read_int(struct sysfs_attrs *attrs, size_t idx, long *value)
+{
+    char buf[32];
+    const char *s = sysfs_attr_read(attrs, idx, sizeof(buf), buf);
+    if (s == NULL)
+        return false;
+
+    bool negative = *s == '-';
+    if (negative)
+        s++;
+
+    if (*s < '0' || *s > '9')
+        goto invalid;
+
+    long v = 0;
+    for (; *s >= '0' && *s <= '9'; s++) {
+        const int digit = *s - '0';
+        if (v > (LONG_MAX - digit) / 10)
+            goto invalid;
+        v = v * 10 + digit;
+    }
+
+    if (*s != '\0')
+        goto invalid;
+
+    *value = negative ? -v : v;
+    return true;
+
+invalid:
+    LOG_WARN("%s/%s: failed to convert \"%s\" to an integer",
+             attrs->path, attrs->names[idx], buf);
+    return false;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A set of attributes (files) in a sysfs device directory.
+ *
+ * The attributes are opened once, and re-read with pread(), instead
+ * of being opened, read and closed on each update. Attributes that
+ * don't exist are skipped (and reported as absent).
+ *
+ * The set is re-opened when a read fails with ENODEV (the device has
+ * gone away, and possibly come back), and should be re-opened
+ * explicitly on hotplug events.
+ */
+struct sysfs_attrs {
+    char *path;               /* e.g. /sys/class/backlight/intel_backlight */
+    int dir_fd;
+    size_t count;
+    const char *const *names;
+    int *fds;                 /* -1 if absent */
+};
+
+/*
+ * 'names' must outlive the set. Returns false if the device directory
+ * cannot be opened; the set must still be destroyed.
+ */
+bool sysfs_attrs_init(struct sysfs_attrs *attrs, const char *class_path,
+                      const char *device, size_t count,
+                      const char *const names[static count]);
+void sysfs_attrs_destroy(struct sysfs_attrs *attrs);
+
+/* Closes, and re-opens, the device directory and all attributes */
+bool sysfs_attrs_reopen(struct sysfs_attrs *attrs);
+
+bool sysfs_attr_present(const struct sysfs_attrs *attrs, size_t idx);
+
+/*
+ * Reads attribute 'idx', with trailing newlines stripped. Returns
+ * NULL if the attribute is absent, or cannot be read.
+ */
+const char *sysfs_attr_read(struct sysfs_attrs *attrs, size_t idx,
+                            size_t sz, char buf[static sz]);
+
+/* Reads, and parses, an integer attribute; returns false on failure */
+bool sysfs_attr_read_int(struct sysfs_attrs *attrs, size_t idx, long *value);
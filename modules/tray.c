@@ -1,4 +1,3 @@
-#include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -16,6 +15,7 @@
 #define LOG_ENABLE_DBG 1
 #include "../log.h"
 #include "../particles/dynlist.h"
+#include "../pixels.h"
 #include "../plugin.h"
 #include "../stringop.h"
 
@@ -158,15 +158,17 @@ read_pixmap(sd_bus_message *msg, struct sni *sni, const char *prop, struct icon_
             goto error;
         }
 
-        if (height > 0 && width == height) {
+        if (height > 0 && width == height && npixels == (size_t)width * height * 4) {
             LOG_DBG("[SNI] %s %s: found icon w:%d h:%d", sni->watcher_id, prop, width, height);
             struct icon_pixmap *p = malloc(sizeof(*p) + npixels);
             p->size = width;
-            // convert from network byte order to host byte order
+
+            // convert from non-premultiplied ARGB, in network byte
+            // order, to what pixman expects. Done once here, instead
+            // of every time the icon is rendered
             //
-            for (int i = 0; i < width * height; ++i) {
-                ((uint32_t *)p->pixels)[i] = ntohl(((uint32_t *)pixels)[i]);
-            }
+            pixels_argb32_be_to_premultiplied(
+                (uint32_t *)p->pixels, pixels, (size_t)width * height);
 
             tll_push_back(pixmaps->list, p);
         } else {
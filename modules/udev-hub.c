@@ -0,0 +1,369 @@
+#include "udev-hub.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <threads.h>
+
+#include <sys/eventfd.h>
+
+#include <libudev.h>
+#include <tllist.h>
+
+#define LOG_MODULE "udev-hub"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../trace.h"
+
+struct udev_hub_subscription {
+    struct hub *hub;
+    char *subsystem;
+    char *sysname;
+    int fd;
+
+    tll(struct udev_hub_event *) events;
+};
+
+struct hub {
+    struct udev *udev;
+    struct udev_monitor *monitor;
+
+    thrd_t thread;
+    int quit_fd;
+
+    tll(struct udev_hub_subscription *) subs;
+};
+
+/*
+ * Protects 'current', and the state of all hubs. The hub thread holds
+ * it while receiving from the monitor, since libudev isn't thread
+ * safe, and the monitor's filters are updated by subscribers.
+ */
+static mtx_t lock;
+static once_flag init_once = ONCE_FLAG_INIT;
+static struct hub *current = NULL;
+
+static void
+init(void)
+{
+    mtx_init(&lock, mtx_plain);
+}
+
+static char *
+strdup_or_null(const char *s)
+{
+    return s != NULL ? strdup(s) : NULL;
+}
+
+static struct udev_hub_event *
+event_new(struct udev_device *dev)
+{
+    struct udev_hub_event *event = malloc(sizeof(*event));
+    struct udev_device *parent = udev_device_get_parent(dev);
+
+    *event = (struct udev_hub_event){
+        .action = strdup_or_null(udev_device_get_action(dev)),
+        .subsystem = strdup_or_null(udev_device_get_subsystem(dev)),
+        .sysname = strdup_or_null(udev_device_get_sysname(dev)),
+        .syspath = strdup_or_null(udev_device_get_syspath(dev)),
+        .devpath = strdup_or_null(udev_device_get_devpath(dev)),
+        .devtype = strdup_or_null(udev_device_get_devtype(dev)),
+        .devnode = strdup_or_null(udev_device_get_devnode(dev)),
+        .parent_devpath = parent != NULL
+            ? strdup_or_null(udev_device_get_devpath(parent)) : NULL,
+    };
+
+    return event;
+}
+
+static struct udev_hub_event *
+event_clone(const struct udev_hub_event *event)
+{
+    struct udev_hub_event *clone = malloc(sizeof(*clone));
+    *clone = (struct udev_hub_event){
+        .action = strdup_or_null(event->action),
+        .subsystem = strdup_or_null(event->subsystem),
+        .sysname = strdup_or_null(event->sysname),
+        .syspath = strdup_or_null(event->syspath),
+        .devpath = strdup_or_null(event->devpath),
+        .devtype = strdup_or_null(event->devtype),
+        .devnode = strdup_or_null(event->devnode),
+        .parent_devpath = strdup_or_null(event->parent_devpath),
+    };
+    return clone;
+}
+
+void
+udev_hub_event_destroy(struct udev_hub_event *event)
+{
+    if (event == NULL)
+        return;
+
+    free(event->action);
+    free(event->subsystem);
+    free(event->sysname);
+    free(event->syspath);
+    free(event->devpath);
+    free(event->devtype);
+    free(event->devnode);
+    free(event->parent_devpath);
+    free(event);
+}
+
+static bool
+sub_matches(const struct udev_hub_subscription *sub,
+            const struct udev_hub_event *event)
+{
+    if (event->subsystem == NULL || strcmp(sub->subsystem, event->subsystem) != 0)
+        return false;
+
+    return sub->sysname == NULL ||
+        (event->sysname != NULL && strcmp(sub->sysname, event->sysname) == 0);
+}
+
+/* Must be called with the lock held */
+static void
+dispatch(struct hub *hub, struct udev_device *dev)
+{
+    struct udev_hub_event *event = event_new(dev);
+    size_t count = 0;
+
+    tll_foreach(hub->subs, it) {
+        struct udev_hub_subscription *sub = it->item;
+        if (!sub_matches(sub, event))
+            continue;
+
+        /* The first subscriber gets the original */
+        tll_push_back(sub->events, count++ == 0 ? event : event_clone(event));
+
+        if (write(sub->fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+            LOG_ERRNO("failed to signal subscriber");
+    }
+
+    LOG_DBG("%s: %s: %s: dispatched to %zu subscriber(s)",
+            event->subsystem, event->sysname, event->action, count);
+
+    if (count == 0)
+        udev_hub_event_destroy(event);
+}
+
+static int
+hub_thread(void *arg)
+{
+    struct hub *hub = arg;
+
+    pthread_setname_np(pthread_self(), "udev-hub");
+    trace_thread_name("udev-hub");
+
+    while (true) {
+        struct pollfd fds[] = {
+            {.fd = hub->quit_fd, .events = POLLIN},
+            {.fd = udev_monitor_get_fd(hub->monitor), .events = POLLIN},
+        };
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            LOG_ERRNO("failed to poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            mtx_lock(&lock);
+
+            struct udev_device *dev = udev_monitor_receive_device(hub->monitor);
+            if (dev != NULL) {
+                dispatch(hub, dev);
+                udev_device_unref(dev);
+            }
+
+            mtx_unlock(&lock);
+        }
+    }
+
+    return 0;
+}
+
+static void
+hub_destroy(struct hub *hub)
+{
+    if (hub->monitor != NULL)
+        udev_monitor_unref(hub->monitor);
+    if (hub->udev != NULL)
+        udev_unref(hub->udev);
+    if (hub->quit_fd >= 0)
+        close(hub->quit_fd);
+    free(hub);
+}
+
+static struct hub *
+hub_new(void)
+{
+    struct hub *hub = calloc(1, sizeof(*hub));
+    hub->quit_fd = eventfd(0, EFD_CLOEXEC);
+    hub->udev = udev_new();
+    hub->monitor = hub->udev != NULL
+        ? udev_monitor_new_from_netlink(hub->udev, "udev") : NULL;
+
+    if (hub->quit_fd < 0 || hub->monitor == NULL) {
+        LOG_ERR("failed to create udev monitor");
+        goto err;
+    }
+
+    if (udev_monitor_enable_receiving(hub->monitor) < 0) {
+        LOG_ERR("failed to enable udev monitor");
+        goto err;
+    }
+
+    if (thrd_create(&hub->thread, &hub_thread, hub) != thrd_success) {
+        LOG_ERR("failed to create udev hub thread");
+        goto err;
+    }
+
+    return hub;
+
+err:
+    hub_destroy(hub);
+    return NULL;
+}
+
+/* Sets the monitor's (kernel) filter to the subscribed subsystems */
+static void
+update_filter(struct hub *hub)
+{
+    udev_monitor_filter_remove(hub->monitor);
+
+    tll_foreach(hub->subs, it) {
+        bool seen = false;
+        tll_foreach(hub->subs, it2) {
+            if (it2 == it)
+                break;
+            if (strcmp(it2->item->subsystem, it->item->subsystem) == 0) {
+                seen = true;
+                break;
+            }
+        }
+
+        if (!seen) {
+            udev_monitor_filter_add_match_subsystem_devtype(
+                hub->monitor, it->item->subsystem, NULL);
+        }
+    }
+
+    if (udev_monitor_filter_update(hub->monitor) < 0)
+        LOG_ERR("failed to update udev monitor filter");
+}
+
+struct udev_hub_subscription *
+udev_hub_subscribe(const char *subsystem, const char *sysname)
+{
+    call_once(&init_once, &init);
+
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        LOG_ERRNO("failed to create eventfd");
+        return NULL;
+    }
+
+    mtx_lock(&lock);
+
+    if (current == NULL && (current = hub_new()) == NULL) {
+        mtx_unlock(&lock);
+        close(fd);
+        return NULL;
+    }
+
+    struct udev_hub_subscription *sub = malloc(sizeof(*sub));
+    *sub = (struct udev_hub_subscription){
+        .hub = current,
+        .subsystem = strdup(subsystem),
+        .sysname = strdup_or_null(sysname),
+        .fd = fd,
+        .events = tll_init(),
+    };
+
+    tll_push_back(current->subs, sub);
+    update_filter(current);
+
+    mtx_unlock(&lock);
+
+    LOG_DBG("subscribed: %s/%s", subsystem, sysname != NULL ? sysname : "*");
+    return sub;
+}
+
+void
+udev_hub_unsubscribe(struct udev_hub_subscription *sub)
+{
+    if (sub == NULL)
+        return;
+
+    struct hub *hub = sub->hub;
+    struct hub *to_destroy = NULL;
+
+    mtx_lock(&lock);
+
+    tll_foreach(hub->subs, it) {
+        if (it->item == sub) {
+            tll_remove(hub->subs, it);
+            break;
+        }
+    }
+
+    if (tll_length(hub->subs) == 0) {
+        /* Subscribers arriving from now on get a new hub */
+        to_destroy = hub;
+        if (current == hub)
+            current = NULL;
+    } else
+        update_filter(hub);
+
+    mtx_unlock(&lock);
+
+    if (to_destroy != NULL) {
+        if (write(to_destroy->quit_fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+            LOG_ERRNO("failed to signal udev hub thread");
+
+        thrd_join(to_destroy->thread, NULL);
+        hub_destroy(to_destroy);
+    }
+
+    tll_free_and_free(sub->events, udev_hub_event_destroy);
+    close(sub->fd);
+    free(sub->subsystem);
+    free(sub->sysname);
+    free(sub);
+}
+
+int
+udev_hub_fd(const struct udev_hub_subscription *sub)
+{
+    return sub->fd;
+}
+
+struct udev_hub_event *
+udev_hub_next_event(struct udev_hub_subscription *sub)
+{
+    struct udev_hub_event *event = NULL;
+
+    mtx_lock(&lock);
+
+    if (tll_length(sub->events) > 0)
+        event = tll_pop_front(sub->events);
+    else {
+        /* Events are queued, and signalled, with the lock held */
+        uint64_t count;
+        if (read(sub->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            LOG_ERRNO("failed to read eventfd");
+    }
+
+    mtx_unlock(&lock);
+    return event;
+}
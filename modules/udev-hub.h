@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * Process wide udev monitor, shared by all modules (and bars).
+ *
+ * A single netlink monitor, filtered (in the kernel) on the union of
+ * all subscribed subsystems, is read by a dedicated thread. Received
+ * devices are parsed once, and queued to the subscriptions matching
+ * their subsystem and, optionally, sysname. A subscription's fd
+ * becomes readable when it has queued events; modules poll() it
+ * instead of a udev monitor of their own.
+ *
+ * The monitor, and its thread, are created with the first
+ * subscription, and destroyed with the last one.
+ */
+
+struct udev_hub_subscription;
+
+struct udev_hub_event {
+    char *action;
+    char *subsystem;
+    char *sysname;
+    char *syspath;
+    char *devpath;
+    char *devtype;          /* May be NULL */
+    char *devnode;          /* May be NULL */
+    char *parent_devpath;   /* May be NULL */
+};
+
+/* 'sysname' may be NULL, to receive events for all devices in 'subsystem' */
+struct udev_hub_subscription *udev_hub_subscribe(
+    const char *subsystem, const char *sysname);
+void udev_hub_unsubscribe(struct udev_hub_subscription *sub);
+
+/* Readable (POLLIN) when there are queued events */
+int udev_hub_fd(const struct udev_hub_subscription *sub);
+
+/*
+ * Returns the next queued event, or NULL if there is none (after
+ * which the fd is no longer readable, until new events are queued).
+ * Never blocks.
+ */
+struct udev_hub_event *udev_hub_next_event(struct udev_hub_subscription *sub);
+void udev_hub_event_destroy(struct udev_hub_event *event);
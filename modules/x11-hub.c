@@ -0,0 +1,481 @@
+#include "x11-hub.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <threads.h>
+
+#include <sys/eventfd.h>
+
+#include <xcb/xcb_aux.h>
+#include <xcb/xcb_event.h>
+#include <tllist.h>
+
+#define LOG_MODULE "x11-hub"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../trace.h"
+#include "../xcb.h"
+
+struct x11_hub_subscription {
+    struct x11_hub *hub;
+    uint8_t response_type;
+    xcb_window_t window;
+    uint32_t event_mask;
+    int fd;
+
+    tll(xcb_generic_event_t *) events;
+};
+
+struct atom {
+    char *name;
+    xcb_atom_t atom;
+};
+
+struct x11_hub {
+    int ref_count;
+
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+
+    /* Target of the ClientMessage that wakes up, and stops, the thread */
+    xcb_window_t wakeup_win;
+
+    thrd_t thread;
+    bool thread_started;
+
+    tll(struct atom) atoms;
+    tll(struct x11_hub_subscription *) subs;
+};
+
+/*
+ * Protects 'current', and the state (but not the connection) of all
+ * hubs. Never held while waiting for the X server.
+ */
+static mtx_t lock;
+static once_flag init_once = ONCE_FLAG_INIT;
+static struct x11_hub *current = NULL;
+
+static void
+init(void)
+{
+    mtx_init(&lock, mtx_plain);
+}
+
+static void
+signal_sub(struct x11_hub_subscription *sub)
+{
+    if (write(sub->fd, &(uint64_t){1}, sizeof(uint64_t)) != sizeof(uint64_t))
+        LOG_ERRNO("failed to signal subscriber");
+}
+
+/* The window an event was generated for, if we route it by window */
+static xcb_window_t
+event_window(const xcb_generic_event_t *event)
+{
+    switch (XCB_EVENT_RESPONSE_TYPE(event)) {
+    case XCB_PROPERTY_NOTIFY:
+        return ((const xcb_property_notify_event_t *)event)->window;
+
+    default:
+        return XCB_WINDOW_NONE;
+    }
+}
+
+/* Must be called with the lock held */
+static void
+dispatch(struct x11_hub *hub, xcb_generic_event_t *event)
+{
+    const uint8_t type = XCB_EVENT_RESPONSE_TYPE(event);
+    const xcb_window_t window = event_window(event);
+    size_t count = 0;
+
+    tll_foreach(hub->subs, it) {
+        struct x11_hub_subscription *sub = it->item;
+
+        if (sub->response_type != type)
+            continue;
+        if (sub->window != XCB_WINDOW_NONE && sub->window != window)
+            continue;
+
+        /* The first subscriber gets the original */
+        xcb_generic_event_t *copy = event;
+        if (count++ > 0) {
+            copy = malloc(sizeof(*copy));
+            memcpy(copy, event, sizeof(*copy));
+        }
+
+        tll_push_back(sub->events, copy);
+        signal_sub(sub);
+    }
+
+    LOG_DBG("event %hhu (window 0x%08x): dispatched to %zu subscriber(s)",
+            type, window, count);
+
+    if (count == 0)
+        free(event);
+}
+
+static int
+hub_thread(void *arg)
+{
+    struct x11_hub *hub = arg;
+
+    pthread_setname_np(pthread_self(), "x11-hub");
+    trace_thread_name("x11-hub");
+
+    /*
+     * Note: we can't poll() the connection's fd, since other threads
+     * waiting for replies may read, and queue, events from it. Thus
+     * we block in xcb_wait_for_event(), and are woken up by a
+     * ClientMessage when it's time to quit.
+     */
+    while (true) {
+        xcb_generic_event_t *event = xcb_wait_for_event(hub->conn);
+
+        if (event == NULL) {
+            LOG_ERR("I/O error, server disconnect?");
+
+            /* Wake up all subscribers, to let them detect the error */
+            mtx_lock(&lock);
+            tll_foreach(hub->subs, it)
+                signal_sub(it->item);
+            mtx_unlock(&lock);
+            break;
+        }
+
+        switch (XCB_EVENT_RESPONSE_TYPE(event)) {
+        case 0:
+            LOG_WARN("XCB: %s", xcb_error((const xcb_generic_error_t *)event));
+            free(event);
+            continue;
+
+        case XCB_CLIENT_MESSAGE:
+            if (((const xcb_client_message_event_t *)event)->window ==
+                hub->wakeup_win)
+            {
+                free(event);
+                return 0;
+            }
+            break;
+
+        case XCB_GE_GENERIC:
+            /* Variable sized; no one subscribes to these (yet) */
+            free(event);
+            continue;
+        }
+
+        mtx_lock(&lock);
+        dispatch(hub, event);
+        mtx_unlock(&lock);
+    }
+
+    return 0;
+}
+
+static void
+hub_destroy(struct x11_hub *hub)
+{
+    assert(tll_length(hub->subs) == 0);
+
+    if (hub->thread_started) {
+        const xcb_client_message_event_t msg = {
+            .response_type = XCB_CLIENT_MESSAGE,
+            .format = 32,
+            .window = hub->wakeup_win,
+            .type = XCB_ATOM_NONE,
+        };
+
+        /* An empty event mask sends it to the window's creator; us */
+        xcb_send_event(hub->conn, false, hub->wakeup_win,
+                       XCB_EVENT_MASK_NO_EVENT, (const char *)&msg);
+        xcb_flush(hub->conn);
+        thrd_join(hub->thread, NULL);
+    }
+
+    if (hub->wakeup_win != XCB_WINDOW_NONE)
+        xcb_destroy_window(hub->conn, hub->wakeup_win);
+
+    tll_foreach(hub->atoms, it) {
+        free(it->item.name);
+        tll_remove(hub->atoms, it);
+    }
+
+    xcb_disconnect(hub->conn);
+    free(hub);
+}
+
+static struct x11_hub *
+hub_new(void)
+{
+    int default_screen;
+    xcb_connection_t *conn = xcb_connect(NULL, &default_screen);
+    if (xcb_connection_has_error(conn) > 0) {
+        LOG_ERR("failed to connect to X");
+        xcb_disconnect(conn);
+        return NULL;
+    }
+
+    struct x11_hub *hub = calloc(1, sizeof(*hub));
+    hub->conn = conn;
+    hub->screen = xcb_aux_get_screen(conn, default_screen);
+
+    hub->wakeup_win = xcb_generate_id(conn);
+    xcb_create_window(conn, 0, hub->wakeup_win, hub->screen->root,
+                      -1, -1, 1, 1, 0,
+                      XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT,
+                      0, NULL);
+    xcb_flush(conn);
+
+    if (thrd_create(&hub->thread, &hub_thread, hub) != thrd_success) {
+        LOG_ERR("failed to create X11 hub thread");
+        hub_destroy(hub);
+        return NULL;
+    }
+
+    hub->thread_started = true;
+    return hub;
+}
+
+struct x11_hub *
+x11_hub_get(void)
+{
+    call_once(&init_once, &init);
+
+    mtx_lock(&lock);
+
+    /* Reconnect if the current connection has been lost */
+    if (current != NULL && xcb_connection_has_error(current->conn) > 0)
+        current = NULL;
+
+    if (current == NULL)
+        current = hub_new();
+
+    struct x11_hub *hub = current;
+    if (hub != NULL)
+        hub->ref_count++;
+
+    mtx_unlock(&lock);
+    return hub;
+}
+
+void
+x11_hub_put(struct x11_hub *hub)
+{
+    if (hub == NULL)
+        return;
+
+    mtx_lock(&lock);
+
+    bool last = --hub->ref_count == 0;
+    if (last && current == hub) {
+        /* Users arriving from now on get a new hub */
+        current = NULL;
+    }
+
+    mtx_unlock(&lock);
+
+    if (last)
+        hub_destroy(hub);
+}
+
+xcb_connection_t *
+x11_hub_connection(const struct x11_hub *hub)
+{
+    return hub->conn;
+}
+
+xcb_screen_t *
+x11_hub_screen(const struct x11_hub *hub)
+{
+    return hub->screen;
+}
+
+/* Must be called with the lock held */
+static bool
+atom_lookup(const struct x11_hub *hub, const char *name, xcb_atom_t *atom)
+{
+    tll_foreach(hub->atoms, it) {
+        if (strcmp(it->item.name, name) == 0) {
+            *atom = it->item.atom;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+x11_hub_intern_atoms(
+    struct x11_hub *hub, size_t count, const char *const names[static count],
+    xcb_atom_t atoms[static count])
+{
+    bool cached[count];
+    xcb_intern_atom_cookie_t cookies[count];
+
+    mtx_lock(&lock);
+    for (size_t i = 0; i < count; i++)
+        cached[i] = atom_lookup(hub, names[i], &atoms[i]);
+    mtx_unlock(&lock);
+
+    /* Send all requests before waiting for the first reply */
+    for (size_t i = 0; i < count; i++) {
+        if (!cached[i]) {
+            cookies[i] = xcb_intern_atom(
+                hub->conn, 0, strlen(names[i]), names[i]);
+        }
+    }
+
+    bool ret = true;
+
+    for (size_t i = 0; i < count; i++) {
+        if (cached[i])
+            continue;
+
+        xcb_generic_error_t *e;
+        xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply(
+            hub->conn, cookies[i], &e);
+
+        if (e != NULL || reply == NULL) {
+            LOG_ERR("%s: failed to get atom: %s",
+                    names[i], e != NULL ? xcb_error(e) : "no reply");
+            free(e);
+            free(reply);
+            atoms[i] = XCB_ATOM_NONE;
+            ret = false;
+            continue;
+        }
+
+        atoms[i] = reply->atom;
+        free(reply);
+
+        LOG_DBG("atom %s = 0x%08x", names[i], atoms[i]);
+
+        mtx_lock(&lock);
+        xcb_atom_t dummy;
+        if (!atom_lookup(hub, names[i], &dummy)) {
+            tll_push_back(
+                hub->atoms,
+                ((struct atom){.name = strdup(names[i]), .atom = atoms[i]}));
+        }
+        mtx_unlock(&lock);
+    }
+
+    return ret;
+}
+
+/*
+ * Selects the union of all subscriptions' event masks on
+ * 'window'. Must be called with the lock held.
+ */
+static void
+select_events(struct x11_hub *hub, xcb_window_t window)
+{
+    uint32_t mask = XCB_EVENT_MASK_NO_EVENT;
+    tll_foreach(hub->subs, it) {
+        if (it->item->window == window)
+            mask |= it->item->event_mask;
+    }
+
+    xcb_void_cookie_t cookie = xcb_change_window_attributes_checked(
+        hub->conn, window, XCB_CW_EVENT_MASK, &mask);
+
+    /* The window may already have been destroyed */
+    xcb_discard_reply(hub->conn, cookie.sequence);
+    xcb_flush(hub->conn);
+}
+
+struct x11_hub_subscription *
+x11_hub_subscribe(struct x11_hub *hub, uint8_t response_type,
+                  xcb_window_t window, uint32_t event_mask)
+{
+    assert(window != XCB_WINDOW_NONE || event_mask == XCB_EVENT_MASK_NO_EVENT);
+
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        LOG_ERRNO("failed to create eventfd");
+        return NULL;
+    }
+
+    struct x11_hub_subscription *sub = malloc(sizeof(*sub));
+    *sub = (struct x11_hub_subscription){
+        .hub = hub,
+        .response_type = response_type,
+        .window = window,
+        .event_mask = event_mask,
+        .fd = fd,
+        .events = tll_init(),
+    };
+
+    mtx_lock(&lock);
+
+    tll_push_back(hub->subs, sub);
+    if (event_mask != XCB_EVENT_MASK_NO_EVENT)
+        select_events(hub, window);
+
+    /* Let the subscriber detect a connection lost before it subscribed */
+    if (xcb_connection_has_error(hub->conn) > 0)
+        signal_sub(sub);
+
+    mtx_unlock(&lock);
+
+    LOG_DBG("subscribed: event %hhu, window 0x%08x, mask 0x%08x",
+            response_type, window, event_mask);
+    return sub;
+}
+
+void
+x11_hub_unsubscribe(struct x11_hub_subscription *sub)
+{
+    if (sub == NULL)
+        return;
+
+    struct x11_hub *hub = sub->hub;
+
+    mtx_lock(&lock);
+
+    tll_foreach(hub->subs, it) {
+        if (it->item == sub) {
+            tll_remove(hub->subs, it);
+            break;
+        }
+    }
+
+    if (sub->event_mask != XCB_EVENT_MASK_NO_EVENT)
+        select_events(hub, sub->window);
+
+    mtx_unlock(&lock);
+
+    tll_free_and_free(sub->events, free);
+    close(sub->fd);
+    free(sub);
+}
+
+int
+x11_hub_fd(const struct x11_hub_subscription *sub)
+{
+    return sub->fd;
+}
+
+xcb_generic_event_t *
+x11_hub_next_event(struct x11_hub_subscription *sub)
+{
+    xcb_generic_event_t *event = NULL;
+
+    mtx_lock(&lock);
+
+    if (tll_length(sub->events) > 0)
+        event = tll_pop_front(sub->events);
+    else {
+        /* Events are queued, and signalled, with the lock held */
+        uint64_t count;
+        if (read(sub->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            LOG_ERRNO("failed to read eventfd");
+    }
+
+    mtx_unlock(&lock);
+    return event;
+}
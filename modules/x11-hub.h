@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+/*
+ * Process wide X11 connection, shared by all modules (and bars).
+ *
+ * The connection is opened by the first x11_hub_get(), and closed by
+ * the last x11_hub_put(). Modules issue requests, and wait for their
+ * replies, directly on the shared connection (XCB is thread safe),
+ * but never read events from it; events are read by a dedicated
+ * thread, and queued to the subscriptions matching their type and,
+ * optionally, window. A subscription's fd becomes readable when it
+ * has queued events; modules poll() it instead of the connection.
+ *
+ * Event masks are selected by the hub, on behalf of the
+ * subscriptions, as the union of all subscriptions' masks on each
+ * window; modules must not change window attributes' event masks
+ * themselves, since that would affect other subscribers.
+ *
+ * The bar's X11 backend does not use the hub; it has a connection of
+ * its own, read by the bar thread.
+ */
+
+struct x11_hub;
+struct x11_hub_subscription;
+
+/* Returns NULL if we fail to connect to the X server */
+struct x11_hub *x11_hub_get(void);
+void x11_hub_put(struct x11_hub *hub);
+
+xcb_connection_t *x11_hub_connection(const struct x11_hub *hub);
+xcb_screen_t *x11_hub_screen(const struct x11_hub *hub);
+
+/*
+ * Interns all atoms in 'names' (at most a single round-trip, for the
+ * atoms not already cached), and stores them in 'atoms'
+ */
+bool x11_hub_intern_atoms(
+    struct x11_hub *hub, size_t count, const char *const names[static count],
+    xcb_atom_t atoms[static count]);
+
+/*
+ * Subscribes to events with the (core, or extension) 'response_type',
+ * as returned by XCB_EVENT_RESPONSE_TYPE(). 'window' is only matched
+ * against PropertyNotify events; XCB_WINDOW_NONE matches all windows.
+ * 'event_mask' is selected on 'window' for the lifetime of the
+ * subscription (XCB_EVENT_MASK_NO_EVENT for e.g. extension events,
+ * selected by other means).
+ */
+struct x11_hub_subscription *x11_hub_subscribe(
+    struct x11_hub *hub, uint8_t response_type, xcb_window_t window,
+    uint32_t event_mask);
+void x11_hub_unsubscribe(struct x11_hub_subscription *sub);
+
+/* Readable (POLLIN) when there are queued events */
+int x11_hub_fd(const struct x11_hub_subscription *sub);
+
+/*
+ * Returns the next queued event (free() it), or NULL if there is
+ * none, after which the fd is no longer readable until new events are
+ * queued. Never blocks. If the connection has been lost, the fd is
+ * signalled, and xcb_connection_has_error() returns non-zero.
+ */
+xcb_generic_event_t *x11_hub_next_event(struct x11_hub_subscription *sub);
@@ -16,6 +16,7 @@
 #include "../config-verify.h"
 #include "../plugin.h"
 #include "../xcb.h"
+#include "x11-hub.h"
 
 struct layout {
     char *name;
@@ -381,7 +382,8 @@ register_for_events(xcb_connection_t *conn)
 }
 
 static bool
-event_loop(struct module *mod, xcb_connection_t *conn, int xkb_event_base)
+event_loop(struct module *mod, xcb_connection_t *conn,
+           struct x11_hub_subscription *sub)
 {
     const struct bar *bar = mod->bar;
     struct private *m = mod->private;
@@ -389,16 +391,12 @@ event_loop(struct module *mod, xcb_connection_t *conn, int xkb_event_base)
     bool ret = false;
     bool has_error = false;
 
-    const int xcb_fd = xcb_get_file_descriptor(conn);
-    assert(xcb_fd >= 0);
-
     while (!has_error) {
         struct pollfd pfds[] = {
             {.fd = mod->abort_fd, .events = POLLIN },
-            {.fd = xcb_fd, .events = POLLIN | POLLHUP }
+            {.fd = x11_hub_fd(sub), .events = POLLIN }
         };
 
-        /* Use poll() since xcb_wait_for_events() doesn't return on signals */
         if (poll(pfds, sizeof(pfds) / sizeof(pfds[0]), -1) < 0) {
             if (errno == EINTR)
                 continue;
@@ -412,28 +410,12 @@ event_loop(struct module *mod, xcb_connection_t *conn, int xkb_event_base)
             break;
         }
 
-        if (pfds[1].revents & POLLHUP) {
-            LOG_WARN("I/O error, server disconnect?");
-            break;
-        }
-
         assert(pfds[1].revents & POLLIN && "POLLIN not set");
 
-        /*
-         * Note: poll() might have returned *before* the entire event
-         * has been received, and thus we might block here. Hopefully
-         * not for long though...
-         */
-
-        for (xcb_generic_event_t *_evt = xcb_wait_for_event(conn);
+        /* Only XKB events are routed to us */
+        for (xcb_generic_event_t *_evt = x11_hub_next_event(sub);
              _evt != NULL;
-             _evt = xcb_poll_for_event(conn)) {
-
-            if (_evt->response_type != xkb_event_base) {
-                LOG_WARN("non-XKB event ignored: %d", _evt->response_type);
-                free(_evt);
-                continue;
-            }
+             _evt = x11_hub_next_event(sub)) {
 
             switch(_evt->pad0) {
             default:
@@ -539,15 +521,21 @@ event_loop(struct module *mod, xcb_connection_t *conn, int xkb_event_base)
 
             free(_evt);
         }
+
+        if (xcb_connection_has_error(conn) > 0) {
+            LOG_WARN("I/O error, server disconnect?");
+            break;
+        }
     }
 
     return ret;
 }
 
 static bool
-talk_to_xkb(struct module *mod, xcb_connection_t *conn)
+talk_to_xkb(struct module *mod, struct x11_hub *hub)
 {
     struct private *m = mod->private;
+    xcb_connection_t *conn = x11_hub_connection(hub);
 
     if (!xkb_enable(conn))
         return false;
@@ -559,25 +547,33 @@ talk_to_xkb(struct module *mod, xcb_connection_t *conn)
     if (xkb_event_base == -1)
         return false;
 
+    /* Subscribe before reading the initial state, to not miss any changes */
+    struct x11_hub_subscription *sub = x11_hub_subscribe(
+        hub, xkb_event_base, XCB_WINDOW_NONE, XCB_EVENT_MASK_NO_EVENT);
+    if (sub == NULL)
+        return false;
+
+    bool ret = false;
+
     int current = get_current_layout(conn);
     if (current == -1)
-        return false;
+        goto out;
 
     /* Bitmask, one bit for every indicator available */
     uint32_t indicator_state = get_indicator_state(conn);
     if (indicator_state == (uint32_t)-1)
-        return false;
+        goto out;
 
     struct layouts layouts;
     struct indicators indicators;
     if (!get_layouts_and_indicators(conn, &layouts, &indicators))
-        return false;
+        goto out;
 
     if (current >= layouts.count) {
         LOG_ERR("current layout index: %d >= %zd", current, layouts.count);
         free_layouts(layouts);
         free_indicators(indicators);
-        return false;
+        goto out;
     }
 
     bool caps_lock = false, num_lock = false, scroll_lock = false;
@@ -633,22 +629,23 @@ talk_to_xkb(struct module *mod, xcb_connection_t *conn)
     mtx_unlock(&mod->lock);
     mod->bar->refresh(mod->bar);
 
-    return event_loop(mod, conn, xkb_event_base);
+    ret = event_loop(mod, conn, sub);
+
+out:
+    x11_hub_unsubscribe(sub);
+    return ret;
 }
 
 static int
 run(struct module *mod)
 {
-    xcb_connection_t *conn = xcb_connect(NULL, NULL);
-    if (xcb_connection_has_error(conn) > 0) {
-        LOG_ERR("failed to connect to X server");
-        xcb_disconnect(conn);
+    struct x11_hub *hub = x11_hub_get();
+    if (hub == NULL)
         return EXIT_FAILURE;
-    }
 
-    int ret = talk_to_xkb(mod, conn) ? EXIT_SUCCESS : EXIT_FAILURE;
+    int ret = talk_to_xkb(mod, hub) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    xcb_disconnect(conn);
+    x11_hub_put(hub);
     return ret;
 }
 
@@ -12,8 +12,6 @@
 #include <poll.h>
 
 #include <xcb/xcb.h>
-#include <xcb/xcb_aux.h>
-#include <xcb/xcb_event.h>
 
 #define LOG_MODULE "xwindow"
 #include "../log.h"
@@ -22,6 +20,26 @@
 #include "../config-verify.h"
 #include "../plugin.h"
 #include "../xcb.h"
+#include "x11-hub.h"
+
+enum atoms {
+    ATOM_UTF8_STRING,
+    ATOM_NET_WM_PID,
+    ATOM_NET_ACTIVE_WINDOW,
+    ATOM_NET_CURRENT_DESKTOP,
+    ATOM_NET_WM_VISIBLE_NAME,
+    ATOM_NET_WM_NAME,
+    ATOM_COUNT,
+};
+
+static const char *const atom_names[ATOM_COUNT] = {
+    [ATOM_UTF8_STRING] = "UTF8_STRING",
+    [ATOM_NET_WM_PID] = "_NET_WM_PID",
+    [ATOM_NET_ACTIVE_WINDOW] = "_NET_ACTIVE_WINDOW",
+    [ATOM_NET_CURRENT_DESKTOP] = "_NET_CURRENT_DESKTOP",
+    [ATOM_NET_WM_VISIBLE_NAME] = "_NET_WM_VISIBLE_NAME",
+    [ATOM_NET_WM_NAME] = "_NET_WM_NAME",
+};
 
 struct private {
     /* Accessed from bar thread only */
@@ -32,10 +50,15 @@ struct private {
     char *title;
 
     /* Accessed from our thread only */
+    struct x11_hub *hub;
     xcb_connection_t *conn;
+    xcb_atom_t atoms[ATOM_COUNT];
     xcb_window_t root_win;
-    xcb_window_t monitor_win;
     xcb_window_t active_win;
+
+    /* Property changes on the root window, and the active window */
+    struct x11_hub_subscription *root_sub;
+    struct x11_hub_subscription *active_sub;
 };
 
 static const char *
@@ -47,24 +70,12 @@ description(const struct module *mod)
 static void
 update_active_window(struct private *m)
 {
-    if (m->active_win != 0) {
-        xcb_void_cookie_t c = xcb_change_window_attributes_checked(
-            m->conn, m->active_win, XCB_CW_EVENT_MASK,
-            (const uint32_t []){XCB_EVENT_MASK_NO_EVENT});
-
-        xcb_generic_error_t *e = xcb_request_check(m->conn, c);
-        if (e != NULL) {
-            LOG_DBG(
-                "failed to de-register events on previous active window: %s",
-                xcb_error(e));
-            free(e);
-        }
-
-        m->active_win = 0;
-    }
+    xcb_window_t previous = m->active_win;
+    m->active_win = 0;
 
     xcb_get_property_cookie_t c = xcb_get_property(
-        m->conn, 0, m->root_win, _NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW, 0, 32);
+        m->conn, 0, m->root_win, m->atoms[ATOM_NET_ACTIVE_WINDOW],
+        XCB_ATOM_WINDOW, 0, 32);
 
     xcb_generic_error_t *e;
     xcb_get_property_reply_t *r = xcb_get_property_reply(m->conn, c, &e);
@@ -73,22 +84,25 @@ update_active_window(struct private *m)
         LOG_ERR("failed to get active window ID: %s", xcb_error(e));
         free(e);
         free(r);
-        return;
+    } else {
+        if (xcb_get_property_value_length(r) == sizeof(m->active_win)) {
+            memcpy(&m->active_win, xcb_get_property_value(r),
+                   sizeof(m->active_win));
+        }
+        free(r);
     }
 
-    if (xcb_get_property_value_length(r) != sizeof(m->active_win)) {
-        free(r);
+    if (m->active_win == previous && m->active_sub != NULL)
         return;
-    }
 
-    assert(sizeof(m->active_win) == xcb_get_property_value_length(r));
-    memcpy(&m->active_win, xcb_get_property_value(r), sizeof(m->active_win));
-    free(r);
+    /* Re-subscribe to property changes (i.e. title changes) */
+    x11_hub_unsubscribe(m->active_sub);
+    m->active_sub = NULL;
 
     if (m->active_win != 0) {
-        xcb_change_window_attributes(
-            m->conn, m->active_win, XCB_CW_EVENT_MASK,
-            (const uint32_t []){XCB_EVENT_MASK_PROPERTY_CHANGE});
+        m->active_sub = x11_hub_subscribe(
+            m->hub, XCB_PROPERTY_NOTIFY, m->active_win,
+            XCB_EVENT_MASK_PROPERTY_CHANGE);
     }
 }
 
@@ -106,7 +120,8 @@ update_application(struct module *mod)
         return;
 
     xcb_get_property_cookie_t c = xcb_get_property(
-        m->conn, 0, m->active_win, _NET_WM_PID, XCB_ATOM_CARDINAL, 0, 32);
+        m->conn, 0, m->active_win, m->atoms[ATOM_NET_WM_PID],
+        XCB_ATOM_CARDINAL, 0, 32);
 
     xcb_generic_error_t *e;
     xcb_get_property_reply_t *r = xcb_get_property_reply(m->conn, c, &e);
@@ -164,10 +179,14 @@ update_title(struct module *mod)
     if (m->active_win == 0)
         return;
 
+    const xcb_atom_t utf8_string = m->atoms[ATOM_UTF8_STRING];
+
     xcb_get_property_cookie_t c1 = xcb_get_property(
-        m->conn, 0, m->active_win, _NET_WM_VISIBLE_NAME, UTF8_STRING, 0, 1000);
+        m->conn, 0, m->active_win, m->atoms[ATOM_NET_WM_VISIBLE_NAME],
+        utf8_string, 0, 1000);
     xcb_get_property_cookie_t c2 = xcb_get_property(
-        m->conn, 0, m->active_win, _NET_WM_NAME, UTF8_STRING, 0, 1000);
+        m->conn, 0, m->active_win, m->atoms[ATOM_NET_WM_NAME],
+        utf8_string, 0, 1000);
     xcb_get_property_cookie_t c3 = xcb_get_property(
         m->conn, 0, m->active_win, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 0, 1000);
 
@@ -209,51 +228,86 @@ update_title(struct module *mod)
     free(r3);
  }
 
+/* Returns false if the connection to the X server has been lost */
+static bool
+handle_events(struct module *mod, struct x11_hub_subscription *sub)
+{
+    struct private *m = mod->private;
+
+    for (xcb_generic_event_t *_e = x11_hub_next_event(sub);
+         _e != NULL;
+         _e = x11_hub_next_event(sub))
+    {
+        const xcb_property_notify_event_t *e =
+            (const xcb_property_notify_event_t *)_e;
+
+        if (e->window == m->root_win) {
+            if (e->atom == m->atoms[ATOM_NET_ACTIVE_WINDOW] ||
+                e->atom == m->atoms[ATOM_NET_CURRENT_DESKTOP])
+            {
+                /* Active desktop and/or window changed */
+                update_active_window(m);
+                update_application(mod);
+                update_title(mod);
+                mod->bar->refresh(mod->bar);
+            }
+        }
+
+        else if (e->window == m->active_win) {
+            if (e->atom == m->atoms[ATOM_NET_WM_VISIBLE_NAME] ||
+                e->atom == m->atoms[ATOM_NET_WM_NAME] ||
+                e->atom == XCB_ATOM_WM_NAME)
+            {
+                update_title(mod);
+                mod->bar->refresh(mod->bar);
+            }
+        }
+
+        /* Else: queued before we switched active window */
+
+        free(_e);
+    }
+
+    return xcb_connection_has_error(m->conn) == 0;
+}
+
 static int
 run(struct module *mod)
 {
     struct private *m = mod->private;
 
-    int default_screen;
-    m->conn = xcb_connect(NULL, &default_screen);
-    if (xcb_connection_has_error(m->conn) > 0) {
-        LOG_ERR("failed to connect to X");
-        xcb_disconnect(m->conn);
+    m->hub = x11_hub_get();
+    if (m->hub == NULL)
         return 1;
-    }
-
-    xcb_screen_t *screen = xcb_aux_get_screen(m->conn, default_screen);
-    m->root_win = screen->root;
 
-    /* Need a window(?) to be able to process events */
-    m->monitor_win = xcb_generate_id(m->conn);
-    xcb_create_window(m->conn, screen->root_depth, m->monitor_win, screen->root,
-                      -1, -1, 1, 1,
-                      0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual,
-                      XCB_CW_OVERRIDE_REDIRECT, (const uint32_t []){1});
+    m->conn = x11_hub_connection(m->hub);
+    m->root_win = x11_hub_screen(m->hub)->root;
 
-    xcb_map_window(m->conn, m->monitor_win);
+    int ret = 1;
 
-    /* Register for property changes on root window. This allows us to
-     * catch e.g. window switches etc */
-    xcb_change_window_attributes(
-        m->conn, screen->root, XCB_CW_EVENT_MASK,
-        (const uint32_t []){XCB_EVENT_MASK_PROPERTY_CHANGE});
+    if (!x11_hub_intern_atoms(m->hub, ATOM_COUNT, atom_names, m->atoms))
+        goto out;
 
-    xcb_flush(m->conn);
+    /* Property changes on the root window catch e.g. window switches */
+    m->root_sub = x11_hub_subscribe(
+        m->hub, XCB_PROPERTY_NOTIFY, m->root_win,
+        XCB_EVENT_MASK_PROPERTY_CHANGE);
+    if (m->root_sub == NULL)
+        goto out;
 
     update_active_window(m);
     update_application(mod);
     update_title(mod);
     mod->bar->refresh(mod->bar);
 
-    int ret = 1;
-
-    int xcb_fd = xcb_get_file_descriptor(m->conn);
     while (true) {
-        struct pollfd fds[] = {{.fd = mod->abort_fd, .events = POLLIN},
-                               {.fd = xcb_fd, .events = POLLIN}};
+        struct pollfd fds[] = {
+            {.fd = mod->abort_fd, .events = POLLIN},
+            {.fd = x11_hub_fd(m->root_sub), .events = POLLIN},
+            {.fd = m->active_sub != NULL ? x11_hub_fd(m->active_sub) : -1,
+             .events = POLLIN},
+        };
+
         if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
             if (errno == EINTR)
                 continue;
@@ -267,43 +321,26 @@ run(struct module *mod)
             break;
         }
 
-        for (xcb_generic_event_t *_e = xcb_wait_for_event(m->conn);
-             _e != NULL;
-             _e = xcb_poll_for_event(m->conn))
-        {
-            switch (XCB_EVENT_RESPONSE_TYPE(_e)) {
-            case 0:
-                LOG_ERR("XCB: %s", xcb_error((const xcb_generic_error_t *)_e));
-                break;
-
-            case XCB_PROPERTY_NOTIFY: {
-                xcb_property_notify_event_t *e = (xcb_property_notify_event_t *)_e;
-                if (e->atom == _NET_ACTIVE_WINDOW ||
-                    e->atom == _NET_CURRENT_DESKTOP)
-                {
-                    /* Active desktop and/or window changed */
-                    update_active_window(m);
-                    update_application(mod);
-                    update_title(mod);
-                    mod->bar->refresh(mod->bar);
-                } else if (e->atom == _NET_WM_VISIBLE_NAME ||
-                           e->atom == _NET_WM_NAME ||
-                           e->atom == XCB_ATOM_WM_NAME)
-                {
-                    assert(e->window == m->active_win);
-                    update_title(mod);
-                    mod->bar->refresh(mod->bar);
-                }
-                break;
-            }
-            }
+        /* Note: handling root events may replace the active subscription */
+        if (fds[1].revents & POLLIN && !handle_events(mod, m->root_sub))
+            break;
 
-            free(_e);
+        if (fds[2].revents & POLLIN && m->active_sub != NULL &&
+            !handle_events(mod, m->active_sub))
+        {
+            break;
         }
     }
 
-    xcb_destroy_window(m->conn, m->monitor_win);
-    xcb_disconnect(m->conn);
+out:
+    x11_hub_unsubscribe(m->active_sub);
+    x11_hub_unsubscribe(m->root_sub);
+    m->active_sub = m->root_sub = NULL;
+    m->active_win = 0;
+
+    x11_hub_put(m->hub);
+    m->hub = NULL;
+    m->conn = NULL;
     return ret;
 }
 
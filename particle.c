@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <threads.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -54,6 +55,9 @@ particle_common_new(int left_margin, int right_margin, char **on_click_templates
             if (on_click_templates[i] != NULL) {
                 p->have_on_click_template = true;
                 p->on_click_templates[i] = on_click_templates[i];
+
+                if (strchr(on_click_templates[i], '{') != NULL)
+                    p->on_click_references_tags = true;
             }
         }
     }
@@ -64,8 +68,7 @@ particle_common_new(int left_margin, int right_margin, char **on_click_templates
 void
 exposable_default_destroy(struct exposable *exposable)
 {
-    for (size_t i = 0; i < MOUSE_BTN_COUNT; i++)
-        free(exposable->on_click[i]);
+    tag_snapshot_unref(exposable->on_click_tags);
     free(exposable);
 }
 
@@ -158,6 +161,49 @@ err:
     return false;
 }
 
+/* Requests made while painting a frame, by the thread painting it */
+static thread_local uint64_t frame_request = 0;
+
+void
+exposable_request_frame(uint64_t delay_ns)
+{
+    if (delay_ns == 0)
+        delay_ns = 1;
+
+    if (frame_request == 0 || delay_ns < frame_request)
+        frame_request = delay_ns;
+}
+
+uint64_t
+exposable_take_frame_request(void)
+{
+    uint64_t delay_ns = frame_request;
+    frame_request = 0;
+    return delay_ns;
+}
+
+ssize_t
+exposable_find_child(size_t count, const int *offsets, const int *widths, int x)
+{
+    /* Find the last sub-exposable starting at, or before, 'x' */
+    size_t lo = 0;
+    size_t hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (offsets[mid] <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return -1;
+
+    size_t idx = lo - 1;
+    return x < offsets[idx] + widths[idx] ? (ssize_t)idx : -1;
+}
+
 void
 exposable_default_on_mouse(struct exposable *exposable, struct bar *bar,
                            enum mouse_event event, enum mouse_button btn,
@@ -190,35 +236,41 @@ exposable_default_on_mouse(struct exposable *exposable, struct bar *bar,
 
     /* If this is a mouse click, and we have a handler, execute it */
     if (exposable->on_click[btn] != NULL && event == ON_MOUSE_CLICK) {
+        char *on_click = tags_expand_template(
+            exposable->on_click[btn], tag_snapshot_tags(exposable->on_click_tags));
+
         /* Need a writeable copy, whose scope *we* control */
-        char *cmd = strdup(exposable->on_click[btn]);
-        LOG_DBG("cmd = \"%s\"", exposable->on_click[btn]);
+        char *cmd = strdup(on_click);
+        LOG_DBG("cmd = \"%s\"", on_click);
 
         char **argv;
         if (!tokenize_cmdline(cmd, &argv)) {
             free(cmd);
+            free(on_click);
             return;
         }
 
         pid_t pid = fork();
-        if (pid == -1)
+        if (pid == -1) {
             LOG_ERRNO("failed to run on_click handler (fork)");
-        else if (pid > 0) {
+            free(cmd);
+            free(argv);
+        } else if (pid > 0) {
             /* Parent */
             free(cmd);
             free(argv);
 
             int wstatus;
             if (waitpid(pid, &wstatus, 0) == -1)
-                LOG_ERRNO("%s: failed to wait for on_click handler", exposable->on_click[btn]);
+                LOG_ERRNO("%s: failed to wait for on_click handler", on_click);
 
             if (WIFEXITED(wstatus)) {
                 if (WEXITSTATUS(wstatus) != 0)
-                    LOG_ERRNO_P(WEXITSTATUS(wstatus), "%s: failed to execute", exposable->on_click[btn]);
+                    LOG_ERRNO_P(WEXITSTATUS(wstatus), "%s: failed to execute", on_click);
             } else
-                LOG_ERR("%s: did not exit normally", exposable->on_click[btn]);
+                LOG_ERR("%s: did not exit normally", on_click);
 
-            LOG_DBG("%s: launched", exposable->on_click[btn]);
+            LOG_DBG("%s: launched", on_click);
         } else {
             /*
              * Use a pipe with O_CLOEXEC to communicate exec() failure
@@ -313,6 +365,8 @@ exposable_default_on_mouse(struct exposable *exposable, struct bar *bar,
                 break;
             }
         }
+
+        free(on_click);
     }
 }
 
@@ -323,10 +377,15 @@ exposable_common_new(const struct particle *particle, const struct tag_set *tags
     exposable->particle = particle;
 
     if (particle != NULL && particle->have_on_click_template) {
-        tags_expand_templates(
-            exposable->on_click,
-            (const char **)particle->on_click_templates,
-            MOUSE_BTN_COUNT, tags);
+        /*
+         * Expanded lazily, if clicked. The tag values are shared with
+         * everything else instantiated from the same tag set.
+         */
+        for (size_t i = 0; i < MOUSE_BTN_COUNT; i++)
+            exposable->on_click[i] = particle->on_click_templates[i];
+
+        if (particle->on_click_references_tags)
+            exposable->on_click_tags = tag_snapshot_ref(tag_set_snapshot(tags));
     }
     exposable->destroy = &exposable_default_destroy;
     exposable->on_mouse = &exposable_default_on_mouse;
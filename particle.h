@@ -1,4 +1,6 @@
 #pragma once
+#include <stdint.h>
+#include <sys/types.h>
 #include <pixman.h>
 
 #include <fcft/fcft.h>
@@ -37,6 +39,9 @@ struct particle {
     bool have_on_click_template;
     char *on_click_templates[MOUSE_BTN_COUNT];
 
+    /* True if any of the on-click templates references a tag */
+    bool on_click_references_tags;
+
     pixman_color_t foreground;
     struct fcft_font *font;
     enum font_shaping font_shaping;
@@ -58,7 +63,13 @@ struct exposable {
     void *private;
 
     int width; /* Should be set by begin_expose(), at latest */
-    char *on_click[MOUSE_BTN_COUNT];
+
+    /*
+     * On-click templates (owned by the particle), and a snapshot of
+     * the tag values they are expanded with, when clicked.
+     */
+    const char *on_click[MOUSE_BTN_COUNT];
+    struct tag_snapshot *on_click_tags;
 
     void (*destroy)(struct exposable *exposable);
     int (*begin_expose)(struct exposable *exposable);
@@ -87,6 +98,25 @@ void exposable_default_on_mouse(
     struct exposable *exposable, struct bar *bar,
     enum mouse_event event, enum mouse_button btn, int x, int y);
 
+/*
+ * Called from expose() by animated exposables: asks for the bar to be
+ * re-painted (without re-instantiating any modules' content) in
+ * 'delay_ns' nanoseconds. The bar collects the earliest request made
+ * while painting a frame, with exposable_take_frame_request().
+ */
+void exposable_request_frame(uint64_t delay_ns);
+
+/* Returns, and clears, the calling thread's frame request; 0 if none */
+uint64_t exposable_take_frame_request(void);
+
+/*
+ * Binary searches the sub-exposables' x-ranges (as laid out by
+ * begin_expose(); 'offsets' must be in ascending order). Returns the
+ * index of the sub-exposable at 'x', or -1 if there is none.
+ */
+ssize_t exposable_find_child(
+    size_t count, const int *offsets, const int *widths, int x);
+
 /* List of attributes *all* particles implement */
 #define PARTICLE_COMMON_ATTRS                           \
     {"margin", false, &conf_verify_unsigned},           \
@@ -14,6 +14,7 @@ struct private {
     struct exposable **exposables;
     size_t count;
     int *widths;
+    int *offsets;  /* Of each sub-exposable, relative to our own x */
 };
 
 static void
@@ -27,6 +28,7 @@ dynlist_destroy(struct exposable *exposable)
 
     free(e->exposables);
     free(e->widths);
+    free(e->offsets);
     free(e);
     free(exposable);
 }
@@ -39,11 +41,14 @@ dynlist_begin_expose(struct exposable *exposable)
     exposable->width = 0;
     bool have_at_least_one = false;
 
+    int x = 0;
     for (size_t i = 0; i < e->count; i++) {
         struct exposable *ee = e->exposables[i];
         e->widths[i] = ee->begin_expose(ee);
+        e->offsets[i] = x;
 
         assert(e->widths[i] >= 0);
+        x += e->left_spacing + e->widths[i] + e->right_spacing;
 
         if (e->widths[i] > 0) {
             exposable->width += e->left_spacing + e->widths[i] + e->right_spacing;
@@ -86,17 +91,12 @@ on_mouse(struct exposable *exposable, struct bar *bar,
         return;
     }
 
-    int px = /*p->left_margin;*/0;
-    for (size_t i = 0; i < e->count; i++) {
-        if (x >= px && x < px + e->exposables[i]->width) {
-            if (e->exposables[i]->on_mouse != NULL) {
-                e->exposables[i]->on_mouse(
-                    e->exposables[i], bar, event, btn, x - px, y);
-            }
-            return;
-        }
-
-        px += e->left_spacing + e->exposables[i]->width + e->right_spacing;
+    ssize_t i = exposable_find_child(e->count, e->offsets, e->widths, x);
+    if (i >= 0) {
+        struct exposable *ee = e->exposables[i];
+        if (ee->on_mouse != NULL)
+            ee->on_mouse(ee, bar, event, btn, x - e->offsets[i], y);
+        return;
     }
 
     LOG_DBG("on_mouse missed all sub-particles");
@@ -111,6 +111,7 @@ dynlist_exposable_new(struct exposable **exposables, size_t count,
     e->count = count;
     e->exposables = malloc(count * sizeof(e->exposables[0]));
     e->widths = calloc(count, sizeof(e->widths[0]));
+    e->offsets = calloc(count, sizeof(e->offsets[0]));
     e->left_spacing = left_spacing;
     e->right_spacing = right_spacing;
 
@@ -1,8 +1,9 @@
 #include <assert.h>
-#include <limits.h>
 #include <pixman.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
 
 #define LOG_MODULE "icon"
 #define LOG_ENABLE_DBG 1
@@ -12,9 +13,9 @@
 #include "../icon.h"
 #include "../log.h"
 #include "../particle.h"
+#include "../pixels.h"
 #include "../plugin.h"
 #include "../png-yambar.h"
-#include "../stride.h"
 #include "../svg.h"
 #include "../tag.h"
 
@@ -29,6 +30,125 @@ struct eprivate {
     bool is_png;
 };
 
+/*
+ * Icons loaded from disk, decoded and scaled to the icon size. Shared
+ * by all icon particles, since particles are re-instantiated each
+ * time their module's content changes. Entries are invalidated when
+ * the icon file is modified.
+ */
+struct cached_icon {
+    char *path;
+    int size;
+    struct timespec mtime;
+    struct pixels_shared *pixels;
+};
+
+/* Least recently used entries are evicted first */
+#define ICON_CACHE_MAX_ENTRIES 64
+
+static once_flag cache_init_once = ONCE_FLAG_INIT;
+static mtx_t cache_lock;
+static tll(struct cached_icon) cache = tll_init();
+
+static void
+cache_init(void)
+{
+    mtx_init(&cache_lock, mtx_plain);
+}
+
+static void
+cached_icon_free(struct cached_icon *icon)
+{
+    free(icon->path);
+    pixels_shared_unref(icon->pixels);
+}
+
+static pixman_image_t *
+load_icon_from_disk(const char *path, int size)
+{
+    size_t len = strlen(path);
+    if (len < 4) {
+        LOG_ERR("invalid icon path, not png or svg: %s", path);
+        return NULL;
+    }
+
+    if (strcmp(&path[len - 4], ".svg") == 0)
+        return svg_load(path, size);
+    else if (strcmp(&path[len - 4], ".png") == 0)
+        return png_load(path, size);
+
+    LOG_ERR("invalid icon path, not png or svg: %s", path);
+    return NULL;
+}
+
+static pixman_image_t *
+load_icon(const char *path, int size)
+{
+    call_once(&cache_init_once, &cache_init);
+
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        LOG_ERRNO("%s: failed to stat", path);
+        return NULL;
+    }
+
+    pixman_image_t *image = NULL;
+
+    mtx_lock(&cache_lock);
+    tll_foreach(cache, it) {
+        struct cached_icon *icon = &it->item;
+        if (icon->size != size || strcmp(icon->path, path) != 0)
+            continue;
+
+        if (icon->mtime.tv_sec == st.st_mtim.tv_sec &&
+            icon->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            struct cached_icon hit = *icon;
+            tll_remove(cache, it);
+            tll_push_front(cache, hit);
+            image = pixels_shared_image(hit.pixels);
+        } else {
+            LOG_DBG("%s: modified, reloading", path);
+            cached_icon_free(icon);
+            tll_remove(cache, it);
+        }
+        break;
+    }
+    mtx_unlock(&cache_lock);
+
+    if (image != NULL)
+        return image;
+
+    /* Load and scale without holding the lock */
+    pixman_image_t *loaded = load_icon_from_disk(path, size);
+    if (loaded == NULL)
+        return NULL;
+
+    struct pixels_shared *pixels = pixels_shared_new(loaded);
+    if (pixels == NULL) {
+        pixman_image_unref(loaded);
+        return NULL;
+    }
+
+    image = pixels_shared_image(pixels);
+
+    mtx_lock(&cache_lock);
+    tll_push_front(cache, ((struct cached_icon){
+        .path = strdup(path),
+        .size = size,
+        .mtime = st.st_mtim,
+        .pixels = pixels,
+    }));
+
+    while (tll_length(cache) > ICON_CACHE_MAX_ENTRIES) {
+        struct cached_icon evicted = tll_pop_back(cache);
+        cached_icon_free(&evicted);
+    }
+    mtx_unlock(&cache_lock);
+
+    return image;
+}
+
 static void
 exposable_destroy(struct exposable *exposable)
 {
@@ -68,26 +188,22 @@ expose(const struct exposable *exposable, pixman_image_t *pix, int x, int y, int
         return;
     }
 
-    int target_size = p->icon_size;
-    double baseline = (double)y + (double)(height - target_size) / 2.0;
-    double src_y = 0;
-    double src_x = 0;
-
-    // Pixmaps and PNGs may not be the correct size, ensure crop is
-    // centered
-    //
-    int png_w = pixman_image_get_width(e->image);
-    if (png_w != target_size) {
-        src_x = (double)(abs(target_size - png_w)) / 2.0;
-    }
-
-    int png_h = pixman_image_get_height(e->image);
-    if (png_h != target_size) {
-        src_y = (double)(abs(target_size - png_h)) / 2.0;
-    }
-
-    pixman_image_composite32(PIXMAN_OP_OVER, e->image, NULL, pix, src_x, src_y, 0, 0, x, baseline,
-                             target_size, target_size);
+    /*
+     * Images are scaled to fit the icon size, but are not necessarily
+     * square; center them. Anything larger is cropped (centered).
+     */
+    const int target_size = p->icon_size;
+    const int img_w = pixman_image_get_width(e->image);
+    const int img_h = pixman_image_get_height(e->image);
+
+    const int src_x = img_w > target_size ? (img_w - target_size) / 2 : 0;
+    const int src_y = img_h > target_size ? (img_h - target_size) / 2 : 0;
+    const int dst_x = x + (img_w < target_size ? (target_size - img_w) / 2 : 0);
+    const int dst_y = y + (height - target_size) / 2 + (img_h < target_size ? (target_size - img_h) / 2 : 0);
+    const int w = img_w < target_size ? img_w : target_size;
+    const int h = img_h < target_size ? img_h : target_size;
+
+    pixman_image_composite32(PIXMAN_OP_OVER, e->image, NULL, pix, src_x, src_y, 0, 0, dst_x, dst_y, w, h);
 }
 
 static struct exposable *
@@ -102,8 +218,6 @@ instantiate(const struct particle *particle, const struct tag_set *tags)
     char *icon_name = NULL;
     string_list_t basedirs = tll_init();
 
-    // TODO: An icon cache
-    //
     if (p->use_tag) {
         const struct icon_tag *tag = icon_tag_for_name(tags, name);
         LOG_DBG("finding icon tag: %s", name);
@@ -113,22 +227,7 @@ instantiate(const struct particle *particle, const struct tag_set *tags)
         }
 
         struct icon_pixmaps *pixmaps = tag->pixmaps(tag);
-        struct icon_pixmap *icon_pixmap = NULL;
-        int min_error = INT_MAX;
-        tll_foreach(pixmaps->list, it) {
-            int e = abs(particle->icon_size - it->item->size);
-            if (e < min_error) {
-                icon_pixmap = it->item;
-                min_error = e;
-            }
-        }
-
-        if (icon_pixmap) {
-            LOG_DBG("found pixmap");
-            e->image = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8, icon_pixmap->size, icon_pixmap->size,
-                                                (uint32_t *)icon_pixmap->pixels,
-                                                stride_for_format_and_width(PIXMAN_a8r8g8b8, icon_pixmap->size));
-        }
+        e->image = icon_pixmaps_get_image(pixmaps, particle->icon_size);
         // case ICON_TAG_TYPE_NAME: {
         //     icon_name = tag->icon_name(tag);
         //     tll_foreach(particle->basedirs->basedirs, it) { tll_push_back(basedirs, it->item); }
@@ -145,20 +244,10 @@ instantiate(const struct particle *particle, const struct tag_set *tags)
     if (icon_name) {
         int min_size = 0, max_size = 0;
 
-        char *icon_path = find_icon(particle->themes->themes, particle->basedirs->basedirs, icon_name, particle->icon_size, particle->icon_theme,
+        char *icon_path = find_icon(particle->themes, particle->basedirs->basedirs, icon_name, particle->icon_size, particle->icon_theme,
                                     &min_size, &max_size);
-        if (icon_path) {
-            int len = strlen(icon_path);
-            if (icon_path[len - 3] == 's') {
-                e->image = svg_load(icon_path, particle->icon_size);
-            } else if (icon_path[len - 3] == 'p') {
-                // TODO: png scaling
-                //
-                e->image = png_load(icon_path);
-            } else {
-                LOG_ERR("invalid icon path, not png or svg: %s", icon_path);
-            }
-        }
+        if (icon_path)
+            e->image = load_icon(icon_path, particle->icon_size);
         free(icon_path);
     }
 
@@ -17,6 +17,7 @@ struct private {
 struct eprivate {
     struct exposable **exposables;
     int *widths;
+    int *offsets;  /* Of each sub-exposable, relative to our own x */
     size_t count;
     int left_spacing, right_spacing;
 };
@@ -31,6 +32,7 @@ exposable_destroy(struct exposable *exposable)
 
     free(e->exposables);
     free(e->widths);
+    free(e->offsets);
     free(e);
     exposable_default_destroy(exposable);
 }
@@ -43,11 +45,14 @@ begin_expose(struct exposable *exposable)
 
     exposable->width = 0;
 
+    int x = exposable->particle->left_margin;
     for (size_t i = 0; i < e->count; i++) {
         struct exposable *ee = e->exposables[i];
         e->widths[i] = ee->begin_expose(ee);
+        e->offsets[i] = x;
 
         assert(e->widths[i] >= 0);
+        x += e->left_spacing + e->widths[i] + e->right_spacing;
 
         if (e->widths[i] > 0) {
             exposable->width += e->left_spacing + e->widths[i] + e->right_spacing;
@@ -88,7 +93,6 @@ static void
 on_mouse(struct exposable *exposable, struct bar *bar,
          enum mouse_event event, enum mouse_button btn, int x, int y)
 {
-    const struct particle *p = exposable->particle;
     const struct eprivate *e = exposable->private;
 
     if ((event == ON_MOUSE_MOTION &&
@@ -100,17 +104,12 @@ on_mouse(struct exposable *exposable, struct bar *bar,
         return;
     }
 
-    int px = p->left_margin;
-    for (size_t i = 0; i < e->count; i++) {
-        if (x >= px && x < px + e->exposables[i]->width) {
-            if (e->exposables[i]->on_mouse != NULL) {
-                e->exposables[i]->on_mouse(
-                    e->exposables[i], bar, event, btn, x - px, y);
-            }
-            return;
-        }
-
-        px += e->left_spacing + e->exposables[i]->width + e->right_spacing;
+    ssize_t i = exposable_find_child(e->count, e->offsets, e->widths, x);
+    if (i >= 0) {
+        struct exposable *ee = e->exposables[i];
+        if (ee->on_mouse != NULL)
+            ee->on_mouse(ee, bar, event, btn, x - e->offsets[i], y);
+        return;
     }
 
     /* We're between sub-particles (or in the left/right margin) */
@@ -125,6 +124,7 @@ instantiate(const struct particle *particle, const struct tag_set *tags)
     struct eprivate *e = calloc(1, sizeof(*e));
     e->exposables = malloc(p->count * sizeof(*e->exposables));
     e->widths = calloc(p->count, sizeof(*e->widths));
+    e->offsets = calloc(p->count, sizeof(*e->offsets));
     e->count = p->count;
     e->left_spacing = p->left_spacing;
     e->right_spacing = p->right_spacing;
@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define LOG_MODULE "marquee"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../char32.h"
+#include "../config.h"
+#include "../config-verify.h"
+#include "../particle.h"
+#include "../plugin.h"
+#include "../stride.h"
+
+#include <tllist.h>
+
+/* Number of unused strips to keep around (e.g. for dynlists) */
+#define MAX_UNUSED_STRIPS 16
+
+/*
+ * The text, rendered once, into an offscreen image. Shared between
+ * the particle's cache and its exposables. Instantiating, and
+ * destroying, exposables is serialized by the bar, and thus the
+ * reference count isn't atomic.
+ */
+struct strip {
+    int ref_count;
+    char *text;
+    pixman_image_t *pix;  /* NULL if the text is empty */
+    int width;
+    int height;
+    int baseline;         /* Relative to the top of the strip */
+    uint64_t start;       /* When we started scrolling, in ns */
+};
+
+struct private {
+    char *text;
+    int width;
+    int speed;  /* Pixels per second */
+    int gap;    /* Pixels between the end of the text, and its repetition */
+
+    /* Rendered texts, least recently used first */
+    tll(struct strip *) strips;
+};
+
+struct eprivate {
+    struct strip *strip;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void
+strip_unref(struct strip *strip)
+{
+    if (strip == NULL || --strip->ref_count > 0)
+        return;
+
+    if (strip->pix != NULL) {
+        free(pixman_image_get_data(strip->pix));
+        pixman_image_unref(strip->pix);
+    }
+    free(strip->text);
+    free(strip);
+}
+
+static struct strip *
+strip_new(const struct particle *particle, char *text)
+{
+    struct fcft_font *font = particle->font;
+
+    struct strip *strip = calloc(1, sizeof(*strip));
+    strip->ref_count = 1;
+    strip->text = text;
+    strip->start = now_ns();
+
+    char32_t *wtext = ambstoc32(text);
+    size_t chars = wtext != NULL ? c32len(wtext) : 0;
+
+    struct fcft_text_run *run = NULL;
+    const struct fcft_glyph **glyphs = NULL;
+    long *kern_x = calloc(chars > 0 ? chars : 1, sizeof(kern_x[0]));
+    size_t count = 0;
+
+    if (particle->font_shaping == FONT_SHAPE_FULL &&
+        fcft_capabilities() & FCFT_CAPABILITY_TEXT_RUN_SHAPING)
+    {
+        run = fcft_rasterize_text_run_utf32(
+            font, chars, wtext, FCFT_SUBPIXEL_NONE);
+
+        if (run != NULL) {
+            glyphs = run->glyphs;
+            count = run->count;
+        }
+    }
+
+    const struct fcft_glyph **allocated_glyphs = NULL;
+    if (glyphs == NULL) {
+        allocated_glyphs = malloc((chars > 0 ? chars : 1) * sizeof(glyphs[0]));
+
+        for (size_t i = 0; i < chars; i++) {
+            const struct fcft_glyph *glyph = fcft_rasterize_char_utf32(
+                font, wtext[i], FCFT_SUBPIXEL_NONE);
+
+            if (glyph == NULL)
+                continue;
+
+            if (i > 0)
+                fcft_kerning(font, wtext[i - 1], wtext[i], &kern_x[count], NULL);
+
+            allocated_glyphs[count++] = glyph;
+        }
+
+        glyphs = allocated_glyphs;
+    }
+
+    /* Size of the strip; glyphs may extend beyond the font's ascent/descent */
+    int width = 0;
+    int above = font->ascent;
+    int below = font->descent > 0 ? font->descent : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct fcft_glyph *glyph = glyphs[i];
+        width += kern_x[i] + glyph->advance.x;
+
+        if (glyph->y > above)
+            above = glyph->y;
+        if (glyph->height - glyph->y > below)
+            below = glyph->height - glyph->y;
+    }
+
+    strip->width = width;
+    strip->height = above + below;
+    strip->baseline = above;
+
+    if (width > 0 && strip->height > 0) {
+        const int stride = stride_for_format_and_width(PIXMAN_a8r8g8b8, width);
+        uint32_t *data = calloc((size_t)stride * strip->height, 1);
+
+        strip->pix = pixman_image_create_bits_no_clear(
+            PIXMAN_a8r8g8b8, width, strip->height, data, stride);
+
+        pixman_image_t *fg = pixman_image_create_solid_fill(&particle->foreground);
+
+        int x = 0;
+        for (size_t i = 0; i < count; i++) {
+            const struct fcft_glyph *glyph = glyphs[i];
+            x += kern_x[i];
+
+            if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
+                /* Pre-rendered image (typically a color emoji) */
+                pixman_image_composite32(
+                    PIXMAN_OP_OVER, glyph->pix, NULL, strip->pix, 0, 0, 0, 0,
+                    x + glyph->x, strip->baseline - glyph->y,
+                    glyph->width, glyph->height);
+            } else {
+                /* Alpha mask */
+                pixman_image_composite32(
+                    PIXMAN_OP_OVER, fg, glyph->pix, strip->pix, 0, 0, 0, 0,
+                    x + glyph->x, strip->baseline - glyph->y,
+                    glyph->width, glyph->height);
+            }
+
+            x += glyph->advance.x;
+        }
+
+        pixman_image_unref(fg);
+    }
+
+    LOG_DBG("%s: %dx%d", text, strip->width, strip->height);
+
+    fcft_text_run_destroy(run);
+    free(allocated_glyphs);
+    free(kern_x);
+    free(wtext);
+    return strip;
+}
+
+static void
+exposable_destroy(struct exposable *exposable)
+{
+    struct eprivate *e = exposable->private;
+    strip_unref(e->strip);
+    free(e);
+    exposable_default_destroy(exposable);
+}
+
+static int
+begin_expose(struct exposable *exposable)
+{
+    const struct private *p = exposable->particle->private;
+    const struct eprivate *e = exposable->private;
+
+    exposable->width =
+        exposable->particle->left_margin +
+        (e->strip->width < p->width ? e->strip->width : p->width) +
+        exposable->particle->right_margin;
+
+    return exposable->width;
+}
+
+static void
+expose(const struct exposable *exposable, pixman_image_t *pix, int x, int y, int height)
+{
+    exposable_render_deco(exposable, pix, x, y, height);
+
+    const struct private *p = exposable->particle->private;
+    const struct eprivate *e = exposable->private;
+    const struct strip *strip = e->strip;
+    const struct fcft_font *font = exposable->particle->font;
+
+    if (strip->pix == NULL)
+        return;
+
+    /* Same vertical placement as the string particle */
+    const int baseline = y +
+        (height + font->ascent + font->descent) / 2 -
+        (font->descent > 0 ? font->descent : 0);
+    const int strip_y = baseline - strip->baseline;
+
+    const int slot_x = x + exposable->particle->left_margin;
+
+    if (strip->width <= p->width) {
+        /* Fits; no need to scroll */
+        pixman_image_composite32(
+            PIXMAN_OP_OVER, strip->pix, NULL, pix, 0, 0, 0, 0,
+            slot_x, strip_y, strip->width, strip->height);
+        return;
+    }
+
+    /* The strip, followed by a gap, repeats indefinitely */
+    const uint64_t period = strip->width + p->gap;
+    const uint64_t elapsed_ms = (now_ns() - strip->start) / 1000000;
+    const int offset = (elapsed_ms * p->speed / 1000) % period;
+
+    for (int i = 0; i < 2; i++) {
+        const int copy_x = slot_x - offset + i * (int)period;
+        const int start = copy_x > slot_x ? copy_x : slot_x;
+        const int end = copy_x + strip->width < slot_x + p->width
+            ? copy_x + strip->width
+            : slot_x + p->width;
+
+        if (start >= end)
+            continue;
+
+        pixman_image_composite32(
+            PIXMAN_OP_OVER, strip->pix, NULL, pix, start - copy_x, 0, 0, 0,
+            start, strip_y, end - start, strip->height);
+    }
+
+    /* Next frame, when we've moved one pixel */
+    if (p->speed > 0)
+        exposable_request_frame(1000000000ull / p->speed);
+}
+
+static struct exposable *
+instantiate(const struct particle *particle, const struct tag_set *tags)
+{
+    struct private *p = particle->private;
+    struct eprivate *e = calloc(1, sizeof(*e));
+
+    char *text = tags_expand_template(p->text, tags);
+
+    /* Re-use the strip, and thus the scroll position, if the text is unchanged */
+    tll_foreach(p->strips, it) {
+        if (strcmp(it->item->text, text) == 0) {
+            e->strip = it->item;
+            tll_remove(p->strips, it);
+            free(text);
+            break;
+        }
+    }
+
+    if (e->strip == NULL)
+        e->strip = strip_new(particle, text);
+
+    tll_push_back(p->strips, e->strip);
+    e->strip->ref_count++;
+
+    /* Evict the least recently used strips not referenced by any exposable */
+    size_t unused = 0;
+    tll_foreach(p->strips, it)
+        unused += it->item->ref_count == 1;
+
+    tll_foreach(p->strips, it) {
+        if (unused <= MAX_UNUSED_STRIPS)
+            break;
+
+        if (it->item->ref_count == 1) {
+            strip_unref(it->item);
+            tll_remove(p->strips, it);
+            unused--;
+        }
+    }
+
+    struct exposable *exposable = exposable_common_new(particle, tags);
+    exposable->private = e;
+    exposable->destroy = &exposable_destroy;
+    exposable->begin_expose = &begin_expose;
+    exposable->expose = &expose;
+    return exposable;
+}
+
+static void
+particle_destroy(struct particle *particle)
+{
+    struct private *p = particle->private;
+    tll_free_and_free(p->strips, strip_unref);
+    free(p->text);
+    free(p);
+    particle_default_destroy(particle);
+}
+
+static struct particle *
+marquee_new(struct particle *common, const char *text, int width, int speed, int gap)
+{
+    struct private *p = calloc(1, sizeof(*p));
+    p->text = strdup(text);
+    p->width = width;
+    p->speed = speed;
+    p->gap = gap;
+
+    common->private = p;
+    common->destroy = &particle_destroy;
+    common->instantiate = &instantiate;
+    return common;
+}
+
+static struct particle *
+from_conf(const struct yml_node *node, struct particle *common)
+{
+    const struct yml_node *text = yml_get_value(node, "text");
+    const struct yml_node *width = yml_get_value(node, "width");
+    const struct yml_node *speed = yml_get_value(node, "speed");
+    const struct yml_node *gap = yml_get_value(node, "gap");
+
+    return marquee_new(
+        common,
+        yml_value_as_string(text),
+        yml_value_as_int(width),
+        speed != NULL ? yml_value_as_int(speed) : 30,
+        gap != NULL ? yml_value_as_int(gap) : 20);
+}
+
+static bool
+verify_conf(keychain_t *chain, const struct yml_node *node)
+{
+    static const struct attr_info attrs[] = {
+        {"text", true, &conf_verify_string},
+        {"width", true, &conf_verify_unsigned},
+        {"speed", false, &conf_verify_unsigned},
+        {"gap", false, &conf_verify_unsigned},
+        PARTICLE_COMMON_ATTRS,
+    };
+
+    return conf_verify_dict(chain, node, attrs);
+}
+
+const struct particle_iface particle_marquee_iface = {
+    .verify_conf = &verify_conf,
+    .from_conf = &from_conf,
+};
+
+#if defined(CORE_PLUGINS_AS_SHARED_LIBRARIES)
+extern const struct particle_iface iface __attribute__((weak, alias("particle_marquee_iface")));
+#endif
@@ -24,6 +24,7 @@ struct private {
 struct eprivate {
     size_t count;
     struct exposable **exposables;
+    int clickable_width;  /* Of the empty/fill cells; set by begin_expose() */
 };
 
 static void
@@ -60,6 +61,7 @@ begin_expose(struct exposable *exposable)
     bool have_at_least_one = false;
 
     exposable->width = 0;
+    e->clickable_width = 0;
 
     /* Sub-exposables */
     for (size_t i = 0; i < e->count; i++) {
@@ -70,6 +72,9 @@ begin_expose(struct exposable *exposable)
             exposable->width += width;
             have_at_least_one = true;
         }
+
+        if (i > 0 && i < e->count - 1)
+            e->clickable_width += width;
     }
 
     /* Margins */
@@ -121,9 +126,7 @@ on_mouse(struct exposable *exposable, struct bar *bar, enum mouse_event event,
     }
 
     /* Size of the clickable area (the empty/fill cells) */
-    int clickable_width = 0;
-    for (size_t i = 1; i < e->count - 1; i++)
-        clickable_width += e->exposables[i]->width;
+    const int clickable_width = e->clickable_width;
 
     /* Mouse is *after* progress-bar? */
     if (x - x_offset > clickable_width) {
@@ -143,48 +146,46 @@ on_mouse(struct exposable *exposable, struct bar *bar, enum mouse_event event,
      * Hack-warning!
      *
      * In order to pass the *clicked* position to the on_click
-     * handler, we expand the handler *again* (first time would be
-     * when the particle instantiated us).
-     *
-     * We pass a single tag, "where", which is a percentage value.
+     * handler, we temporarily replace the tags the handler is
+     * expanded with (a snapshot, taken when the particle instantiated
+     * us), with a copy that also has the clicked position.
      *
-     * Keep a reference to the un-expanded string, to be able to
-     * reset it after executing the handler.
+     * We pass a single additional tag, "where", which is a
+     * percentage value.
      *
      * Note that we only consider the actual progress bar to be
      * clickable. This means we ignore the start and end markers.
      */
 
-    /* Remember the original handler, so that we can restore it */
-    char *original[MOUSE_BTN_COUNT];
-    for (size_t i = 0; i < MOUSE_BTN_COUNT; i++)
-        original[i] = exposable->on_click[i];
+    /* Remember the original tags, so that we can restore them */
+    struct tag_snapshot *original = exposable->on_click_tags;
 
     if (event == ON_MOUSE_CLICK) {
         long where = clickable_width > 0
             ? 100 * (x - x_offset) / clickable_width
             : 0;
 
-        struct tag_set tags = {
-            .tags = (struct tag *[]){tag_new_int(NULL, "where", where)},
-            .count = 1,
-        };
+        const struct tag_set *tags = tag_snapshot_tags(original);
+        const size_t count = tags != NULL ? tags->count : 0;
+
+        struct tag *all_tags[count + 1];
+        for (size_t i = 0; i < count; i++)
+            all_tags[i] = tags->tags[i];
+        all_tags[count] = tag_new_int(NULL, "where", where);
 
-        tags_expand_templates(
-            exposable->on_click, (const char **)exposable->on_click,
-            MOUSE_BTN_COUNT, &tags);
-        tag_set_destroy(&tags);
+        const struct tag_set with_where = {.tags = all_tags, .count = count + 1};
+        exposable->on_click_tags = tag_snapshot_new(&with_where);
+
+        all_tags[count]->destroy(all_tags[count]);
     }
 
     /* Call default implementation, which will execute our handler */
     exposable_default_on_mouse(exposable, bar, event, btn, x, y);
 
     if (event == ON_MOUSE_CLICK) {
-        /* Reset handler string */
-        for (size_t i = 0; i < MOUSE_BTN_COUNT; i++) {
-            free(exposable->on_click[i]);
-            exposable->on_click[i] = original[i];
-        }
+        /* Reset handler tags */
+        tag_snapshot_unref(exposable->on_click_tags);
+        exposable->on_click_tags = original;
     }
 }
 
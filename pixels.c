@@ -0,0 +1,387 @@
+#include "pixels.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#if defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+ #include <immintrin.h>
+ #define HAVE_X86_TARGET_ATTR
+#endif
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+ #include <arm_neon.h>
+#endif
+
+#define LOG_MODULE "pixels"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+/* (c * a) / 255, correctly rounded */
+static inline uint8_t
+mul_div_255(uint8_t c, uint8_t a)
+{
+    uint32_t t = (uint32_t)c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t
+premultiply_argb(uint32_t argb)
+{
+    const uint8_t a = argb >> 24;
+
+    if (a == 0xff)
+        return argb;
+    if (a == 0x00)
+        return 0;
+
+    return (uint32_t)a << 24 |
+        (uint32_t)mul_div_255((argb >> 16) & 0xff, a) << 16 |
+        (uint32_t)mul_div_255((argb >> 8) & 0xff, a) << 8 |
+        (uint32_t)mul_div_255(argb & 0xff, a);
+}
+
+static void
+argb32_be_to_premultiplied_scalar(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    for (size_t i = 0; i < count; i++, src += 4) {
+        const uint32_t argb =
+            (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 |
+            (uint32_t)src[2] << 8 | (uint32_t)src[3];
+        dst[i] = premultiply_argb(argb);
+    }
+}
+
+#if defined(__SSE2__)
+/*
+ * Premultiplies four host order ARGB pixels. Color channels are
+ * widened to 16 bits, multiplied with their pixel's alpha, and
+ * divided by 255 using the same rounding as mul_div_255(). The
+ * alpha channel itself is passed through unmodified.
+ */
+static inline __m128i
+premultiply_sse2(__m128i px)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000);
+
+    __m128i lo = _mm_unpacklo_epi8(px, zero);
+    __m128i hi = _mm_unpackhi_epi8(px, zero);
+
+    __m128i alo = _mm_shufflehi_epi16(
+        _mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i ahi = _mm_shufflehi_epi16(
+        _mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+
+    lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+    hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    __m128i res = _mm_packus_epi16(lo, hi);
+    return _mm_or_si128(
+        _mm_andnot_si128(alpha_mask, res), _mm_and_si128(alpha_mask, px));
+}
+
+static inline __m128i
+bswap32_sse2(__m128i x)
+{
+    /* SSE2 has no byte shuffle; swap 16-bit halves, then bytes */
+    x = _mm_or_si128(_mm_slli_epi32(x, 16), _mm_srli_epi32(x, 16));
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static size_t
+argb32_be_to_premultiplied_sse2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)&src[i * 4]);
+        _mm_storeu_si128((__m128i *)&dst[i], premultiply_sse2(bswap32_sse2(px)));
+    }
+    return i;
+}
+
+static size_t
+premultiply_in_place_sse2(uint32_t *data, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)&data[i]);
+        _mm_storeu_si128((__m128i *)&data[i], premultiply_sse2(px));
+    }
+    return i;
+}
+#endif
+
+#if defined(HAVE_X86_TARGET_ATTR)
+/* AVX2 version of premultiply_sse2(), eight pixels at a time */
+__attribute__((target("avx2")))
+static inline __m256i
+premultiply_avx2(__m256i px)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i alpha_mask = _mm256_set1_epi32((int)0xff000000);
+    const __m256i alpha_bcast = _mm256_setr_epi8(
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+
+    /* Unpack/pack operate per 128-bit lane; ordering is preserved */
+    __m256i lo = _mm256_unpacklo_epi8(px, zero);
+    __m256i hi = _mm256_unpackhi_epi8(px, zero);
+    __m256i alo = _mm256_shuffle_epi8(lo, alpha_bcast);
+    __m256i ahi = _mm256_shuffle_epi8(hi, alpha_bcast);
+
+    lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), round);
+    hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), round);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+
+    __m256i res = _mm256_packus_epi16(lo, hi);
+    return _mm256_or_si256(
+        _mm256_andnot_si256(alpha_mask, res), _mm256_and_si256(alpha_mask, px));
+}
+
+__attribute__((target("avx2")))
+static size_t
+argb32_be_to_premultiplied_avx2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    const __m256i bswap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *)&src[i * 4]);
+        px = _mm256_shuffle_epi8(px, bswap);
+        _mm256_storeu_si256((__m256i *)&dst[i], premultiply_avx2(px));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+premultiply_in_place_avx2(uint32_t *data, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *)&data[i]);
+        _mm256_storeu_si256((__m256i *)&data[i], premultiply_avx2(px));
+    }
+    return i;
+}
+
+static bool
+have_avx2(void)
+{
+    static int cached = -1;
+    if (cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2");
+    }
+    return cached;
+}
+#endif
+
+#if defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint8x16_t
+mul_div_255_neon(uint8x16_t c, uint8x16_t a)
+{
+    uint16x8_t lo = vmull_u8(vget_low_u8(c), vget_low_u8(a));
+    uint16x8_t hi = vmull_u8(vget_high_u8(c), vget_high_u8(a));
+    lo = vaddq_u16(lo, vrshrq_n_u16(lo, 8));
+    hi = vaddq_u16(hi, vrshrq_n_u16(hi, 8));
+    return vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+}
+
+static size_t
+argb32_be_to_premultiplied_neon(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        /* De-interleave big endian A, R, G, B planes */
+        uint8x16x4_t in = vld4q_u8(&src[i * 4]);
+        uint8x16x4_t out;
+
+        /* Re-interleave as little endian B, G, R, A */
+        out.val[0] = mul_div_255_neon(in.val[3], in.val[0]);
+        out.val[1] = mul_div_255_neon(in.val[2], in.val[0]);
+        out.val[2] = mul_div_255_neon(in.val[1], in.val[0]);
+        out.val[3] = in.val[0];
+        vst4q_u8((uint8_t *)&dst[i], out);
+    }
+    return i;
+}
+
+static size_t
+premultiply_in_place_neon(uint32_t *data, size_t count)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        /* Little endian; alpha is the last byte of each pixel */
+        uint8x16x4_t px = vld4q_u8((const uint8_t *)&data[i]);
+        px.val[0] = mul_div_255_neon(px.val[0], px.val[3]);
+        px.val[1] = mul_div_255_neon(px.val[1], px.val[3]);
+        px.val[2] = mul_div_255_neon(px.val[2], px.val[3]);
+        vst4q_u8((uint8_t *)&data[i], px);
+    }
+    return i;
+}
+#endif
+
+void
+pixels_argb32_be_to_premultiplied(uint32_t *dst, const void *_src, size_t count)
+{
+    const uint8_t *src = _src;
+    size_t done = 0;
+
+#if defined(HAVE_X86_TARGET_ATTR)
+    if (have_avx2())
+        done = argb32_be_to_premultiplied_avx2(dst, src, count);
+#endif
+#if defined(__SSE2__)
+    done += argb32_be_to_premultiplied_sse2(
+        &dst[done], &src[done * 4], count - done);
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    done += argb32_be_to_premultiplied_neon(
+        &dst[done], &src[done * 4], count - done);
+#endif
+
+    argb32_be_to_premultiplied_scalar(&dst[done], &src[done * 4], count - done);
+}
+
+void
+pixels_premultiply(uint32_t *data, size_t count)
+{
+    size_t done = 0;
+
+#if defined(HAVE_X86_TARGET_ATTR)
+    if (have_avx2())
+        done = premultiply_in_place_avx2(data, count);
+#endif
+#if defined(__SSE2__)
+    done += premultiply_in_place_sse2(&data[done], count - done);
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    done += premultiply_in_place_neon(&data[done], count - done);
+#endif
+
+    for (size_t i = done; i < count; i++)
+        data[i] = premultiply_argb(data[i]);
+}
+
+pixman_image_t *
+pixels_scale_image(pixman_image_t *src, int width, int height)
+{
+    const int src_width = pixman_image_get_width(src);
+    const int src_height = pixman_image_get_height(src);
+
+    pixman_image_t *dst = pixman_image_create_bits(
+        PIXMAN_a8r8g8b8, width, height, NULL, 0);
+    if (dst == NULL) {
+        LOG_ERR("failed to allocate %dx%d image", width, height);
+        return NULL;
+    }
+
+    if (src_width == width && src_height == height) {
+        pixman_image_composite32(
+            PIXMAN_OP_SRC, src, NULL, dst, 0, 0, 0, 0, 0, 0, width, height);
+        return dst;
+    }
+
+    const double scale_x = (double)src_width / width;
+    const double scale_y = (double)src_height / height;
+
+    pixman_transform_t transform;
+    pixman_transform_init_scale(
+        &transform,
+        pixman_double_to_fixed(scale_x), pixman_double_to_fixed(scale_y));
+    pixman_image_set_transform(src, &transform);
+
+    if (scale_x > 1. || scale_y > 1.) {
+        /*
+         * Downscaling; bilinear filtering only samples the four
+         * closest source pixels, and would alias badly. Use a box
+         * filter covering all source pixels instead.
+         */
+        int param_count = 0;
+        pixman_fixed_t *params = pixman_filter_create_separable_convolution(
+            &param_count,
+            pixman_double_to_fixed(scale_x > 1. ? scale_x : 1.),
+            pixman_double_to_fixed(scale_y > 1. ? scale_y : 1.),
+            PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+            PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+            1, 1);
+
+        pixman_image_set_filter(
+            src, PIXMAN_FILTER_SEPARABLE_CONVOLUTION, params, param_count);
+        free(params);
+    } else
+        pixman_image_set_filter(src, PIXMAN_FILTER_BILINEAR, NULL, 0);
+
+    pixman_image_composite32(
+        PIXMAN_OP_SRC, src, NULL, dst, 0, 0, 0, 0, 0, 0, width, height);
+
+    /* Restore, in case the source image is used elsewhere */
+    pixman_image_set_transform(src, NULL);
+    pixman_image_set_filter(src, PIXMAN_FILTER_FAST, NULL, 0);
+    return dst;
+}
+
+struct pixels_shared {
+    atomic_size_t refcount;
+    pixman_image_t *image;
+};
+
+struct pixels_shared *
+pixels_shared_new(pixman_image_t *image)
+{
+    struct pixels_shared *shared = malloc(sizeof(*shared));
+    if (shared == NULL)
+        return NULL;
+
+    atomic_init(&shared->refcount, 1);
+    shared->image = image;
+    return shared;
+}
+
+void
+pixels_shared_unref(struct pixels_shared *shared)
+{
+    if (shared == NULL)
+        return;
+
+    if (atomic_fetch_sub(&shared->refcount, 1) == 1) {
+        pixman_image_unref(shared->image);
+        free(shared);
+    }
+}
+
+static void
+shared_image_destroy(pixman_image_t *image, void *data)
+{
+    pixels_shared_unref(data);
+}
+
+pixman_image_t *
+pixels_shared_image(struct pixels_shared *shared)
+{
+    pixman_image_t *src = shared->image;
+    pixman_image_t *image = pixman_image_create_bits_no_clear(
+        pixman_image_get_format(src),
+        pixman_image_get_width(src),
+        pixman_image_get_height(src),
+        pixman_image_get_data(src),
+        pixman_image_get_stride(src));
+
+    if (image == NULL)
+        return NULL;
+
+    atomic_fetch_add(&shared->refcount, 1);
+    pixman_image_set_destroy_function(image, &shared_image_destroy, shared);
+    return image;
+}
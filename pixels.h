@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pixman.h>
+
+/*
+ * Converts non-premultiplied ARGB32, in network byte order (as used
+ * by e.g. StatusNotifierItem pixmaps), to premultiplied ARGB32 in
+ * host byte order (i.e. PIXMAN_a8r8g8b8).
+ *
+ * 'src' does not have to be aligned.
+ */
+void pixels_argb32_be_to_premultiplied(
+    uint32_t *dst, const void *src, size_t count);
+
+/*
+ * Premultiplies 'count' host byte order 32-bit pixels, in place. The
+ * alpha channel must be in the most significant byte; the order of
+ * the color channels does not matter (i.e. works for both ARGB32 and
+ * ABGR32).
+ */
+void pixels_premultiply(uint32_t *data, size_t count);
+
+/*
+ * Returns a new image, 'width' x 'height' pixels, with 'src' scaled
+ * to fit. Uses a box filter when downscaling, and bilinear filtering
+ * when upscaling.
+ */
+pixman_image_t *pixels_scale_image(pixman_image_t *src, int width, int height);
+
+/*
+ * Immutable, reference counted, pixel data, that can be shared
+ * between threads.
+ *
+ * pixman's image reference counting is not thread safe, meaning a
+ * cached pixman image cannot be handed out to multiple threads. Use
+ * pixels_shared_image() instead, which returns a new pixman image
+ * (without copying any pixels) owned by the caller. The shared data
+ * is kept alive until the last such image has been unref:ed.
+ *
+ * pixels_shared_new() takes ownership of 'image'; it must not be
+ * modified after this.
+ */
+struct pixels_shared;
+
+struct pixels_shared *pixels_shared_new(pixman_image_t *image);
+void pixels_shared_unref(struct pixels_shared *shared);
+pixman_image_t *pixels_shared_image(struct pixels_shared *shared);
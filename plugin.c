@@ -102,6 +102,7 @@
 EXTERN_PARTICLE(empty);
 EXTERN_PARTICLE(list);
 EXTERN_PARTICLE(map);
+EXTERN_PARTICLE(marquee);
 EXTERN_PARTICLE(progress_bar);
 EXTERN_PARTICLE(ramp);
 EXTERN_PARTICLE(string);
@@ -232,6 +233,7 @@ init(void)
     REGISTER_CORE_PARTICLE(empty, empty);
     REGISTER_CORE_PARTICLE(list, list);
     REGISTER_CORE_PARTICLE(map, map);
+    REGISTER_CORE_PARTICLE(marquee, marquee);
     REGISTER_CORE_PARTICLE(progress-bar, progress_bar);
     REGISTER_CORE_PARTICLE(ramp, ramp);
     REGISTER_CORE_PARTICLE(string, string);
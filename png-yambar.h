@@ -1,5 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
 #include <pixman.h>
 
-pixman_image_t *png_load(const char *path);
+/*
+ * Loads a PNG image. If 'size' is positive, the image is scaled to
+ * fit a 'size' x 'size' square (preserving its aspect ratio). Large
+ * images are decoded at a reduced resolution, when possible.
+ */
+pixman_image_t *png_load(const char *path, int size);
+
+/* Writes an ARGB32 (or XRGB32) image to a PNG file */
+bool png_save(const char *path, pixman_image_t *image);
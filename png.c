@@ -11,10 +11,54 @@
 #define LOG_MODULE "png"
 #define LOG_ENABLE_DBG 0
 #include "log.h"
+#include "pixels.h"
 #include "stride.h"
 
+static void
+free_image_data(pixman_image_t *image, void *data)
+{
+    free(data);
+}
+
+/*
+ * Accumulates one decoded row into 'acc', summing each channel of
+ * 'factor' consecutive source pixels into a single destination pixel.
+ */
+static void
+accumulate_row(uint32_t *acc, const uint8_t *row, int width, int bpp, int factor)
+{
+    for (int x = 0; x < width; x++) {
+        uint32_t *dst = &acc[(x / factor) * bpp];
+        const uint8_t *src = &row[x * bpp];
+
+        for (int c = 0; c < bpp; c++)
+            dst[c] += src[c];
+    }
+}
+
+/*
+ * Writes the average of the accumulated 'rows' x 'factor' (or less,
+ * for the last column) source pixels to 'dst', and resets the
+ * accumulator.
+ */
+static void
+flush_row(uint8_t *dst, uint32_t *acc, int src_width, int dst_width,
+          int bpp, int factor, int rows)
+{
+    for (int x = 0; x < dst_width; x++) {
+        const int cols = x < dst_width - 1 ? factor : src_width - x * factor;
+        const uint32_t count = cols * rows;
+
+        for (int c = 0; c < bpp; c++) {
+            uint32_t *a = &acc[x * bpp + c];
+            dst[x * bpp + c] = (*a + count / 2) / count;
+            *a = 0;
+        }
+    }
+}
+
 pixman_image_t *
-png_load(const char *path)
+png_load(const char *path, int size)
 {
     pixman_image_t *pix = NULL;
 
@@ -23,6 +67,8 @@ png_load(const char *path)
     png_infop info_ptr = NULL;
     png_bytepp row_pointers = NULL;
     uint8_t *image_data = NULL;
+    uint8_t *row = NULL;
+    uint32_t *acc = NULL;
 
     /* open file and test for it being a png */
     if ((fp = fopen(path, "rb")) == NULL) {
@@ -109,29 +155,191 @@ png_load(const char *path)
 
     png_read_update_info(png_ptr, info_ptr);
 
+    /*
+     * libpng has no reduced resolution decoding. But, for
+     * non-interlaced images, we can decode row by row, and box filter
+     * the image by an integer factor while decoding. This way, we
+     * never allocate (or scale) the full size image. The factor is
+     * chosen such that the intermediate image is still at least twice
+     * the target size, leaving the final (non-integer) scaling to
+     * pixman.
+     */
+    int factor = 1;
+    if (size > 0 &&
+        png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_NONE)
+    {
+        const int min_dim = width < height ? width : height;
+        factor = min_dim / (2 * size);
+        if (factor < 1)
+            factor = 1;
+    }
+
+    const int dst_width = (width + factor - 1) / factor;
+    const int dst_height = (height + factor - 1) / factor;
+
     size_t row_bytes __attribute__((unused)) = png_get_rowbytes(png_ptr, info_ptr);
-    int stride = stride_for_format_and_width(format, width);
-    image_data = malloc(height * stride);
+    int stride = stride_for_format_and_width(format, dst_width);
+    image_data = malloc(dst_height * stride);
 
     LOG_DBG("stride=%d, row-bytes=%zu", stride, row_bytes);
-    assert(stride >= row_bytes);
 
-    row_pointers = malloc(height * sizeof(png_bytep));
-    for (int i = 0; i < height; i++)
-        row_pointers[i] = &image_data[i * stride];
+    if (factor == 1) {
+        assert(stride >= row_bytes);
+
+        row_pointers = malloc(height * sizeof(png_bytep));
+        for (int i = 0; i < height; i++)
+            row_pointers[i] = &image_data[i * stride];
 
-    png_read_image(png_ptr, row_pointers);
+        png_read_image(png_ptr, row_pointers);
+    } else {
+        LOG_DBG("%s: decoding at 1/%d resolution: %dx%d",
+                path, factor, dst_width, dst_height);
 
-    pix = pixman_image_create_bits_no_clear(format, width, height, (uint32_t *)image_data, stride);
+        const int bpp = PIXMAN_FORMAT_BPP(format) / 8;
+        row = malloc(row_bytes);
+        acc = calloc(dst_width * bpp, sizeof(acc[0]));
+
+        int rows = 0;
+        for (int y = 0; y < height; y++) {
+            png_read_row(png_ptr, row, NULL);
+            accumulate_row(acc, row, width, bpp, factor);
+
+            if (++rows == factor || y == height - 1) {
+                flush_row(&image_data[(y / factor) * stride], acc,
+                          width, dst_width, bpp, factor, rows);
+                rows = 0;
+            }
+        }
+
+        png_read_end(png_ptr, NULL);
+    }
+
+    pix = pixman_image_create_bits_no_clear(
+        format, dst_width, dst_height, (uint32_t *)image_data, stride);
+    if (pix != NULL)
+        pixman_image_set_destroy_function(pix, &free_image_data, image_data);
 
 err:
     if (pix == NULL)
         free(image_data);
     free(row_pointers);
+    free(row);
+    free(acc);
     if (png_ptr != NULL)
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
     if (fp != NULL)
         fclose(fp);
 
-    return pix;
+    if (pix == NULL || size <= 0)
+        return pix;
+
+    const int pix_width = pixman_image_get_width(pix);
+    const int pix_height = pixman_image_get_height(pix);
+
+    if (pix_width == size && pix_height == size)
+        return pix;
+
+    /* Scale to fit, preserving the aspect ratio */
+    int scaled_width = size;
+    int scaled_height = size;
+    if (pix_width > pix_height)
+        scaled_height = (int)((double)size * pix_height / pix_width + 0.5);
+    else if (pix_height > pix_width)
+        scaled_width = (int)((double)size * pix_width / pix_height + 0.5);
+
+    if (scaled_width < 1)
+        scaled_width = 1;
+    if (scaled_height < 1)
+        scaled_height = 1;
+
+    pixman_image_t *scaled = pixels_scale_image(pix, scaled_width, scaled_height);
+    pixman_image_unref(pix);
+    return scaled;
+}
+
+bool
+png_save(const char *path, pixman_image_t *image)
+{
+    bool ret = false;
+
+    assert(pixman_image_get_format(image) == PIXMAN_a8r8g8b8 ||
+           pixman_image_get_format(image) == PIXMAN_x8r8g8b8);
+
+    const bool has_alpha = pixman_image_get_format(image) == PIXMAN_a8r8g8b8;
+    const int width = pixman_image_get_width(image);
+    const int height = pixman_image_get_height(image);
+    const int stride = pixman_image_get_stride(image);
+    const uint8_t *data = (const uint8_t *)pixman_image_get_data(image);
+
+    FILE *fp = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    uint8_t *row = NULL;
+
+    if ((fp = fopen(path, "wb")) == NULL) {
+        LOG_ERRNO("%s: failed to open", path);
+        goto err;
+    }
+
+    if ((png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL
+        || (info_ptr = png_create_info_struct(png_ptr)) == NULL) {
+        LOG_ERR("%s: failed to initialize libpng", path);
+        goto err;
+    }
+
+    row = malloc(width * 4);
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        LOG_ERR("%s: libpng error", path);
+        goto err;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8,
+                 has_alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+
+    /* Favor speed; this is used to dump frames */
+    png_set_compression_level(png_ptr, 1);
+    png_write_info(png_ptr, info_ptr);
+
+    for (int y = 0; y < height; y++) {
+        const uint32_t *src = (const uint32_t *)&data[y * stride];
+        uint8_t *dst = row;
+
+        /* pixman is premultiplied, PNG is not */
+        for (int x = 0; x < width; x++) {
+            const uint32_t px = src[x];
+            const uint8_t a = has_alpha ? px >> 24 : 0xff;
+            uint8_t r = (px >> 16) & 0xff;
+            uint8_t g = (px >> 8) & 0xff;
+            uint8_t b = px & 0xff;
+
+            if (a != 0xff && a != 0) {
+                r = r >= a ? 0xff : (r * 0xff + a / 2) / a;
+                g = g >= a ? 0xff : (g * 0xff + a / 2) / a;
+                b = b >= a ? 0xff : (b * 0xff + a / 2) / a;
+            }
+
+            *dst++ = r;
+            *dst++ = g;
+            *dst++ = b;
+            if (has_alpha)
+                *dst++ = a;
+        }
+
+        png_write_row(png_ptr, row);
+    }
+
+    png_write_end(png_ptr, NULL);
+    ret = true;
+
+err:
+    free(row);
+    if (png_ptr != NULL)
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (fp != NULL)
+        fclose(fp);
+    return ret;
 }
@@ -1,17 +1,129 @@
 #include "svg.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <sys/stat.h>
+
+#include <tllist.h>
 
 #define LOG_MODULE "svg"
 #define LOG_ENABLE_DBG 0
 #include "log.h"
+#include "pixels.h"
 
 #include <nanosvg.h>
 #include <nanosvgrast.h>
 
-pixman_image_t *
-svg_load(const char *path, int size)
+/*
+ * Parsed SVG documents are cached, and re-used when the same icon is
+ * rasterized again (e.g. at a different size). Entries are keyed on
+ * the file path, and invalidated when the file's mtime or size
+ * changes.
+ *
+ * The parsed document is never modified by the rasterizer, meaning
+ * multiple threads can rasterize the same entry concurrently; the
+ * lock only protects the cache itself, and the reference counts.
+ */
+struct parsed_svg {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    NSVGimage *svg;
+    size_t refcount;
+};
+
+/* Least recently used entries are evicted first */
+#define CACHE_MAX_ENTRIES 64
+
+static once_flag init_once = ONCE_FLAG_INIT;
+static mtx_t cache_lock;
+static tll(struct parsed_svg *) cache = tll_init();
+
+/* One rasterizer per thread; it owns scratch buffers that grow as needed */
+static tss_t rasterizer_key;
+
+static void
+rasterizer_destroy(void *rast)
+{
+    nsvgDeleteRasterizer(rast);
+}
+
+static void
+init(void)
+{
+    mtx_init(&cache_lock, mtx_plain);
+    if (tss_create(&rasterizer_key, &rasterizer_destroy) != thrd_success)
+        LOG_ERR("failed to create rasterizer thread-specific storage");
+}
+
+static struct NSVGrasterizer *
+rasterizer(void)
+{
+    struct NSVGrasterizer *rast = tss_get(rasterizer_key);
+    if (rast == NULL) {
+        rast = nsvgCreateRasterizer();
+        if (rast != NULL && tss_set(rasterizer_key, rast) != thrd_success) {
+            nsvgDeleteRasterizer(rast);
+            rast = NULL;
+        }
+    }
+    return rast;
+}
+
+/* Must be called with the cache lock held */
+static void
+parsed_svg_unref(struct parsed_svg *p)
+{
+    if (--p->refcount > 0)
+        return;
+
+    nsvgDelete(p->svg);
+    free(p->path);
+    free(p);
+}
+
+static void
+parsed_svg_put(struct parsed_svg *p)
 {
+    mtx_lock(&cache_lock);
+    parsed_svg_unref(p);
+    mtx_unlock(&cache_lock);
+}
+
+static struct parsed_svg *
+parsed_svg_get(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    mtx_lock(&cache_lock);
+    tll_foreach(cache, it) {
+        struct parsed_svg *p = it->item;
+        if (strcmp(p->path, path) != 0)
+            continue;
+
+        tll_remove(cache, it);
+
+        if (p->mtime.tv_sec != st.st_mtim.tv_sec ||
+            p->mtime.tv_nsec != st.st_mtim.tv_nsec ||
+            p->size != st.st_size)
+        {
+            LOG_DBG("%s: modified, re-parsing", path);
+            parsed_svg_unref(p);
+            break;
+        }
+
+        LOG_DBG("%s: cache hit", path);
+        tll_push_front(cache, p);
+        p->refcount++;
+        mtx_unlock(&cache_lock);
+        return p;
+    }
+    mtx_unlock(&cache_lock);
+
+    /* Parse without holding the lock */
     NSVGimage *svg = nsvgParseFromFile(path, "px", 96);
     if (svg == NULL)
         return NULL;
@@ -21,41 +133,70 @@ svg_load(const char *path, int size)
         return NULL;
     }
 
-    struct NSVGrasterizer *rast = nsvgCreateRasterizer();
+    struct parsed_svg *p = malloc(sizeof(*p));
+    *p = (struct parsed_svg){
+        .path = strdup(path),
+        .mtime = st.st_mtim,
+        .size = st.st_size,
+        .svg = svg,
+        .refcount = 2,  /* Cache + caller */
+    };
+
+    mtx_lock(&cache_lock);
+    tll_push_front(cache, p);
+    while (tll_length(cache) > CACHE_MAX_ENTRIES)
+        parsed_svg_unref(tll_pop_back(cache));
+    mtx_unlock(&cache_lock);
+
+    return p;
+}
+
+static void
+free_image_data(pixman_image_t *image, void *data)
+{
+    free(data);
+}
+
+pixman_image_t *
+svg_load(const char *path, int size)
+{
+    call_once(&init_once, &init);
 
+    struct parsed_svg *p = parsed_svg_get(path);
+    if (p == NULL)
+        return NULL;
+
+    struct NSVGrasterizer *rast = rasterizer();
+    if (rast == NULL) {
+        parsed_svg_put(p);
+        return NULL;
+    }
+
+    const NSVGimage *svg = p->svg;
     const int w = size;
     const int h = size;
     float scale = w > h ? w / svg->width : h / svg->height;
 
     uint8_t *data = malloc(h * w * 4);
-    nsvgRasterize(rast, svg, 0, 0, scale, data, w, h, w * 4);
-
-    nsvgDeleteRasterizer(rast);
-    nsvgDelete(svg);
+    if (data == NULL) {
+        parsed_svg_put(p);
+        return NULL;
+    }
 
-    pixman_image_t *img = pixman_image_create_bits_no_clear(PIXMAN_a8b8g8r8, w, h, (uint32_t *)data, w * 4);
+    nsvgRasterize(rast, p->svg, 0, 0, scale, data, w, h, w * 4);
+    parsed_svg_put(p);
 
     /* Nanosvg produces non-premultiplied ABGR, while pixman expects
      * premultiplied */
-    for (uint32_t *abgr = (uint32_t *)data; abgr < (uint32_t *)(data + h * w * 4); abgr++) {
-        uint8_t alpha = (*abgr >> 24) & 0xff;
-        uint8_t blue = (*abgr >> 16) & 0xff;
-        uint8_t green = (*abgr >> 8) & 0xff;
-        uint8_t red = (*abgr >> 0) & 0xff;
-
-        if (alpha == 0xff)
-            continue;
+    pixels_premultiply((uint32_t *)data, (size_t)w * h);
 
-        if (alpha == 0x00)
-            blue = green = red = 0x00;
-        else {
-            blue = blue * alpha / 0xff;
-            green = green * alpha / 0xff;
-            red = red * alpha / 0xff;
-        }
-
-        *abgr = (uint32_t)alpha << 24 | blue << 16 | green << 8 | red;
+    pixman_image_t *img = pixman_image_create_bits_no_clear(
+        PIXMAN_a8b8g8r8, w, h, (uint32_t *)data, w * 4);
+    if (img == NULL) {
+        free(data);
+        return NULL;
     }
 
+    pixman_image_set_destroy_function(img, &free_image_data, data);
     return img;
 }
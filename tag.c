@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #define LOG_MODULE "tag"
 #define LOG_ENABLE_DBG 0
@@ -789,14 +790,6 @@ tags_expand_template(const char *template, const struct tag_set *tags)
     return formatted.s;
 }
 
-void
-tags_expand_templates(char *expanded[], const char *template[], size_t nmemb,
-                      const struct tag_set *tags)
-{
-    for (size_t i = 0; i < nmemb; i++)
-        expanded[i] = tags_expand_template(template[i], tags);
-}
-
 void
 tag_set_destroy(struct tag_set *set)
 {
@@ -811,4 +804,100 @@ tag_set_destroy(struct tag_set *set)
 
     set->tags = NULL;
     set->count = 0;
+
+    tag_snapshot_unref(set->snapshot);
+    set->snapshot = NULL;
+}
+
+struct tag_snapshot {
+    atomic_int ref_count;
+    struct tag_set tags;
+};
+
+static struct tag *
+tag_clone(const struct tag *tag)
+{
+    /* Not owned by any module; the snapshot may outlive it */
+    switch (tag->type(tag)) {
+    case TAG_TYPE_BOOL:
+        return tag_new_bool(NULL, tag->name(tag), tag->as_bool(tag));
+
+    case TAG_TYPE_INT:
+        return tag_new_int_realtime(
+            NULL, tag->name(tag), tag->as_int(tag), tag->min(tag),
+            tag->max(tag), tag->realtime(tag));
+
+    case TAG_TYPE_FLOAT:
+        return tag_new_float(NULL, tag->name(tag), tag->as_float(tag));
+
+    case TAG_TYPE_STRING:
+        return tag_new_string(NULL, tag->name(tag), tag->as_string(tag));
+    }
+
+    assert(false);
+    return NULL;
+}
+
+struct tag_snapshot *
+tag_snapshot_new(const struct tag_set *tags)
+{
+    if (tags == NULL || tags->count == 0)
+        return NULL;
+
+    struct tag_snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    atomic_init(&snapshot->ref_count, 1);
+    snapshot->tags.tags = malloc(tags->count * sizeof(snapshot->tags.tags[0]));
+    snapshot->tags.count = tags->count;
+
+    for (size_t i = 0; i < tags->count; i++)
+        snapshot->tags.tags[i] = tag_clone(tags->tags[i]);
+
+    return snapshot;
+}
+
+struct tag_snapshot *
+tag_snapshot_ref(struct tag_snapshot *snapshot)
+{
+    if (snapshot != NULL)
+        atomic_fetch_add_explicit(&snapshot->ref_count, 1, memory_order_relaxed);
+    return snapshot;
+}
+
+void
+tag_snapshot_unref(struct tag_snapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+
+    if (atomic_fetch_sub_explicit(
+            &snapshot->ref_count, 1, memory_order_acq_rel) > 1)
+        return;
+
+    struct tag **tags = snapshot->tags.tags;
+    tag_set_destroy(&snapshot->tags);
+    free(tags);
+    free(snapshot);
+}
+
+struct tag_snapshot *
+tag_set_snapshot(const struct tag_set *tags)
+{
+    if (tags == NULL)
+        return NULL;
+
+    /*
+     * A cache; it doesn't change the set's (logical) contents. Tag
+     * sets are only ever instantiated from one thread at a time (the
+     * owning module's lock is held).
+     */
+    struct tag_set *set = (struct tag_set *)tags;
+    if (set->snapshot == NULL)
+        set->snapshot = tag_snapshot_new(set);
+    return set->snapshot;
+}
+
+const struct tag_set *
+tag_snapshot_tags(const struct tag_snapshot *snapshot)
+{
+    return snapshot != NULL ? &snapshot->tags : NULL;
 }
@@ -54,6 +54,9 @@ struct tag_set {
     struct icon_tag **icon_tags;
     size_t count;
     size_t icon_count;
+
+    /* See tag_set_snapshot(); released by tag_set_destroy() */
+    struct tag_snapshot *snapshot;
 };
 
 struct tag *tag_new_int(struct module *owner, const char *name, long value);
@@ -72,4 +75,26 @@ void tag_set_destroy(struct tag_set *set);
 
 /* Utility functions */
 char *tags_expand_template(const char *template, const struct tag_set *tags);
-void tags_expand_templates(char *expanded[], const char *template[], size_t nmemb, const struct tag_set *tags);
+
+/*
+ * Immutable, reference counted, copy of a tag set's values. Outlives
+ * the tag set (and module) it was created from, and can thus be used
+ * to expand templates later on.
+ */
+struct tag_snapshot;
+
+/* Copies all tags in 'tags'. Returns NULL (an empty snapshot) for an empty set */
+struct tag_snapshot *tag_snapshot_new(const struct tag_set *tags);
+struct tag_snapshot *tag_snapshot_ref(struct tag_snapshot *snapshot);
+void tag_snapshot_unref(struct tag_snapshot *snapshot);
+
+/*
+ * The set's snapshot, created on first use, and then shared by
+ * everything instantiated from the same set. The returned snapshot is
+ * borrowed; use tag_snapshot_ref() to keep it beyond the set's
+ * lifetime.
+ */
+struct tag_snapshot *tag_set_snapshot(const struct tag_set *tags);
+
+/* The snapshot's tags; NULL for an empty snapshot */
+const struct tag_set *tag_snapshot_tags(const struct tag_snapshot *snapshot);
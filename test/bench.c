@@ -0,0 +1,767 @@
+/*
+ * Microbenchmarks for yambar's hot paths.
+ *
+ * Each benchmark reports the average wall clock time, and the average
+ * number of heap allocations, per operation. Run all benchmarks with
+ * 'meson test --benchmark', or a single one with 'yambar-bench NAME'.
+ *
+ * Allocations are counted by wrapping malloc(), calloc(), realloc(),
+ * strdup() and strndup() at link time (see test/meson.build). Only
+ * calls made directly by yambar's own code are counted; allocations
+ * done internally by libc (e.g. asprintf()) or by other libraries
+ * (fcft, pixman, fontconfig etc) are not.
+ */
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <fcft/fcft.h>
+#include <pixman.h>
+
+#define LOG_MODULE "bench"
+#define LOG_ENABLE_DBG 0
+#include "../log.h"
+#include "../config.h"
+#include "../fonts.h"
+#include "../icon.h"
+#include "../particle.h"
+#include "../png-yambar.h"
+#include "../svg.h"
+#include "../tag.h"
+#include "../yml.h"
+#include "../particles/dynlist.h"
+#include "../bar/bar.h"
+
+#define ALEN(v) (sizeof(v) / sizeof((v)[0]))
+
+/* Minimum wall clock time to run each benchmark for */
+#define MIN_DURATION_NS (200 * 1000 * 1000ull)
+
+/*
+ * Allocation counting
+ */
+static atomic_size_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *
+__wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+char *
+__wrap_strdup(const char *s)
+{
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __real_strdup(s);
+}
+
+char *
+__wrap_strndup(const char *s, size_t n)
+{
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    return __real_strndup(s, n);
+}
+
+/*
+ * Fixtures
+ */
+static char tmp_dir[] = "/tmp/yambar-bench-XXXXXX";
+static struct fcft_font *font;
+static struct basedirs *basedirs;
+static struct themes *themes;
+
+static bool
+write_file(const char *path, const char *content)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to create", path);
+        return false;
+    }
+
+    fputs(content, f);
+    fclose(f);
+    return true;
+}
+
+static struct yml_node *
+yml_from_string(const char *yml)
+{
+    FILE *f = fmemopen((void *)yml, strlen(yml), "r");
+    if (f == NULL)
+        return NULL;
+
+    char *error = NULL;
+    struct yml_node *root = yml_load(f, &error);
+    fclose(f);
+
+    if (root == NULL) {
+        LOG_ERR("%s", error);
+        free(error);
+    }
+    return root;
+}
+
+static struct particle *
+particle_from_string(const char *yml)
+{
+    struct yml_node *root = yml_from_string(yml);
+    if (root == NULL)
+        return NULL;
+
+    struct conf_inherit inherited = {
+        .font = font,
+        .font_shaping = FONT_SHAPE_FULL,
+        .themes = themes,
+        .basedirs = basedirs,
+        .icon_theme = NULL,
+        .icon_size = 24,
+        .foreground = {0xffff, 0xffff, 0xffff, 0xffff},
+    };
+
+    struct particle *p = conf_to_particle(
+        yml_get_value(root, "particle"), inherited);
+    yml_destroy(root);
+    return p;
+}
+
+static struct tag_set
+tag_set_new(size_t count, struct tag *tags[static count])
+{
+    struct tag_set set = {
+        .tags = malloc(count * sizeof(set.tags[0])),
+        .count = count,
+    };
+    memcpy(set.tags, tags, count * sizeof(set.tags[0]));
+    return set;
+}
+
+static struct tag_set
+default_tags(const char *title)
+{
+    return tag_set_new(6, (struct tag *[]){
+            tag_new_string(NULL, "title", title),
+            tag_new_string(NULL, "state", "playing"),
+            tag_new_int_range(NULL, "volume", 42, 0, 100),
+            tag_new_int(NULL, "bytes", 123456789),
+            tag_new_float(NULL, "load", 1.2345),
+            tag_new_bool(NULL, "muted", false),
+        });
+}
+
+/* Writes a 'size' x 'size' gradient image to 'path' */
+static bool
+write_png(const char *path, int size)
+{
+    uint32_t *data = malloc((size_t)size * size * 4);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            uint8_t a = 0x80 + (x * 0x7f) / size;
+            uint8_t r = (a * x) / size;
+            uint8_t g = (a * y) / size;
+            data[y * size + x] = (uint32_t)a << 24 | r << 16 | g << 8;
+        }
+    }
+
+    pixman_image_t *img = pixman_image_create_bits_no_clear(
+        PIXMAN_a8r8g8b8, size, size, data, size * 4);
+    bool ret = png_save(path, img);
+    pixman_image_unref(img);
+    free(data);
+    return ret;
+}
+
+/*
+ * Synthetic icon theme: 'bench' inherits 'bench-base'. 'bench' has a
+ * number of fixed size directories, none of which contain the icon
+ * we look for; it is found in 'bench-base', in a scalable directory.
+ */
+static bool
+create_theme_tree(void)
+{
+    static const int sizes[] = {8, 16, 22, 24, 32, 48, 64, 96, 128, 256};
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/icons", tmp_dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/icons/bench", tmp_dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/icons/bench-base", tmp_dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/icons/bench-base/scalable", tmp_dir);
+    mkdir(path, 0700);
+
+    char index[4096];
+    size_t idx = 0;
+
+    idx += snprintf(&index[idx], sizeof(index) - idx,
+                    "[Icon Theme]\nName=bench\nInherits=bench-base\n"
+                    "Directories=");
+    for (size_t i = 0; i < ALEN(sizes); i++) {
+        idx += snprintf(&index[idx], sizeof(index) - idx, "%s%dx%d/apps",
+                        i > 0 ? "," : "", sizes[i], sizes[i]);
+    }
+    idx += snprintf(&index[idx], sizeof(index) - idx, "\n\n");
+
+    for (size_t i = 0; i < ALEN(sizes); i++) {
+        idx += snprintf(&index[idx], sizeof(index) - idx,
+                        "[%dx%d/apps]\nSize=%d\nType=Fixed\n\n",
+                        sizes[i], sizes[i], sizes[i]);
+
+        snprintf(path, sizeof(path), "%s/icons/bench/%dx%d",
+                 tmp_dir, sizes[i], sizes[i]);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/icons/bench/%dx%d/apps",
+                 tmp_dir, sizes[i], sizes[i]);
+        mkdir(path, 0700);
+    }
+
+    snprintf(path, sizeof(path), "%s/icons/bench/index.theme", tmp_dir);
+    if (!write_file(path, index))
+        return false;
+
+    snprintf(path, sizeof(path), "%s/icons/bench-base/index.theme", tmp_dir);
+    if (!write_file(path,
+                    "[Icon Theme]\nName=bench-base\nDirectories=scalable\n\n"
+                    "[scalable]\nSize=48\nMinSize=8\nMaxSize=512\n"
+                    "Type=Scalable\n"))
+        return false;
+
+    snprintf(path, sizeof(path), "%s/icons/bench-base/scalable/bench-icon.png",
+             tmp_dir);
+    return write_png(path, 48);
+}
+
+static const char svg_document[] =
+    "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"48\" height=\"48\">"
+    "<circle cx=\"24\" cy=\"24\" r=\"20\" fill=\"#3465a4\" fill-opacity=\"0.8\"/>"
+    "<rect x=\"8\" y=\"8\" width=\"16\" height=\"32\" fill=\"#cc0000\"/>"
+    "<path d=\"M4 44 L24 4 L44 44 Z\" fill=\"none\" stroke=\"#73d216\" "
+    "stroke-width=\"3\"/>"
+    "</svg>";
+
+static bool
+fixtures_init(void)
+{
+    if (mkdtemp(tmp_dir) == NULL) {
+        LOG_ERRNO("failed to create temporary directory");
+        return false;
+    }
+
+    font = fonts_from_name(1, (const char *[]){"monospace"}, NULL);
+    if (font == NULL) {
+        LOG_ERR("failed to load font");
+        return false;
+    }
+
+    if (!create_theme_tree())
+        return false;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/icon.svg", tmp_dir);
+    if (!write_file(path, svg_document))
+        return false;
+
+    snprintf(path, sizeof(path), "%s/small.png", tmp_dir);
+    if (!write_png(path, 32))
+        return false;
+
+    snprintf(path, sizeof(path), "%s/large.png", tmp_dir);
+    if (!write_png(path, 512))
+        return false;
+
+    basedirs = basedirs_new();
+    snprintf(path, sizeof(path), "%s/icons", tmp_dir);
+    tll_push_back(basedirs->basedirs, strdup(path));
+    themes = init_themes(basedirs);
+    return true;
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void
+fixtures_fini(void)
+{
+    if (themes != NULL)
+        themes_dec(themes);
+    if (basedirs != NULL)
+        basedirs_dec(basedirs);
+    fcft_destroy(font);
+    nftw(tmp_dir, &remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Benchmarks
+ *
+ * setup() returns a context passed to run() and teardown(). run()
+ * executes the benchmarked operation 'iterations' times.
+ */
+struct benchmark {
+    const char *name;
+    void *(*setup)(void);
+    void (*run)(void *ctx, size_t iterations);
+    void (*teardown)(void *ctx);
+};
+
+/* tags_expand_template() */
+
+struct expand_ctx {
+    struct tag_set tags;
+    const char *template;
+};
+
+static void *
+expand_setup(const char *template)
+{
+    struct expand_ctx *ctx = malloc(sizeof(*ctx));
+    ctx->tags = default_tags("The Title");
+    ctx->template = template;
+    return ctx;
+}
+
+static void *
+expand_plain_setup(void)
+{
+    return expand_setup("{title} - {state}");
+}
+
+static void *
+expand_formatters_setup(void)
+{
+    return expand_setup(
+        "{volume}{volume:%} {bytes:kb}/{bytes:mib} {load:.2} {volume:03} "
+        "{volume:hex} {volume:max}");
+}
+
+static void
+expand_run(void *_ctx, size_t iterations)
+{
+    struct expand_ctx *ctx = _ctx;
+    for (size_t i = 0; i < iterations; i++)
+        free(tags_expand_template(ctx->template, &ctx->tags));
+}
+
+static void
+expand_teardown(void *_ctx)
+{
+    struct expand_ctx *ctx = _ctx;
+    tag_set_destroy(&ctx->tags);
+    free(ctx);
+}
+
+/* Particle instantiation */
+
+#define TAG_SET_RING_SIZE 1024
+
+struct particle_ctx {
+    struct particle *particle;
+    struct tag_set tags[TAG_SET_RING_SIZE];
+    size_t tag_set_count;
+    size_t idx;
+};
+
+static void *
+particle_setup(const char *yml, bool unique_titles)
+{
+    struct particle_ctx *ctx = calloc(1, sizeof(*ctx));
+    ctx->particle = particle_from_string(yml);
+    if (ctx->particle == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->tag_set_count = unique_titles ? TAG_SET_RING_SIZE : 1;
+    for (size_t i = 0; i < ctx->tag_set_count; i++) {
+        char title[32];
+        snprintf(title, sizeof(title), "Title %zu", i);
+        ctx->tags[i] = default_tags(title);
+    }
+    return ctx;
+}
+
+static void *
+string_hit_setup(void)
+{
+    return particle_setup("particle: {string: {text: '{title} ({volume}%)'}}", false);
+}
+
+static void *
+string_miss_setup(void)
+{
+    return particle_setup("particle: {string: {text: '{title} ({volume}%)'}}", true);
+}
+
+static void *
+string_on_click_setup(void)
+{
+    return particle_setup(
+        "particle:\n"
+        "  string:\n"
+        "    text: '{title}'\n"
+        "    on-click:\n"
+        "      left: 'player select \"{title}\"'\n"
+        "      middle: player toggle\n"
+        "      right: 'player info \"{title}\" {state}'\n"
+        "      wheel-up: 'player volume {volume:%}+5'\n"
+        "      wheel-down: 'player volume {volume:%}-5'\n",
+        true);
+}
+
+static void *
+list_on_click_setup(void)
+{
+    /* A workspace list like layout; all items share the same tags */
+    char yml[2048] = "particle:\n  list:\n    items:\n";
+    for (int i = 0; i < 8; i++) {
+        char item[256];
+        snprintf(item, sizeof(item),
+                 "      - string:\n"
+                 "          text: '%d: {title}'\n"
+                 "          on-click: 'workspace %d \"{title}\" {state}'\n",
+                 i, i);
+        strcat(yml, item);
+    }
+    return particle_setup(yml, true);
+}
+
+static void *
+map_setup(void)
+{
+    return particle_setup(
+        "particle:\n"
+        "  map:\n"
+        "    default: {string: {text: default}}\n"
+        "    conditions:\n"
+        "      state == stopped: {string: {text: stopped}}\n"
+        "      state == paused && volume < 10: {string: {text: paused}}\n"
+        "      muted: {string: {text: muted}}\n"
+        "      volume > 90 || load >= 4: {string: {text: loud}}\n"
+        "      title == \"Title 0\" && ~muted: {string: {text: first}}\n"
+        "      state == playing && (volume <= 50 || muted): {string: {text: playing}}\n",
+        true);
+}
+
+static void
+particle_run(void *_ctx, size_t iterations)
+{
+    struct particle_ctx *ctx = _ctx;
+    struct particle *p = ctx->particle;
+
+    for (size_t i = 0; i < iterations; i++) {
+        const struct tag_set *tags = &ctx->tags[ctx->idx];
+        ctx->idx = (ctx->idx + 1) % ctx->tag_set_count;
+
+        struct exposable *e = p->instantiate(p, tags);
+        e->begin_expose(e);
+        e->destroy(e);
+    }
+}
+
+/*
+ * Modules build a new tag set for each refresh. Drop the set's
+ * snapshot after each instantiation, such that it is re-created, as
+ * it would be for a new set.
+ */
+static void
+on_click_run(void *_ctx, size_t iterations)
+{
+    struct particle_ctx *ctx = _ctx;
+    struct particle *p = ctx->particle;
+
+    for (size_t i = 0; i < iterations; i++) {
+        struct tag_set *tags = &ctx->tags[ctx->idx];
+        ctx->idx = (ctx->idx + 1) % ctx->tag_set_count;
+
+        struct exposable *e = p->instantiate(p, tags);
+        e->begin_expose(e);
+        e->destroy(e);
+
+        tag_snapshot_unref(tags->snapshot);
+        tags->snapshot = NULL;
+    }
+}
+
+static void
+particle_teardown(void *_ctx)
+{
+    struct particle_ctx *ctx = _ctx;
+    for (size_t i = 0; i < ctx->tag_set_count; i++)
+        tag_set_destroy(&ctx->tags[i]);
+    ctx->particle->destroy(ctx->particle);
+    free(ctx);
+}
+
+/* find_icon() */
+
+static void *
+find_icon_setup(void)
+{
+    return themes;
+}
+
+static void
+find_icon_run(void *ctx, size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++) {
+        int min_size, max_size;
+        char *path = find_icon(
+            themes, basedirs->basedirs, "bench-icon", 24, "bench",
+            &min_size, &max_size);
+
+        if (path == NULL) {
+            LOG_ERR("find_icon(): icon not found");
+            abort();
+        }
+        free(path);
+    }
+}
+
+/* svg_load() and png_load() */
+
+static char *
+image_setup(const char *name)
+{
+    char *path = malloc(PATH_MAX);
+    snprintf(path, PATH_MAX, "%s/%s", tmp_dir, name);
+    return path;
+}
+
+static void *svg_setup(void) { return image_setup("icon.svg"); }
+static void *png_small_setup(void) { return image_setup("small.png"); }
+static void *png_large_setup(void) { return image_setup("large.png"); }
+
+static void
+image_run(void *ctx, size_t iterations,
+          pixman_image_t *(*load)(const char *path, int size))
+{
+    const char *path = ctx;
+    for (size_t i = 0; i < iterations; i++) {
+        pixman_image_t *img = load(path, 24);
+        if (img == NULL) {
+            LOG_ERR("%s: failed to load", path);
+            abort();
+        }
+        pixman_image_unref(img);
+    }
+}
+
+static void svg_run(void *ctx, size_t n) { image_run(ctx, n, &svg_load); }
+static void png_run(void *ctx, size_t n) { image_run(ctx, n, &png_load); }
+
+/* dynlist layout (begin_expose() + expose()) */
+
+struct dynlist_ctx {
+    struct particle *particle;
+    struct tag_set tags;
+    struct exposable *dynlist;
+    pixman_image_t *pix;
+};
+
+static void *
+dynlist_setup(size_t count)
+{
+    struct dynlist_ctx *ctx = calloc(1, sizeof(*ctx));
+    ctx->particle = particle_from_string(
+        "particle: {string: {text: '{title}', margin: 2}}");
+    if (ctx->particle == NULL) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->tags = default_tags("item");
+
+    struct exposable **items = malloc(count * sizeof(items[0]));
+    for (size_t i = 0; i < count; i++)
+        items[i] = ctx->particle->instantiate(ctx->particle, &ctx->tags);
+
+    ctx->dynlist = dynlist_exposable_new(items, count, 2, 2);
+    free(items);
+
+    ctx->pix = pixman_image_create_bits(PIXMAN_a8r8g8b8, 8192, 32, NULL, 0);
+    return ctx;
+}
+
+static void *dynlist_10_setup(void) { return dynlist_setup(10); }
+static void *dynlist_100_setup(void) { return dynlist_setup(100); }
+
+static void
+dynlist_run(void *_ctx, size_t iterations)
+{
+    struct dynlist_ctx *ctx = _ctx;
+    struct exposable *e = ctx->dynlist;
+
+    for (size_t i = 0; i < iterations; i++) {
+        e->begin_expose(e);
+        e->expose(e, ctx->pix, 0, 0, 32);
+    }
+}
+
+/* Pointer motion over a laid out dynlist */
+
+static void
+null_set_cursor(struct bar *bar, const char *cursor)
+{
+}
+
+static void *
+dynlist_hit_test_setup(void)
+{
+    struct dynlist_ctx *ctx = dynlist_setup(100);
+    if (ctx != NULL)
+        ctx->dynlist->begin_expose(ctx->dynlist);
+    return ctx;
+}
+
+static void
+dynlist_hit_test_run(void *_ctx, size_t iterations)
+{
+    struct dynlist_ctx *ctx = _ctx;
+    struct exposable *e = ctx->dynlist;
+    struct bar bar = {.set_cursor = &null_set_cursor};
+
+    for (size_t i = 0; i < iterations; i++) {
+        int x = (int)((i * 7919) % (size_t)(e->width > 0 ? e->width : 1));
+        e->on_mouse(e, &bar, ON_MOUSE_MOTION, MOUSE_BTN_NONE, x, 0);
+    }
+}
+
+static void
+dynlist_teardown(void *_ctx)
+{
+    struct dynlist_ctx *ctx = _ctx;
+    ctx->dynlist->destroy(ctx->dynlist);
+    pixman_image_unref(ctx->pix);
+    tag_set_destroy(&ctx->tags);
+    ctx->particle->destroy(ctx->particle);
+    free(ctx);
+}
+
+static const struct benchmark benchmarks[] = {
+    {"tags-expand", &expand_plain_setup, &expand_run, &expand_teardown},
+    {"tags-expand-formatters", &expand_formatters_setup, &expand_run, &expand_teardown},
+    {"string-instantiate-hit", &string_hit_setup, &particle_run, &particle_teardown},
+    {"string-instantiate-miss", &string_miss_setup, &particle_run, &particle_teardown},
+    {"string-instantiate-on-click", &string_on_click_setup, &on_click_run, &particle_teardown},
+    {"list-instantiate-on-click", &list_on_click_setup, &on_click_run, &particle_teardown},
+    {"map-conditions", &map_setup, &particle_run, &particle_teardown},
+    {"find-icon", &find_icon_setup, &find_icon_run, NULL},
+    {"svg-load", &svg_setup, &svg_run, &free},
+    {"png-load", &png_small_setup, &png_run, &free},
+    {"png-load-large", &png_large_setup, &png_run, &free},
+    {"dynlist-layout-10", &dynlist_10_setup, &dynlist_run, &dynlist_teardown},
+    {"dynlist-layout-100", &dynlist_100_setup, &dynlist_run, &dynlist_teardown},
+    {"dynlist-hit-test-100", &dynlist_hit_test_setup, &dynlist_hit_test_run, &dynlist_teardown},
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool
+run_benchmark(const struct benchmark *b)
+{
+    void *ctx = b->setup();
+    if (ctx == NULL) {
+        LOG_ERR("%s: setup failed", b->name);
+        return false;
+    }
+
+    /* Warm up caches, and find an iteration count that runs for long
+     * enough to be measurable */
+    size_t iterations = 1;
+    for (;;) {
+        uint64_t start = now_ns();
+        b->run(ctx, iterations);
+        uint64_t elapsed = now_ns() - start;
+
+        if (elapsed >= MIN_DURATION_NS / 10 || iterations >= (1ul << 30))
+            break;
+        iterations *= 2;
+    }
+
+    iterations *= 10;
+
+    size_t allocs_before = atomic_load(&alloc_count);
+    uint64_t start = now_ns();
+    b->run(ctx, iterations);
+    uint64_t elapsed = now_ns() - start;
+    size_t allocs = atomic_load(&alloc_count) - allocs_before;
+
+    printf("%-24s %10zu iterations %12.1f ns/op %8.2f allocs/op\n",
+           b->name, iterations, (double)elapsed / iterations,
+           (double)allocs / iterations);
+
+    if (b->teardown != NULL)
+        b->teardown(ctx);
+    return true;
+}
+
+int
+main(int argc, char *const *argv)
+{
+    log_init(LOG_COLORIZE_AUTO, false, LOG_FACILITY_DAEMON, LOG_CLASS_WARNING);
+    fcft_init(FCFT_LOG_COLORIZE_AUTO, false, FCFT_LOG_CLASS_WARNING);
+
+    int ret = EXIT_FAILURE;
+
+    if (!fixtures_init())
+        goto out;
+
+    ret = EXIT_SUCCESS;
+
+    for (size_t i = 0; i < ALEN(benchmarks); i++) {
+        const struct benchmark *b = &benchmarks[i];
+
+        bool selected = argc <= 1;
+        for (int j = 1; j < argc && !selected; j++)
+            selected = strcmp(argv[j], b->name) == 0;
+
+        if (selected && !run_benchmark(b))
+            ret = EXIT_FAILURE;
+    }
+
+out:
+    fixtures_fini();
+    fonts_fini();
+    fcft_fini();
+    log_deinit();
+    return ret;
+}
@@ -0,0 +1,351 @@
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tllist.h>
+
+#define LOG_MODULE "trace"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+/* Events per thread */
+#define BUFFER_SIZE 8192
+
+/*
+ * Snapshots may be taken while the owning thread is recording
+ * events, and thus overwriting the oldest ones. Each event is
+ * published by storing its index (plus one) in 'seq', with release
+ * semantics, after all its fields have been written; 'seq' is zero
+ * while the event is being written. The reader copies an event, and
+ * then re-checks 'seq', skipping events that were (being)
+ * overwritten.
+ *
+ * The fields are (relaxed) atomics, since they may be read while
+ * being written.
+ */
+struct event {
+    atomic_uint_least64_t seq;
+    _Atomic uint64_t ts;  /* Nanoseconds, CLOCK_MONOTONIC */
+    _Atomic(const char *) name;
+    _Atomic(const char *) detail;
+    _Atomic int64_t value;
+    atomic_char phase;
+    atomic_bool has_value;
+};
+
+struct buffer {
+    /* Protected by 'lock' */
+    unsigned tid;
+    const char *thread_name;
+    bool retired;  /* Owning thread has exited; may be re-used */
+
+    /* Written by the owning thread only; total number of events
+     * recorded */
+    atomic_uint_least64_t head;
+    struct event events[BUFFER_SIZE];
+};
+
+bool trace_is_enabled = false;
+
+static char *trace_path;
+static mtx_t lock;  /* Protects 'buffers' and 'interned' */
+static tll(struct buffer *) buffers = tll_init();
+static tll(char *) interned = tll_init();
+static atomic_uint next_tid = 1;
+
+static thread_local struct buffer *thread_buffer = NULL;
+
+/* Only used for its destructor, which retires the thread's buffer */
+static tss_t buffer_key;
+
+static void
+retire_buffer(void *_buf)
+{
+    struct buffer *buf = _buf;
+
+    mtx_lock(&lock);
+    buf->retired = true;
+    mtx_unlock(&lock);
+}
+
+bool
+trace_init(const char *path)
+{
+    trace_path = strdup(path);
+    if (trace_path == NULL)
+        return false;
+
+    mtx_init(&lock, mtx_plain);
+    tss_create(&buffer_key, &retire_buffer);
+    trace_is_enabled = true;
+
+    trace_thread_name("main");
+    return true;
+}
+
+static struct buffer *
+get_buffer(void)
+{
+    if (thread_buffer != NULL)
+        return thread_buffer;
+
+    struct buffer *buf = NULL;
+
+    mtx_lock(&lock);
+
+    /*
+     * Re-use the buffer of an exited thread (e.g. a module stopped by
+     * a configuration reload). Its events are kept until then.
+     */
+    tll_foreach(buffers, it) {
+        if (it->item->retired) {
+            buf = it->item;
+            buf->thread_name = NULL;
+            buf->retired = false;
+            atomic_store_explicit(&buf->head, 0, memory_order_relaxed);
+            break;
+        }
+    }
+
+    if (buf == NULL) {
+        buf = calloc(1, sizeof(*buf));
+        if (buf == NULL) {
+            mtx_unlock(&lock);
+            return NULL;
+        }
+        tll_push_back(buffers, buf);
+    }
+
+    buf->tid = atomic_fetch_add(&next_tid, 1);
+    mtx_unlock(&lock);
+
+    tss_set(buffer_key, buf);
+    thread_buffer = buf;
+    return buf;
+}
+
+const char *
+trace_intern(const char *str)
+{
+    if (!trace_enabled() || str == NULL)
+        return NULL;
+
+    const char *ret = NULL;
+
+    mtx_lock(&lock);
+    tll_foreach(interned, it) {
+        if (strcmp(it->item, str) == 0) {
+            ret = it->item;
+            break;
+        }
+    }
+
+    if (ret == NULL) {
+        char *copy = strdup(str);
+        if (copy != NULL)
+            tll_push_back(interned, copy);
+        ret = copy;
+    }
+    mtx_unlock(&lock);
+
+    return ret;
+}
+
+void
+trace_thread_name(const char *name)
+{
+    if (!trace_enabled())
+        return;
+
+    const char *interned_name = trace_intern(name);
+
+    struct buffer *buf = get_buffer();
+    if (buf == NULL)
+        return;
+
+    mtx_lock(&lock);
+    buf->thread_name = interned_name;
+    mtx_unlock(&lock);
+}
+
+void
+trace_event(char phase, const char *name, const char *detail,
+            bool has_value, int64_t value)
+{
+    struct buffer *buf = get_buffer();
+    if (buf == NULL)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    struct event *ev = &buf->events[head % BUFFER_SIZE];
+
+    /* Invalidate the (overwritten) event before touching its fields */
+    atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(
+        &ev->ts, (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec,
+        memory_order_relaxed);
+    atomic_store_explicit(&ev->name, name, memory_order_relaxed);
+    atomic_store_explicit(&ev->detail, detail, memory_order_relaxed);
+    atomic_store_explicit(&ev->value, value, memory_order_relaxed);
+    atomic_store_explicit(&ev->phase, phase, memory_order_relaxed);
+    atomic_store_explicit(&ev->has_value, has_value, memory_order_relaxed);
+
+    atomic_store_explicit(&ev->seq, head + 1, memory_order_release);
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+/*
+ * Copies event 'idx', unless it has been, or is being,
+ * overwritten. Returns false in that case.
+ */
+static bool
+read_event(const struct buffer *buf, uint64_t idx, const char **name,
+           const char **detail, uint64_t *ts, int64_t *value, char *phase,
+           bool *has_value)
+{
+    const struct event *ev = &buf->events[idx % BUFFER_SIZE];
+
+    if (atomic_load_explicit(&ev->seq, memory_order_acquire) != idx + 1)
+        return false;
+
+    *ts = atomic_load_explicit(&ev->ts, memory_order_relaxed);
+    *name = atomic_load_explicit(&ev->name, memory_order_relaxed);
+    *detail = atomic_load_explicit(&ev->detail, memory_order_relaxed);
+    *value = atomic_load_explicit(&ev->value, memory_order_relaxed);
+    *phase = atomic_load_explicit(&ev->phase, memory_order_relaxed);
+    *has_value = atomic_load_explicit(&ev->has_value, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ev->seq, memory_order_relaxed) == idx + 1;
+}
+
+static void
+write_json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void
+write_buffer(FILE *f, const struct buffer *buf, bool *first)
+{
+    const pid_t pid = getpid();
+
+    if (buf->thread_name != NULL) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                "\"args\":{\"name\":", *first ? "" : ",\n", pid, buf->tid);
+        write_json_string(f, buf->thread_name);
+        fputs("}}", f);
+        *first = false;
+    }
+
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    uint64_t start = head > BUFFER_SIZE ? head - BUFFER_SIZE : 0;
+
+    for (uint64_t i = start; i < head; i++) {
+        const char *name, *detail;
+        uint64_t ts;
+        int64_t value;
+        char phase;
+        bool has_value;
+
+        if (!read_event(buf, i, &name, &detail, &ts, &value, &phase, &has_value))
+            continue;
+
+        fprintf(f, "%s{\"name\":", *first ? "" : ",\n");
+        write_json_string(f, name);
+        fprintf(f, ",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%u",
+                phase,
+                (unsigned long long)(ts / 1000), (unsigned)(ts % 1000),
+                pid, buf->tid);
+
+        if (phase == 'i')
+            fputs(",\"s\":\"t\"", f);
+
+        if (detail != NULL || has_value) {
+            fputs(",\"args\":{", f);
+            if (detail != NULL) {
+                fputs("\"detail\":", f);
+                write_json_string(f, detail);
+            }
+            if (has_value) {
+                fprintf(f, "%s\"value\":%lld",
+                        detail != NULL ? "," : "", (long long)value);
+            }
+            fputc('}', f);
+        }
+
+        fputc('}', f);
+        *first = false;
+    }
+}
+
+void
+trace_write(void)
+{
+    if (trace_path == NULL)
+        return;
+
+    FILE *f = fopen(trace_path, "w");
+    if (f == NULL) {
+        LOG_ERRNO("%s: failed to open", trace_path);
+        return;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+
+    bool first = true;
+
+    mtx_lock(&lock);
+    tll_foreach(buffers, it)
+        write_buffer(f, it->item, &first);
+    mtx_unlock(&lock);
+
+    fputs("\n]}\n", f);
+
+    if (ferror(f))
+        LOG_ERR("%s: failed to write trace", trace_path);
+    fclose(f);
+
+    LOG_INFO("%s: trace written", trace_path);
+}
+
+void
+trace_fini(void)
+{
+    if (!trace_enabled())
+        return;
+
+    trace_is_enabled = false;
+    trace_write();
+
+    /* Threads exiting from now on must not touch their (freed) buffers */
+    tss_delete(buffer_key);
+
+    tll_free_and_free(buffers, free);
+    tll_free_and_free(interned, free);
+    mtx_destroy(&lock);
+
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Event tracing, exported as Chrome/Perfetto trace event JSON (load
+ * the file in https://ui.perfetto.dev, or chrome://tracing).
+ *
+ * Each thread records its events in its own ring buffer, without
+ * locking; when a buffer is full, the oldest events are
+ * overwritten. The buffer of an exited thread is re-used by the next
+ * thread that starts tracing. Nothing is recorded unless trace_init() has been
+ * called, and the trace_*() wrappers are cheap no-ops when tracing is
+ * disabled.
+ *
+ * 'name' must be a string literal. 'detail' (may be NULL) must either
+ * be a string literal, or have been returned by trace_intern().
+ */
+
+/* Not to be accessed directly; use trace_enabled() */
+extern bool trace_is_enabled;
+
+/* Enables tracing. Must be called before any threads are started */
+bool trace_init(const char *path);
+
+/* Writes the trace file, and disables tracing */
+void trace_fini(void);
+
+/* Writes a snapshot of all buffers to the trace file */
+void trace_write(void);
+
+/* Returns a copy of 'str' that lives until trace_fini() */
+const char *trace_intern(const char *str);
+
+/* Names the calling thread */
+void trace_thread_name(const char *name);
+
+void trace_event(char phase, const char *name, const char *detail,
+                 bool has_value, int64_t value);
+
+static inline bool
+trace_enabled(void)
+{
+    return __builtin_expect(trace_is_enabled, false);
+}
+
+static inline void
+trace_begin(const char *name, const char *detail)
+{
+    if (trace_enabled())
+        trace_event('B', name, detail, false, 0);
+}
+
+static inline void
+trace_end(const char *name, const char *detail)
+{
+    if (trace_enabled())
+        trace_event('E', name, detail, false, 0);
+}
+
+static inline void
+trace_instant(const char *name, const char *detail)
+{
+    if (trace_enabled())
+        trace_event('i', name, detail, false, 0);
+}
+
+static inline void
+trace_instant_value(const char *name, int64_t value)
+{
+    if (trace_enabled())
+        trace_event('i', name, NULL, true, value);
+}
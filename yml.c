@@ -628,6 +628,62 @@ yml_destroy(struct yml_node *node)
     free(node);
 }
 
+bool
+yml_equal(const struct yml_node *a, const struct yml_node *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+    case ROOT:
+        return yml_equal(a->root.root, b->root.root);
+
+    case SCALAR:
+        if (a->scalar.value == NULL || b->scalar.value == NULL)
+            return a->scalar.value == b->scalar.value;
+        return strcmp(a->scalar.value, b->scalar.value) == 0;
+
+    case LIST: {
+        if (tll_length(a->list.values) != tll_length(b->list.values))
+            return false;
+
+        const __typeof__(*b->list.values.head) *b_it = b->list.values.head;
+        tll_foreach(a->list.values, a_it) {
+            if (!yml_equal(a_it->item, b_it->item))
+                return false;
+            b_it = b_it->next;
+        }
+        return true;
+    }
+
+    case DICT:
+        if (tll_length(a->dict.pairs) != tll_length(b->dict.pairs))
+            return false;
+
+        /* Keys are unique, but their order does not matter */
+        tll_foreach(a->dict.pairs, a_it) {
+            bool found = false;
+            tll_foreach(b->dict.pairs, b_it) {
+                if (yml_equal(a_it->item.key, b_it->item.key)) {
+                    if (!yml_equal(a_it->item.value, b_it->item.value))
+                        return false;
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+                return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
 bool
 yml_is_scalar(const struct yml_node *node)
 {
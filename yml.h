@@ -7,6 +7,9 @@ struct yml_node;
 struct yml_node *yml_load(FILE *yml, char **error);
 void yml_destroy(struct yml_node *root);
 
+/* Deep comparison; the order of dictionary keys does not matter */
+bool yml_equal(const struct yml_node *a, const struct yml_node *b);
+
 bool yml_is_scalar(const struct yml_node *node);
 bool yml_is_dict(const struct yml_node *node);
 bool yml_is_list(const struct yml_node *node);